@@ -50,47 +50,45 @@ bool bitbuf_destroy(bitbuf_t *buffer) {
 bool bitbuf_append(bitbuf_t *buffer, uint32_t bits, uint8_t nbits)
 {
     // Verify enough space to to handle these bits available in the object
-    // already. If not, append enough for a full uint32_t using realloc. No
-    // error checking, because this is a @!"£?!"ing rar assembler.
+    // already. If not, double the size using realloc, so large programs don't
+    // spend all their time copying. No error checking, because this is a
+    // @!"£?!"ing rar assembler.
     if (buffer->occupancy + nbits > buffer->max) {
-        uint8_t *newbits = realloc(buffer->bits, buffer->max / 8 + 4);
-
-        buffer->bits  = newbits;
-        buffer->max  += 32;
+        size_t   size    = max(buffer->max / 8 * 2, 64);
+        uint8_t *newbits = realloc(buffer->bits, size);
 
         // Clean the new bytes.
-        memset(&buffer->bits[buffer->occupancy / 8 + min(1, buffer->occupancy % 8)], 0, 4);
+        memset(&newbits[buffer->max / 8], 0, size - buffer->max / 8);
+
+        buffer->bits  = newbits;
+        buffer->max   = size * 8;
     }
 
-    // Append nbits from the integer bits to the buffer one octet at a time.
-    while (nbits) {
-        uint8_t *current = &buffer->bits[buffer->occupancy / 8];    // Pointer to the last modified octet.
-        uint8_t  avail   = 8 - (buffer->occupancy % 8);             // How many bits in this octet we can modify.
-
-        // There are no spare bits in this byte, move to the next one (value should be zero).
-        if (avail == 0) ++current, avail = 8;
-
-        // Get the current value of the final bit (unused bits are zero up to
-        // the next octet boundary). The bits are stored from least to most
-        // significant, like this:
-        //
-        // 0b00000000 //             occupancy = 0
-        // 0b00000001 // append   1, occupancy = 1
-        // 0b00001101 // append 101, occupancy = 4
-        //
-
-        // To append these bits, we shift them left however many we need, then
-        // or in as many of the new bits as we can, starting with the most
-        // significant.
-        *current <<= min(nbits, avail);
-        *current  |= (bits >> (nbits - min(nbits, avail)));
-
-        // Update records accordingly.
-        buffer->occupancy += min(nbits, avail);
-
-        // Remove the saved bits from input by masking them out.
-        bits   &= (~0U >> (32 - nbits + min(nbits, avail)));
-        nbits  -= min(nbits, avail);
+    // Append nbits from the integer bits to the buffer. The bits are stored
+    // from least to most significant within the final octet, like this:
+    //
+    // 0b00000000 //             occupancy = 0
+    // 0b00000001 // append   1, occupancy = 1
+    // 0b00001101 // append 101, occupancy = 4
+    //
+    // So join the new bits onto the partial octet, then write out as many
+    // complete octets as we can, starting with the most significant.
+    if (nbits) {
+        uint8_t  *current = &buffer->bits[buffer->occupancy / 8];
+        uint32_t  total   = buffer->occupancy % 8 + nbits;
+        uint64_t  value   = (uint64_t) *current << nbits | (bits & (~0ULL >> (64 - nbits)));
+
+        while (total >= 8) {
+            total     -= 8;
+            *current++ = value >> total;
+        }
+
+        // Unused bits are zero up to the next octet boundary.
+        if (total) {
+            *current = value & ((1U << total) - 1);
+        }
+
+        buffer->occupancy += nbits;
     }
 
     // Success.
@@ -0,0 +1,352 @@
+// Content addressed cache for assembled objects.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <time.h>
+#include <err.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "sha256.h"
+#include "cache.h"
+
+// Temporary files older than this were left by a writer that died.
+#define STALE_TEMP_AGE  3600
+
+typedef struct {
+    char        name[SHA256_DIGEST_SIZE * 2 + 1];
+    struct timespec mtime;
+    off_t       size;
+} entry_t;
+
+static void entry_path(cache_t *cache, const uint8_t key[SHA256_DIGEST_SIZE], char *path, size_t size)
+{
+    int n = snprintf(path, size, "%s/", cache->dir);
+
+    for (int i = 0; i < SHA256_DIGEST_SIZE && n < size; i++)
+        n += snprintf(path + n, size - n, "%02x", key[i]);
+}
+
+static bool is_entry_name(const char *name)
+{
+    return strlen(name) == SHA256_DIGEST_SIZE * 2
+        && strspn(name, "0123456789abcdef") == SHA256_DIGEST_SIZE * 2;
+}
+
+// Create the directory and any missing parents.
+static bool make_directory(const char *dir)
+{
+    char path[PATH_MAX];
+
+    if (snprintf(path, sizeof path, "%s", dir) >= sizeof path)
+        return false;
+
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(path, 0755) != 0 && errno != EEXIST)
+                return false;
+            *p = '/';
+        }
+    }
+
+    return mkdir(path, 0755) == 0 || errno == EEXIST;
+}
+
+// The counters and the total size of all entries are shared by every process
+// using the cache, so are read and updated under a lock on the stats file.
+typedef struct {
+    unsigned long long  hits;
+    unsigned long long  misses;
+    unsigned long long  size;
+    bool                sized;      // Older caches didn't record the size.
+} counters_t;
+
+static int lock_counters(cache_t *cache, counters_t *counters)
+{
+    char    path[PATH_MAX];
+    char    buf[128] = {0};
+    int     fd;
+
+    snprintf(path, sizeof path, "%s/stats", cache->dir);
+
+    memset(counters, 0, sizeof *counters);
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+        return -1;
+
+    flock(fd, LOCK_EX);
+
+    if (read(fd, buf, sizeof buf - 1) > 0) {
+        counters->sized = sscanf(buf, "hits %llu misses %llu size %llu",
+                                 &counters->hits,
+                                 &counters->misses,
+                                 &counters->size) == 3;
+    }
+
+    return fd;
+}
+
+static void unlock_counters(int fd, const counters_t *counters)
+{
+    char buf[128];
+    int  len;
+
+    len = snprintf(buf, sizeof buf, "hits %llu misses %llu size %llu\n",
+                   counters->hits,
+                   counters->misses,
+                   counters->size);
+
+    if (ftruncate(fd, 0) != 0 || pwrite(fd, buf, len, 0) != len)
+        warnx("failed to update cache statistics");
+
+    close(fd);
+}
+
+static void update_counters(cache_t *cache, bool hit)
+{
+    counters_t  counters;
+    int         fd;
+
+    if ((fd = lock_counters(cache, &counters)) < 0)
+        return;
+
+    if (hit) {
+        counters.hits++;
+    } else {
+        counters.misses++;
+    }
+
+    unlock_counters(fd, &counters);
+}
+
+static int compare_mtime(const void *a, const void *b)
+{
+    const entry_t *x = a;
+    const entry_t *y = b;
+
+    if (x->mtime.tv_sec != y->mtime.tv_sec)
+        return (x->mtime.tv_sec > y->mtime.tv_sec) - (x->mtime.tv_sec < y->mtime.tv_sec);
+
+    return (x->mtime.tv_nsec > y->mtime.tv_nsec) - (x->mtime.tv_nsec < y->mtime.tv_nsec);
+}
+
+// List all entries, optionally removing stale temporary files.
+static entry_t * list_entries(cache_t *cache, size_t *count, uint64_t *total, bool cleanup)
+{
+    entry_t        *entries = NULL;
+    struct dirent  *de;
+    DIR            *dir;
+    char            path[PATH_MAX];
+    struct stat     st;
+
+    *count = 0;
+    *total = 0;
+
+    if (!(dir = opendir(cache->dir)))
+        return NULL;
+
+    while ((de = readdir(dir))) {
+        snprintf(path, sizeof path, "%s/%s", cache->dir, de->d_name);
+
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+            continue;
+
+        if (cleanup && strncmp(de->d_name, "tmp.", 4) == 0) {
+            if (time(NULL) - st.st_mtime > STALE_TEMP_AGE)
+                unlink(path);
+            continue;
+        }
+
+        if (!is_entry_name(de->d_name))
+            continue;
+
+        entries = realloc(entries, sizeof(entry_t) * ++*count);
+
+        strcpy(entries[*count - 1].name, de->d_name);
+        entries[*count - 1].mtime = st.st_mtim;
+        entries[*count - 1].size  = st.st_size;
+
+        *total += st.st_size;
+    }
+
+    closedir(dir);
+    return entries;
+}
+
+// Remove the least recently used entries until the cache fits, and return the
+// new total. Lookups touch the mtime, so that is the last use.
+static uint64_t evict(cache_t *cache)
+{
+    entry_t  *entries;
+    size_t    count;
+    uint64_t  total;
+    char      path[PATH_MAX];
+
+    entries = list_entries(cache, &count, &total, true);
+
+    if (total > cache->maxsize) {
+        qsort(entries, count, sizeof(entry_t), compare_mtime);
+
+        for (size_t i = 0; i < count && total > cache->maxsize; i++) {
+            snprintf(path, sizeof path, "%s/%s", cache->dir, entries[i].name);
+
+            if (unlink(path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+
+    free(entries);
+    return total;
+}
+
+bool cache_create(cache_t **cache, const char *dir, uint64_t maxsize)
+{
+    if (!make_directory(dir))
+        return false;
+
+    *cache = calloc(1, sizeof(cache_t));
+
+    (*cache)->dir       = strdup(dir);
+    (*cache)->maxsize   = maxsize;
+    return true;
+}
+
+bool cache_destroy(cache_t *cache)
+{
+    if (cache)
+        free(cache->dir);
+    free(cache);
+    return true;
+}
+
+bool cache_lookup(cache_t *cache, const uint8_t key[SHA256_DIGEST_SIZE], uint8_t **data, size_t *size)
+{
+    char        path[PATH_MAX];
+    struct stat st;
+    int         fd;
+
+    entry_path(cache, key, path, sizeof path);
+
+    *data = NULL;
+    *size = 0;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        goto miss;
+
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        goto miss;
+    }
+
+    *data = malloc(st.st_size + 1);
+    *size = st.st_size;
+
+    if (read(fd, *data, st.st_size) != st.st_size) {
+        close(fd);
+        free(*data);
+        *data = NULL;
+        goto miss;
+    }
+
+    close(fd);
+
+    // Mark it as recently used.
+    utimensat(AT_FDCWD, path, NULL, 0);
+
+    update_counters(cache, true);
+    return true;
+
+  miss:
+    update_counters(cache, false);
+    return false;
+}
+
+// Entries are written to a temporary file then renamed, so readers never see
+// a partial object, even with concurrent builds. The directory is only
+// scanned when the running total says the cache is too big.
+bool cache_store(cache_t *cache, const uint8_t key[SHA256_DIGEST_SIZE], const uint8_t *data, size_t size)
+{
+    char        path[PATH_MAX];
+    char        temp[PATH_MAX];
+    counters_t  counters;
+    struct stat st;
+    int         fd;
+    int         lock;
+
+    entry_path(cache, key, path, sizeof path);
+    snprintf(temp, sizeof temp, "%s/tmp.XXXXXX", cache->dir);
+
+    if ((fd = mkstemp(temp)) < 0)
+        return false;
+
+    if (write(fd, data, size) != size || fchmod(fd, 0644) != 0) {
+        close(fd);
+        unlink(temp);
+        return false;
+    }
+
+    close(fd);
+
+    lock = lock_counters(cache, &counters);
+
+    // Replacing an entry doesn't make the cache any bigger.
+    if (stat(path, &st) == 0)
+        counters.size -= st.st_size < counters.size ? st.st_size : counters.size;
+
+    if (rename(temp, path) != 0) {
+        unlink(temp);
+
+        if (lock >= 0)
+            close(lock);
+        return false;
+    }
+
+    counters.size += size;
+
+    if (lock < 0) {
+        evict(cache);
+        return true;
+    }
+
+    if (!counters.sized || counters.size > cache->maxsize)
+        counters.size = evict(cache);
+
+    unlock_counters(lock, &counters);
+    return true;
+}
+
+bool cache_stats(cache_t *cache, cache_stats_t *stats)
+{
+    counters_t  counters;
+    size_t      count;
+    int         fd;
+
+    if ((fd = lock_counters(cache, &counters)) < 0)
+        return false;
+
+    free(list_entries(cache, &count, &stats->size, false));
+
+    close(fd);
+
+    stats->entries  = count;
+    stats->hits     = counters.hits;
+    stats->misses   = counters.misses;
+    return true;
+}
@@ -0,0 +1,25 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+// A content addressed object cache, entries are named by the hex digest of
+// their key and the least recently used are evicted past a size limit.
+
+typedef struct {
+    char       *dir;
+    uint64_t    maxsize;
+} cache_t;
+
+typedef struct {
+    uint64_t    hits;
+    uint64_t    misses;
+    uint64_t    entries;
+    uint64_t    size;
+} cache_stats_t;
+
+bool cache_create(cache_t **cache, const char *dir, uint64_t maxsize);
+bool cache_destroy(cache_t *cache);
+bool cache_lookup(cache_t *cache, const uint8_t key[SHA256_DIGEST_SIZE], uint8_t **data, size_t *size);
+bool cache_store(cache_t *cache, const uint8_t key[SHA256_DIGEST_SIZE], const uint8_t *data, size_t size);
+bool cache_stats(cache_t *cache, cache_stats_t *stats);
+
+#endif
@@ -0,0 +1,127 @@
+// Check the object cache finds what was stored, and evicts the oldest first.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+
+#include "sha256.h"
+#include "cache.h"
+
+static void make_key(const char *name, uint8_t key[SHA256_DIGEST_SIZE])
+{
+    sha256_t ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, name, strlen(name));
+    sha256_final(&ctx, key);
+}
+
+static bool lookup(cache_t *cache, const char *name, uint8_t fill)
+{
+    uint8_t  key[SHA256_DIGEST_SIZE];
+    uint8_t *data;
+    size_t   size;
+    bool     found;
+
+    make_key(name, key);
+
+    if ((found = cache_lookup(cache, key, &data, &size))) {
+        assert(size == 40);
+
+        for (size_t i = 0; i < size; i++)
+            assert(data[i] == fill);
+    }
+
+    free(data);
+    return found;
+}
+
+static void store(cache_t *cache, const char *name, uint8_t fill)
+{
+    uint8_t key[SHA256_DIGEST_SIZE];
+    uint8_t data[40];
+
+    make_key(name, key);
+    memset(data, fill, sizeof data);
+
+    assert(cache_store(cache, key, data, sizeof data));
+}
+
+// The running total kept in the stats file.
+static unsigned long long recorded_size(const char *dir)
+{
+    char                path[PATH_MAX];
+    unsigned long long  hits;
+    unsigned long long  misses;
+    unsigned long long  size;
+    FILE               *stats;
+
+    snprintf(path, sizeof path, "%s/stats", dir);
+
+    assert((stats = fopen(path, "r")));
+    assert(fscanf(stats, "hits %llu misses %llu size %llu", &hits, &misses, &size) == 3);
+
+    fclose(stats);
+    return size;
+}
+
+int main(int argc, char **argv)
+{
+    char            dir[] = "/tmp/cache_test.XXXXXX";
+    char            command[64];
+    cache_t        *cache;
+    cache_stats_t   stats;
+
+    assert(mkdtemp(dir));
+    assert(cache_create(&cache, dir, 100));
+
+    // Miss, then hit.
+    assert(!lookup(cache, "a", 'a'));
+
+    store(cache, "a", 'a');
+
+    assert(lookup(cache, "a", 'a'));
+    assert(recorded_size(dir) == 40);
+
+    // Replacing an entry doesn't change the size.
+    store(cache, "a", 'A');
+
+    assert(lookup(cache, "a", 'A'));
+    assert(recorded_size(dir) == 40);
+
+    // The third entry doesn't fit, b is evicted because a was used since.
+    store(cache, "b", 'b');
+
+    assert(lookup(cache, "a", 'A'));
+
+    store(cache, "c", 'c');
+
+    assert(!lookup(cache, "b", 'b'));
+    assert(lookup(cache, "a", 'A'));
+    assert(lookup(cache, "c", 'c'));
+    assert(recorded_size(dir) == 80);
+
+    assert(cache_stats(cache, &stats));
+    assert(stats.entries == 2);
+    assert(stats.size == 80);
+    assert(stats.hits == 5);
+    assert(stats.misses == 2);
+
+    cache_destroy(cache);
+
+    snprintf(command, sizeof command, "rm -rf %s", dir);
+    assert(system(command) == 0);
+    return 0;
+}
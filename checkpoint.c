@@ -0,0 +1,277 @@
+// Save and restore the state of the VM.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "rarvm.h"
+#include "checkpoint.h"
+
+#define CHECKPOINT_MAGIC    0x50434b52      // "RKCP"
+#define CHECKPOINT_VERSION  1
+
+#pragma pack(push, 1)
+
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    hash;           // Of the program as it was loaded.
+} header_t;
+
+typedef struct {
+    uint64_t    icount;
+    uint64_t    mcount;
+    uint32_t    ip;
+    uint32_t    flags;
+    uint32_t    r[8];
+    uint32_t    numimmediates;  // Overwritten immediates that follow.
+    uint64_t    pages;          // Pages that follow, after the immediates.
+} record_t;
+
+typedef struct {
+    uint32_t    operand;        // Instruction number * 2, plus 1 for op2.
+    uint32_t    value;
+} immediate_t;
+
+#pragma pack(pop)
+
+struct checkpoint {
+    gzFile          file;
+    bool            matches;    // The file was written for this program.
+    uint64_t        count;      // Records read or written.
+    uint8_t        *image;      // Memory as of the last record.
+    uint32_t       *original;   // Every immediate as it was loaded, two per instruction.
+    uint32_t        numoperands;
+    immediate_t    *immediates;
+};
+
+// Pages include the extra bytes past the end of memory, like vm_restore.
+static inline uint32_t page_size(uint32_t page)
+{
+    return page == VM_NUMPAGES - 1 ? VM_PAGESIZE + 4 : VM_PAGESIZE;
+}
+
+static inline vm_operand_t * get_operand(const vm_program_t *program, uint32_t operand)
+{
+    vm_insn_t *insn = &program->insns[operand / 2];
+
+    return operand % 2 ? &insn->op2 : &insn->op1;
+}
+
+static bool checkpoint_init(checkpoint_t **checkpoint, const vm_program_t *program)
+{
+    checkpoint_t *cp;
+
+    if (!(cp = calloc(1, sizeof *cp)))
+        return false;
+
+    cp->numoperands = program->count * 2;
+    cp->image       = calloc(1, VM_MEMSIZE + 4);
+    cp->original    = malloc(cp->numoperands * sizeof(uint32_t));
+    cp->immediates  = malloc(cp->numoperands * sizeof(immediate_t));
+
+    if (!cp->image || !cp->original || !cp->immediates) {
+        checkpoint_close(cp);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < cp->numoperands; i++)
+        cp->original[i] = get_operand(program, i)->value;
+
+    *checkpoint = cp;
+    return true;
+}
+
+bool checkpoint_create(checkpoint_t **checkpoint, const char *filename, const vm_program_t *program)
+{
+    header_t header = { CHECKPOINT_MAGIC, CHECKPOINT_VERSION, vm_program_hash(program) };
+
+    if (!checkpoint_init(checkpoint, program))
+        return false;
+
+    (*checkpoint)->matches = true;
+
+    if (!((*checkpoint)->file = gzopen(filename, "wb"))
+     || gzwrite((*checkpoint)->file, &header, sizeof header) != sizeof header) {
+        checkpoint_close(*checkpoint);
+        return false;
+    }
+
+    return true;
+}
+
+bool checkpoint_open(checkpoint_t **checkpoint, const char *filename, const vm_program_t *program)
+{
+    header_t header;
+
+    if (!checkpoint_init(checkpoint, program))
+        return false;
+
+    if (!((*checkpoint)->file = gzopen(filename, "rb"))
+     || gzread((*checkpoint)->file, &header, sizeof header) != sizeof header
+     || header.magic != CHECKPOINT_MAGIC
+     || header.version != CHECKPOINT_VERSION) {
+        checkpoint_close(*checkpoint);
+        return false;
+    }
+
+    // Resuming a different program is allowed, e.g. if only the code after
+    // the checkpoint has changed, but it can be detected.
+    (*checkpoint)->matches = header.hash == vm_program_hash(program);
+    return true;
+}
+
+bool checkpoint_close(checkpoint_t *checkpoint)
+{
+    bool result = true;
+
+    if (checkpoint->file)
+        result = gzclose(checkpoint->file) == Z_OK;
+
+    free(checkpoint->image);
+    free(checkpoint->original);
+    free(checkpoint->immediates);
+    free(checkpoint);
+    return result;
+}
+
+// Only the pages marked dirty since the last record are compared, and this
+// counts as a snapshot, so they're all clean afterwards.
+bool checkpoint_save(checkpoint_t *checkpoint, vm_t *vm, const vm_program_t *program)
+{
+    record_t record = {
+        .icount = vm->icount,
+        .mcount = vm->mcount,
+        .ip     = vm->ip,
+        .flags  = vm->flags,
+    };
+    uint8_t  delta[VM_PAGESIZE + 4];
+
+    memcpy(record.r, vm->r, sizeof record.r);
+
+    for (uint64_t dirty = vm->dirty; dirty; dirty &= dirty - 1) {
+        uint32_t page = __builtin_ctzll(dirty);
+        uint32_t base = page * VM_PAGESIZE;
+
+        if (memcmp(&vm->mem[base], &checkpoint->image[base], page_size(page)) != 0)
+            record.pages |= 1ULL << page;
+    }
+
+    // Programs can write to their own immediates.
+    for (uint32_t i = 0; i < checkpoint->numoperands; i++) {
+        uint32_t value = get_operand(program, i)->value;
+
+        if (value != checkpoint->original[i]) {
+            checkpoint->immediates[record.numimmediates].operand  = i;
+            checkpoint->immediates[record.numimmediates].value    = value;
+            record.numimmediates++;
+        }
+    }
+
+    if (gzwrite(checkpoint->file, &record, sizeof record) != sizeof record)
+        return false;
+
+    if (record.numimmediates) {
+        uint32_t size = record.numimmediates * sizeof(immediate_t);
+
+        if (gzwrite(checkpoint->file, checkpoint->immediates, size) != size)
+            return false;
+    }
+
+    // Mostly zeros, unless most of the page changed.
+    for (uint64_t pages = record.pages; pages; pages &= pages - 1) {
+        uint32_t page = __builtin_ctzll(pages);
+        uint32_t base = page * VM_PAGESIZE;
+        uint32_t size = page_size(page);
+
+        for (uint32_t i = 0; i < size; i++)
+            delta[i] = vm->mem[base + i] ^ checkpoint->image[base + i];
+
+        if (gzwrite(checkpoint->file, delta, size) != size)
+            return false;
+
+        memcpy(&checkpoint->image[base], &vm->mem[base], size);
+    }
+
+    vm->dirty = 0;
+    checkpoint->count++;
+    return true;
+}
+
+// Read the next record into vm, returns false at the end of the file. Every
+// page is marked dirty, because memory is replaced completely.
+bool checkpoint_load(checkpoint_t *checkpoint, vm_t *vm, vm_program_t *program)
+{
+    record_t record;
+    uint8_t  delta[VM_PAGESIZE + 4];
+
+    if (gzread(checkpoint->file, &record, sizeof record) != sizeof record)
+        return false;
+
+    // A different program might not have the instruction it stopped at.
+    if (record.numimmediates > checkpoint->numoperands || record.ip >= program->count)
+        return false;
+
+    if (record.numimmediates) {
+        uint32_t size = record.numimmediates * sizeof(immediate_t);
+
+        if (gzread(checkpoint->file, checkpoint->immediates, size) != size)
+            return false;
+    }
+
+    for (uint64_t pages = record.pages; pages; pages &= pages - 1) {
+        uint32_t page = __builtin_ctzll(pages);
+        uint32_t base = page * VM_PAGESIZE;
+        uint32_t size = page_size(page);
+
+        if (gzread(checkpoint->file, delta, size) != size)
+            return false;
+
+        for (uint32_t i = 0; i < size; i++)
+            checkpoint->image[base + i] ^= delta[i];
+    }
+
+    // Immediates that aren't listed have their original value.
+    for (uint32_t i = 0; i < checkpoint->numoperands; i++)
+        get_operand(program, i)->value = checkpoint->original[i];
+
+    for (uint32_t i = 0; i < record.numimmediates; i++) {
+        if (checkpoint->immediates[i].operand < checkpoint->numoperands) {
+            get_operand(program, checkpoint->immediates[i].operand)->value = checkpoint->immediates[i].value;
+        }
+    }
+
+    memcpy(vm->mem, checkpoint->image, VM_MEMSIZE + 4);
+    memcpy(vm->r, record.r, sizeof vm->r);
+
+    vm->icount  = record.icount;
+    vm->mcount  = record.mcount;
+    vm->ip      = record.ip;
+    vm->flags   = record.flags;
+    vm->dirty   = ~0ULL;
+
+    checkpoint->count++;
+    return true;
+}
+
+// The number of records read or written so far.
+uint64_t checkpoint_count(const checkpoint_t *checkpoint)
+{
+    return checkpoint->count;
+}
+
+// False if the file was written for a different program.
+bool checkpoint_matches(const checkpoint_t *checkpoint)
+{
+    return checkpoint->matches;
+}
@@ -0,0 +1,24 @@
+#ifndef __CHECKPOINT_H
+#define __CHECKPOINT_H
+
+// Checkpoints of the complete VM state, so that long running programs can be
+// resumed part way through. A checkpoint file is a gzip stream of records,
+// each one holds the registers, flags, instruction count and any immediates
+// the program has overwritten, but only the memory pages that changed since
+// the previous record, xor'd with their old contents.
+//
+// Records are deltas, so a file must be read in order. The program passed to
+// checkpoint_create() or checkpoint_open() must not have been run yet, the
+// immediates are recorded relative to it.
+
+typedef struct checkpoint checkpoint_t;
+
+bool checkpoint_create(checkpoint_t **checkpoint, const char *filename, const vm_program_t *program);
+bool checkpoint_open(checkpoint_t **checkpoint, const char *filename, const vm_program_t *program);
+bool checkpoint_close(checkpoint_t *checkpoint);
+bool checkpoint_save(checkpoint_t *checkpoint, vm_t *vm, const vm_program_t *program);
+bool checkpoint_load(checkpoint_t *checkpoint, vm_t *vm, vm_program_t *program);
+uint64_t checkpoint_count(const checkpoint_t *checkpoint);
+bool checkpoint_matches(const checkpoint_t *checkpoint);
+
+#endif
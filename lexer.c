@@ -0,0 +1,392 @@
+// Lexer for RarVM assembly.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <setjmp.h>
+#include <string.h>
+#include <err.h>
+
+#include "rarvm.h"
+#include "lexer.h"
+
+// Mnemonics are looked up with a perfect hash, the first two and last two
+// characters and the length are packed into a word, then multiplied by a
+// constant chosen so that no two mnemonics share one of the 128 slots. If you
+// add a mnemonic, search for a new constant, lexer_test will tell you if you
+// need to.
+#define MNEMONIC_HASH_MULT  0xbdceeef9
+#define MNEMONIC_HASH_BITS  7
+
+static inline uint32_t mnemonic_hash(const char *s, size_t len)
+{
+    uint32_t key = (uint8_t) s[0]
+                 | (uint8_t) s[1] << 8
+                 | (uint8_t) s[len - 2] << 16
+                 | (uint32_t) (uint8_t) s[len - 1] << 24;
+
+    return (uint32_t) ((key ^ len) * MNEMONIC_HASH_MULT) >> (32 - MNEMONIC_HASH_BITS);
+}
+
+int lexer_opcode(const char *mnemonic, size_t length)
+{
+    static const struct {
+        const char *name;
+        uint8_t     opcode;
+    } table[1 << MNEMONIC_HASH_BITS] = {
+        [  4] = { "div", VM_DIV },        [  5] = { "jae", VM_JAE },        [  6] = { "movb", VM_MOVB },
+        [  7] = { "sbb", VM_SBB },        [  9] = { "shr", VM_SHR },        [ 11] = { "push", VM_PUSH },
+        [ 13] = { "add", VM_ADD },        [ 14] = { "jnz", VM_JNZ },        [ 17] = { "adc", VM_ADC },
+        [ 19] = { "sub", VM_SUB },        [ 29] = { "xchg", VM_XCHG },      [ 30] = { "shl", VM_SHL },
+        [ 37] = { "cmpd", VM_CMPD },      [ 39] = { "jns", VM_JNS },        [ 42] = { "addd", VM_ADDD },
+        [ 43] = { "jz", VM_JZ },          [ 44] = { "cmpb", VM_CMPB },      [ 49] = { "addb", VM_ADDB },
+        [ 50] = { "mul", VM_MUL },        [ 52] = { "print", VM_PRINT },    [ 53] = { "incd", VM_INCD },
+        [ 54] = { "xor", VM_XOR },        [ 56] = { "movzx", VM_MOVZX },    [ 59] = { "or", VM_OR },
+        [ 60] = { "incb", VM_INCB },      [ 62] = { "inc", VM_INC },        [ 63] = { "popf", VM_POPF },
+        [ 64] = { "decd", VM_DECD },      [ 67] = { "and", VM_AND },        [ 68] = { "ret", VM_RET },
+        [ 69] = { "pop", VM_POP },        [ 70] = { "subd", VM_SUBD },      [ 71] = { "decb", VM_DECB },
+        [ 74] = { "dec", VM_DEC },        [ 76] = { "jb", VM_JB },          [ 77] = { "subb", VM_SUBB },
+        [ 78] = { "pushf", VM_PUSHF },    [ 80] = { "popa", VM_POPA },      [ 81] = { "call", VM_CALL },
+        [ 82] = { "jmp", VM_JMP },        [ 83] = { "negd", VM_NEGD },      [ 86] = { "mov", VM_MOV },
+        [ 90] = { "negb", VM_NEGB },      [ 96] = { "pusha", VM_PUSHA },    [100] = { "jbe", VM_JBE },
+        [104] = { "ja", VM_JA },          [110] = { "test", VM_TEST },      [111] = { "js", VM_JS },
+        [112] = { "sar", VM_SAR },        [115] = { "movsx", VM_MOVSX },    [118] = { "neg", VM_NEG },
+        [124] = { "cmp", VM_CMP },        [126] = { "not", VM_NOT },        [127] = { "movd", VM_MOVD },
+    };
+    uint32_t slot;
+
+    // All the mnemonics are between 2 and 5 characters.
+    if (length < 2 || length > 5)
+        return -1;
+
+    slot = mnemonic_hash(mnemonic, length);
+
+    if (table[slot].name == NULL
+     || strncmp(table[slot].name, mnemonic, length) != 0
+     || table[slot].name[length] != '\0')
+        return -1;
+
+    return table[slot].opcode;
+}
+
+int lexer_register(const char *name, size_t length)
+{
+    if (length != 2 || name[0] != 'r' || name[1] < '0' || name[1] > '7')
+        return -1;
+
+    return name[1] - '0';
+}
+
+static inline bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Anything that can end an operand.
+static inline bool is_delimiter(char c)
+{
+    return is_space(c) || c == ',' || c == ';' || c == '\n';
+}
+
+static inline bool is_alnum(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+void lexer_init(lexer_t *lexer, const char *filename, const char *source, size_t size)
+{
+    lexer->ptr      = source;
+    lexer->end      = source + size;
+    lexer->file.ptr = filename;
+    lexer->file.len = strlen(filename);
+    lexer->line     = 0;
+    lexer->recover  = NULL;
+}
+
+void lexer_error(const lexer_t *lexer, uint32_t line, uint32_t column, const char *format, ...)
+{
+    char    message[512];
+    va_list ap;
+
+    if (lexer->recover)
+        longjmp(*(jmp_buf *) lexer->recover, 1);
+
+    va_start(ap, format);
+    vsnprintf(message, sizeof message, format, ap);
+    va_end(ap);
+
+    errx(EXIT_FAILURE, "%.*s:%u:%u: %s", (int) lexer->file.len, lexer->file.ptr, line, column, message);
+}
+
+// Move to the start of the next line.
+static void skip_line(lexer_t *lexer, const char *p)
+{
+    const char *newline = memchr(p, '\n', lexer->end - p);
+
+    lexer->ptr = newline ? newline + 1 : lexer->end;
+}
+
+// Move to the next line, recording the text of this one for listings.
+static void finish_line(lexer_t *lexer, asm_line_t *line, const char *start, const char *p)
+{
+    const char *end;
+
+    skip_line(lexer, p);
+
+    for (end = lexer->ptr; end > start && (end[-1] == '\n' || is_space(end[-1])); end--)
+        ;
+
+    line->text.ptr = start;
+    line->text.len = end - start;
+}
+
+static const char * skip_space(const lexer_t *lexer, const char *p)
+{
+    while (p < lexer->end && is_space(*p))
+        p++;
+    return p;
+}
+
+// Follow cpp line markers, like # 12 "file.rs", so diagnostics refer to the
+// original source. Any other directive is ignored.
+static void line_marker(lexer_t *lexer, const char *p)
+{
+    uint32_t    line = 0;
+    const char *name;
+
+    p = skip_space(lexer, p + 1);
+
+    if (lexer->end - p > 4 && strncmp(p, "line", 4) == 0)
+        p = skip_space(lexer, p + 4);
+
+    if (p == lexer->end || *p < '0' || *p > '9')
+        return;
+
+    while (p < lexer->end && *p >= '0' && *p <= '9')
+        line = line * 10 + *p++ - '0';
+
+    p = skip_space(lexer, p);
+
+    if (p < lexer->end && *p == '"') {
+        name = ++p;
+
+        while (p < lexer->end && *p != '"' && *p != '\n')
+            p++;
+
+        if (p < lexer->end && *p == '"') {
+            lexer->file.ptr = name;
+            lexer->file.len = p - name;
+        }
+    }
+
+    // The marker gives the number of the next line.
+    lexer->line = line - 1;
+}
+
+// Integers are parsed like strtoul() with base 0, but must be followed by a
+// delimiter.
+static const char * lex_integer(const lexer_t *lexer, const char *start, const char *p, uint32_t *value)
+{
+    const char *digits;
+    bool        negate  = false;
+    uint32_t    base    = 10;
+    uint32_t    result  = 0;
+
+    if (p < lexer->end && (*p == '-' || *p == '+'))
+        negate = *p++ == '-';
+
+    if (lexer->end - p > 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base  = 16;
+        p    += 2;
+    } else if (p < lexer->end && *p == '0') {
+        base  = 8;
+    }
+
+    for (digits = p; p < lexer->end; p++) {
+        uint32_t digit;
+
+        if (*p >= '0' && *p <= '9') {
+            digit = *p - '0';
+        } else if (*p >= 'a' && *p <= 'f') {
+            digit = *p - 'a' + 10;
+        } else if (*p >= 'A' && *p <= 'F') {
+            digit = *p - 'A' + 10;
+        } else {
+            break;
+        }
+
+        if (digit >= base)
+            break;
+
+        result = result * base + digit;
+    }
+
+    if (p == digits || (p < lexer->end && is_alnum(*p)))
+        lexer_error(lexer, lexer->line, digits - start + 1, "invalid integer");
+
+    *value = negate ? -result : result;
+    return p;
+}
+
+static const char * lex_register(const lexer_t *lexer, const char *start, const char *p, uint8_t *reg)
+{
+    const char *name = p;
+    int         num;
+
+    while (p < lexer->end && is_alnum(*p))
+        p++;
+
+    if ((num = lexer_register(name, p - name)) < 0)
+        lexer_error(lexer, lexer->line, name - start + 1, "unrecognised register '%.*s'", (int) (p - name), name);
+
+    *reg = num;
+    return p;
+}
+
+// Operands are one of r0, #123, $symbol, [#123], [r0], [r0+#123] or [r0-#123].
+static const char * lex_operand(const lexer_t *lexer, const char *start, const char *p, asm_operand_t *op)
+{
+    op->column = p - start + 1;
+
+    switch (*p) {
+        case '#':
+            op->type = VM_OPINT;
+            p = lex_integer(lexer, start, p + 1, &op->value);
+            break;
+        case 'r':
+            op->type = VM_OPREG;
+            p = lex_register(lexer, start, p, &op->reg);
+            break;
+        case '$':
+            op->type = ASM_OPSYMBOL;
+            op->symbol.ptr = ++p;
+
+            while (p < lexer->end && !is_delimiter(*p))
+                p++;
+
+            if ((op->symbol.len = p - op->symbol.ptr) == 0)
+                lexer_error(lexer, lexer->line, op->column, "expected symbol name");
+            break;
+        case '[':
+            if (++p < lexer->end && *p == '#') {
+                op->type = VM_OPMEM;
+                p = lex_integer(lexer, start, p + 1, &op->value);
+            } else if (p < lexer->end && *p == 'r') {
+                op->type = VM_OPREGMEM;
+                p = lex_register(lexer, start, p, &op->reg);
+
+                // Negative offsets are just for convenience, rar doesn't
+                // know about them.
+                if (p < lexer->end && (*p == '+' || *p == '-')) {
+                    bool negate = *p++ == '-';
+
+                    if (p == lexer->end || *p != '#')
+                        lexer_error(lexer, lexer->line, p - start + 1, "expected immediate index");
+
+                    p = lex_integer(lexer, start, p + 1, &op->value);
+
+                    op->indexed = true;
+                    op->value   = negate ? -op->value : op->value;
+                }
+            } else {
+                lexer_error(lexer, lexer->line, p - start + 1, "expected register or immediate in memory reference");
+            }
+
+            if (p == lexer->end || *p != ']')
+                lexer_error(lexer, lexer->line, p - start + 1, "expected ']'");
+
+            p++;
+            break;
+        default:
+            lexer_error(lexer, lexer->line, op->column, "unrecognised operand");
+    }
+
+    if (p < lexer->end && !is_delimiter(*p))
+        lexer_error(lexer, lexer->line, p - start + 1, "unexpected '%c' after operand", *p);
+
+    return p;
+}
+
+// Returns the next label or instruction, blank lines, comments and cpp
+// directives are skipped.
+bool lexer_next(lexer_t *lexer, asm_line_t *line)
+{
+    while (lexer->ptr < lexer->end) {
+        const char *start   = lexer->ptr;
+        const char *p       = start;
+        const char *name;
+        int         opcode;
+
+        lexer->line++;
+
+        if (*p == '#') {
+            line_marker(lexer, p);
+            skip_line(lexer, p);
+            continue;
+        }
+
+        p = skip_space(lexer, p);
+
+        if (p == lexer->end || *p == '\n' || *p == ';') {
+            skip_line(lexer, p);
+            continue;
+        }
+
+        for (name = p; p < lexer->end && !is_space(*p) && *p != '\n' && *p != ';' && *p != ':'; p++)
+            ;
+
+        line->line      = lexer->line;
+        line->column    = name - start + 1;
+        line->name.ptr  = name;
+        line->name.len  = p - name;
+        line->numops    = 0;
+
+        // Anything else on a label line is ignored.
+        if (p < lexer->end && *p == ':') {
+            line->kind = ASM_LABEL;
+            finish_line(lexer, line, start, p);
+            return true;
+        }
+
+        if ((opcode = lexer_opcode(name, p - name)) < 0) {
+            lexer_error(lexer, lexer->line, line->column, "unrecognised mnemonic '%.*s'", (int) (p - name), name);
+        }
+
+        line->kind      = ASM_INSN;
+        line->opcode    = opcode;
+
+        p = skip_space(lexer, p);
+
+        if (p < lexer->end && *p != '\n' && *p != ';') {
+            memset(line->op, 0, sizeof line->op);
+
+            p = skip_space(lexer, lex_operand(lexer, start, p, &line->op[line->numops++]));
+
+            if (p < lexer->end && *p == ',') {
+                p = skip_space(lexer, p + 1);
+
+                if (p == lexer->end || *p == '\n' || *p == ';')
+                    lexer_error(lexer, lexer->line, p - start + 1, "expected operand after ','");
+
+                p = skip_space(lexer, lex_operand(lexer, start, p, &line->op[line->numops++]));
+            }
+
+            if (p < lexer->end && *p != '\n' && *p != ';')
+                lexer_error(lexer, lexer->line, p - start + 1, "unexpected '%c'", *p);
+        }
+
+        finish_line(lexer, line, start, p);
+        return true;
+    }
+
+    return false;
+}
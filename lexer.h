@@ -0,0 +1,57 @@
+#ifndef __LEXER_H
+#define __LEXER_H
+
+// Single pass lexer for RarVM assembly. Nothing is copied, tokens point into
+// the source buffer, which is usually the input file mapped into memory.
+
+typedef struct {
+    const char *ptr;
+    uint32_t    len;
+} token_t;
+
+typedef enum {
+    ASM_LABEL,
+    ASM_INSN,
+} asm_kind_t;
+
+// Symbolic references are resolved by the assembler, otherwise operands use
+// the same types as the VM.
+#define ASM_OPSYMBOL 0x80
+
+typedef struct {
+    uint8_t     type;       // A vm_optype_t, or ASM_OPSYMBOL.
+    uint8_t     reg;
+    bool        indexed;    // [r0+#0] rather than [r0], they're encoded differently.
+    uint32_t    value;
+    token_t     symbol;
+    uint32_t    column;
+} asm_operand_t;
+
+typedef struct {
+    uint8_t         kind;
+    uint8_t         opcode;
+    uint8_t         numops;
+    uint32_t        line;
+    uint32_t        column;
+    token_t         name;   // The label, or the mnemonic.
+    token_t         text;   // The whole line, without the newline.
+    asm_operand_t   op[2];
+} asm_line_t;
+
+typedef struct {
+    const char     *ptr;
+    const char     *end;
+    token_t         file;   // Follows cpp line markers, for diagnostics.
+    uint32_t        line;
+    void           *recover;    // If set, a jmp_buf that errors longjmp to instead of exiting.
+} lexer_t;
+
+void lexer_init(lexer_t *lexer, const char *filename, const char *source, size_t size);
+bool lexer_next(lexer_t *lexer, asm_line_t *line);
+void lexer_error(const lexer_t *lexer, uint32_t line, uint32_t column, const char *format, ...)
+    __attribute__((noreturn, format(printf, 4, 5)));
+
+int lexer_opcode(const char *mnemonic, size_t length);
+int lexer_register(const char *name, size_t length);
+
+#endif
@@ -0,0 +1,323 @@
+// Check the assembler lexer and perfect hash.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "bitbuffer.h"
+#include "rarvm.h"
+#include "lexer.h"
+#include "rar.h"
+
+static void lex_string(lexer_t *lexer, const char *source)
+{
+    lexer_init(lexer, "<test>", source, strlen(source));
+}
+
+// Every mnemonic must have its own slot, and near misses must be rejected.
+static void perfect_hash(void)
+{
+    static const char *invalid[] = {
+        "", "m", "mo", "movq", "movzxx", "jmpp", "Mov", "MOV", "j", "jnb", "pushad",
+        "cmpw", "movs", "x", "xchgg", "retn", "r0", "_start",
+    };
+
+    for (int i = 0; i < VM_STANDARD; i++) {
+        assert(lexer_opcode(vm_mnemonic(i, false), strlen(vm_mnemonic(i, false))) == i);
+    }
+
+    // Only some byte forms have a mnemonic.
+    assert(lexer_opcode(vm_mnemonic(VM_NEG, true), 4) == VM_NEGB);
+    assert(vm_mnemonic(VM_XOR, true) == NULL);
+
+    for (int i = 0; i < sizeof invalid / sizeof *invalid; i++) {
+        assert(lexer_opcode(invalid[i], strlen(invalid[i])) == -1);
+    }
+
+    // The mnemonic doesn't need to be terminated.
+    assert(lexer_opcode("movzx r0", 5) == VM_MOVZX);
+    assert(lexer_opcode("movzx r0", 3) == VM_MOV);
+
+    for (int i = 0; i < 8; i++) {
+        char name[] = { 'r', '0' + i };
+        assert(lexer_register(name, 2) == i);
+    }
+
+    assert(lexer_register("r8", 2) == -1);
+    assert(lexer_register("r", 1) == -1);
+    assert(lexer_register("r00", 3) == -1);
+    assert(lexer_register("R0", 2) == -1);
+}
+
+static void operands(void)
+{
+    lexer_t     lexer;
+    asm_line_t  line;
+
+    lex_string(&lexer, "\tmov\t[r3+#0x10], #-1\n"
+                       "  cmp [r7-#4],[#0x3c020] ; comment, r0\n"
+                       "jmp $loop\n"
+                       "push r6;no space\n"
+                       "movzx r0,[r1]\n"
+                       "  ret  \n"
+                       "mov r0, #010\n"
+                       "mov r0, #0\n");
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.kind == ASM_INSN);
+    assert(line.opcode == VM_MOV);
+    assert(line.line == 1 && line.column == 2);
+    assert(line.numops == 2);
+    assert(line.op[0].type == VM_OPREGMEM && line.op[0].reg == 3);
+    assert(line.op[0].indexed && line.op[0].value == 0x10);
+    assert(line.op[0].column == 6);
+    assert(line.op[1].type == VM_OPINT && line.op[1].value == UINT32_MAX);
+    assert(line.op[1].column == 18);
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.opcode == VM_CMP && line.line == 2 && line.column == 3);
+    assert(line.op[0].type == VM_OPREGMEM && line.op[0].reg == 7 && line.op[0].value == -4);
+    assert(line.op[1].type == VM_OPMEM && line.op[1].value == 0x3c020);
+    assert(line.op[1].column == 15);
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.opcode == VM_JMP && line.numops == 1);
+    assert(line.op[0].type == ASM_OPSYMBOL);
+    assert(line.op[0].symbol.len == 4 && strncmp(line.op[0].symbol.ptr, "loop", 4) == 0);
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.opcode == VM_PUSH && line.numops == 1);
+    assert(line.op[0].type == VM_OPREG && line.op[0].reg == 6);
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.opcode == VM_MOVZX && line.numops == 2);
+    assert(line.op[1].type == VM_OPREGMEM && line.op[1].reg == 1 && !line.op[1].indexed);
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.opcode == VM_RET && line.numops == 0 && line.line == 6);
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.op[1].value == 8);
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.op[1].value == 0);
+
+    assert(!lexer_next(&lexer, &line));
+}
+
+// Labels, blank lines and line markers.
+static void structure(void)
+{
+    lexer_t     lexer;
+    asm_line_t  line;
+
+    lex_string(&lexer, "# 1 \"<stdin>\"\n"
+                       "\n"
+                       "# 10 \"stdlib/math.rh\" 1\n"
+                       "; nothing here\n"
+                       "_mod:   ; the label\n"
+                       "   \t\n"
+                       "loop: mov r0, r1\n"
+                       "#pragma once\n"
+                       "    div r0, r1\n"
+                       "# 3 \"test/mod.rs\" 2\n"
+                       "    call $_mod");
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.kind == ASM_LABEL);
+    assert(line.name.len == 4 && strncmp(line.name.ptr, "_mod", 4) == 0);
+    assert(line.line == 11);
+    assert(lexer.file.len == 14 && strncmp(lexer.file.ptr, "stdlib/math.rh", 14) == 0);
+
+    // Anything after a label is ignored, this is how it always worked.
+    assert(lexer_next(&lexer, &line));
+    assert(line.kind == ASM_LABEL && line.line == 13);
+    assert(line.name.len == 4 && strncmp(line.name.ptr, "loop", 4) == 0);
+
+    assert(lexer_next(&lexer, &line));
+    assert(line.kind == ASM_INSN && line.opcode == VM_DIV && line.line == 15);
+
+    // Missing final newline.
+    assert(lexer_next(&lexer, &line));
+    assert(line.opcode == VM_CALL && line.line == 3);
+    assert(line.op[0].symbol.len == 4);
+    assert(lexer.file.len == 11 && strncmp(lexer.file.ptr, "test/mod.rs", 11) == 0);
+
+    assert(!lexer_next(&lexer, &line));
+}
+
+// Run the lexer on source that should fail, and check the diagnostic.
+static void diagnostic(const char *source, const char *expected)
+{
+    int     fds[2];
+    char    message[512] = {0};
+    pid_t   child;
+    int     status;
+    size_t  size = 0;
+    ssize_t n;
+
+    assert(pipe(fds) == 0);
+
+    if ((child = fork()) == 0) {
+        lexer_t     lexer;
+        asm_line_t  line;
+        bitbuf_t   *output;
+        symtab_t   *symtab;
+
+        dup2(fds[1], STDERR_FILENO);
+
+        bitbuf_create(&output);
+        symtab_create(&symtab);
+        lex_string(&lexer, source);
+
+        while (lexer_next(&lexer, &line)) {
+            if (line.kind == ASM_INSN) {
+                rar_assemble(&lexer, &line, output, symtab, NULL);
+            }
+        }
+        _exit(0);
+    }
+
+    close(fds[1]);
+
+    // errx() writes the message in pieces.
+    while ((n = read(fds[0], message + size, sizeof message - size - 1)) > 0)
+        size += n;
+
+    close(fds[0]);
+    waitpid(child, &status, 0);
+
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE);
+    assert(size > 0);
+
+    if (strstr(message, expected) == NULL) {
+        fprintf(stderr, "expected \"%s\", got %s", expected, message);
+        abort();
+    }
+}
+
+static void errors(void)
+{
+    diagnostic("mov r0, r1\nmvo r0, r1\n",          "<test>:2:1: unrecognised mnemonic 'mvo'");
+    diagnostic("  mov r9, r1\n",                    "<test>:1:7: unrecognised register 'r9'");
+    diagnostic("mov r0, #12z\n",                    "<test>:1:10: invalid integer");
+    diagnostic("mov r0, [r1+4]\n",                  "<test>:1:13: expected immediate index");
+    diagnostic("mov r0, [r1\n",                     "<test>:1:12: expected ']'");
+    diagnostic("mov r0, r1 r2\n",                   "<test>:1:12: unexpected 'r'");
+    diagnostic("mov r0,\n",                         "<test>:1:8: expected operand after ','");
+    diagnostic("mov r0\n",                          "<test>:1:1: too few operands to mov");
+    diagnostic("inc r0, r1\n",                      "<test>:1:9: too many operands to inc");
+    diagnostic("ret r0\n",                          "<test>:1:5: too many operands to ret");
+    diagnostic("\n\n  jmp $nowhere\n",              "<test>:3:7: unresolved symbol nowhere");
+    diagnostic("# 7 \"foo.rs\"\n\nmov r0, x\n",     "foo.rs:8:9: unrecognised operand");
+}
+
+// Assembled instructions must decode to what was written.
+static void encoding(void)
+{
+    static const struct {
+        const char  *text;
+        vm_insn_t    insn;
+    } tests[] = {
+        { "mov [r3+#-4], #0x1234",  { VM_MOV,  false, { VM_OPREGMEM, 3, -4 },    { VM_OPINT, 0, 0x1234 } } },
+        { "movb [r1], #0x1ff",      { VM_MOV,  true,  { VM_OPREGMEM, 1, 0 },     { VM_OPINT, 0, 0xff } } },
+        { "addd r2, [#0x3c000]",    { VM_ADD,  false, { VM_OPREG, 2, 0 },        { VM_OPMEM, 0, 0x3c000 } } },
+        { "negb [r0]",              { VM_NEG,  true,  { VM_OPREGMEM, 0, 0 } } },
+        { "xchg r7, r0",            { VM_XCHG, false, { VM_OPREG, 7, 0 },        { VM_OPREG, 0, 0 } } },
+        { "pushf",                  { VM_PUSHF } },
+    };
+
+    for (int i = 0; i < sizeof tests / sizeof *tests; i++) {
+        uint8_t        code[64] = {0};
+        bitbuf_t      *output;
+        const uint8_t *bits;
+        uint32_t       size;
+        vm_program_t  *program;
+        vm_insn_t     *insn;
+
+        bitbuf_create(&output);
+        bitbuf_append(output, 0, 1);    // DataFlag
+
+        assert(rar_assemble_line(tests[i].text, output, NULL));
+
+        bitbuf_append(output, 0, 8 - bitbuf_numbits(output) % 8);
+        bitbuf_getbits(output, &bits, &size);
+
+        memcpy(code + 1, bits, size);
+
+        for (uint32_t j = 0; j < size; j++)
+            code[0] ^= bits[j];
+
+        assert(vm_program_decode(&program, code, size + 1));
+
+        insn = &program->insns[0];
+
+        assert(insn->opcode == tests[i].insn.opcode);
+        assert(insn->bytemode == tests[i].insn.bytemode);
+        assert(insn->op1.type == tests[i].insn.op1.type || tests[i].insn.op1.type == VM_OPNONE);
+        assert(insn->op1.reg == tests[i].insn.op1.reg);
+        assert(insn->op1.value == tests[i].insn.op1.value);
+        assert(insn->op2.type == tests[i].insn.op2.type || tests[i].insn.op2.type == VM_OPNONE);
+        assert(insn->op2.reg == tests[i].insn.op2.reg);
+        assert(insn->op2.value == tests[i].insn.op2.value);
+
+        vm_program_destroy(program);
+        bitbuf_destroy(output);
+    }
+
+    // Blank lines and labels are not instructions.
+    assert(!rar_assemble_line("", NULL, NULL));
+    assert(!rar_assemble_line("label:", NULL, NULL));
+    assert(!rar_assemble_line("   ; comment", NULL, NULL));
+}
+
+static void symbols(void)
+{
+    symtab_t       *symtab;
+    const label_t  *label;
+    char            names[4096][8];
+
+    assert(symtab_create(&symtab));
+
+    // Enough to grow the table a few times.
+    for (int i = 0; i < 4096; i++) {
+        snprintf(names[i], sizeof names[i], "l%d", i);
+        assert(symtab_add(symtab, names[i], strlen(names[i]), i));
+    }
+
+    for (int i = 0; i < 4096; i++) {
+        assert((label = symtab_lookup(symtab, names[i], strlen(names[i]))));
+        assert(label->address == i);
+    }
+
+    // The first definition is kept.
+    assert(!symtab_add(symtab, "l10", 3, 1234));
+    assert(symtab_lookup(symtab, "l10xyz", 3)->address == 10);
+    assert(symtab_lookup(symtab, "l4096", 5) == NULL);
+    assert(symtab_lookup(symtab, "l", 1) == NULL);
+
+    assert(symtab_destroy(symtab));
+}
+
+int main(int argc, char **argv)
+{
+    perfect_hash();
+    operands();
+    structure();
+    errors();
+    encoding();
+    symbols();
+    return 0;
+}
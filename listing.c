@@ -0,0 +1,465 @@
+// Assembler listings and code size accounting.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <err.h>
+
+#include "bitbuffer.h"
+#include "rarvm.h"
+#include "lexer.h"
+#include "rar.h"
+#include "listing.h"
+
+// The longest possible instruction is a 6 bit opcode, a bytemode flag and two
+// 41 bit [r0+#imm] operands.
+#define MAX_INSN_BITS   89
+
+typedef enum {
+    MODE_OPCODE,
+    MODE_REG,
+    MODE_IMM8,
+    MODE_IMM32,
+    MODE_MEM,
+    MODE_REGMEM,
+    MODE_INDEXED,
+    MODE_SYMBOL,
+    MODE_COUNT,
+} listing_mode_t;
+
+static const char *mode_names[MODE_COUNT] = {
+    [MODE_OPCODE]   = "opcode",
+    [MODE_REG]      = "r0",
+    [MODE_IMM8]     = "#imm8",
+    [MODE_IMM32]    = "#imm32",
+    [MODE_MEM]      = "[#mem]",
+    [MODE_REGMEM]   = "[r0]",
+    [MODE_INDEXED]  = "[r0+#imm]",
+    [MODE_SYMBOL]   = "$symbol",
+};
+
+typedef struct {
+    const char *name;
+    uint32_t    length;
+    uint32_t    insns;
+    uint64_t    bits;
+} listing_total_t;
+
+typedef struct {
+    uint32_t        *function;  // Index into functions for each entry.
+    listing_total_t *functions; // Every label, then <entry> and <toplevel>.
+    listing_total_t *ranked;    // Functions with code, largest first.
+    size_t           numranked;
+    listing_total_t  modes[MODE_COUNT];
+    uint32_t         insns;
+    uint64_t         bits;
+} listing_summary_t;
+
+static uint8_t operand_mode(const asm_operand_t *op, uint8_t bits)
+{
+    switch (op->type) {
+        case VM_OPREG:      return MODE_REG;
+        case VM_OPINT:      return bits == 10 ? MODE_IMM8 : MODE_IMM32;
+        case VM_OPMEM:      return MODE_MEM;
+        case VM_OPREGMEM:   return op->indexed ? MODE_INDEXED : MODE_REGMEM;
+        case ASM_OPSYMBOL:  return MODE_SYMBOL;
+    }
+    return MODE_OPCODE;
+}
+
+// Symbols starting with a single '_' are functions by convention, anything
+// else only if it's called.
+static bool is_function_name(const token_t *name)
+{
+    if (name->len == 6 && strncmp(name->ptr, "_start", 6) == 0)
+        return true;
+
+    return name->len > 1 && name->ptr[0] == '_' && name->ptr[1] != '_';
+}
+
+bool listing_create(listing_t **listing)
+{
+    *listing = calloc(1, sizeof(listing_t));
+    return *listing != NULL;
+}
+
+bool listing_destroy(listing_t *listing)
+{
+    if (listing)
+        free(listing->entries);
+    free(listing);
+    return true;
+}
+
+// Record a label or an instruction, the text is not copied so the source must
+// outlive the listing.
+bool listing_add(listing_t *listing,
+                 const lexer_t *lexer,
+                 const asm_line_t *line,
+                 symtab_t *symtab,
+                 uint32_t address,
+                 uint32_t bitpos,
+                 uint32_t bitlen,
+                 const asm_size_t *size)
+{
+    listing_entry_t *entry;
+    label_t         *label;
+
+    if (listing->count == listing->capacity) {
+        listing->capacity = listing->capacity ? listing->capacity * 2 : 1024;
+        listing->entries  = realloc(listing->entries, listing->capacity * sizeof(listing_entry_t));
+    }
+
+    entry = memset(&listing->entries[listing->count++], 0, sizeof(listing_entry_t));
+
+    entry->kind     = line->kind;
+    entry->address  = address;
+    entry->bitpos   = bitpos;
+    entry->bitlen   = bitlen;
+    entry->line     = line->line;
+    entry->file     = lexer->file;
+    entry->name     = line->name;
+    entry->text     = line->text;
+
+    if (line->kind == ASM_LABEL) {
+        if (is_function_name(&line->name) && (label = symtab_lookup(symtab, line->name.ptr, line->name.len)))
+            label->flags |= LABEL_FUNCTION;
+        return true;
+    }
+
+    entry->size = *size;
+
+    for (int i = 0; i < line->numops; i++) {
+        entry->modes[i] = operand_mode(&line->op[i], size->operand[i]);
+    }
+
+    // Anything that's called is a function.
+    if (line->opcode == VM_CALL && line->op[0].type == ASM_OPSYMBOL) {
+        if ((label = symtab_lookup(symtab, line->op[0].symbol.ptr, line->op[0].symbol.len)))
+            label->flags |= LABEL_FUNCTION;
+    }
+
+    return true;
+}
+
+static int compare_totals(const void *a, const void *b)
+{
+    const listing_total_t *x = a;
+    const listing_total_t *y = b;
+
+    if (x->bits != y->bits)
+        return x->bits < y->bits ? 1 : -1;
+
+    if (x->length != y->length)
+        return x->length < y->length ? -1 : 1;
+
+    return strncmp(x->name, y->name, x->length);
+}
+
+// Work out which function each instruction belongs to, and add up the bits.
+// Instructions belong to the last function label before them.
+static void listing_summarise(const listing_t *listing, const symtab_t *symtab, listing_summary_t *summary)
+{
+    size_t  entry     = symtab->count;
+    size_t  toplevel  = symtab->count + 1;
+    size_t  current   = toplevel;
+    size_t  n         = 0;
+
+    memset(summary, 0, sizeof *summary);
+
+    summary->function  = calloc(listing->count, sizeof(uint32_t));
+    summary->functions = calloc(symtab->count + 2, sizeof(listing_total_t));
+    summary->ranked    = calloc(symtab->count + 2, sizeof(listing_total_t));
+
+    for (size_t i = 0; i < symtab->count; i++) {
+        summary->functions[i].name   = symtab->labels[i].symbol;
+        summary->functions[i].length = symtab->labels[i].length;
+    }
+
+    summary->functions[entry].name      = "<entry>";
+    summary->functions[entry].length    = strlen("<entry>");
+    summary->functions[toplevel].name   = "<toplevel>";
+    summary->functions[toplevel].length = strlen("<toplevel>");
+
+    for (int i = 0; i < MODE_COUNT; i++) {
+        summary->modes[i].name   = mode_names[i];
+        summary->modes[i].length = strlen(mode_names[i]);
+    }
+
+    for (size_t i = 0; i < listing->count; i++) {
+        const listing_entry_t *e = &listing->entries[i];
+        const label_t         *label;
+
+        if (e->kind == ASM_LABEL) {
+            label = symtab_lookup(symtab, e->name.ptr, e->name.len);
+
+            if (label && label->flags & LABEL_FUNCTION)
+                current = label - symtab->labels;
+
+            summary->function[i] = current;
+            continue;
+        }
+
+        // The implicit jump to _start is the only instruction at address 0.
+        summary->function[i] = e->address == 0 ? entry : current;
+
+        summary->functions[summary->function[i]].insns++;
+        summary->functions[summary->function[i]].bits += e->bitlen;
+
+        summary->modes[MODE_OPCODE].insns++;
+        summary->modes[MODE_OPCODE].bits += e->size.opcode;
+
+        for (int j = 0; j < 2; j++) {
+            if (e->size.operand[j]) {
+                summary->modes[e->modes[j]].insns++;
+                summary->modes[e->modes[j]].bits += e->size.operand[j];
+            }
+        }
+
+        summary->insns++;
+        summary->bits += e->bitlen;
+    }
+
+    for (size_t i = 0; i < symtab->count + 2; i++) {
+        if (summary->functions[i].insns)
+            summary->ranked[n++] = summary->functions[i];
+    }
+
+    summary->numranked = n;
+
+    qsort(summary->ranked, summary->numranked, sizeof(listing_total_t), compare_totals);
+    qsort(summary->modes, MODE_COUNT, sizeof(listing_total_t), compare_totals);
+}
+
+static void listing_summary_free(listing_summary_t *summary)
+{
+    free(summary->function);
+    free(summary->functions);
+    free(summary->ranked);
+}
+
+// Format the encoded bits as hex, most significant first. The final digit is
+// padded with zero bits on the right, so it reads like the bitstream does.
+static void format_bits(char *buf, const uint8_t *code, uint32_t codesize, uint32_t bitpos, uint32_t bitlen)
+{
+    static const char digits[] = "0123456789abcdef";
+    uint32_t nibble = 0;
+    uint32_t i;
+
+    for (i = 0; i < bitlen; i++) {
+        uint32_t bit = bitpos + i;
+
+        nibble <<= 1;
+        nibble  |= bit / 8 < codesize ? code[bit / 8] >> (7 - bit % 8) & 1 : 0;
+
+        if (i % 4 == 3) {
+            *buf++ = digits[nibble];
+            nibble = 0;
+        }
+    }
+
+    if (i % 4)
+        *buf++ = digits[nibble << (4 - i % 4)];
+
+    *buf = '\0';
+}
+
+static bool same_file(const token_t *a, const token_t *b)
+{
+    return a->len == b->len && memcmp(a->ptr, b->ptr, a->len) == 0;
+}
+
+bool listing_write(const listing_t *listing,
+                   FILE *output,
+                   const char *filename,
+                   const symtab_t *symtab,
+                   const uint8_t *code,
+                   uint32_t codesize)
+{
+    listing_summary_t   summary;
+    token_t             file = {0};
+    char                hex[MAX_INSN_BITS / 4 + 2];
+
+    listing_summarise(listing, symtab, &summary);
+
+    fprintf(output, "; raras listing of %s\n", filename);
+    fprintf(output, ";\n");
+    fprintf(output, "; %5s %7s %5s  %-24s source\n", "addr", "bitpos", "bits", "encoding");
+
+    for (size_t i = 0; i < listing->count; i++) {
+        const listing_entry_t *e = &listing->entries[i];
+
+        // Note where each file starts, like cpp does.
+        if (!same_file(&file, &e->file)) {
+            fprintf(output, "\n; %.*s\n", (int) e->file.len, e->file.ptr);
+            file = e->file;
+        }
+
+        if (e->kind == ASM_LABEL) {
+            fprintf(output, "  %5u %7s %5s  %-24s %.*s\n", e->address, "", "", "", (int) e->text.len, e->text.ptr);
+            continue;
+        }
+
+        format_bits(hex, code, codesize, e->bitpos, e->bitlen);
+
+        fprintf(output, "  %5u %7u %5u  %-24s %.*s\n",
+                        e->address,
+                        e->bitpos,
+                        e->bitlen,
+                        hex,
+                        (int) e->text.len,
+                        e->text.ptr);
+    }
+
+    fprintf(output, "\n; %u instructions, %llu bits, %u bytes including the check byte.\n",
+                    summary.insns,
+                    (unsigned long long) summary.bits,
+                    codesize + 1);
+
+    fprintf(output, ";\n; Functions by size:\n;\n");
+    fprintf(output, "; %8s %6s %8s %6s  %s\n", "bits", "insns", "bytes", "%", "function");
+
+    for (size_t i = 0; i < summary.numranked; i++) {
+        fprintf(output, "; %8llu %6u %8.1f %6.1f  %.*s\n",
+                        (unsigned long long) summary.ranked[i].bits,
+                        summary.ranked[i].insns,
+                        summary.ranked[i].bits / 8.0,
+                        summary.bits ? summary.ranked[i].bits * 100.0 / summary.bits : 0.0,
+                        (int) summary.ranked[i].length,
+                        summary.ranked[i].name);
+    }
+
+    fprintf(output, ";\n; Operand modes by size:\n;\n");
+    fprintf(output, "; %8s %6s %8s %6s  %s\n", "bits", "count", "average", "%", "mode");
+
+    for (int i = 0; i < MODE_COUNT; i++) {
+        if (summary.modes[i].insns == 0)
+            continue;
+
+        fprintf(output, "; %8llu %6u %8.1f %6.1f  %s\n",
+                        (unsigned long long) summary.modes[i].bits,
+                        summary.modes[i].insns,
+                        (double) summary.modes[i].bits / summary.modes[i].insns,
+                        summary.bits ? summary.modes[i].bits * 100.0 / summary.bits : 0.0,
+                        summary.modes[i].name);
+    }
+
+    listing_summary_free(&summary);
+    return !ferror(output);
+}
+
+static void json_string(FILE *output, const char *string, size_t length)
+{
+    fputc('"', output);
+
+    for (size_t i = 0; i < length; i++) {
+        uint8_t c = string[i];
+
+        switch (c) {
+            case '"':   fputs("\\\"", output); break;
+            case '\\':  fputs("\\\\", output); break;
+            case '\t':  fputs("\\t", output); break;
+            default:
+                if (c < 0x20) {
+                    fprintf(output, "\\u%04x", c);
+                } else {
+                    fputc(c, output);
+                }
+        }
+    }
+
+    fputc('"', output);
+}
+
+// The same information as the listing, in a form that's easy to diff between
+// builds.
+bool listing_write_json(const listing_t *listing,
+                        FILE *output,
+                        const char *filename,
+                        const symtab_t *symtab,
+                        const uint8_t *code,
+                        uint32_t codesize)
+{
+    listing_summary_t   summary;
+    char                hex[MAX_INSN_BITS / 4 + 2];
+    bool                first = true;
+
+    listing_summarise(listing, symtab, &summary);
+
+    fprintf(output, "{\n  \"file\": ");
+    json_string(output, filename, strlen(filename));
+    fprintf(output, ",\n  \"instructions\": %u,\n  \"bits\": %llu,\n  \"bytes\": %u,\n",
+                    summary.insns,
+                    (unsigned long long) summary.bits,
+                    codesize + 1);
+
+    fprintf(output, "  \"code\": [\n");
+
+    for (size_t i = 0; i < listing->count; i++) {
+        const listing_entry_t *e = &listing->entries[i];
+        const listing_total_t *f = &summary.functions[summary.function[i]];
+
+        if (e->kind != ASM_INSN)
+            continue;
+
+        format_bits(hex, code, codesize, e->bitpos, e->bitlen);
+
+        fprintf(output, "%s    {\"address\": %u, \"bitpos\": %u, \"bits\": %u, \"encoding\": \"%s\", \"function\": ",
+                        first ? "" : ",\n",
+                        e->address,
+                        e->bitpos,
+                        e->bitlen,
+                        hex);
+
+        json_string(output, f->name, f->length);
+        fprintf(output, ", \"file\": ");
+        json_string(output, e->file.ptr, e->file.len);
+        fprintf(output, ", \"line\": %u, \"source\": ", e->line);
+        json_string(output, e->text.ptr, e->text.len);
+        fprintf(output, "}");
+
+        first = false;
+    }
+
+    fprintf(output, "\n  ],\n  \"functions\": [\n");
+
+    for (size_t i = 0; i < summary.numranked; i++) {
+        fprintf(output, "    {\"name\": ");
+        json_string(output, summary.ranked[i].name, summary.ranked[i].length);
+        fprintf(output, ", \"instructions\": %u, \"bits\": %llu}%s\n",
+                        summary.ranked[i].insns,
+                        (unsigned long long) summary.ranked[i].bits,
+                        i + 1 < summary.numranked ? "," : "");
+    }
+
+    fprintf(output, "  ],\n  \"modes\": [\n");
+
+    first = true;
+
+    for (int i = 0; i < MODE_COUNT; i++) {
+        if (summary.modes[i].insns == 0)
+            continue;
+
+        fprintf(output, "%s    {\"mode\": ", first ? "" : ",\n");
+        json_string(output, summary.modes[i].name, summary.modes[i].length);
+        fprintf(output, ", \"count\": %u, \"bits\": %llu}",
+                        summary.modes[i].insns,
+                        (unsigned long long) summary.modes[i].bits);
+
+        first = false;
+    }
+
+    fprintf(output, "\n  ]\n}\n");
+
+    listing_summary_free(&summary);
+    return !ferror(output);
+}
@@ -0,0 +1,49 @@
+#ifndef __LISTING_H
+#define __LISTING_H
+
+// Records what the assembler produced for every line, so the cost of each
+// instruction, function and operand mode can be reported.
+
+typedef struct {
+    uint8_t     kind;       // ASM_LABEL or ASM_INSN.
+    uint8_t     modes[2];   // How each operand was encoded, see listing.c.
+    asm_size_t  size;
+    uint32_t    address;
+    uint32_t    bitpos;     // Offset in the code, after the check byte.
+    uint32_t    bitlen;
+    uint32_t    line;
+    token_t     file;
+    token_t     name;       // The label, or the mnemonic.
+    token_t     text;
+} listing_entry_t;
+
+typedef struct {
+    listing_entry_t *entries;
+    size_t           count;
+    size_t           capacity;
+} listing_t;
+
+bool listing_create(listing_t **listing);
+bool listing_destroy(listing_t *listing);
+bool listing_add(listing_t *listing,
+                 const lexer_t *lexer,
+                 const asm_line_t *line,
+                 symtab_t *symtab,
+                 uint32_t address,
+                 uint32_t bitpos,
+                 uint32_t bitlen,
+                 const asm_size_t *size);
+bool listing_write(const listing_t *listing,
+                   FILE *output,
+                   const char *filename,
+                   const symtab_t *symtab,
+                   const uint8_t *code,
+                   uint32_t codesize);
+bool listing_write_json(const listing_t *listing,
+                        FILE *output,
+                        const char *filename,
+                        const symtab_t *symtab,
+                        const uint8_t *code,
+                        uint32_t codesize);
+
+#endif
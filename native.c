@@ -0,0 +1,737 @@
+// Translate RarVM programs to C, and execute them once compiled.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <dlfcn.h>
+
+#include "rarvm.h"
+#include "native.h"
+
+typedef int (*native_fn_t)(native_state_t *state, uint64_t maxinsns);
+
+struct native {
+    void        *handle;
+    native_fn_t  execute;
+    uint32_t     count;
+    uint32_t    *imm;
+};
+
+// What the translator knows about each instruction.
+typedef struct {
+    bool    leader;         // It starts a basic block.
+    bool    loop;           // A backward branch goes here, the limit is checked.
+    bool    livein;         // The flags might be read before they're next set.
+    bool    liveout;
+    bool    imm[2];         // The operand is an immediate the instruction overwrites.
+} node_t;
+
+// Everything before the first function, the state must match native.h.
+static const char kPrologue[] =
+    "#ifndef __RAR2C_PROLOGUE\n"
+    "#define __RAR2C_PROLOGUE\n"
+    "\n"
+    "#include <stdint.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "typedef struct {\n"
+    "    uint32_t    r[8];\n"
+    "    uint32_t    flags;\n"
+    "    uint32_t    ip;\n"
+    "    uint64_t    icount;\n"
+    "    uint64_t    mcount;\n"
+    "    uint8_t    *mem;\n"
+    "    uint32_t   *imm;\n"
+    "} native_state_t;\n"
+    "\n"
+    "enum { NATIVE_FINISHED, NATIVE_LIMIT, NATIVE_ENTRY };\n"
+    "\n"
+    "#define FC          0x00000001u\n"
+    "#define FZ          0x00000002u\n"
+    "#define FS          0x80000000u\n"
+    "#define MEMMASK     0x0003ffffu\n"
+    "\n"
+    "// Dwords at the end of memory use the extra bytes past it.\n"
+    "static inline uint32_t rar2c_load(const uint8_t *mem, uint32_t addr)\n"
+    "{\n"
+    "    uint32_t value;\n"
+    "    memcpy(&value, &mem[addr & MEMMASK], sizeof value);\n"
+    "    return value;\n"
+    "}\n"
+    "\n"
+    "static inline void rar2c_store(uint8_t *mem, uint32_t addr, uint32_t value)\n"
+    "{\n"
+    "    memcpy(&mem[addr & MEMMASK], &value, sizeof value);\n"
+    "}\n"
+    "\n"
+    "#define LD(addr)        rar2c_load(mem, (addr))\n"
+    "#define ST(addr, v)     rar2c_store(mem, (addr), (v))\n"
+    "#define LDB(addr)       mem[(addr) & MEMMASK]\n"
+    "#define STB(addr, v)    (mem[(addr) & MEMMASK] = (uint8_t) (v))\n"
+    "\n"
+    "#endif\n";
+
+static inline bool is_jump(const vm_insn_t *insn)
+{
+    return vm_opcode_flags_table[insn->opcode] & VMCF_JUMP;
+}
+
+static inline bool is_control(const vm_insn_t *insn)
+{
+    return is_jump(insn) || insn->opcode == VM_CALL || insn->opcode == VM_RET;
+}
+
+// Immediates can't be changed by other instructions, so these always go to
+// the same place.
+static inline bool is_direct(const vm_insn_t *insn)
+{
+    return (is_jump(insn) || insn->opcode == VM_CALL) && insn->op1.type == VM_OPINT;
+}
+
+static inline bool is_immediate(const vm_operand_t *op)
+{
+    return op->type != VM_OPREG && op->type != VM_OPREGMEM && op->type != VM_OPMEM;
+}
+
+static bool reads_flags(const vm_insn_t *insn)
+{
+    switch (insn->opcode) {
+        case VM_JZ:  case VM_JNZ: case VM_JS:  case VM_JNS:
+        case VM_JB:  case VM_JBE: case VM_JA:  case VM_JAE:
+        case VM_PUSHF:
+        case VM_ADC: case VM_SBB:
+            return true;
+    }
+    return false;
+}
+
+static bool sets_flags(const vm_insn_t *insn)
+{
+    switch (insn->opcode) {
+        case VM_CMP: case VM_ADD: case VM_SUB: case VM_INC:
+        case VM_DEC: case VM_XOR: case VM_AND: case VM_OR:
+        case VM_TEST: case VM_SHL: case VM_SHR: case VM_SAR:
+        case VM_NEG: case VM_ADC: case VM_SBB: case VM_POPF:
+            return true;
+    }
+    return false;
+}
+
+static bool writes_op1(const vm_insn_t *insn)
+{
+    switch (insn->opcode) {
+        case VM_MOV: case VM_ADD: case VM_SUB: case VM_INC:
+        case VM_DEC: case VM_XOR: case VM_AND: case VM_OR:
+        case VM_NOT: case VM_SHL: case VM_SHR: case VM_SAR:
+        case VM_NEG: case VM_POP: case VM_MOVZX: case VM_MOVSX:
+        case VM_XCHG: case VM_MUL: case VM_DIV: case VM_ADC:
+        case VM_SBB:
+            return true;
+    }
+    return false;
+}
+
+static inline bool successor_live(const vm_program_t *program, const node_t *nodes, uint32_t target)
+{
+    return target >= program->count || nodes[target].livein;
+}
+
+// Find the basic blocks, and where the flags are live. Leaving the
+// translated code, including through an indirect jump, needs the flags.
+static void analyse(const vm_program_t *program, node_t *nodes)
+{
+    bool changed;
+
+    nodes[0].leader = true;
+
+    for (uint32_t i = 0; i < program->count; i++) {
+        const vm_insn_t *insn = &program->insns[i];
+
+        nodes[i].imm[0] = writes_op1(insn) && is_immediate(&insn->op1);
+        nodes[i].imm[1] = insn->opcode == VM_XCHG && is_immediate(&insn->op2);
+
+        if (is_control(insn) && i + 1 < program->count)
+            nodes[i + 1].leader = true;
+
+        if (is_direct(insn) && insn->op1.value < program->count) {
+            nodes[insn->op1.value].leader = true;
+            nodes[insn->op1.value].loop |= insn->op1.value <= i;
+        }
+    }
+
+    do {
+        changed = false;
+
+        for (uint32_t i = program->count; i-- > 0;) {
+            const vm_insn_t *insn = &program->insns[i];
+            bool             in;
+            bool             out;
+
+            if (insn->opcode == VM_RET) {
+                out = true;
+            } else if (is_control(insn)) {
+                out = is_direct(insn) ? successor_live(program, nodes, insn->op1.value) : true;
+
+                if (is_jump(insn) && insn->opcode != VM_JMP)
+                    out |= successor_live(program, nodes, i + 1);
+            } else {
+                out = successor_live(program, nodes, i + 1);
+            }
+
+            in = nodes[i].loop || reads_flags(insn) || (out && !sets_flags(insn));
+
+            changed |= in != nodes[i].livein || out != nodes[i].liveout;
+
+            nodes[i].livein  = in;
+            nodes[i].liveout = out;
+        }
+    } while (changed);
+}
+
+// An expression for the value of an operand. Memory operands are addressed
+// with registers as they were before the instruction.
+static const char * get_operand(char *buf, size_t size, const vm_insn_t *insn, const node_t *node, uint32_t ip, int n, bool bytemode)
+{
+    const vm_operand_t *op = n ? &insn->op2 : &insn->op1;
+
+    switch (op->type) {
+        case VM_OPREG:
+            snprintf(buf, size, bytemode ? "(r%u & 0xff)" : "r%u", op->reg);
+            break;
+        case VM_OPREGMEM:
+            snprintf(buf, size, bytemode ? "LDB(a%d)" : "LD(a%d)", n + 1);
+            break;
+        case VM_OPMEM:
+            snprintf(buf, size, bytemode ? "LDB(%#xu)" : "LD(%#xu)", op->value & VM_MEMMASK);
+            break;
+        default:
+            if (node->imm[n]) {
+                snprintf(buf, size, bytemode ? "(i%u & 0xff)" : "i%u", ip * 2 + n);
+            } else {
+                snprintf(buf, size, "%#xu", bytemode ? op->value & 0xff : op->value);
+            }
+            break;
+    }
+
+    return buf;
+}
+
+static void set_operand(FILE *output, const vm_insn_t *insn, const node_t *node, uint32_t ip, int n, bool bytemode, const char *value)
+{
+    const vm_operand_t *op = n ? &insn->op2 : &insn->op1;
+
+    switch (op->type) {
+        case VM_OPREG:
+            if (bytemode) {
+                fprintf(output, "        r%u = (r%u & ~0xffu) | (%s & 0xff);\n", op->reg, op->reg, value);
+            } else {
+                fprintf(output, "        r%u = %s;\n", op->reg, value);
+            }
+            break;
+        case VM_OPREGMEM:
+            fprintf(output, "        %s(a%d, %s);\n", bytemode ? "STB" : "ST", n + 1, value);
+            break;
+        case VM_OPMEM:
+            fprintf(output, "        %s(%#xu, %s);\n", bytemode ? "STB" : "ST", op->value & VM_MEMMASK, value);
+            break;
+        default:
+            if (!node->imm[n])
+                break;
+
+            if (bytemode) {
+                fprintf(output, "        i%u = (i%u & ~0xffu) | (%s & 0xff);\n", ip * 2 + n, ip * 2 + n, value);
+            } else {
+                fprintf(output, "        i%u = %s;\n", ip * 2 + n, value);
+            }
+            break;
+    }
+}
+
+// Transfer control, leaving the code segment terminates the program.
+static void emit_jump(FILE *output, const vm_program_t *program, const vm_insn_t *insn, const node_t *node, uint32_t ip, const char *indent)
+{
+    char target[64];
+
+    if (is_direct(insn) && insn->op1.value < program->count) {
+        fprintf(output, "%sgoto L%u;\n", indent, insn->op1.value);
+    } else if (is_direct(insn)) {
+        fprintf(output, "%sip = %#xu;\n%sgoto finished;\n", indent, insn->op1.value, indent);
+    } else {
+        fprintf(output, "%sip = %s;\n", indent, get_operand(target, sizeof target, insn, node, ip, 0, false));
+        fprintf(output, "%sif (ip >= %uu)\n%s    goto finished;\n", indent, program->count, indent);
+        fprintf(output, "%sgoto dispatch;\n", indent);
+    }
+}
+
+// The flags as the interpreter would set them from res, or nothing if they
+// can't be read.
+static void emit_flags(FILE *output, const node_t *node, const char *expression)
+{
+    if (node->liveout) {
+        fprintf(output, "        flags = %s;\n", expression);
+    }
+}
+
+static void emit_insn(FILE *output, const vm_program_t *program, const node_t *nodes, uint32_t ip)
+{
+    const vm_insn_t *insn       = &program->insns[ip];
+    const node_t    *node       = &nodes[ip];
+    bool             bytemode   = insn->bytemode;
+    uint8_t          opflags    = vm_opcode_flags_table[insn->opcode];
+    char             op1[64];
+    char             op2[64];
+    char             text[128];
+
+    fprintf(output, "    // %u: %s\n    {\n", ip, vm_format_insn(text, sizeof text, insn));
+
+    if (opflags & (VMCF_OP1 | VMCF_OP2) && insn->op1.type == VM_OPREGMEM)
+        fprintf(output, "        uint32_t a1 = r%u + %#xu;\n", insn->op1.reg, insn->op1.value);
+    if (opflags & VMCF_OP2 && insn->op2.type == VM_OPREGMEM)
+        fprintf(output, "        uint32_t a2 = r%u + %#xu;\n", insn->op2.reg, insn->op2.value);
+
+    get_operand(op1, sizeof op1, insn, node, ip, 0, bytemode);
+    get_operand(op2, sizeof op2, insn, node, ip, 1, bytemode);
+
+    switch (insn->opcode) {
+        case VM_MOV:
+            set_operand(output, insn, node, ip, 0, bytemode, op2);
+            break;
+        case VM_CMP:
+            // Without the flags, it does nothing.
+            if (!node->liveout)
+                break;
+            fprintf(output, "        uint32_t v1 = %s;\n", op1);
+            fprintf(output, "        uint32_t res = v1 - %s;\n", op2);
+            emit_flags(output, node, "res == 0 ? FZ : (res > v1) | (res & FS)");
+            break;
+        case VM_ADD:
+            fprintf(output, "        uint32_t v1 = %s;\n", op1);
+            fprintf(output, "        uint32_t res = v1 + %s;\n", op2);
+            if (bytemode) {
+                fprintf(output, "        res &= 0xff;\n");
+                emit_flags(output, node, "(res < v1) | (res == 0 ? FZ : (res & 0x80) ? FS : 0)");
+            } else {
+                emit_flags(output, node, "(res < v1) | (res == 0 ? FZ : (res & FS))");
+            }
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_SUB:
+            fprintf(output, "        uint32_t v1 = %s;\n", op1);
+            fprintf(output, "        uint32_t res = v1 - %s;\n", op2);
+            emit_flags(output, node, "res == 0 ? FZ : (res > v1) | (res & FS)");
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_INC:
+            fprintf(output, "        uint32_t res = %s + 1;\n", op1);
+            if (bytemode)
+                fprintf(output, "        res &= 0xff;\n");
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            emit_flags(output, node, "res == 0 ? FZ : res & FS");
+            break;
+        case VM_DEC:
+            fprintf(output, "        uint32_t res = %s - 1;\n", op1);
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            emit_flags(output, node, "res == 0 ? FZ : res & FS");
+            break;
+        case VM_XOR:
+        case VM_AND:
+        case VM_OR:
+        case VM_TEST:
+            if (insn->opcode == VM_TEST && !node->liveout)
+                break;
+            fprintf(output, "        uint32_t res = %s %s %s;\n", op1,
+                    insn->opcode == VM_XOR ? "^" : insn->opcode == VM_OR ? "|" : "&", op2);
+            emit_flags(output, node, "res == 0 ? FZ : res & FS");
+            if (insn->opcode != VM_TEST)
+                set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_NOT:
+            fprintf(output, "        uint32_t res = ~%s;\n", op1);
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_SHL:
+            fprintf(output, "        uint32_t v1 = %s;\n", op1);
+            fprintf(output, "        uint32_t v2 = %s;\n", op2);
+            fprintf(output, "        uint32_t res = v1 << (v2 & 31);\n");
+            emit_flags(output, node, "(res == 0 ? FZ : (res & FS)) | ((v1 << ((v2 - 1) & 31)) & 0x80000000 ? FC : 0)");
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_SHR:
+        case VM_SAR:
+            fprintf(output, "        uint32_t v1 = %s;\n", op1);
+            fprintf(output, "        uint32_t v2 = %s;\n", op2);
+            if (insn->opcode == VM_SHR) {
+                fprintf(output, "        uint32_t res = v1 >> (v2 & 31);\n");
+            } else {
+                fprintf(output, "        uint32_t res = ((int32_t) v1) >> (v2 & 31);\n");
+            }
+            emit_flags(output, node, "(res == 0 ? FZ : (res & FS)) | ((v1 >> ((v2 - 1) & 31)) & FC)");
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_NEG:
+            fprintf(output, "        uint32_t res = 0 - %s;\n", op1);
+            emit_flags(output, node, "res == 0 ? FZ : FC | (res & FS)");
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_PUSH:
+            // The value is read after r7 is decremented, but the address
+            // of a memory operand was calculated before.
+            fprintf(output, "        r7 -= 4;\n");
+            fprintf(output, "        ST(r7, %s);\n", op1);
+            break;
+        case VM_POP:
+            set_operand(output, insn, node, ip, 0, false, "LD(r7)");
+            fprintf(output, "        r7 += 4;\n");
+            break;
+        case VM_PUSHA:
+            for (int i = REG0; i <= REG7; i++)
+                fprintf(output, "        ST(r7 - %d, r%d);\n", 4 * (i + 1), i);
+            fprintf(output, "        r7 -= 32;\n");
+            break;
+        case VM_POPA:
+            fprintf(output, "        uint32_t sp = r7;\n");
+            for (int i = REG0; i <= REG7; i++)
+                fprintf(output, "        r%d = LD(sp + %d);\n", REG7 - i, 4 * i);
+            break;
+        case VM_PUSHF:
+            fprintf(output, "        r7 -= 4;\n");
+            fprintf(output, "        ST(r7, flags);\n");
+            break;
+        case VM_POPF:
+            fprintf(output, "        flags = LD(r7);\n");
+            fprintf(output, "        r7 += 4;\n");
+            break;
+        case VM_MOVZX:
+            set_operand(output, insn, node, ip, 0, false, get_operand(op2, sizeof op2, insn, node, ip, 1, true));
+            break;
+        case VM_MOVSX:
+            snprintf(text, sizeof text, "(uint32_t) (int8_t) %s", get_operand(op2, sizeof op2, insn, node, ip, 1, true));
+            set_operand(output, insn, node, ip, 0, false, text);
+            break;
+        case VM_XCHG:
+            fprintf(output, "        uint32_t v1 = %s;\n", op1);
+            fprintf(output, "        uint32_t v2 = %s;\n", op2);
+            set_operand(output, insn, node, ip, 0, bytemode, "v2");
+            set_operand(output, insn, node, ip, 1, bytemode, "v1");
+            break;
+        case VM_MUL:
+            fprintf(output, "        uint32_t res = %s * %s;\n", op1, op2);
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_DIV:
+            // Division by zero is silently ignored.
+            fprintf(output, "        uint32_t v2 = %s;\n", op2);
+            fprintf(output, "        if (v2) {\n");
+            fprintf(output, "            uint32_t res = %s / v2;\n", op1);
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            fprintf(output, "        }\n");
+            break;
+        case VM_ADC:
+        case VM_SBB:
+            fprintf(output, "        uint32_t v1 = %s;\n", op1);
+            fprintf(output, "        uint32_t c = flags & FC;\n");
+            if (insn->opcode == VM_ADC) {
+                fprintf(output, "        uint32_t res = v1 + %s + c;\n", op2);
+                if (bytemode)
+                    fprintf(output, "        res &= 0xff;\n");
+                emit_flags(output, node, "(res < v1 || (res == v1 && c)) | (res == 0 ? FZ : (res & FS))");
+            } else {
+                fprintf(output, "        uint32_t res = v1 - %s - c;\n", op2);
+                emit_flags(output, node, "(res > v1 || (res == v1 && c)) | (res == 0 ? FZ : (res & FS))");
+            }
+            set_operand(output, insn, node, ip, 0, bytemode, "res");
+            break;
+        case VM_JMP:
+            emit_jump(output, program, insn, node, ip, "        ");
+            break;
+        case VM_JZ:
+        case VM_JNZ:
+        case VM_JS:
+        case VM_JNS:
+        case VM_JB:
+        case VM_JBE:
+        case VM_JA:
+        case VM_JAE: {
+            static const char *conditions[] = {
+                [VM_JZ]     = "flags & FZ",
+                [VM_JNZ]    = "!(flags & FZ)",
+                [VM_JS]     = "flags & FS",
+                [VM_JNS]    = "!(flags & FS)",
+                [VM_JB]     = "flags & FC",
+                [VM_JBE]    = "flags & (FC | FZ)",
+                [VM_JA]     = "!(flags & (FC | FZ))",
+                [VM_JAE]    = "!(flags & FC)",
+            };
+
+            fprintf(output, "        if (%s) {\n", conditions[insn->opcode]);
+            emit_jump(output, program, insn, node, ip, "            ");
+            fprintf(output, "        }\n");
+            break;
+        }
+        case VM_CALL:
+            // The target is read after the return address is pushed.
+            fprintf(output, "        r7 -= 4;\n");
+            fprintf(output, "        ST(r7, %uu);\n", ip + 1);
+            emit_jump(output, program, insn, node, ip, "        ");
+            break;
+        case VM_RET:
+            fprintf(output, "        if (r7 >= %#xu) {\n", VM_MEMSIZE);
+            fprintf(output, "            ip = %uu;\n", ip);
+            fprintf(output, "            goto finished;\n");
+            fprintf(output, "        }\n");
+            fprintf(output, "        ip = LD(r7);\n");
+            fprintf(output, "        if (ip >= %uu)\n", program->count);
+            fprintf(output, "            goto finished;\n");
+            fprintf(output, "        r7 += 4;\n");
+            fprintf(output, "        goto dispatch;\n");
+            break;
+    }
+
+    fprintf(output, "    }\n");
+
+    // The interpreter would read past the end of the program.
+    if (!is_control(insn) && ip + 1 == program->count) {
+        fprintf(output, "    ip = %uu;\n", ip + 1);
+        fprintf(output, "    goto finished;\n");
+    }
+}
+
+// The counters are updated once per block, every instruction in a block
+// always executes.
+static void emit_block(FILE *output, const vm_program_t *program, const node_t *nodes, uint32_t start)
+{
+    uint32_t end;
+    uint32_t mcount = 0;
+
+    for (end = start; end < program->count; end++) {
+        const vm_insn_t *insn = &program->insns[end];
+
+        mcount += insn->op1.type == VM_OPREGMEM || insn->op1.type == VM_OPMEM;
+        mcount += insn->op2.type == VM_OPREGMEM || insn->op2.type == VM_OPMEM;
+
+        if (is_control(insn) || (end + 1 < program->count && nodes[end + 1].leader)) {
+            end++;
+            break;
+        }
+    }
+
+    fprintf(output, "L%u:\n", start);
+
+    if (nodes[start].loop) {
+        fprintf(output, "    if (maxinsns - icount < %uu) {\n", program->count);
+        fprintf(output, "        ip = %uu;\n", start);
+        fprintf(output, "        status = NATIVE_LIMIT;\n");
+        fprintf(output, "        goto leave;\n");
+        fprintf(output, "    }\n");
+    }
+
+    fprintf(output, "    icount += %u;\n", end - start);
+
+    if (mcount)
+        fprintf(output, "    mcount += %u;\n", mcount);
+
+    for (uint32_t ip = start; ip < end; ip++)
+        emit_insn(output, program, nodes, ip);
+}
+
+// The function is name_execute(), and name_hash identifies the program it
+// was translated from.
+bool native_translate(FILE *output, const vm_program_t *program, const char *name)
+{
+    node_t *nodes;
+
+    // Standard filters are already native.
+    if (program->filter != VMSF_NONE || program->count == 0)
+        return false;
+
+    for (const char *p = name; *p; p++) {
+        if (!isalnum(*p) && *p != '_') {
+            return false;
+        }
+    }
+
+    if (!(nodes = calloc(program->count, sizeof(node_t))))
+        return false;
+
+    analyse(program, nodes);
+
+    fprintf(output, "%s\n", kPrologue);
+    fprintf(output, "const uint32_t %s_abi = %u;\n", name, NATIVE_ABI);
+    fprintf(output, "const uint32_t %s_hash = %#xu;\n\n", name, vm_program_hash(program));
+    fprintf(output, "int %s_execute(native_state_t *s, uint64_t maxinsns)\n{\n", name);
+
+    for (int i = REG0; i <= REG7; i++)
+        fprintf(output, "    uint32_t r%d = s->r[%d];\n", i, i);
+
+    for (uint32_t i = 0; i < program->count * 2; i++) {
+        if (nodes[i / 2].imm[i % 2]) {
+            fprintf(output, "    uint32_t i%u = s->imm[%u];\n", i, i);
+        }
+    }
+
+    fprintf(output, "    uint32_t flags = s->flags;\n");
+    fprintf(output, "    uint32_t ip = s->ip;\n");
+    fprintf(output, "    uint64_t icount = s->icount;\n");
+    fprintf(output, "    uint64_t mcount = s->mcount;\n");
+    fprintf(output, "    uint8_t *mem = s->mem;\n");
+    fprintf(output, "    int status;\n\n");
+    fprintf(output, "    goto dispatch;\n\n");
+
+    for (uint32_t i = 0; i < program->count; i++) {
+        if (nodes[i].leader) {
+            emit_block(output, program, nodes, i);
+        }
+    }
+
+    // Indirect jumps, and entry from the host.
+    fprintf(output, "\ndispatch:\n");
+    fprintf(output, "    if (maxinsns - icount < %uu) {\n", program->count);
+    fprintf(output, "        status = NATIVE_LIMIT;\n");
+    fprintf(output, "        goto leave;\n");
+    fprintf(output, "    }\n");
+    fprintf(output, "    switch (ip) {\n");
+
+    for (uint32_t i = 0; i < program->count; i++) {
+        if (nodes[i].leader) {
+            fprintf(output, "        case %u: goto L%u;\n", i, i);
+        }
+    }
+
+    fprintf(output, "    }\n");
+    fprintf(output, "    status = NATIVE_ENTRY;\n");
+    fprintf(output, "    goto leave;\n\n");
+    fprintf(output, "finished:\n");
+    fprintf(output, "    status = NATIVE_FINISHED;\n\n");
+    fprintf(output, "leave:\n");
+
+    for (int i = REG0; i <= REG7; i++)
+        fprintf(output, "    s->r[%d] = r%d;\n", i, i);
+
+    for (uint32_t i = 0; i < program->count * 2; i++) {
+        if (nodes[i / 2].imm[i % 2]) {
+            fprintf(output, "    s->imm[%u] = i%u;\n", i, i);
+        }
+    }
+
+    fprintf(output, "    s->flags = flags;\n");
+    fprintf(output, "    s->ip = ip;\n");
+    fprintf(output, "    s->icount = icount;\n");
+    fprintf(output, "    s->mcount = mcount;\n");
+    fprintf(output, "    return status;\n}\n");
+
+    free(nodes);
+    return !ferror(output);
+}
+
+bool native_load(native_t **native, const char *filename, const char *name, const vm_program_t *program)
+{
+    char            path[4096];
+    char            symbol[256];
+    const uint32_t *abi;
+    const uint32_t *hash;
+
+    if (!(*native = calloc(1, sizeof(native_t))))
+        return false;
+
+    // Otherwise dlopen searches the library path.
+    snprintf(path, sizeof path, "%s%s", strchr(filename, '/') ? "" : "./", filename);
+
+    if (!((*native)->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+        native_unload(*native);
+        return false;
+    }
+
+    snprintf(symbol, sizeof symbol, "%s_abi", name);
+    abi = dlsym((*native)->handle, symbol);
+    snprintf(symbol, sizeof symbol, "%s_hash", name);
+    hash = dlsym((*native)->handle, symbol);
+    snprintf(symbol, sizeof symbol, "%s_execute", name);
+    (*native)->execute = (native_fn_t) dlsym((*native)->handle, symbol);
+
+    if (!abi || !hash || !(*native)->execute
+     || *abi != NATIVE_ABI
+     || *hash != vm_program_hash(program)) {
+        native_unload(*native);
+        return false;
+    }
+
+    (*native)->count = program->count;
+    (*native)->imm   = calloc(program->count * 2, sizeof(uint32_t));
+    return true;
+}
+
+bool native_unload(native_t *native)
+{
+    if (native->handle)
+        dlclose(native->handle);
+
+    free(native->imm);
+    free(native);
+    return true;
+}
+
+// Like vm_execute, the program must be the one native_load() was given.
+bool native_execute(native_t *native, vm_t *vm, vm_program_t *program, uint64_t maxinsns)
+{
+    native_state_t state;
+    int            status;
+
+    // Filters are already native, and translated code doesn't record edges.
+    if (program->filter != VMSF_NONE || vm->coverage)
+        return vm_execute(vm, program, maxinsns);
+
+    while (vm->icount < maxinsns) {
+        for (uint32_t i = 0; i < native->count; i++) {
+            native->imm[i * 2 + 0] = program->insns[i].op1.value;
+            native->imm[i * 2 + 1] = program->insns[i].op2.value;
+        }
+
+        memcpy(state.r, vm->r, sizeof state.r);
+
+        state.flags     = vm->flags;
+        state.ip        = vm->ip;
+        state.icount    = vm->icount;
+        state.mcount    = vm->mcount;
+        state.mem       = vm->mem;
+        state.imm       = native->imm;
+
+        status = native->execute(&state, maxinsns);
+
+        memcpy(vm->r, state.r, sizeof vm->r);
+
+        vm->flags       = state.flags;
+        vm->ip          = state.ip;
+        vm->icount      = state.icount;
+        vm->mcount      = state.mcount;
+        vm->dirty       = ~0ULL;
+
+        for (uint32_t i = 0; i < native->count; i++) {
+            program->insns[i].op1.value = native->imm[i * 2 + 0];
+            program->insns[i].op2.value = native->imm[i * 2 + 1];
+        }
+
+        switch (status) {
+            case NATIVE_FINISHED:
+                return true;
+            case NATIVE_LIMIT:
+                return vm_execute(vm, program, maxinsns);
+            case NATIVE_ENTRY:
+                // Step to the next block.
+                if (vm_execute(vm, program, vm->icount + 1))
+                    return true;
+                break;
+        }
+    }
+
+    return false;
+}
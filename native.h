@@ -0,0 +1,43 @@
+#ifndef __NATIVE_H
+#define __NATIVE_H
+
+// Programs translated ahead of time to C by rar2c, and compiled into shared
+// objects. Each basic block becomes straight line C, registers are locals,
+// the flags are only computed where something might read them and direct
+// branches are gotos. The results are exactly the same as vm_execute(),
+// including the instruction and memory operand counts.
+//
+// Translated code checks the instruction limit at the top of loops, and
+// returns early when it's close. It also can't jump into the middle of a
+// block, e.g. if a ret goes somewhere other than after a call. In both cases
+// native_execute() runs the interpreter until it can continue.
+
+// Changes whenever native_state_t or the generated symbols change.
+#define NATIVE_ABI          1
+
+// The state passed to translated code.
+typedef struct {
+    uint32_t    r[8];
+    uint32_t    flags;
+    uint32_t    ip;
+    uint64_t    icount;
+    uint64_t    mcount;
+    uint8_t    *mem;
+    uint32_t   *imm;            // The value of both operands of every instruction.
+} native_state_t;
+
+// Why translated code returned.
+enum {
+    NATIVE_FINISHED,            // The program terminated.
+    NATIVE_LIMIT,               // Fewer instructions remain than the program length.
+    NATIVE_ENTRY,               // The ip isn't the start of a block.
+};
+
+typedef struct native native_t;
+
+bool native_translate(FILE *output, const vm_program_t *program, const char *name);
+bool native_load(native_t **native, const char *filename, const char *name, const vm_program_t *program);
+bool native_unload(native_t *native);
+bool native_execute(native_t *native, vm_t *vm, vm_program_t *program, uint64_t maxinsns);
+
+#endif
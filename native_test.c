@@ -0,0 +1,170 @@
+// Check that translated programs agree exactly with the interpreter.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "rarvm.h"
+#include "native.h"
+#include "vmtest.h"
+
+#define NUM_CASES   300
+#define MAX_INSNS   24
+#define MAX_STEPS   3000
+
+typedef struct {
+    vm_insn_t       insns[MAX_INSNS + 1];
+    vm_program_t    program;
+    vm_t            initial;        // Just the registers and flags.
+    uint64_t        limits[2];
+} testcase_t;
+
+static testcase_t cases[NUM_CASES];
+
+// Every program starts with the same memory, and its own registers.
+static void reset(vm_t *vm, const vm_t *initial)
+{
+    uint32_t seed = 0x7d2a9b41;
+
+    for (uint32_t addr = 0; addr < VM_MEMSIZE + 4; addr++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+
+        vm->mem[addr] = addr < 0x300 || addr >= VM_MEMSIZE - 0x100 ? seed : 0;
+    }
+
+    memcpy(vm->r, initial->r, sizeof vm->r);
+
+    vm->flags   = initial->flags;
+    vm->ip      = 0;
+    vm->icount  = 0;
+    vm->mcount  = 0;
+}
+
+static void check_state(const vm_t *vm, const vm_program_t *program, const vm_t *native, const vm_program_t *translated)
+{
+    assert(memcmp(vm->r, native->r, sizeof vm->r) == 0);
+    assert(vm->flags == native->flags);
+    assert(vm->ip == native->ip);
+    assert(vm->icount == native->icount);
+    assert(vm->mcount == native->mcount);
+    assert(memcmp(vm->mem, native->mem, VM_MEMSIZE + 4) == 0);
+
+    for (uint32_t i = 0; i < program->count; i++) {
+        assert(program->insns[i].op1.value == translated->insns[i].op1.value);
+        assert(program->insns[i].op2.value == translated->insns[i].op2.value);
+    }
+}
+
+// Every program is translated into one file, which is compiled once. Each is
+// run to a random limit and then resumed, so translated code is also entered
+// part way through a block.
+static void differential(void)
+{
+    char          source[]  = "/tmp/native_test.XXXXXX";
+    char          library[sizeof source + 3];
+    char          command[256];
+    const char   *cc        = getenv("CC") ? getenv("CC") : "cc";
+    FILE         *output;
+    vm_t         *vm;
+    vm_t         *native;
+    int           fd;
+
+    vmtest_seed(0x1f3c52e7);
+
+    assert((fd = mkstemp(source)) >= 0);
+    assert((output = fdopen(fd, "w")));
+
+    for (int i = 0; i < NUM_CASES; i++) {
+        char name[32];
+
+        cases[i].program.insns = cases[i].insns;
+
+        vmtest_random_program(&cases[i].program, MAX_INSNS);
+
+        for (int r = REG0; r <= REG7; r++)
+            cases[i].initial.r[r] = vmtest_random32() % 2 ? vmtest_random32() % 0x200 : vmtest_random_value();
+
+        cases[i].initial.r[REG7]    = vmtest_random32() % 2 ? 0x200 : VM_MEMSIZE;
+        cases[i].initial.flags      = vmtest_random32() % 4 ? vmtest_random32() & (VM_FC | VM_FZ | VM_FS) : vmtest_random32();
+        cases[i].limits[0]          = vmtest_random32() % MAX_STEPS;
+        cases[i].limits[1]          = cases[i].limits[0] + vmtest_random32() % MAX_STEPS;
+
+        snprintf(name, sizeof name, "case%d", i);
+
+        assert(native_translate(output, &cases[i].program, name));
+    }
+
+    assert(fclose(output) == 0);
+
+    snprintf(library, sizeof library, "%s.so", source);
+    snprintf(command, sizeof command, "%s -O1 -shared -fPIC -x c -o %s %s", cc, library, source);
+
+    assert(system(command) == 0);
+
+    assert(vm_create(&vm));
+    assert(vm_create(&native));
+
+    for (int i = 0; i < NUM_CASES; i++) {
+        vm_insn_t     copy[MAX_INSNS + 1];
+        vm_program_t  translated    = cases[i].program;
+        native_t     *compiled;
+        char          name[32];
+
+        memcpy(copy, cases[i].insns, sizeof copy);
+
+        translated.insns = copy;
+
+        snprintf(name, sizeof name, "case%d", i);
+
+        assert(native_load(&compiled, library, name, &translated));
+
+        reset(vm, &cases[i].initial);
+        reset(native, &cases[i].initial);
+
+        for (int n = 0; n < 2; n++) {
+            bool finished = vm_execute(vm, &cases[i].program, cases[i].limits[n]);
+
+            assert(native_execute(compiled, native, &translated, cases[i].limits[n]) == finished);
+
+            check_state(vm, &cases[i].program, native, &translated);
+
+            if (finished)
+                break;
+        }
+
+        native_unload(compiled);
+    }
+
+    // Only the program it was translated from can be loaded.
+    {
+        native_t *compiled;
+
+        cases[0].insns[0].op1.value ^= 1;
+
+        assert(!native_load(&compiled, library, "case0", &cases[0].program));
+        assert(!native_load(&compiled, library, "missing", &cases[1].program));
+    }
+
+    vm_destroy(vm);
+    vm_destroy(native);
+    unlink(source);
+    unlink(library);
+}
+
+int main(int argc, char **argv)
+{
+    differential();
+    return 0;
+}
@@ -2,14 +2,45 @@
 #define __RAR_H
 
 
+// Labels that are called, or look like a function by the stdlib naming
+// convention, used for accounting code size.
+#define LABEL_FUNCTION  (1 << 0)
+
+// Labels point into the source, the name is not nul terminated.
 typedef struct {
-    char        symbol[128];
+    const char *symbol;
+    uint32_t    length;
     uint32_t    flags;
     uint32_t    address;
 } label_t;
 
+// An open addressed hash table of labels.
+typedef struct {
+    label_t    *labels;
+    size_t      count;
+    size_t      capacity;
+    uint32_t   *buckets;    // Index of a label plus one, or zero if empty.
+    size_t      size;       // Number of buckets, always a power of two.
+} symtab_t;
+
+// How many bits each part of an instruction was encoded with.
+typedef struct {
+    uint8_t     opcode;     // Including the bytemode flag.
+    uint8_t     operand[2];
+} asm_size_t;
+
+
+bool symtab_create(symtab_t **symtab);
+bool symtab_destroy(symtab_t *symtab);
+bool symtab_add(symtab_t *symtab, const char *symbol, uint32_t length, uint32_t address);
+label_t * symtab_lookup(const symtab_t *symtab, const char *symbol, uint32_t length);
 
-bool rar_assemble_line(const char *line, bitbuf_t *output, label_t *symtab, size_t numsyms);
+bool rar_assemble(const lexer_t *lexer,
+                  const asm_line_t *line,
+                  bitbuf_t *output,
+                  const symtab_t *symtab,
+                  asm_size_t *size);
+bool rar_assemble_line(const char *line, bitbuf_t *output, const symtab_t *symtab);
 
 
 #endif
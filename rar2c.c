@@ -0,0 +1,66 @@
+// Translate RarVM object files to C, to be compiled into shared objects.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "rarvm.h"
+#include "native.h"
+
+int main(int argc, char **argv)
+{
+    vm_program_t *program;
+    FILE         *output    = stdout;
+    const char   *filename  = NULL;
+    const char   *name      = "program";
+    int           opt;
+
+    while ((opt = getopt(argc, argv, "o:n:")) != -1) {
+        switch (opt) {
+            case 'o':
+                filename = optarg;
+                break;
+            case 'n':
+                name = optarg;
+                break;
+            default:
+                errx(EXIT_FAILURE, "usage: %s [-n name] [-o output.c] input.ro", *argv);
+        }
+    }
+
+    if (optind != argc - 1)
+        errx(EXIT_FAILURE, "usage: %s [-n name] [-o output.c] input.ro", *argv);
+
+    if (!vm_program_load(&program, argv[optind]))
+        errx(EXIT_FAILURE, "failed to load rar object file %s", argv[optind]);
+
+    if (program->filter != VMSF_NONE)
+        errx(EXIT_FAILURE, "%s is the %s standard filter, which is already native", argv[optind], vm_standard_filter_name(program->filter));
+
+    if (filename && !(output = fopen(filename, "w")))
+        err(EXIT_FAILURE, "failed to open output file %s", filename);
+
+    if (!native_translate(output, program, name)) {
+        if (filename)
+            unlink(filename);
+
+        errx(EXIT_FAILURE, "failed to translate %s, names must be alphanumeric", argv[optind]);
+    }
+
+    if (output != stdout && fclose(output) != 0)
+        err(EXIT_FAILURE, "failed to write output file %s", filename);
+
+    vm_program_destroy(program);
+    return 0;
+}
@@ -18,94 +18,393 @@
 #include <string.h>
 #include <getopt.h>
 #include <err.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
 #include "bitbuffer.h"
+#include "lexer.h"
 #include "rar.h"
+#include "sha256.h"
+#include "cache.h"
+#include "listing.h"
 
-#include "strchrnul.h"
+// Change this whenever the object format changes, so stale entries are ignored.
+#define CACHE_VERSION       "raras-1"
+#define CACHE_DEFAULT_SIZE  (64 << 20)
+
+// Rar has no entrypoint, so every program starts with a jump to _start.
+#define ENTRYPOINT          "jmp $_start"
+
+// Read the entire input, it needs to be hashed before assembling.
+static char * read_input(FILE *input, size_t *size)
+{
+    char   *buf = NULL;
+    size_t  max = 0;
+    size_t  n;
+
+    *size = 0;
+
+    do {
+        if (*size == max) {
+            buf = realloc(buf, max = max ? max * 2 : 65536);
+        }
+
+        n = fread(buf + *size, 1, max - *size, input);
+
+        *size += n;
+    } while (n > 0);
+
+    return buf;
+}
+
+// Map the input if possible, otherwise it's a pipe or something and has to be
+// read. Returns true if the buffer was mapped.
+static bool map_input(const char *path, char **source, size_t *size)
+{
+    struct stat  st;
+    FILE        *input;
+    int          fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        err(EXIT_FAILURE, "failed to open input file %s", path);
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        *source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (*source != MAP_FAILED) {
+            madvise(*source, st.st_size, MADV_SEQUENTIAL);
+            *size = st.st_size;
+            close(fd);
+            return true;
+        }
+    }
+
+    if (!(input = fdopen(fd, "r"))) {
+        err(EXIT_FAILURE, "failed to open input file %s", path);
+    }
+
+    *source = read_input(input, size);
+
+    fclose(input);
+    return false;
+}
+
+// A hash of the raras executable, so any rebuild invalidates the cache.
+static uint8_t assembler[SHA256_DIGEST_SIZE];
+
+// Hashing the executable takes longer than assembling most programs, so the
+// hash is saved in the cache directory with everything fstat knows about the
+// file. Rewriting it always changes the ctime, which can't be set back.
+// Returns false if the executable can't be read, e.g. /proc isn't mounted.
+static bool hash_assembler(const char *dir)
+{
+    char         path[PATH_MAX];
+    char         temp[PATH_MAX];
+    char         identity[128];
+    char         line[256];
+    struct stat  st;
+    sha256_t     ctx;
+    FILE        *saved;
+    void        *image;
+    size_t       len;
+    int          fd;
+
+    if ((fd = open("/proc/self/exe", O_RDONLY)) < 0)
+        return false;
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    len = snprintf(identity, sizeof identity, "%llu %llu %llu %lld.%09ld %lld.%09ld ",
+                   (unsigned long long) st.st_dev,
+                   (unsigned long long) st.st_ino,
+                   (unsigned long long) st.st_size,
+                   (long long) st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                   (long long) st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+
+    snprintf(path, sizeof path, "%s/assembler", dir);
+
+    if ((saved = fopen(path, "r"))) {
+        bool valid = fgets(line, sizeof line, saved)
+                  && strncmp(line, identity, len) == 0
+                  && strlen(line + len) >= sizeof assembler * 2;
+
+        for (size_t i = 0; valid && i < sizeof assembler; i++)
+            valid = sscanf(line + len + i * 2, "%2hhx", &assembler[i]) == 1;
+
+        fclose(saved);
+
+        if (valid) {
+            close(fd);
+            return true;
+        }
+    }
+
+    if ((image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+
+    close(fd);
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, image, st.st_size);
+    sha256_final(&ctx, assembler);
+
+    munmap(image, st.st_size);
+
+    // Saving it is just an optimization, so errors are ignored.
+    snprintf(temp, sizeof temp, "%s/tmp.XXXXXX", dir);
+
+    if ((fd = mkstemp(temp)) >= 0) {
+        if ((saved = fdopen(fd, "w"))) {
+            fputs(identity, saved);
+
+            for (size_t i = 0; i < sizeof assembler; i++)
+                fprintf(saved, "%02x", assembler[i]);
+
+            fputc('\n', saved);
+
+            if (fclose(saved) != 0 || rename(temp, path) != 0)
+                unlink(temp);
+        } else {
+            close(fd);
+            unlink(temp);
+        }
+    }
+
+    return true;
+}
+
+// The object only depends on the preprocessed input, and the assembler
+// itself. Any option that changes the output must be added to the key too,
+// there aren't any yet.
+static void cache_key(const char *source, size_t size, uint8_t key[SHA256_DIGEST_SIZE])
+{
+    sha256_t ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, CACHE_VERSION, sizeof CACHE_VERSION);
+    sha256_update(&ctx, assembler, sizeof assembler);
+    sha256_update(&ctx, source, size);
+    sha256_final(&ctx, key);
+}
+
+// The cache is at $RARAS_CACHE_DIR, or the usual XDG location. Setting
+// RARAS_CACHE_DIR to an empty string disables it, and so does not being able
+// to identify the assembler, as stale objects could be returned.
+static cache_t * open_cache(void)
+{
+    char        path[PATH_MAX];
+    const char *dir     = getenv("RARAS_CACHE_DIR");
+    const char *maxsize = getenv("RARAS_CACHE_SIZE");
+    cache_t    *cache;
+
+    if (dir == NULL) {
+        if (getenv("XDG_CACHE_HOME")) {
+            snprintf(path, sizeof path, "%s/raras", getenv("XDG_CACHE_HOME"));
+        } else if (getenv("HOME")) {
+            snprintf(path, sizeof path, "%s/.cache/raras", getenv("HOME"));
+        } else {
+            return NULL;
+        }
+        dir = path;
+    }
+
+    if (*dir == '\0')
+        return NULL;
+
+    if (!cache_create(&cache, dir, maxsize ? strtoull(maxsize, NULL, 0) : CACHE_DEFAULT_SIZE)) {
+        warn("failed to create cache directory %s", dir);
+        return NULL;
+    }
+
+    if (!hash_assembler(dir)) {
+        cache_destroy(cache);
+        return NULL;
+    }
+
+    return cache;
+}
+
+static void print_stats(cache_t *cache)
+{
+    cache_stats_t stats;
+
+    if (!cache || !cache_stats(cache, &stats)) {
+        fprintf(stderr, "cache: disabled\n");
+        return;
+    }
+
+    fprintf(stderr, "cache: %llu hits, %llu misses, %.1f%% hit rate, %llu entries, %llu bytes\n",
+            (unsigned long long) stats.hits,
+            (unsigned long long) stats.misses,
+            stats.hits + stats.misses ? stats.hits * 100.0 / (stats.hits + stats.misses) : 0.0,
+            (unsigned long long) stats.entries,
+            (unsigned long long) stats.size);
+}
+
+// Assemble a line in the second pass, and record it if a listing is wanted.
+static void assemble(const lexer_t *lexer,
+                     const asm_line_t *line,
+                     bitbuf_t *text,
+                     symtab_t *symtab,
+                     listing_t *listing,
+                     uint32_t address)
+{
+    size_t      bitpos = bitbuf_numbits(text);
+    asm_size_t  size   = {0};
+
+    if (line->kind == ASM_INSN) {
+        rar_assemble(lexer, line, text, symtab, &size);
+    }
+
+    if (listing) {
+        listing_add(listing, lexer, line, symtab, address, bitpos, bitbuf_numbits(text) - bitpos, &size);
+    }
+}
+
+static FILE * open_output(const char *filename)
+{
+    FILE *output;
+
+    if (!(output = fopen(filename, "w"))) {
+        errx(EXIT_FAILURE, "failed to open output file %s", filename);
+    }
+
+    return output;
+}
 
 int main(int argc, char **argv)
 {
-    FILE     *input       = NULL;
     FILE     *output      = NULL;
-    char     *line        = NULL;
+    FILE     *listfile    = NULL;
+    FILE     *jsonfile    = NULL;
+    listing_t *listing    = NULL;
     size_t    address     = 1;
-    size_t    size        = 0;
-    label_t  *symtab      = NULL;
-    size_t    symtab_size = 0;
+    symtab_t *symtab      = NULL;
+    lexer_t   lexer;
+    asm_line_t line;
     uint8_t   checkbyte   = 0;
     int       opt;
     uint32_t  codesize;
     bitbuf_t *text;
     const uint8_t *code;
+    cache_t  *cache       = NULL;
+    bool      usecache    = true;
+    bool      stats       = false;
+    char     *source;
+    size_t    sourcesize;
+    bool      mapped;
+    uint8_t   key[SHA256_DIGEST_SIZE];
+    uint8_t  *object;
+    size_t    objectsize;
+
+    static const struct option longopts[] = {
+        { "stats",      no_argument,        NULL, 's' },
+        { "no-cache",   no_argument,        NULL, 'n' },
+        { "listing",    required_argument,  NULL, 'l' },
+        { "json",       required_argument,  NULL, 'j' },
+        { 0 },
+    };
 
     // Parse commandline arguments.
-    while ((opt = getopt(argc, argv, "o:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "o:l:j:", longopts, NULL)) != -1) {
         switch (opt) {
             case 'o':
-                if (!(output = fopen(optarg, "w"))) {
-                    errx(EXIT_FAILURE, "failed to open output file %s", optarg);
-                }
+                output = open_output(optarg);
+                break;
+            case 'l':
+                listfile = open_output(optarg);
+                break;
+            case 'j':
+                jsonfile = open_output(optarg);
+                break;
+            case 's':
+                stats = true;
+                break;
+            case 'n':
+                usecache = false;
+                break;
+            default:
+                errx(EXIT_FAILURE, "usage: %s [--stats] [--no-cache] [-l listing.lst] [-j listing.json] -o output.ro input.ri", *argv);
         }
     }
 
-    // Open the input file, the last argument specified.
-    input = fopen(argv[optind], "r");
+    if (usecache || stats) {
+        cache = open_cache();
+    }
 
-    // Verify we have enough input to continue.
-    if (!input) {
-        err(EXIT_FAILURE, "failed to open input file %s", argv[optind]);
+    // Just print the statistics if there is no input.
+    if (stats && optind == argc) {
+        print_stats(cache);
+        cache_destroy(cache);
+        return 0;
+    }
+
+    if (optind == argc) {
+        errx(EXIT_FAILURE, "no input file specified");
     }
 
     if (!output) {
         errx(EXIT_FAILURE, "no output file specified");
     }
 
-    // First pass, locate all labels and record their address.
-    while (getline(&line, &size, input) > 0) {
-        char *comment   = strchrnul(line, ';');
-        char *label     = strchrnul(line, ':');
-        char *newline   = strchrnul(line, '\n');
-
-        // Remove any comment, label symbol, or newline.
-        *comment = '\0';
-        *label   = '\0';
-        *newline = '\0';
-
-        // Skip if this is a cpp or blank line.
-        if (*line == '#' || *line == '\0') {
-            continue;
-        }
+    // Open the input file, the last argument specified.
+    mapped = map_input(argv[optind], &source, &sourcesize);
+
+    // Hashing is a significant part of the work for large inputs, so only do
+    // it if the cache is going to be used.
+    if (usecache && cache) {
+        cache_key(source, sourcesize, key);
+    }
+
+    // A listing needs the program assembled, but the result can still be
+    // cached.
+    if (listfile || jsonfile) {
+        listing_create(&listing);
+    }
 
-        // If there is a ':' character before any comment, then this is a label.
-        if (label < comment) {
-            // Now line is the nul terminated label.
-            symtab = realloc(symtab, sizeof(label_t) * ++symtab_size);
+    if (usecache && cache && !listing && cache_lookup(cache, key, &object, &objectsize)) {
+        fwrite(object, 1, objectsize, output);
 
-            symtab[symtab_size - 1].flags   = 0;
-            symtab[symtab_size - 1].address = address;
+        if (stats)
+            print_stats(cache);
 
-            strncpy(symtab[symtab_size - 1].symbol,
-                    line,
-                    sizeof(symtab[symtab_size - 1].symbol) - 1);
+        free(object);
+        mapped ? munmap(source, sourcesize) : free(source);
+        fclose(output);
+        cache_destroy(cache);
+        return 0;
+    }
 
-            // Labels do not occupy space, so no need to assemble.
+    symtab_create(&symtab);
+
+    // First pass, locate all labels and record their address.
+    lexer_init(&lexer, argv[optind], source, sourcesize);
+
+    while (lexer_next(&lexer, &line)) {
+        // Labels do not occupy space, so no need to assemble.
+        if (line.kind == ASM_LABEL) {
+            if (!symtab_add(symtab, line.name.ptr, line.name.len, address)) {
+                lexer_error(&lexer, line.line, line.column, "label %.*s redefined", (int) line.name.len, line.name.ptr);
+            }
             continue;
         }
 
-        // We dont actually use or save the result, because we havn't built our
-        // symtab yet, that will wait until pass 2.
-        if (rar_assemble_line(line, NULL, NULL, 0)) {
-            // The instruction seems valid, so we need to increment address.
-            address++;
-        }
+        // The lexer has verified the mnemonic, so we need to increment address.
+        address++;
     }
 
-    // Rewind input file.
-    rewind(input);
-
-    // Reset address.
-    address = 0;
+    if (!symtab_lookup(symtab, "_start", strlen("_start"))) {
+        errx(EXIT_FAILURE, "%s: no entrypoint, _start is not defined", argv[optind]);
+    }
 
     // Allocate a bitbuffer for program text.
     bitbuf_create(&text);
@@ -114,31 +413,21 @@ int main(int argc, char **argv)
     bitbuf_append(text, 0, 1);  // DataFlag
 
     // Inject a jmp to entrypoint.
-    rar_assemble_line("jmp $_start", text, symtab, symtab_size);
+    lexer_init(&lexer, "<builtin>", ENTRYPOINT, strlen(ENTRYPOINT));
+    lexer_next(&lexer, &line);
+    assemble(&lexer, &line, text, symtab, listing, 0);
 
     // Second pass, now assemble and generate output.
-    while (getline(&line, &size, input) > 0) {
-        char *comment   = strchrnul(line, ';');
-        char *label     = strchrnul(line, ':');
-        char *newline   = strchrnul(line, '\n');
-
-        // Remove any comment or label symbol.
-        *comment = '\0';
-        *label   = '\0';
-        *newline = '\0';
-
-        // Skip if this is a CPP or blank line
-        if (*line == '#' || *line == '\0') {
-            continue;
-        }
+    lexer_init(&lexer, argv[optind], source, sourcesize);
 
-        // If there is a ':' character before any comment, then this is a label.
-        if (label < comment) {
-            continue;
-        }
+    for (address = 1; lexer_next(&lexer, &line); address += line.kind == ASM_INSN) {
+        assemble(&lexer, &line, text, symtab, listing, address);
+    }
 
-        // Now we assemble the line and append to out bitbuffer.
-        rar_assemble_line(line, text, symtab, symtab_size);
+    // Rar reads code most significant bit first, so pad the final octet to
+    // make sure the last instruction is aligned correctly.
+    if (bitbuf_numbits(text) % 8) {
+        bitbuf_append(text, 0, 8 - bitbuf_numbits(text) % 8);
     }
 
     // Fetch the results.
@@ -150,9 +439,39 @@ int main(int argc, char **argv)
 
     fwrite(&checkbyte, 1, 1, output);
     fwrite(code, 1, codesize, output);
-    free(line);
 
+    if (listfile && !listing_write(listing, listfile, argv[optind], symtab, code, codesize)) {
+        errx(EXIT_FAILURE, "failed to write listing");
+    }
+
+    if (jsonfile && !listing_write_json(listing, jsonfile, argv[optind], symtab, code, codesize)) {
+        errx(EXIT_FAILURE, "failed to write json listing");
+    }
+
+    if (usecache && cache) {
+        object = malloc(codesize + 1);
+        object[0] = checkbyte;
+        memcpy(object + 1, code, codesize);
+
+        if (!cache_store(cache, key, object, codesize + 1))
+            warnx("failed to store object in cache");
+
+        free(object);
+    }
+
+    if (stats)
+        print_stats(cache);
+
+    bitbuf_destroy(text);
+    symtab_destroy(symtab);
+    listing_destroy(listing);
+    cache_destroy(cache);
     fclose(output);
-    fclose(input);
+
+    if (listfile)
+        fclose(listfile);
+    if (jsonfile)
+        fclose(jsonfile);
+    mapped ? munmap(source, sourcesize) : free(source);
     return 0;
 }
@@ -0,0 +1,660 @@
+// Run a manifest of RarVM programs across every cpu.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <err.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "rarvm.h"
+#include "unpack.h"
+
+typedef enum {
+    JOB_DONE,                   // Finished, nothing was expected.
+    JOB_PASS,                   // Finished with the expected output.
+    JOB_FAIL,                   // Finished, but the output was wrong.
+    JOB_LIMIT,                  // Exceeded the instruction budget.
+    JOB_ERROR,                  // Couldn't be run at all.
+} status_t;
+
+static const char *kStatusNames[] = { "done", "pass", "fail", "limit", "error" };
+
+// A line of the manifest.
+typedef struct {
+    unsigned    line;
+    char       *name;           // As written in the manifest.
+    char       *path;           // Relative to the current directory.
+    char       *input;          // Block to filter, only for object files.
+    uint8_t    *expect;         // Expected output, if any.
+    uint32_t    expectsize;
+    bool        checkcrc;
+    uint32_t    crc;            // Expected crc32 of the output.
+    uint64_t    maxinsns;       // Budget for each execution of the program.
+} job_t;
+
+// Each worker owns a deque of jobs, it takes work from the tail of its own
+// and steals from the head of the others when that runs out. No job creates
+// more work, so once every deque is empty the workers can stop.
+typedef struct {
+    pthread_mutex_t lock;
+    job_t         **jobs;
+    unsigned        head;
+    unsigned        tail;
+} deque_t;
+
+typedef struct {
+    unsigned    id;
+    deque_t     deque;
+    vm_t       *vm;             // From the pool, reused for every job.
+    uint64_t    jobs;
+    uint64_t    stolen;
+} worker_t;
+
+// The outcome of running a single job.
+typedef struct {
+    status_t    status;
+    const char *error;
+    uint64_t    icount;
+    uint32_t    executions;
+    uint32_t    crc;
+    uint32_t    size;           // Bytes of output.
+    bool        mismatch;       // Output differed from expect.
+    uint64_t    usec;
+} result_t;
+
+typedef struct {
+    worker_t   *worker;
+    job_t      *job;
+    result_t   *result;
+} run_t;
+
+static pthread_mutex_t outputlock = PTHREAD_MUTEX_INITIALIZER;
+
+static worker_t *workers;
+static unsigned  numworkers;
+
+// Memory is restored from this between jobs, only the dirty pages are copied.
+static uint8_t  *zeroimage;
+
+static uint64_t  totals[JOB_ERROR + 1];
+static uint64_t  totalinsns;
+
+static job_t * deque_take(deque_t *deque, bool steal)
+{
+    job_t *job = NULL;
+
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->head != deque->tail)
+        job = steal ? deque->jobs[deque->head++] : deque->jobs[--deque->tail];
+
+    pthread_mutex_unlock(&deque->lock);
+    return job;
+}
+
+static job_t * next_job(worker_t *worker)
+{
+    job_t *job;
+
+    if ((job = deque_take(&worker->deque, false)))
+        return job;
+
+    for (unsigned i = 1; i < numworkers; i++) {
+        if ((job = deque_take(&workers[(worker->id + i) % numworkers].deque, true))) {
+            worker->stolen++;
+            return job;
+        }
+    }
+
+    return NULL;
+}
+
+// The output is checked as it's produced, so nothing has to be kept.
+static void add_output(job_t *job, result_t *result, const uint8_t *data, uint32_t size)
+{
+    if (job->expect) {
+        if (result->size + size > job->expectsize
+         || memcmp(job->expect + result->size, data, size) != 0) {
+            result->mismatch = true;
+        }
+    }
+
+    result->crc   = crc32(result->crc, data, size);
+    result->size += size;
+}
+
+// Run the program once, returning false if it couldn't finish.
+static bool execute(worker_t *worker,
+                    job_t *job,
+                    result_t *result,
+                    vm_program_t *program,
+                    const uint32_t *initr,
+                    const uint8_t *block,
+                    uint32_t blocksize,
+                    const uint8_t *data,
+                    uint32_t datasize)
+{
+    vm_t          *vm = worker->vm;
+    const uint8_t *output;
+    uint32_t       outputsize;
+    bool           finished;
+
+    vm_restore(vm, zeroimage);
+
+    if (!vm_prepare(vm, program, initr, block, blocksize)) {
+        result->status = JOB_ERROR;
+        result->error  = "block too large";
+        return false;
+    }
+
+    // Global data from the archive goes after the fixed globals, and any
+    // static data in the program follows it, as in rar.
+    if (datasize) {
+        uint8_t  *globals   = &vm->mem[VM_GLOBALMEMADDR + VM_FIXEDGLOBALSIZE];
+        uint32_t  available = VM_GLOBALMEMSIZE - VM_FIXEDGLOBALSIZE - datasize;
+
+        memmove(globals + datasize, globals, program->datasize < available ? program->datasize : available);
+        memcpy(globals, data, datasize);
+
+        for (uint32_t page = VM_GLOBALMEMADDR / VM_PAGESIZE; page < (VM_GLOBALMEMADDR + VM_GLOBALMEMSIZE) / VM_PAGESIZE; page++)
+            vm->dirty |= 1ULL << page;
+    }
+
+    finished = vm_execute(vm, program, job->maxinsns);
+
+    result->icount += vm->icount;
+    result->executions++;
+
+    // Rar still writes the output of a program that didn't terminate.
+    vm_getoutput(vm, &output, &outputsize);
+    add_output(job, result, output, outputsize);
+
+    if (!finished)
+        result->status = JOB_LIMIT;
+
+    return finished;
+}
+
+static bool run_filter(void *opaque, const unpack_filter_t *filter)
+{
+    run_t        *run = opaque;
+    vm_program_t *program;
+    bool          finished;
+
+    if (!vm_program_decode(&program, filter->code, filter->codesize)) {
+        run->result->status = JOB_ERROR;
+        run->result->error  = "invalid filter program";
+        return false;
+    }
+
+    // Filters run on the unfiltered block, they aren't chained like rar does.
+    finished = execute(run->worker,
+                       run->job,
+                       run->result,
+                       program,
+                       filter->initr,
+                       filter->block,
+                       filter->blocklength,
+                       filter->data,
+                       filter->datasize);
+
+    vm_program_destroy(program);
+    return finished;
+}
+
+static void run_archive(worker_t *worker, job_t *job, result_t *result)
+{
+    run_t            run = { worker, job, result };
+    unpack_archive_t archive;
+    struct stat      st;
+    uint8_t         *base;
+    int              fd;
+
+    if ((fd = open(job->path, O_RDONLY)) < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        result->status = JOB_ERROR;
+        result->error  = "failed to open archive";
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+    close(fd);
+
+    if (base == MAP_FAILED) {
+        result->status = JOB_ERROR;
+        result->error  = "failed to map archive";
+        return;
+    }
+
+    unpack_archive(base, st.st_size, run_filter, &run, &archive);
+
+    munmap(base, st.st_size);
+
+    if (result->status == JOB_DONE && (archive.error || archive.skipped)) {
+        result->status = JOB_ERROR;
+        result->error  = archive.error ? archive.error : "files were skipped";
+    }
+}
+
+static void run_object(worker_t *worker, job_t *job, result_t *result)
+{
+    vm_program_t *program;
+    uint8_t      *block     = NULL;
+    uint32_t      blocksize = 0;
+
+    if (!vm_program_load(&program, job->path)) {
+        result->status = JOB_ERROR;
+        result->error  = "failed to load object file";
+        return;
+    }
+
+    if (job->input) {
+        FILE *input = fopen(job->input, "r");
+
+        if (!input) {
+            result->status = JOB_ERROR;
+            result->error  = "failed to open input block";
+            vm_program_destroy(program);
+            return;
+        }
+
+        block     = malloc(VM_GLOBALMEMADDR);
+        blocksize = fread(block, 1, VM_GLOBALMEMADDR, input);
+        fclose(input);
+    }
+
+    execute(worker, job, result, program, NULL, block, blocksize, NULL, 0);
+
+    vm_program_destroy(program);
+    free(block);
+}
+
+static void json_string(FILE *output, const char *string)
+{
+    fputc('"', output);
+
+    for (; *string; string++) {
+        uint8_t c = *string;
+
+        switch (c) {
+            case '"':   fputs("\\\"", output); break;
+            case '\\':  fputs("\\\\", output); break;
+            case '\t':  fputs("\\t", output); break;
+            default:
+                if (c < 0x20) {
+                    fprintf(output, "\\u%04x", c);
+                } else {
+                    fputc(c, output);
+                }
+        }
+    }
+
+    fputc('"', output);
+}
+
+// Results are printed as each job finishes, so they're not in manifest
+// order, the line number identifies the job.
+static void report(const job_t *job, const result_t *result)
+{
+    pthread_mutex_lock(&outputlock);
+
+    printf("{\"line\":%u,\"path\":", job->line);
+    json_string(stdout, job->name);
+    printf(",\"status\":\"%s\",\"icount\":%" PRIu64 ",\"executions\":%u,\"size\":%u,\"crc\":\"%08x\",\"usec\":%" PRIu64,
+           kStatusNames[result->status],
+           result->icount,
+           result->executions,
+           result->size,
+           result->crc,
+           result->usec);
+
+    if (result->error) {
+        printf(",\"error\":");
+        json_string(stdout, result->error);
+    }
+
+    printf("}\n");
+    fflush(stdout);
+
+    totals[result->status]++;
+    totalinsns += result->icount;
+
+    pthread_mutex_unlock(&outputlock);
+}
+
+static void run_job(worker_t *worker, job_t *job)
+{
+    result_t        result = {0};
+    struct timespec start;
+    struct timespec end;
+    size_t          length = strlen(job->path);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (length > 4 && strcmp(job->path + length - 4, ".rar") == 0) {
+        run_archive(worker, job, &result);
+    } else {
+        run_object(worker, job, &result);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    result.usec = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+
+    if (result.status == JOB_DONE && (job->expect || job->checkcrc)) {
+        if (result.mismatch || (job->expect && result.size != job->expectsize)) {
+            result.status = JOB_FAIL;
+        } else if (job->checkcrc && result.crc != job->crc) {
+            result.status = JOB_FAIL;
+        } else {
+            result.status = JOB_PASS;
+        }
+    }
+
+    report(job, &result);
+}
+
+static void * worker_thread(void *arg)
+{
+    worker_t *worker = arg;
+    job_t    *job;
+
+    while ((job = next_job(worker))) {
+        run_job(worker, job);
+        worker->jobs++;
+    }
+
+    return NULL;
+}
+
+// Decode a value in place, supporting quotes and the usual C escapes. Returns
+// a pointer past the end of the value, or NULL if it's malformed.
+static char * parse_value(char *value, uint32_t *length)
+{
+    char *in    = value;
+    char *out   = value;
+    bool  quote = false;
+
+    for (; *in && (quote || (*in != ' ' && *in != '\t')); in++) {
+        if (*in == '"') {
+            quote = !quote;
+            continue;
+        }
+
+        if (*in != '\\') {
+            *out++ = *in;
+            continue;
+        }
+
+        switch (*++in) {
+            case 'n':   *out++ = '\n'; break;
+            case 'r':   *out++ = '\r'; break;
+            case 't':   *out++ = '\t'; break;
+            case '0':   *out++ = '\0'; break;
+            case '\\':  *out++ = '\\'; break;
+            case '"':   *out++ = '"'; break;
+            case 'x': {
+                char hex[3] = { in[1], in[1] ? in[2] : 0 };
+                char *end;
+
+                *out++ = strtoul(hex, &end, 16);
+
+                if (end != hex + 2)
+                    return NULL;
+
+                in += 2;
+                break;
+            }
+            default:
+                return NULL;
+        }
+    }
+
+    if (quote)
+        return NULL;
+
+    *length = out - value;
+    return *in ? in + 1 : in;
+}
+
+static char * join_path(const char *dir, const char *path)
+{
+    char *result;
+
+    if (*path == '/' || strcmp(dir, ".") == 0)
+        return strdup(path);
+
+    if (asprintf(&result, "%s/%s", dir, path) < 0)
+        return NULL;
+
+    return result;
+}
+
+// One job per line, a path to an object file or archive followed by options.
+// Paths are relative to the manifest.
+//
+//  test/crc32.ro expect="OK\n" maxinsns=10000
+//  filter.ro input=block.bin crc=0x12345678
+static job_t * read_manifest(const char *filename, uint64_t maxinsns, unsigned *count)
+{
+    FILE    *manifest;
+    job_t   *jobs   = NULL;
+    char    *line   = NULL;
+    size_t   size   = 0;
+    unsigned lineno = 0;
+    char    *copy   = strdup(filename);
+    char    *dir    = dirname(copy);
+
+    if (strcmp(filename, "-") == 0) {
+        manifest = stdin;
+        dir      = ".";
+    } else if (!(manifest = fopen(filename, "r"))) {
+        err(EXIT_FAILURE, "failed to open manifest %s", filename);
+    }
+
+    *count = 0;
+
+    while (getline(&line, &size, manifest) > 0) {
+        job_t *job;
+        char  *field;
+        char  *next;
+
+        lineno++;
+
+        line[strcspn(line, "\r\n")] = '\0';
+
+        if (!(field = strtok(line, " \t")) || *field == '#')
+            continue;
+
+        jobs = realloc(jobs, (*count + 1) * sizeof(job_t));
+        job  = memset(&jobs[(*count)++], 0, sizeof(job_t));
+
+        job->line       = lineno;
+        job->name       = strdup(field);
+        job->path       = join_path(dir, field);
+        job->maxinsns   = maxinsns;
+
+        // The rest of the line is options, which may contain quoted spaces.
+        for (field = strtok(NULL, ""); field && *field; field = next) {
+            char     *value;
+            uint32_t  length;
+
+            field += strspn(field, " \t");
+
+            if (!*field)
+                break;
+
+            if (!(value = strchr(field, '=')) || !(next = parse_value(++value, &length)))
+                errx(EXIT_FAILURE, "%s:%u: invalid option %s", filename, lineno, field);
+
+            if (strncmp(field, "expect=", 7) == 0) {
+                job->expect     = malloc(length + 1);
+                job->expectsize = length;
+                memcpy(job->expect, value, length);
+            } else if (strncmp(field, "crc=", 4) == 0) {
+                job->checkcrc   = true;
+                job->crc        = strtoul(value, NULL, 0);
+            } else if (strncmp(field, "maxinsns=", 9) == 0) {
+                job->maxinsns   = strtoull(value, NULL, 0);
+            } else if (strncmp(field, "input=", 6) == 0) {
+                value[length]   = '\0';
+                job->input      = join_path(dir, value);
+            } else {
+                errx(EXIT_FAILURE, "%s:%u: unknown option %s", filename, lineno, field);
+            }
+        }
+    }
+
+    if (manifest != stdin)
+        fclose(manifest);
+
+    free(line);
+    free(copy);
+    return jobs;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [-j threads] [-n maxinsns] manifest\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t      *threads;
+    long            numthreads  = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t        maxinsns    = VM_MAXINSNS;
+    bool            verbose     = false;
+    job_t          *jobs;
+    unsigned        count;
+    struct timespec start;
+    struct timespec end;
+    double          elapsed;
+    int             c;
+
+    while ((c = getopt(argc, argv, "vj:n:h")) != -1) {
+        switch (c) {
+            case 'v':
+                verbose = true;
+                break;
+            case 'j':
+                numthreads = strtol(optarg, NULL, 0);
+                break;
+            case 'n':
+                maxinsns = strtoull(optarg, NULL, 0);
+                break;
+            case 'h':
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    jobs = read_manifest(argv[optind], maxinsns, &count);
+
+    if (numthreads < 1)
+        numthreads = 1;
+
+    // There's no point having more workers than jobs.
+    numworkers = count && numthreads > count ? count : numthreads;
+    workers    = calloc(numworkers, sizeof(worker_t));
+    threads    = calloc(numworkers, sizeof(pthread_t));
+    zeroimage  = calloc(1, VM_MEMSIZE + 4);
+
+    // Preallocate a VM for each worker, and deal the jobs out round robin.
+    for (unsigned i = 0; i < numworkers; i++) {
+        workers[i].id           = i;
+        workers[i].deque.jobs   = calloc(count / numworkers + 1, sizeof(job_t *));
+
+        pthread_mutex_init(&workers[i].deque.lock, NULL);
+
+        if (!vm_create(&workers[i].vm))
+            errx(EXIT_FAILURE, "failed to allocate vm memory");
+    }
+
+    // Workers take from the tail, so push in reverse to start at the top.
+    for (unsigned i = count; i-- > 0;) {
+        deque_t *deque = &workers[i % numworkers].deque;
+
+        deque->jobs[deque->tail++] = &jobs[i];
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (unsigned i = 0; i < numworkers; i++) {
+        if (pthread_create(&threads[i], NULL, worker_thread, &workers[i]) != 0) {
+            errx(EXIT_FAILURE, "failed to create worker thread");
+        }
+    }
+
+    for (unsigned i = 0; i < numworkers; i++)
+        pthread_join(threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    if (verbose) {
+        for (unsigned i = 0; i < numworkers; i++) {
+            fprintf(stderr, "worker %u: %" PRIu64 " jobs, %" PRIu64 " stolen\n",
+                    i,
+                    workers[i].jobs,
+                    workers[i].stolen);
+        }
+    }
+
+    fprintf(stderr, "%u jobs, %" PRIu64 " passed, %" PRIu64 " failed, %" PRIu64 " over limit, %" PRIu64 " errors, "
+                    "%" PRIu64 " instructions in %.2fs (%.1f M/s)\n",
+            count,
+            totals[JOB_PASS],
+            totals[JOB_FAIL],
+            totals[JOB_LIMIT],
+            totals[JOB_ERROR],
+            totalinsns,
+            elapsed,
+            elapsed > 0 ? totalinsns / 1e6 / elapsed : 0);
+
+    for (unsigned i = 0; i < numworkers; i++) {
+        vm_destroy(workers[i].vm);
+        free(workers[i].deque.jobs);
+        pthread_mutex_destroy(&workers[i].deque.lock);
+    }
+
+    for (unsigned i = 0; i < count; i++) {
+        free(jobs[i].name);
+        free(jobs[i].path);
+        free(jobs[i].input);
+        free(jobs[i].expect);
+    }
+
+    free(jobs);
+    free(workers);
+    free(threads);
+    free(zeroimage);
+
+    return totals[JOB_FAIL] || totals[JOB_LIMIT] || totals[JOB_ERROR] ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,2448 @@
+// Compiler for a small C subset, producing RarVM assembly for raras.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <err.h>
+
+#include "rarvm.h"
+
+// The pipeline is the usual one, source is parsed into a tree, the tree is
+// translated to a three address IR over unlimited virtual registers, and
+// then a linear scan allocator maps those onto r0-r6. Anything that doesn't
+// fit is spilled to the stack, which is cheap on RarVM because every operand
+// may be a memory reference.
+//
+// C names get a leading underscore, just like the stdlib routines, so that
+// foo() in C is _foo in assembly and can't collide with a mnemonic.
+//
+// The calling convention is the one used by the stdlib, parameters are
+// pushed in reverse order, the result is returned in r0, and only r6 and r7
+// are preserved. The compiler doesn't need a frame pointer because it always
+// knows the stack depth, so r6 is just a callee saved register.
+
+enum {
+    TOK_EOF = 256,  TOK_IDENT,      TOK_NUMBER,     TOK_INT,        TOK_UNSIGNED,
+    TOK_CHAR,       TOK_VOID,       TOK_EXTERN,     TOK_IF,         TOK_ELSE,
+    TOK_WHILE,      TOK_DO,         TOK_FOR,        TOK_RETURN,     TOK_BREAK,
+    TOK_CONTINUE,   TOK_SHL,        TOK_SHR,        TOK_LE,         TOK_GE,
+    TOK_EQ,         TOK_NE,         TOK_ANDAND,     TOK_OROR,       TOK_INC,
+    TOK_DEC,        TOK_ADDEQ,      TOK_SUBEQ,      TOK_MULEQ,      TOK_DIVEQ,
+    TOK_MODEQ,      TOK_ANDEQ,      TOK_OREQ,       TOK_XOREQ,      TOK_SHLEQ,
+    TOK_SHREQ,
+};
+
+enum {
+    TY_VOID,        TY_CHAR,        TY_INT,         TY_UNSIGNED,    TY_PTR,
+};
+
+enum {
+    N_NUM,          N_VAR,          N_BINARY,       N_NEG,          N_BITNOT,
+    N_LNOT,         N_DEREF,        N_ADDR,         N_ASSIGN,       N_OPASSIGN,
+    N_PREINC,       N_POSTINC,      N_LAND,         N_LOR,          N_COND,
+    N_CALL,         N_CAST,         N_COMMA,
+    S_EXPR,         S_IF,           S_WHILE,        S_DO,           S_FOR,
+    S_RETURN,       S_BREAK,        S_CONTINUE,     S_BLOCK,
+};
+
+enum {
+    IR_MOV,         IR_ADD,         IR_SUB,         IR_MUL,         IR_DIV,
+    IR_AND,         IR_OR,          IR_XOR,         IR_SHL,         IR_SHR,
+    IR_SAR,         IR_NEG,         IR_NOT,         IR_LOAD,        IR_STORE,
+    IR_BR,          IR_JMP,         IR_LABEL,       IR_ARG,         IR_CALL,
+    IR_RET,         IR_PARAM,
+};
+
+enum {
+    CC_Z,           CC_NZ,          CC_B,           CC_BE,          CC_A,
+    CC_AE,          CC_S,           CC_NS,
+};
+
+enum {
+    IRV_NONE,       IRV_REG,        IRV_IMM,
+};
+
+typedef struct type {
+    int          kind;
+    struct type *base;
+} type_t;
+
+typedef struct {
+    char        *name;
+    type_t      *type;
+    int          vreg;
+    int          depth;
+} var_t;
+
+typedef struct {
+    char        *name;
+    type_t      *ret;
+    int          nparams;
+    bool         defined;
+} func_t;
+
+typedef struct node {
+    int           kind;
+    int           op;
+    int           line;
+    type_t       *type;
+    uint32_t      value;
+    var_t        *var;
+    func_t       *func;
+    struct node  *lhs;
+    struct node  *rhs;
+    struct node  *cond;
+    struct node  *init;
+    struct node  *step;
+    struct node  *body;
+    struct node  *els;
+    struct node **list;
+    int           count;
+} node_t;
+
+typedef struct {
+    uint8_t     kind;
+    uint32_t    value;      // Virtual register number or immediate.
+} irv_t;
+
+typedef struct {
+    int         op;
+    irv_t       d;
+    irv_t       a;
+    irv_t       b;
+    int         cc;         // Condition for IR_BR.
+    bool        test;       // IR_BR uses test rather than cmp.
+    bool        carry;      // IR_BR uses the carry from the previous instruction.
+    int         width;      // Access size for IR_LOAD and IR_STORE.
+    uint32_t    offset;     // Displacement for IR_LOAD and IR_STORE, or parameter number.
+    int         label;
+    char       *sym;
+    int         nargs;
+} ir_t;
+
+typedef struct {
+    int         vreg;
+    int         start;
+    int         end;
+    bool        crosscall;
+    int         hint;       // Prefer the register assigned to this vreg.
+    int         avoid;      // Try not to share a register with this vreg.
+} interval_t;
+
+static type_t ty_void       = { TY_VOID };
+static type_t ty_char       = { TY_CHAR };
+static type_t ty_int        = { TY_INT };
+static type_t ty_unsigned   = { TY_UNSIGNED };
+
+// Lexer state.
+static const char *filename;
+static char       *source;
+static char       *cursor;
+static int         line = 1;
+static int         tok;
+static int         tokline;
+static uint32_t    tokval;
+static char        tokstr[128];
+
+// Symbol tables.
+static var_t     **vars;
+static int         nvars;
+static int         depth;
+static func_t    **funcs;
+static int         nfuncs;
+
+// The function currently being compiled.
+static ir_t       *code;
+static int         ncode;
+static int         nvregs;
+static int         nlabels;
+static int         breaklabel   = -1;
+static int         contlabel    = -1;
+static func_t     *current;
+
+static FILE       *output;
+
+static void __attribute__((noreturn, format(printf, 2, 3))) error(int where, const char *fmt, ...)
+{
+    va_list ap;
+
+    va_start(ap, fmt);
+    fprintf(stderr, "%s:%d: error: ", filename, where);
+    vfprintf(stderr, fmt, ap);
+    fputc('\n', stderr);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+static void next(void)
+{
+    static const struct {
+        const char *str;
+        int         tok;
+    } keywords[] = {
+        { "int",      TOK_INT      }, { "unsigned", TOK_UNSIGNED }, { "char",     TOK_CHAR     },
+        { "void",     TOK_VOID     }, { "extern",   TOK_EXTERN   }, { "if",       TOK_IF       },
+        { "else",     TOK_ELSE     }, { "while",    TOK_WHILE    }, { "do",       TOK_DO       },
+        { "for",      TOK_FOR      }, { "return",   TOK_RETURN   }, { "break",    TOK_BREAK    },
+        { "continue", TOK_CONTINUE },
+    }, punctuators[] = {
+        { "<<=", TOK_SHLEQ  }, { ">>=", TOK_SHREQ  }, { "<<",  TOK_SHL    }, { ">>",  TOK_SHR    },
+        { "<=",  TOK_LE     }, { ">=",  TOK_GE     }, { "==",  TOK_EQ     }, { "!=",  TOK_NE     },
+        { "&&",  TOK_ANDAND }, { "||",  TOK_OROR   }, { "++",  TOK_INC    }, { "--",  TOK_DEC    },
+        { "+=",  TOK_ADDEQ  }, { "-=",  TOK_SUBEQ  }, { "*=",  TOK_MULEQ  }, { "/=",  TOK_DIVEQ  },
+        { "%=",  TOK_MODEQ  }, { "&=",  TOK_ANDEQ  }, { "|=",  TOK_OREQ   }, { "^=",  TOK_XOREQ  },
+    };
+
+    // Skip whitespace, comments and preprocessor lines.
+    while (true) {
+        if (*cursor == '\n') {
+            line++, cursor++;
+        } else if (isspace(*cursor)) {
+            cursor++;
+        } else if (strncmp(cursor, "//", 2) == 0 || *cursor == '#') {
+            cursor = strchrnul(cursor, '\n');
+        } else if (strncmp(cursor, "/*", 2) == 0) {
+            for (cursor += 2; *cursor && strncmp(cursor, "*/", 2); cursor++)
+                line += *cursor == '\n';
+            if (*cursor)
+                cursor += 2;
+        } else {
+            break;
+        }
+    }
+
+    tokline = line;
+
+    if (*cursor == '\0') {
+        tok = TOK_EOF;
+        return;
+    }
+
+    if (isalpha(*cursor) || *cursor == '_') {
+        size_t len = 0;
+
+        while (isalnum(cursor[len]) || cursor[len] == '_')
+            len++;
+
+        if (len >= sizeof tokstr)
+            error(line, "identifier too long");
+
+        memcpy(tokstr, cursor, len);
+        tokstr[len] = '\0';
+        cursor     += len;
+        tok         = TOK_IDENT;
+
+        for (int i = 0; i < sizeof keywords / sizeof *keywords; i++) {
+            if (strcmp(keywords[i].str, tokstr) == 0) {
+                tok = keywords[i].tok;
+            }
+        }
+        return;
+    }
+
+    if (isdigit(*cursor)) {
+        tokval = strtoul(cursor, &cursor, 0);
+        tok    = TOK_NUMBER;
+
+        // Integer suffixes are accepted but ignored.
+        while (*cursor == 'u' || *cursor == 'U' || *cursor == 'l' || *cursor == 'L')
+            cursor++;
+        return;
+    }
+
+    if (*cursor == '\'') {
+        cursor++;
+        if (*cursor == '\\') {
+            switch (*++cursor) {
+                case 'n':   tokval = '\n'; break;
+                case 't':   tokval = '\t'; break;
+                case 'r':   tokval = '\r'; break;
+                case '0':   tokval = '\0'; break;
+                default:    tokval = *cursor; break;
+            }
+        } else {
+            tokval = (uint8_t) *cursor;
+        }
+        if (*++cursor != '\'')
+            error(line, "unterminated character constant");
+        cursor++;
+        tok = TOK_NUMBER;
+        return;
+    }
+
+    for (int i = 0; i < sizeof punctuators / sizeof *punctuators; i++) {
+        size_t len = strlen(punctuators[i].str);
+
+        if (strncmp(cursor, punctuators[i].str, len) == 0) {
+            cursor += len;
+            tok     = punctuators[i].tok;
+            return;
+        }
+    }
+
+    if (strchr("+-*/%&|^~!<>=?:;,(){}[]", *cursor) == NULL)
+        error(line, "unexpected character '%c'", *cursor);
+
+    tok = *cursor++;
+}
+
+// Peek at the token after the current one.
+static int lookahead(void)
+{
+    char    *savecursor = cursor;
+    int      saveline   = line;
+    int      savetok    = tok;
+    int      savetokline = tokline;
+    uint32_t savetokval = tokval;
+    char     savetokstr[sizeof tokstr];
+    int      result;
+
+    strcpy(savetokstr, tokstr);
+    next();
+    result  = tok;
+    cursor  = savecursor;
+    line    = saveline;
+    tok     = savetok;
+    tokline = savetokline;
+    tokval  = savetokval;
+    strcpy(tokstr, savetokstr);
+    return result;
+}
+
+static bool accept(int t)
+{
+    if (tok == t) {
+        next();
+        return true;
+    }
+    return false;
+}
+
+static void expect(int t, const char *what)
+{
+    if (!accept(t))
+        error(tokline, "expected %s", what);
+}
+
+static type_t *pointer_to(type_t *base)
+{
+    type_t *type = calloc(1, sizeof *type);
+
+    type->kind = TY_PTR;
+    type->base = base;
+    return type;
+}
+
+static int type_size(type_t *type)
+{
+    return type->kind == TY_CHAR ? 1 : 4;
+}
+
+static bool is_type(int t)
+{
+    return t == TOK_INT || t == TOK_UNSIGNED || t == TOK_CHAR || t == TOK_VOID;
+}
+
+static type_t *parse_type(void)
+{
+    type_t *type;
+
+    switch (tok) {
+        case TOK_INT:       type = &ty_int; break;
+        case TOK_CHAR:      type = &ty_char; break;
+        case TOK_VOID:      type = &ty_void; break;
+        case TOK_UNSIGNED:  type = &ty_unsigned;
+                            // Allow unsigned int.
+                            if (lookahead() == TOK_INT)
+                                next();
+                            break;
+        default:
+            error(tokline, "expected type");
+    }
+
+    next();
+
+    while (accept('*'))
+        type = pointer_to(type);
+
+    return type;
+}
+
+static var_t *find_var(const char *name)
+{
+    for (int i = nvars - 1; i >= 0; i--) {
+        if (strcmp(vars[i]->name, name) == 0) {
+            return vars[i];
+        }
+    }
+    return NULL;
+}
+
+static func_t *find_func(const char *name)
+{
+    for (int i = 0; i < nfuncs; i++) {
+        if (strcmp(funcs[i]->name, name) == 0) {
+            return funcs[i];
+        }
+    }
+    return NULL;
+}
+
+static var_t *declare_var(const char *name, type_t *type)
+{
+    var_t *var;
+
+    for (int i = nvars - 1; i >= 0 && vars[i]->depth == depth; i--) {
+        if (strcmp(vars[i]->name, name) == 0) {
+            error(tokline, "redefinition of '%s'", name);
+        }
+    }
+
+    // Nodes refer to variables, so they must not move.
+    var         = calloc(1, sizeof *var);
+    var->name   = strdup(name);
+    var->type   = type;
+    var->vreg   = nvregs++;
+    var->depth  = depth;
+    vars        = realloc(vars, sizeof(var_t *) * ++nvars);
+    vars[nvars - 1] = var;
+    return var;
+}
+
+static node_t *new_node(int kind, type_t *type)
+{
+    node_t *node = calloc(1, sizeof *node);
+
+    node->kind = kind;
+    node->type = type;
+    node->line = tokline;
+    return node;
+}
+
+static node_t *new_num(uint32_t value, type_t *type)
+{
+    node_t *node = new_node(N_NUM, type);
+
+    node->value = value;
+    return node;
+}
+
+static node_t *new_binary(int op, node_t *lhs, node_t *rhs)
+{
+    node_t *node = new_node(N_BINARY, NULL);
+    bool    lptr = lhs->type->kind == TY_PTR;
+    bool    rptr = rhs->type->kind == TY_PTR;
+
+    if (lhs->type->kind == TY_VOID || rhs->type->kind == TY_VOID)
+        error(tokline, "void value not ignored as it ought to be");
+
+    // Pointer arithmetic is scaled by the size of the pointed to type.
+    if ((op == '+' || op == '-') && lptr && !rptr) {
+        // Constant indexes are scaled here, so that they fold into the
+        // displacement of a memory operand.
+        if (type_size(lhs->type->base) > 1 && rhs->kind == N_NUM) {
+            rhs = new_num(rhs->value * type_size(lhs->type->base), rhs->type);
+        } else if (type_size(lhs->type->base) > 1) {
+            rhs = new_binary('*', rhs, new_num(type_size(lhs->type->base), &ty_int));
+        }
+    } else if (op == '+' && rptr && !lptr) {
+        return new_binary('+', rhs, lhs);
+    } else if (op == '-' && lptr && rptr) {
+        node->op    = op;
+        node->lhs   = lhs;
+        node->rhs   = rhs;
+        node->type  = &ty_int;
+        if (type_size(lhs->type->base) > 1)
+            return new_binary('/', node, new_num(type_size(lhs->type->base), &ty_int));
+        return node;
+    }
+
+    node->op  = op;
+    node->lhs = lhs;
+    node->rhs = rhs;
+
+    switch (op) {
+        case '<': case '>': case TOK_LE: case TOK_GE: case TOK_EQ: case TOK_NE:
+            node->type = &ty_int;
+            break;
+        case TOK_SHL: case TOK_SHR:
+            node->type = lhs->type->kind == TY_UNSIGNED ? &ty_unsigned : &ty_int;
+            break;
+        default:
+            if (lptr) {
+                node->type = lhs->type;
+            } else if (lhs->type->kind == TY_UNSIGNED || rhs->type->kind == TY_UNSIGNED) {
+                node->type = &ty_unsigned;
+            } else {
+                node->type = &ty_int;
+            }
+            break;
+    }
+
+    return node;
+}
+
+static bool is_lvalue(node_t *node)
+{
+    return node->kind == N_VAR || node->kind == N_DEREF;
+}
+
+static node_t *parse_expr(void);
+static node_t *parse_assign(void);
+static node_t *parse_unary(void);
+
+static node_t *parse_primary(void)
+{
+    node_t *node;
+
+    if (accept('(')) {
+        node = parse_expr();
+        expect(')', "')'");
+        return node;
+    }
+
+    if (tok == TOK_NUMBER) {
+        node = new_num(tokval, tokval > INT32_MAX ? &ty_unsigned : &ty_int);
+        next();
+        return node;
+    }
+
+    if (tok != TOK_IDENT)
+        error(tokline, "expected expression");
+
+    if (lookahead() == '(') {
+        func_t *func = find_func(tokstr);
+
+        if (!func)
+            error(tokline, "implicit declaration of function '%s'", tokstr);
+
+        node        = new_node(N_CALL, func->ret);
+        node->func  = func;
+        next();
+        next();
+
+        if (!accept(')')) {
+            do {
+                node->list = realloc(node->list, sizeof(node_t *) * ++node->count);
+                node->list[node->count - 1] = parse_assign();
+            } while (accept(','));
+            expect(')', "')'");
+        }
+
+        if (node->count != func->nparams)
+            error(node->line, "wrong number of arguments to '%s'", func->name);
+
+        return node;
+    }
+
+    node        = new_node(N_VAR, NULL);
+    node->var   = find_var(tokstr);
+
+    if (!node->var)
+        error(tokline, "'%s' undeclared", tokstr);
+
+    node->type  = node->var->type;
+    next();
+    return node;
+}
+
+static node_t *parse_postfix(void)
+{
+    node_t *node = parse_primary();
+
+    while (true) {
+        if (accept('[')) {
+            node_t *index = parse_expr();
+            node_t *deref;
+
+            expect(']', "']'");
+
+            if (node->type->kind != TY_PTR)
+                error(tokline, "subscripted value is not a pointer");
+
+            deref       = new_node(N_DEREF, node->type->base);
+            deref->lhs  = new_binary('+', node, index);
+            node        = deref;
+        } else if (tok == TOK_INC || tok == TOK_DEC) {
+            node_t *incr = new_node(N_POSTINC, node->type);
+
+            if (!is_lvalue(node))
+                error(tokline, "lvalue required as increment operand");
+
+            incr->lhs   = node;
+            incr->value = node->type->kind == TY_PTR ? type_size(node->type->base) : 1;
+            incr->value = tok == TOK_INC ? incr->value : -incr->value;
+            node        = incr;
+            next();
+        } else {
+            return node;
+        }
+    }
+}
+
+static node_t *parse_unary(void)
+{
+    node_t *node;
+
+    // Casts.
+    if (tok == '(' && is_type(lookahead())) {
+        next();
+        node        = new_node(N_CAST, parse_type());
+        expect(')', "')'");
+        node->lhs   = parse_unary();
+        return node;
+    }
+
+    switch (tok) {
+        case '+':
+            next();
+            return parse_unary();
+        case '-':
+            next();
+            node        = new_node(N_NEG, NULL);
+            node->lhs   = parse_unary();
+            node->type  = node->lhs->type->kind == TY_UNSIGNED ? &ty_unsigned : &ty_int;
+            return node;
+        case '~':
+            next();
+            node        = new_node(N_BITNOT, NULL);
+            node->lhs   = parse_unary();
+            node->type  = node->lhs->type->kind == TY_UNSIGNED ? &ty_unsigned : &ty_int;
+            return node;
+        case '!':
+            next();
+            node        = new_node(N_LNOT, &ty_int);
+            node->lhs   = parse_unary();
+            return node;
+        case '*':
+            next();
+            node        = new_node(N_DEREF, NULL);
+            node->lhs   = parse_unary();
+            if (node->lhs->type->kind != TY_PTR)
+                error(node->line, "invalid type argument of unary '*'");
+            node->type  = node->lhs->type->base;
+            return node;
+        case '&':
+            next();
+            node        = new_node(N_ADDR, NULL);
+            node->lhs   = parse_unary();
+            // Locals live in registers, so only memory has an address.
+            if (node->lhs->kind != N_DEREF)
+                error(node->line, "cannot take the address of a register variable");
+            node->type  = pointer_to(node->lhs->type);
+            return node;
+        case TOK_INC:
+        case TOK_DEC:
+            node        = new_node(N_PREINC, NULL);
+            node->value = tok == TOK_INC ? 1 : -1;
+            next();
+            node->lhs   = parse_unary();
+            node->type  = node->lhs->type;
+            if (!is_lvalue(node->lhs))
+                error(node->line, "lvalue required as increment operand");
+            if (node->type->kind == TY_PTR)
+                node->value *= type_size(node->type->base);
+            return node;
+    }
+
+    return parse_postfix();
+}
+
+// Binary operators in order of increasing precedence.
+static const int precedence[][6] = {
+    { TOK_OROR },
+    { TOK_ANDAND },
+    { '|' },
+    { '^' },
+    { '&' },
+    { TOK_EQ, TOK_NE },
+    { '<', '>', TOK_LE, TOK_GE },
+    { TOK_SHL, TOK_SHR },
+    { '+', '-' },
+    { '*', '/', '%' },
+};
+
+static node_t *parse_binary(int level)
+{
+    node_t *node;
+
+    if (level == sizeof precedence / sizeof *precedence)
+        return parse_unary();
+
+    node = parse_binary(level + 1);
+
+    while (true) {
+        int op = 0;
+
+        for (int i = 0; i < 6 && precedence[level][i]; i++) {
+            if (tok == precedence[level][i]) {
+                op = tok;
+            }
+        }
+
+        if (op == 0)
+            return node;
+
+        next();
+
+        if (op == TOK_ANDAND || op == TOK_OROR) {
+            node_t *logical = new_node(op == TOK_ANDAND ? N_LAND : N_LOR, &ty_int);
+
+            logical->lhs = node;
+            logical->rhs = parse_binary(level + 1);
+            node         = logical;
+        } else {
+            node = new_binary(op, node, parse_binary(level + 1));
+        }
+    }
+}
+
+static node_t *parse_conditional(void)
+{
+    node_t *node = parse_binary(0);
+    node_t *cond;
+
+    if (!accept('?'))
+        return node;
+
+    cond        = new_node(N_COND, NULL);
+    cond->cond  = node;
+    cond->lhs   = parse_expr();
+    expect(':', "':'");
+    cond->rhs   = parse_conditional();
+    cond->type  = cond->lhs->type;
+    return cond;
+}
+
+static node_t *parse_assign(void)
+{
+    static const int compound[][2] = {
+        { TOK_ADDEQ, '+' },     { TOK_SUBEQ, '-' },     { TOK_MULEQ, '*' },
+        { TOK_DIVEQ, '/' },     { TOK_MODEQ, '%' },     { TOK_ANDEQ, '&' },
+        { TOK_OREQ,  '|' },     { TOK_XOREQ, '^' },     { TOK_SHLEQ, TOK_SHL },
+        { TOK_SHREQ, TOK_SHR },
+    };
+    node_t *node = parse_conditional();
+    node_t *assign;
+
+    if (accept('=')) {
+        if (!is_lvalue(node))
+            error(tokline, "lvalue required as left operand of assignment");
+
+        assign      = new_node(N_ASSIGN, node->type);
+        assign->lhs = node;
+        assign->rhs = parse_assign();
+        return assign;
+    }
+
+    for (int i = 0; i < sizeof compound / sizeof *compound; i++) {
+        if (accept(compound[i][0])) {
+            if (!is_lvalue(node))
+                error(tokline, "lvalue required as left operand of assignment");
+
+            // The value of the lhs is substituted in when generating code,
+            // so that it is only evaluated once.
+            assign      = new_node(N_OPASSIGN, node->type);
+            assign->lhs = node;
+            assign->rhs = new_binary(compound[i][1], new_node(N_NUM, node->type), parse_assign());
+            return assign;
+        }
+    }
+
+    return node;
+}
+
+static node_t *parse_expr(void)
+{
+    node_t *node = parse_assign();
+
+    while (accept(',')) {
+        node_t *comma = new_node(N_COMMA, NULL);
+
+        comma->lhs  = node;
+        comma->rhs  = parse_assign();
+        comma->type = comma->rhs->type;
+        node        = comma;
+    }
+
+    return node;
+}
+
+static node_t *parse_stmt(void);
+
+// Parse a declaration, appending any initializers to block.
+static void parse_declaration(node_t *block)
+{
+    type_t *base = parse_type();
+
+    do {
+        type_t *type = base;
+        var_t  *var;
+
+        while (accept('*'))
+            type = pointer_to(type);
+
+        if (tok != TOK_IDENT)
+            error(tokline, "expected identifier");
+
+        if (type->kind == TY_VOID)
+            error(tokline, "variable '%s' declared void", tokstr);
+
+        var = declare_var(tokstr, type);
+        next();
+
+        if (accept('=')) {
+            node_t *stmt    = new_node(S_EXPR, NULL);
+            node_t *lhs     = new_node(N_VAR, type);
+
+            lhs->var        = var;
+            stmt->lhs       = new_node(N_ASSIGN, type);
+            stmt->lhs->lhs  = lhs;
+            stmt->lhs->rhs  = parse_assign();
+
+            block->list = realloc(block->list, sizeof(node_t *) * ++block->count);
+            block->list[block->count - 1] = stmt;
+        }
+    } while (accept(','));
+
+    expect(';', "';'");
+}
+
+static node_t *parse_block(void)
+{
+    node_t *block = new_node(S_BLOCK, NULL);
+    int     saved = nvars;
+
+    depth++;
+
+    while (!accept('}')) {
+        if (tok == TOK_EOF)
+            error(tokline, "expected '}'");
+
+        // Declarations may appear anywhere in a block.
+        if (is_type(tok)) {
+            parse_declaration(block);
+            continue;
+        }
+
+        block->list = realloc(block->list, sizeof(node_t *) * ++block->count);
+        block->list[block->count - 1] = parse_stmt();
+    }
+
+    depth--;
+    nvars = saved;
+    return block;
+}
+
+static node_t *parse_stmt(void)
+{
+    node_t *node;
+    int     saved;
+
+    switch (tok) {
+        case '{':
+            next();
+            return parse_block();
+        case ';':
+            next();
+            return new_node(S_BLOCK, NULL);
+        case TOK_IF:
+            node = new_node(S_IF, NULL);
+            next();
+            expect('(', "'('");
+            node->cond = parse_expr();
+            expect(')', "')'");
+            node->body = parse_stmt();
+            if (accept(TOK_ELSE))
+                node->els = parse_stmt();
+            return node;
+        case TOK_WHILE:
+            node = new_node(S_WHILE, NULL);
+            next();
+            expect('(', "'('");
+            node->cond = parse_expr();
+            expect(')', "')'");
+            node->body = parse_stmt();
+            return node;
+        case TOK_DO:
+            node = new_node(S_DO, NULL);
+            next();
+            node->body = parse_stmt();
+            expect(TOK_WHILE, "'while'");
+            expect('(', "'('");
+            node->cond = parse_expr();
+            expect(')', "')'");
+            expect(';', "';'");
+            return node;
+        case TOK_FOR:
+            node = new_node(S_FOR, NULL);
+            next();
+            expect('(', "'('");
+            // A declaration here is scoped to the loop.
+            saved = nvars;
+            depth++;
+            if (is_type(tok)) {
+                node->init = new_node(S_BLOCK, NULL);
+                parse_declaration(node->init);
+            } else if (!accept(';')) {
+                node->init = new_node(S_EXPR, NULL);
+                node->init->lhs = parse_expr();
+                expect(';', "';'");
+            }
+            if (!accept(';')) {
+                node->cond = parse_expr();
+                expect(';', "';'");
+            }
+            if (!accept(')')) {
+                node->step = parse_expr();
+                expect(')', "')'");
+            }
+            node->body = parse_stmt();
+            depth--;
+            nvars = saved;
+            return node;
+        case TOK_RETURN:
+            node = new_node(S_RETURN, NULL);
+            next();
+            if (!accept(';')) {
+                node->lhs = parse_expr();
+                expect(';', "';'");
+            }
+            if (!!node->lhs != (current->ret->kind != TY_VOID))
+                error(node->line, "return type mismatch in '%s'", current->name);
+            return node;
+        case TOK_BREAK:
+            node = new_node(S_BREAK, NULL);
+            next();
+            expect(';', "';'");
+            return node;
+        case TOK_CONTINUE:
+            node = new_node(S_CONTINUE, NULL);
+            next();
+            expect(';', "';'");
+            return node;
+    }
+
+    node      = new_node(S_EXPR, NULL);
+    node->lhs = parse_expr();
+    expect(';', "';'");
+    return node;
+}
+
+static irv_t vreg(int n)
+{
+    return (irv_t) { IRV_REG, n };
+}
+
+static irv_t imm(uint32_t value)
+{
+    return (irv_t) { IRV_IMM, value };
+}
+
+static irv_t none(void)
+{
+    return (irv_t) { IRV_NONE };
+}
+
+static ir_t *emit(int op, irv_t d, irv_t a, irv_t b)
+{
+    code = realloc(code, sizeof(ir_t) * ++ncode);
+    memset(&code[ncode - 1], 0, sizeof(ir_t));
+    code[ncode - 1].op = op;
+    code[ncode - 1].d  = d;
+    code[ncode - 1].a  = a;
+    code[ncode - 1].b  = b;
+    return &code[ncode - 1];
+}
+
+static void emit_label(int label)
+{
+    emit(IR_LABEL, none(), none(), none())->label = label;
+}
+
+static void emit_jump(int label)
+{
+    emit(IR_JMP, none(), none(), none())->label = label;
+}
+
+static ir_t *emit_branch(int cc, bool test, irv_t a, irv_t b, int label)
+{
+    ir_t *ir = emit(IR_BR, none(), a, b);
+
+    ir->cc      = cc;
+    ir->test    = test;
+    ir->label   = label;
+    return ir;
+}
+
+static uint32_t fold(int op, uint32_t a, uint32_t b)
+{
+    switch (op) {
+        case IR_ADD:    return a + b;
+        case IR_SUB:    return a - b;
+        case IR_MUL:    return a * b;
+        case IR_DIV:    return b ? a / b : a;
+        case IR_AND:    return a & b;
+        case IR_OR:     return a | b;
+        case IR_XOR:    return a ^ b;
+        case IR_SHL:    return a << (b & 31);
+        case IR_SHR:    return a >> (b & 31);
+        case IR_SAR:    return (int32_t) a >> (b & 31);
+    }
+    abort();
+}
+
+static irv_t gen_arith(int op, irv_t a, irv_t b)
+{
+    irv_t d;
+
+    if (a.kind == IRV_IMM && b.kind == IRV_IMM)
+        return imm(fold(op, a.value, b.value));
+
+    // Strength reduction for powers of two.
+    if (b.kind == IRV_IMM && b.value && (b.value & (b.value - 1)) == 0) {
+        switch (op) {
+            case IR_MUL: op = IR_SHL; b = imm(__builtin_ctz(b.value)); break;
+            case IR_DIV: op = IR_SHR; b = imm(__builtin_ctz(b.value)); break;
+        }
+    }
+
+    d = vreg(nvregs++);
+    emit(op, d, a, b);
+    return d;
+}
+
+static irv_t gen_expr(node_t *node);
+static void gen_branch(node_t *node, bool sense, int label);
+
+// Generate the base and displacement of a memory reference.
+static irv_t gen_address(node_t *node, uint32_t *offset)
+{
+    *offset = 0;
+
+    if (node->kind == N_BINARY && node->op == '+' && node->rhs->kind == N_NUM) {
+        *offset = node->rhs->value;
+        return gen_expr(node->lhs);
+    }
+
+    if (node->kind == N_BINARY && node->op == '-' && node->rhs->kind == N_NUM) {
+        *offset = -node->rhs->value;
+        return gen_expr(node->lhs);
+    }
+
+    return gen_expr(node);
+}
+
+static irv_t gen_load(irv_t base, uint32_t offset, type_t *type)
+{
+    irv_t d  = vreg(nvregs++);
+    ir_t *ir = emit(IR_LOAD, d, base, none());
+
+    ir->offset  = offset;
+    ir->width   = type_size(type);
+    return d;
+}
+
+static void gen_store(irv_t base, uint32_t offset, type_t *type, irv_t value)
+{
+    ir_t *ir = emit(IR_STORE, none(), base, value);
+
+    ir->offset  = offset;
+    ir->width   = type_size(type);
+}
+
+static int binary_op(node_t *node)
+{
+    bool sign = node->type->kind == TY_INT;
+
+    switch (node->op) {
+        case '+':       return IR_ADD;
+        case '-':       return IR_SUB;
+        case '*':       return IR_MUL;
+        case '/':       return IR_DIV;
+        case '&':       return IR_AND;
+        case '|':       return IR_OR;
+        case '^':       return IR_XOR;
+        case TOK_SHL:   return IR_SHL;
+        case TOK_SHR:   return sign ? IR_SAR : IR_SHR;
+    }
+    return -1;
+}
+
+static irv_t gen_binary(node_t *node, irv_t a)
+{
+    irv_t b = gen_expr(node->rhs);
+    irv_t q;
+
+    // RarVM has no remainder instruction, a % b = a - (a / b) * b.
+    if (node->op == '%') {
+        if (b.kind == IRV_IMM && b.value && (b.value & (b.value - 1)) == 0)
+            return gen_arith(IR_AND, a, imm(b.value - 1));
+
+        q = gen_arith(IR_DIV, a, b);
+        q = gen_arith(IR_MUL, q, b);
+        return gen_arith(IR_SUB, a, q);
+    }
+
+    return gen_arith(binary_op(node), a, b);
+}
+
+// Materialize a boolean expression as 0 or 1.
+static irv_t gen_bool(node_t *node)
+{
+    irv_t d    = vreg(nvregs++);
+    int   done = nlabels++;
+
+    emit(IR_MOV, d, imm(1), none());
+    gen_branch(node, true, done);
+    emit(IR_MOV, d, imm(0), none());
+    emit_label(done);
+    return d;
+}
+
+static irv_t gen_expr(node_t *node)
+{
+    irv_t    a;
+    irv_t    d;
+    irv_t    base;
+    uint32_t offset;
+    int      label;
+    int      done;
+
+    switch (node->kind) {
+        case N_NUM:
+            return imm(node->value);
+        case N_VAR:
+            return vreg(node->var->vreg);
+        case N_CAST:
+            a = gen_expr(node->lhs);
+            if (node->type->kind == TY_CHAR)
+                return gen_arith(IR_AND, a, imm(0xff));
+            return a;
+        case N_COMMA:
+            gen_expr(node->lhs);
+            return gen_expr(node->rhs);
+        case N_BINARY:
+            switch (node->op) {
+                case '<': case '>': case TOK_LE: case TOK_GE: case TOK_EQ: case TOK_NE:
+                    return gen_bool(node);
+            }
+            return gen_binary(node, gen_expr(node->lhs));
+        case N_LAND:
+        case N_LOR:
+        case N_LNOT:
+            return gen_bool(node);
+        case N_NEG:
+        case N_BITNOT:
+            a = gen_expr(node->lhs);
+            if (a.kind == IRV_IMM)
+                return imm(node->kind == N_NEG ? -a.value : ~a.value);
+            d = vreg(nvregs++);
+            emit(node->kind == N_NEG ? IR_NEG : IR_NOT, d, a, none());
+            return d;
+        case N_DEREF:
+            base = gen_address(node->lhs, &offset);
+            return gen_load(base, offset, node->type);
+        case N_ADDR:
+            return gen_expr(node->lhs->lhs);
+        case N_ASSIGN:
+            a = gen_expr(node->rhs);
+            if (node->lhs->kind == N_VAR) {
+                d = vreg(node->lhs->var->vreg);
+                if (node->lhs->type->kind == TY_CHAR)
+                    a = gen_arith(IR_AND, a, imm(0xff));
+                emit(IR_MOV, d, a, none());
+                return d;
+            }
+            base = gen_address(node->lhs->lhs, &offset);
+            gen_store(base, offset, node->type, a);
+            return a;
+        case N_OPASSIGN:
+            if (node->lhs->kind == N_VAR) {
+                d = vreg(node->lhs->var->vreg);
+                a = gen_binary(node->rhs, d);
+                emit(IR_MOV, d, a, none());
+                return d;
+            }
+            base = gen_address(node->lhs->lhs, &offset);
+            a    = gen_binary(node->rhs, gen_load(base, offset, node->type));
+            gen_store(base, offset, node->type, a);
+            return a;
+        case N_PREINC:
+        case N_POSTINC:
+            if (node->lhs->kind == N_VAR) {
+                d = vreg(node->lhs->var->vreg);
+                a = d;
+                if (node->kind == N_POSTINC) {
+                    a = vreg(nvregs++);
+                    emit(IR_MOV, a, d, none());
+                }
+                emit(IR_ADD, d, d, imm(node->value));
+                return a;
+            }
+            base = gen_address(node->lhs->lhs, &offset);
+            a    = gen_load(base, offset, node->type);
+            d    = gen_arith(IR_ADD, a, imm(node->value));
+            gen_store(base, offset, node->type, d);
+            return node->kind == N_POSTINC ? a : d;
+        case N_COND:
+            d     = vreg(nvregs++);
+            label = nlabels++;
+            done  = nlabels++;
+            gen_branch(node->cond, false, label);
+            emit(IR_MOV, d, gen_expr(node->lhs), none());
+            emit_jump(done);
+            emit_label(label);
+            emit(IR_MOV, d, gen_expr(node->rhs), none());
+            emit_label(done);
+            return d;
+        case N_CALL: {
+            irv_t args[node->count + 1];
+            ir_t *ir;
+
+            // Evaluate all the arguments before pushing any of them, so that
+            // nested calls don't interleave with the pushes.
+            for (int i = 0; i < node->count; i++)
+                args[i] = gen_expr(node->list[i]);
+
+            for (int i = node->count - 1; i >= 0; i--)
+                emit(IR_ARG, none(), args[i], none());
+
+            d         = node->type->kind == TY_VOID ? none() : vreg(nvregs++);
+            ir        = emit(IR_CALL, d, none(), none());
+            ir->sym   = node->func->name;
+            ir->nargs = node->count;
+            return d;
+        }
+    }
+
+    error(node->line, "invalid expression");
+}
+
+static int invert(int cc)
+{
+    static const int inverse[] = {
+        [CC_Z]  = CC_NZ, [CC_NZ] = CC_Z,  [CC_B]  = CC_AE, [CC_AE] = CC_B,
+        [CC_BE] = CC_A,  [CC_A]  = CC_BE, [CC_S]  = CC_NS, [CC_NS] = CC_S,
+    };
+
+    return inverse[cc];
+}
+
+// Branch to label if the truth of node matches sense, otherwise fall through.
+static void gen_branch(node_t *node, bool sense, int label)
+{
+    irv_t a;
+    irv_t b;
+    int   cc;
+    int   skip;
+
+    switch (node->kind) {
+        case N_NUM:
+            if (!!node->value == sense)
+                emit_jump(label);
+            return;
+        case N_LNOT:
+            gen_branch(node->lhs, !sense, label);
+            return;
+        case N_LAND:
+        case N_LOR:
+            if ((node->kind == N_LAND) == sense) {
+                skip = nlabels++;
+                gen_branch(node->lhs, !sense, skip);
+                gen_branch(node->rhs, sense, label);
+                emit_label(skip);
+            } else {
+                gen_branch(node->lhs, sense, label);
+                gen_branch(node->rhs, sense, label);
+            }
+            return;
+        case N_BINARY:
+            break;
+        case N_POSTINC:
+            // while (n--) is common, compare the new value rather than keeping
+            // a copy of the old one.
+            if (node->lhs->kind == N_VAR) {
+                a = vreg(node->lhs->var->vreg);
+
+                // Subtracting one borrows exactly when the old value was zero.
+                if (node->value == -1) {
+                    emit(IR_SUB, a, a, imm(1));
+                    emit_branch(sense ? CC_AE : CC_B, false, a, imm(1), label)->carry = true;
+                    return;
+                }
+
+                emit(IR_ADD, a, a, imm(node->value));
+                emit_branch(sense ? CC_NZ : CC_Z, false, a, imm(node->value), label);
+                return;
+            }
+            // fallthrough
+        default:
+            a = gen_expr(node);
+            emit_branch(sense ? CC_NZ : CC_Z, true, a, a, label);
+            return;
+    }
+
+    switch (node->op) {
+        case TOK_EQ:    cc = CC_Z;  break;
+        case TOK_NE:    cc = CC_NZ; break;
+        case '<':       cc = CC_B;  break;
+        case TOK_LE:    cc = CC_BE; break;
+        case '>':       cc = CC_A;  break;
+        case TOK_GE:    cc = CC_AE; break;
+        case '&':
+            // Use test for bitmasks.
+            a = gen_expr(node->lhs);
+            b = gen_expr(node->rhs);
+            emit_branch(sense ? CC_NZ : CC_Z, true, a, b, label);
+            return;
+        default:
+            a = gen_expr(node);
+            emit_branch(sense ? CC_NZ : CC_Z, true, a, a, label);
+            return;
+    }
+
+    a  = gen_expr(node->lhs);
+    b  = gen_expr(node->rhs);
+    cc = sense ? cc : invert(cc);
+
+    // Put any immediate on the right.
+    if (a.kind == IRV_IMM && b.kind != IRV_IMM) {
+        irv_t t = a;
+
+        a = b, b = t;
+
+        switch (cc) {
+            case CC_B:  cc = CC_A;  break;
+            case CC_A:  cc = CC_B;  break;
+            case CC_BE: cc = CC_AE; break;
+            case CC_AE: cc = CC_BE; break;
+        }
+    }
+
+    // RarVM has no overflow flag, so signed comparisons are done by flipping
+    // the sign bits and comparing unsigned. Comparisons against zero can use
+    // the sign flag instead.
+    if (cc != CC_Z && cc != CC_NZ
+     && node->lhs->type->kind == TY_INT && node->rhs->type->kind == TY_INT) {
+        if (b.kind == IRV_IMM && b.value == 0 && (cc == CC_B || cc == CC_AE)) {
+            emit_branch(cc == CC_B ? CC_S : CC_NS, true, a, a, label);
+            return;
+        }
+
+        a = gen_arith(IR_XOR, a, imm(0x80000000));
+        b = gen_arith(IR_XOR, b, imm(0x80000000));
+    }
+
+    if (b.kind == IRV_IMM && b.value == 0 && (cc == CC_Z || cc == CC_NZ)) {
+        emit_branch(cc, true, a, a, label);
+        return;
+    }
+
+    emit_branch(cc, false, a, b, label);
+}
+
+static void gen_stmt(node_t *node)
+{
+    int savebreak = breaklabel;
+    int savecont  = contlabel;
+    int body;
+    int cond;
+    int els;
+    int done;
+
+    switch (node->kind) {
+        case S_EXPR:
+            // Discard the result of calls.
+            if (node->lhs->kind == N_CALL) {
+                gen_expr(node->lhs);
+                code[ncode - 1].d = none();
+            } else {
+                gen_expr(node->lhs);
+            }
+            return;
+        case S_BLOCK:
+            for (int i = 0; i < node->count; i++)
+                gen_stmt(node->list[i]);
+            return;
+        case S_IF:
+            els  = nlabels++;
+            gen_branch(node->cond, false, els);
+            gen_stmt(node->body);
+            if (node->els) {
+                done = nlabels++;
+                emit_jump(done);
+                emit_label(els);
+                gen_stmt(node->els);
+                emit_label(done);
+            } else {
+                emit_label(els);
+            }
+            return;
+        case S_WHILE:
+        case S_FOR:
+            // Loops are rotated so the test is at the bottom, saving a jump
+            // on every iteration.
+            body        = nlabels++;
+            cond        = nlabels++;
+            contlabel   = nlabels++;
+            breaklabel  = nlabels++;
+            if (node->init)
+                gen_stmt(node->init);
+            emit_jump(cond);
+            emit_label(body);
+            gen_stmt(node->body);
+            emit_label(contlabel);
+            if (node->step)
+                gen_expr(node->step);
+            emit_label(cond);
+            if (node->cond) {
+                gen_branch(node->cond, true, body);
+            } else {
+                emit_jump(body);
+            }
+            emit_label(breaklabel);
+            break;
+        case S_DO:
+            body        = nlabels++;
+            contlabel   = nlabels++;
+            breaklabel  = nlabels++;
+            emit_label(body);
+            gen_stmt(node->body);
+            emit_label(contlabel);
+            gen_branch(node->cond, true, body);
+            emit_label(breaklabel);
+            break;
+        case S_RETURN:
+            emit(IR_RET, none(), node->lhs ? gen_expr(node->lhs) : none(), none());
+            return;
+        case S_BREAK:
+        case S_CONTINUE:
+            if (breaklabel < 0)
+                error(node->line, "%s statement not within loop", node->kind == S_BREAK ? "break" : "continue");
+            emit_jump(node->kind == S_BREAK ? breaklabel : contlabel);
+            return;
+    }
+
+    breaklabel  = savebreak;
+    contlabel   = savecont;
+}
+
+// Return the vregs read by ir.
+static int ir_uses(ir_t *ir, int *uses)
+{
+    int count = 0;
+
+    if (ir->a.kind == IRV_REG)
+        uses[count++] = ir->a.value;
+    if (ir->b.kind == IRV_REG)
+        uses[count++] = ir->b.value;
+
+    return count;
+}
+
+// Return the vreg written by ir, or -1.
+static int ir_def(ir_t *ir)
+{
+    return ir->d.kind == IRV_REG ? ir->d.value : -1;
+}
+
+static bool same(irv_t a, irv_t b)
+{
+    return a.kind == b.kind && a.value == b.value;
+}
+
+// Tree translation produces a temporary for every intermediate value, fold
+// them into their consumer where possible so that e.g. x = (x >> 1) ^ y
+// becomes shr x, #1; xor x, y rather than going via two temporaries.
+static void optimize_ir(void)
+{
+    int  *defs = calloc(nvregs, sizeof(int));
+    int  *uses = calloc(nvregs, sizeof(int));
+    int   operands[2];
+    bool  changed;
+
+    for (int i = 0; i < ncode; i++) {
+        if (ir_def(&code[i]) >= 0)
+            defs[ir_def(&code[i])]++;
+        for (int n = ir_uses(&code[i], operands); n; n--)
+            uses[operands[n - 1]]++;
+    }
+
+    // Work backwards, so that a chain of temporaries collapses into the
+    // final destination.
+    for (int i = ncode - 2; i >= 0; i--) {
+        ir_t *ir   = &code[i];
+        ir_t *next = &code[i + 1];
+        int   t    = ir_def(ir);
+
+        if (t < 0 || defs[t] != 1 || uses[t] != 1 || ir->op == IR_PARAM || ir->op == IR_CALL)
+            continue;
+
+        // t = ...; d = t  ->  d = ...
+        if (next->op == IR_MOV && same(next->a, ir->d)) {
+            ir->d       = next->d;
+            next->op    = IR_LABEL;
+            next->label = -1;
+            next->d     = next->a = none();
+            defs[t]--, uses[t]--;
+            continue;
+        }
+
+        if (next->op < IR_ADD || next->op > IR_NOT || next->d.kind != IRV_REG)
+            continue;
+
+        // Commutative operators may use either operand.
+        if ((next->op == IR_ADD || next->op == IR_MUL || next->op == IR_AND
+          || next->op == IR_OR || next->op == IR_XOR) && same(next->b, ir->d)) {
+            next->b = next->a;
+            next->a = ir->d;
+        }
+
+        // t = ...; d = t op b  ->  d = ...; d = d op b
+        if (same(next->a, ir->d) && !same(next->b, next->d)) {
+            ir->d   = next->d;
+            next->a = next->d;
+            defs[t]--, uses[t]--;
+            defs[next->d.value]++, uses[next->d.value]++;
+        }
+    }
+
+    // Remove instructions that compute values nobody uses.
+    do {
+        changed = false;
+
+        for (int i = 0; i < ncode; i++) {
+            ir_t *ir = &code[i];
+            int   t  = ir_def(ir);
+
+            if (t < 0 || uses[t] || ir->op == IR_CALL || ir->op == IR_PARAM)
+                continue;
+
+            for (int n = ir_uses(ir, operands); n; n--)
+                uses[operands[n - 1]]--;
+
+            defs[t]--;
+            ir->op      = IR_LABEL;
+            ir->label   = -1;
+            ir->d       = ir->a = ir->b = none();
+            changed     = true;
+        }
+    } while (changed);
+
+    free(defs);
+    free(uses);
+}
+
+// Instructions deleted by optimize_ir() are left behind as anonymous labels.
+static void ir_delete(ir_t *ir)
+{
+    ir->op      = IR_LABEL;
+    ir->label   = -1;
+    ir->d       = ir->a = ir->b = none();
+}
+
+static bool ir_deleted(ir_t *ir)
+{
+    return ir->op == IR_LABEL && ir->label < 0;
+}
+
+// Only simple instructions can be moved between blocks.
+static bool ir_movable(ir_t *ir)
+{
+    return ir->op <= IR_STORE;
+}
+
+static bool ir_same(ir_t *x, ir_t *y)
+{
+    return x->op == y->op
+        && same(x->d, y->d)
+        && same(x->a, y->a)
+        && same(x->b, y->b)
+        && x->width == y->width
+        && x->offset == y->offset;
+}
+
+// Return the end of the straight line code starting at i, skipping deleted
+// instructions, the result is the index of the first label or branch.
+static int ir_straight(int i)
+{
+    while (i < ncode && (ir_deleted(&code[i]) || ir_movable(&code[i])))
+        i++;
+    return i;
+}
+
+// Return the first live instruction in [start, end), or -1.
+static int ir_first(int start, int end)
+{
+    for (int i = start; i < end; i++) {
+        if (!ir_deleted(&code[i]))
+            return i;
+    }
+    return -1;
+}
+
+// Return the last live instruction in [start, end), or -1.
+static int ir_last(int start, int end)
+{
+    for (int i = end - 1; i >= start; i--) {
+        if (!ir_deleted(&code[i]))
+            return i;
+    }
+    return -1;
+}
+
+// An if/else whose arms start or end with the same instruction only needs one
+// copy. A common tail moves below the join, and a common head moves above the
+// branch if it doesn't change what the branch tests. The exception is the crc
+// idiom if (x & 1) { x >>= 1; ... } else { x >>= 1; ... }, shr leaves the bit
+// being tested in the carry flag so the branch can use that instead.
+static void merge_arms(void)
+{
+    int *refs = calloc(nlabels + 1, sizeof(int));
+
+    for (int i = 0; i < ncode; i++) {
+        if (code[i].op == IR_BR || code[i].op == IR_JMP)
+            refs[code[i].label]++;
+    }
+
+    for (int i = 0; i < ncode; i++) {
+        ir_t *br = &code[i];
+        int   jmp;
+        int   els;
+        int   done;
+        int   x;
+        int   y;
+
+        if (br->op != IR_BR || br->carry || refs[br->label] != 1)
+            continue;
+
+        // br; then...; jmp done; els: else...; done:
+        jmp = ir_straight(i + 1);
+
+        if (jmp == ncode || code[jmp].op != IR_JMP || refs[code[jmp].label] != 1)
+            continue;
+
+        els = jmp + 1;
+
+        if (els == ncode || code[els].op != IR_LABEL || code[els].label != br->label)
+            continue;
+
+        done = ir_straight(els + 1);
+
+        if (done == ncode || code[done].op != IR_LABEL || code[done].label != code[jmp].label)
+            continue;
+
+        // Move common tails below the join, the label takes the place of the
+        // instruction in the else arm.
+        while ((x = ir_last(i + 1, jmp)) >= 0 && (y = ir_last(els + 1, done)) >= 0 && ir_same(&code[x], &code[y])) {
+            ir_t label = code[done];
+
+            code[done]  = code[y];
+            code[y]     = label;
+            done        = y;
+
+            ir_delete(&code[x]);
+        }
+
+        // Move common heads above the branch, which is the next instruction
+        // to be emitted so the flags it sets are still there.
+        while ((x = ir_first(i + 1, jmp)) >= 0 && (y = ir_first(els + 1, done)) >= 0 && ir_same(&code[x], &code[y])) {
+            ir_t insn   = code[x];
+            int  t      = ir_def(&insn);
+
+            if (t >= 0 && (same(br->a, insn.d) || same(br->b, insn.d))) {
+                if (insn.op != IR_SHR || !same(insn.a, insn.d) || !same(insn.b, imm(1))
+                 || !br->test || !same(br->a, insn.d) || !same(br->b, imm(1))
+                 || (br->cc != CC_Z && br->cc != CC_NZ))
+                    break;
+
+                br->cc      = br->cc == CC_Z ? CC_AE : CC_B;
+                br->carry   = true;
+            }
+
+            ir_delete(&code[y]);
+
+            // Shuffle the branch down to make room.
+            memmove(&code[i + 1], &code[i], sizeof(ir_t) * (x - i));
+
+            code[i] = insn;
+            br      = &code[++i];
+
+            if (br->carry)
+                break;
+        }
+
+        // Nothing left to do in the then arm, branch straight to the join.
+        if (ir_first(i + 1, jmp) < 0) {
+            br->cc      = invert(br->cc);
+            br->label   = code[jmp].label;
+
+            ir_delete(&code[jmp]);
+        }
+    }
+
+    free(refs);
+}
+
+static const char *regnames[] = { "r0", "r1", "r2", "r3", "r4", "r5", "r6" };
+
+// Register allocation results.
+static int      *regs;              // Register assigned to each vreg, or -1.
+static uint32_t *slots;             // Stack offset of each spilled vreg.
+static int       nslots;
+static uint32_t  framesize;
+static bool      saver6;
+static int       scratch;           // Register reserved for spilled addresses.
+static int       tmpslot;           // Frame slot used to resolve operand conflicts.
+static uint32_t  stackdepth;        // Bytes pushed during a call sequence.
+
+static int compare_start(const void *a, const void *b)
+{
+    return ((interval_t *) a)->start - ((interval_t *) b)->start;
+}
+
+// Compute live intervals, one per vreg, covering every position at which the
+// vreg might be live.
+static interval_t *build_intervals(void)
+{
+    int         words   = (nvregs + 63) / 64;
+    int        *blockof = calloc(ncode + 1, sizeof(int));
+    int        *first   = calloc(ncode + 1, sizeof(int));
+    int        *last    = calloc(ncode + 1, sizeof(int));
+    int        *labels  = calloc(nlabels + 1, sizeof(int));
+    int         nblocks = 0;
+    uint64_t   *livein;
+    uint64_t   *liveout;
+    uint64_t   *use;
+    uint64_t   *def;
+    interval_t *intervals = calloc(nvregs, sizeof(interval_t));
+    bool        changed;
+
+    // Split the code into basic blocks.
+    for (int i = 0; i < ncode; i++) {
+        if (i == 0 || code[i].op == IR_LABEL
+         || code[i - 1].op == IR_BR || code[i - 1].op == IR_JMP || code[i - 1].op == IR_RET) {
+            first[nblocks++] = i;
+        }
+        blockof[i]          = nblocks - 1;
+        last[nblocks - 1]   = i;
+        if (code[i].op == IR_LABEL && code[i].label >= 0)
+            labels[code[i].label] = nblocks - 1;
+    }
+
+    livein  = calloc(nblocks * words + 1, sizeof(uint64_t));
+    liveout = calloc(nblocks * words + 1, sizeof(uint64_t));
+    use     = calloc(nblocks * words + 1, sizeof(uint64_t));
+    def     = calloc(nblocks * words + 1, sizeof(uint64_t));
+
+    for (int b = 0; b < nblocks; b++) {
+        for (int i = first[b]; i <= last[b]; i++) {
+            int operands[2];
+
+            for (int n = ir_uses(&code[i], operands); n; n--) {
+                int v = operands[n - 1];
+                if (!(def[b * words + v / 64] & (1ULL << v % 64)))
+                    use[b * words + v / 64] |= 1ULL << v % 64;
+            }
+
+            if (ir_def(&code[i]) >= 0)
+                def[b * words + ir_def(&code[i]) / 64] |= 1ULL << ir_def(&code[i]) % 64;
+        }
+    }
+
+    // Iterate to a fixed point, in reverse because liveness flows backwards.
+    do {
+        changed = false;
+
+        for (int b = nblocks - 1; b >= 0; b--) {
+            ir_t *term = &code[last[b]];
+            int   succ[2];
+            int   nsucc = 0;
+
+            if (term->op == IR_JMP || term->op == IR_BR)
+                succ[nsucc++] = labels[term->label];
+            if (term->op != IR_JMP && term->op != IR_RET && b + 1 < nblocks)
+                succ[nsucc++] = b + 1;
+
+            for (int w = 0; w < words; w++) {
+                uint64_t out = 0;
+                uint64_t in;
+
+                for (int s = 0; s < nsucc; s++)
+                    out |= livein[succ[s] * words + w];
+
+                in = use[b * words + w] | (out & ~def[b * words + w]);
+
+                if (out != liveout[b * words + w] || in != livein[b * words + w]) {
+                    liveout[b * words + w] = out;
+                    livein[b * words + w]  = in;
+                    changed = true;
+                }
+            }
+        }
+    } while (changed);
+
+    for (int v = 0; v < nvregs; v++) {
+        intervals[v].vreg   = v;
+        intervals[v].start  = INT32_MAX;
+        intervals[v].end    = -1;
+        intervals[v].hint   = -1;
+        intervals[v].avoid  = -1;
+    }
+
+    // Uses are at position 2i, and definitions at 2i+1, so that an
+    // instruction can reuse the register of an operand that dies there.
+    for (int i = 0; i < ncode; i++) {
+        int operands[2];
+        int d = ir_def(&code[i]);
+
+        for (int n = ir_uses(&code[i], operands); n; n--) {
+            interval_t *interval = &intervals[operands[n - 1]];
+
+            interval->start = interval->start < 2 * i ? interval->start : 2 * i;
+            interval->end   = interval->end > 2 * i ? interval->end : 2 * i;
+        }
+
+        if (d >= 0) {
+            intervals[d].start = intervals[d].start < 2 * i + 1 ? intervals[d].start : 2 * i + 1;
+            intervals[d].end   = intervals[d].end > 2 * i + 1 ? intervals[d].end : 2 * i + 1;
+
+            // A two operand machine wants the result in the same place as
+            // the first operand, but not the second.
+            if (code[i].op != IR_LOAD && code[i].a.kind == IRV_REG)
+                intervals[d].hint = code[i].a.value;
+            if (code[i].b.kind == IRV_REG)
+                intervals[d].avoid = code[i].b.value;
+        }
+    }
+
+    for (int b = 0; b < nblocks; b++) {
+        for (int v = 0; v < nvregs; v++) {
+            if (livein[b * words + v / 64] & (1ULL << v % 64)) {
+                if (intervals[v].start > 2 * first[b])
+                    intervals[v].start = 2 * first[b];
+            }
+            if (liveout[b * words + v / 64] & (1ULL << v % 64)) {
+                if (intervals[v].end < 2 * last[b] + 1)
+                    intervals[v].end = 2 * last[b] + 1;
+            }
+        }
+    }
+
+    // Values live across a call must be in callee saved registers.
+    for (int i = 0; i < ncode; i++) {
+        if (code[i].op != IR_CALL)
+            continue;
+
+        for (int v = 0; v < nvregs; v++) {
+            if (intervals[v].start < 2 * i && intervals[v].end > 2 * i + 1)
+                intervals[v].crosscall = true;
+        }
+    }
+
+    free(blockof);
+    free(first);
+    free(last);
+    free(labels);
+    free(livein);
+    free(liveout);
+    free(use);
+    free(def);
+    return intervals;
+}
+
+static uint32_t param_offset(int param)
+{
+    // Spill slots, saved r6, return address, then the parameters.
+    return framesize + (saver6 ? 4 : 0) + 4 + 4 * param;
+}
+
+// Classic linear scan, see Poletto and Sarkar.
+static void linear_scan(interval_t *intervals, int reserved)
+{
+    interval_t *sorted  = malloc(sizeof(interval_t) * nvregs);
+    interval_t *active[7];
+    int         nactive = 0;
+    int         nsorted = 0;
+    bool        isparam[nvregs];
+
+    memset(isparam, 0, sizeof isparam);
+
+    for (int i = 0; i < ncode; i++) {
+        if (code[i].op == IR_PARAM)
+            isparam[code[i].d.value] = true;
+    }
+
+    for (int v = 0; v < nvregs; v++) {
+        regs[v]  = -1;
+        slots[v] = UINT32_MAX;
+        if (intervals[v].end >= 0)
+            sorted[nsorted++] = intervals[v];
+    }
+
+    nslots = 0;
+    qsort(sorted, nsorted, sizeof(interval_t), compare_start);
+
+    for (int i = 0; i < nsorted; i++) {
+        interval_t *current = &sorted[i];
+        bool        freeregs[7];
+        int         choice = -1;
+
+        // Expire intervals that ended before this one started.
+        for (int j = 0; j < nactive; j++) {
+            if (active[j]->end < current->start) {
+                active[j--] = active[--nactive];
+            }
+        }
+
+        for (int r = 0; r < 7; r++)
+            freeregs[r] = r != reserved && (!current->crosscall || r == REG6);
+
+        for (int j = 0; j < nactive; j++)
+            freeregs[regs[active[j]->vreg]] = false;
+
+        if (current->hint >= 0 && regs[current->hint] >= 0 && freeregs[regs[current->hint]])
+            choice = regs[current->hint];
+
+        for (int r = 0; r < 7 && choice < 0; r++) {
+            if (freeregs[r] && !(current->avoid >= 0 && regs[current->avoid] == r))
+                choice = r;
+        }
+
+        for (int r = 0; r < 7 && choice < 0; r++) {
+            if (freeregs[r])
+                choice = r;
+        }
+
+        if (choice < 0) {
+            interval_t *victim = NULL;
+
+            // Spill whichever interval ends furthest away.
+            for (int j = 0; j < nactive; j++) {
+                int r = regs[active[j]->vreg];
+
+                if (r != reserved && (!current->crosscall || r == REG6)) {
+                    if (!victim || active[j]->end > victim->end) {
+                        victim = active[j];
+                    }
+                }
+            }
+
+            if (victim && victim->end > current->end) {
+                choice              = regs[victim->vreg];
+                regs[victim->vreg]  = -1;
+                for (int j = 0; j < nactive; j++) {
+                    if (active[j] == victim) {
+                        active[j] = active[--nactive];
+                        break;
+                    }
+                }
+            }
+        }
+
+        if (choice >= 0) {
+            regs[current->vreg] = choice;
+            active[nactive++]   = current;
+        }
+    }
+
+    // Parameters can stay where the caller put them.
+    for (int v = 0; v < nvregs; v++) {
+        if (regs[v] < 0 && intervals[v].end >= 0 && !isparam[v]) {
+            slots[v] = 4 * nslots++;
+        }
+    }
+
+    free(sorted);
+}
+
+static void allocate_registers(void)
+{
+    interval_t *intervals = build_intervals();
+
+    regs    = realloc(regs, sizeof(int) * (nvregs + 1));
+    slots   = realloc(slots, sizeof(uint32_t) * (nvregs + 1));
+    scratch = -1;
+    tmpslot = -1;
+
+    linear_scan(intervals, -1);
+
+    // Memory references need their base in a register, if a spilled value is
+    // used as a pointer then try again with a scratch register reserved.
+    for (int i = 0; i < ncode; i++) {
+        if ((code[i].op == IR_LOAD || code[i].op == IR_STORE)
+          && code[i].a.kind == IRV_REG && regs[code[i].a.value] < 0) {
+            scratch = REG5;
+            linear_scan(intervals, scratch);
+            break;
+        }
+    }
+
+    // A two operand conflict like d = a - d needs somewhere to work.
+    for (int i = 0; i < ncode; i++) {
+        if (code[i].op >= IR_SUB && code[i].op <= IR_SAR && code[i].op != IR_MUL
+         && code[i].op != IR_AND && code[i].op != IR_OR && code[i].op != IR_XOR
+         && code[i].b.kind == IRV_REG && code[i].d.kind == IRV_REG
+         && !same(code[i].a, code[i].d)) {
+            int d = code[i].d.value;
+            int b = code[i].b.value;
+
+            if ((regs[d] >= 0 && regs[d] == regs[b]) || (regs[d] < 0 && regs[b] < 0 && slots[d] == slots[b]))
+                tmpslot = nslots;
+        }
+    }
+
+    framesize = 4 * (nslots + (tmpslot >= 0));
+    saver6    = false;
+
+    for (int v = 0; v < nvregs; v++)
+        saver6 |= regs[v] == REG6;
+
+    // Now the frame size is known, parameters can be located.
+    for (int i = 0; i < ncode; i++) {
+        if (code[i].op == IR_PARAM && regs[code[i].d.value] < 0)
+            slots[code[i].d.value] = param_offset(code[i].offset);
+    }
+
+    free(intervals);
+}
+
+// Format an operand, the result is only valid until the next call.
+static const char *operand(irv_t v)
+{
+    static char buf[4][32];
+    static int  n;
+    char       *s = buf[n++ % 4];
+
+    if (v.kind == IRV_IMM) {
+        snprintf(s, 32, v.value < 256 ? "#%u" : "#0x%08x", v.value);
+    } else if (regs[v.value] >= 0) {
+        snprintf(s, 32, "%s", regnames[regs[v.value]]);
+    } else {
+        snprintf(s, 32, "[r7+#%u]", slots[v.value] + stackdepth);
+    }
+    return s;
+}
+
+static const char *tmpoperand(void)
+{
+    static char s[32];
+
+    snprintf(s, sizeof s, "[r7+#%u]", 4 * tmpslot + stackdepth);
+    return s;
+}
+
+// Remember which location the flags describe, so redundant tests can be
+// omitted.
+static char flagsloc[32];
+
+static void insn(const char *mnemonic, const char *op1, const char *op2)
+{
+    if (op2) {
+        fprintf(output, "        %-8s%s, %s\n", mnemonic, op1, op2);
+    } else if (op1) {
+        fprintf(output, "        %-8s%s\n", mnemonic, op1);
+    } else {
+        fprintf(output, "        %s\n", mnemonic);
+    }
+
+    *flagsloc = '\0';
+
+    // These instructions set ZF and SF from their result.
+    if (strcmp(mnemonic, "add") == 0 || strcmp(mnemonic, "sub") == 0
+     || strcmp(mnemonic, "and") == 0 || strcmp(mnemonic, "or") == 0
+     || strcmp(mnemonic, "xor") == 0 || strcmp(mnemonic, "shl") == 0
+     || strcmp(mnemonic, "shr") == 0 || strcmp(mnemonic, "sar") == 0
+     || strcmp(mnemonic, "neg") == 0 || strcmp(mnemonic, "inc") == 0
+     || strcmp(mnemonic, "dec") == 0) {
+        snprintf(flagsloc, sizeof flagsloc, "%s", op1);
+    }
+}
+
+static void move(irv_t d, irv_t a)
+{
+    if (strcmp(operand(d), operand(a)) == 0)
+        return;
+
+    // Zeroing a register with xor saves encoding a 32 bit immediate.
+    if (a.kind == IRV_IMM && a.value == 0 && regs[d.value] >= 0) {
+        insn("xor", operand(d), operand(d));
+        return;
+    }
+
+    insn("mov", operand(d), operand(a));
+}
+
+// Format a memory reference to base+offset, loading base into the scratch
+// register if it was spilled.
+static const char *memory(irv_t base, uint32_t offset)
+{
+    static char s[64];
+
+    if (base.kind == IRV_IMM) {
+        snprintf(s, sizeof s, "[#0x%08x]", base.value + offset);
+        return s;
+    }
+
+    if (regs[base.value] < 0) {
+        insn("mov", regnames[scratch], operand(base));
+        snprintf(s, sizeof s, "[%s", regnames[scratch]);
+    } else {
+        snprintf(s, sizeof s, "[%s", regnames[regs[base.value]]);
+    }
+
+    if (offset == 0) {
+        strcat(s, "]");
+    } else if ((int32_t) offset < 0) {
+        snprintf(s + strlen(s), sizeof s - strlen(s), "-#%d]", -(int32_t) offset);
+    } else {
+        snprintf(s + strlen(s), sizeof s - strlen(s), "+#%u]", offset);
+    }
+    return s;
+}
+
+// Check if label is reached by falling through from i, labels don't generate
+// any code.
+static bool falls_through(int i, int label)
+{
+    for (; i < ncode && code[i].op == IR_LABEL; i++) {
+        if (code[i].label == label)
+            return true;
+    }
+    return false;
+}
+
+static void emit_epilogue(void)
+{
+    if (framesize)
+        insn("add", "r7", operand(imm(framesize)));
+    if (saver6)
+        insn("pop", "r6", NULL);
+    insn("ret", NULL, NULL);
+}
+
+static void emit_function(const char *name)
+{
+    static const char *mnemonics[] = {
+        [IR_ADD] = "add", [IR_SUB] = "sub", [IR_MUL] = "mul", [IR_DIV] = "div",
+        [IR_AND] = "and", [IR_OR]  = "or",  [IR_XOR] = "xor", [IR_SHL] = "shl",
+        [IR_SHR] = "shr", [IR_SAR] = "sar", [IR_NEG] = "neg", [IR_NOT] = "not",
+    };
+    static const char *jumps[] = {
+        [CC_Z]  = "jz",  [CC_NZ] = "jnz", [CC_B]  = "jb", [CC_BE] = "jbe",
+        [CC_A]  = "ja",  [CC_AE] = "jae", [CC_S]  = "js", [CC_NS] = "jns",
+    };
+    char target[160];
+    bool referenced[nlabels + 1];
+
+    stackdepth = 0;
+
+    memset(referenced, 0, sizeof referenced);
+
+    for (int i = 0; i < ncode; i++) {
+        if (code[i].op == IR_BR || code[i].op == IR_JMP)
+            referenced[code[i].label] = true;
+    }
+
+    fprintf(output, "\n_%s:\n", name);
+
+    if (saver6)
+        insn("push", "r6", NULL);
+    if (framesize)
+        insn("sub", "r7", operand(imm(framesize)));
+
+    for (int i = 0; i < ncode; i++) {
+        ir_t *ir = &code[i];
+
+        snprintf(target, sizeof target, "$__%s_%d", name, ir->label);
+
+        switch (ir->op) {
+            case IR_PARAM:
+                if (regs[ir->d.value] >= 0) {
+                    ir->a = vreg(nvregs);
+                    regs[nvregs]  = -1;
+                    slots[nvregs] = param_offset(ir->offset);
+                    move(ir->d, ir->a);
+                }
+                break;
+            case IR_MOV:
+                move(ir->d, ir->a);
+                break;
+            case IR_ADD ... IR_SAR:
+                if (ir->op == IR_ADD && ir->b.kind == IRV_IMM && (ir->b.value == 1 || ir->b.value == -1)) {
+                    move(ir->d, ir->a);
+                    insn(ir->b.value == 1 ? "inc" : "dec", operand(ir->d), NULL);
+                } else if (strcmp(operand(ir->d), operand(ir->a)) == 0) {
+                    insn(mnemonics[ir->op], operand(ir->d), operand(ir->b));
+                } else if (strcmp(operand(ir->d), operand(ir->b)) != 0) {
+                    move(ir->d, ir->a);
+                    insn(mnemonics[ir->op], operand(ir->d), operand(ir->b));
+                } else if (ir->op == IR_ADD || ir->op == IR_MUL || ir->op == IR_AND
+                        || ir->op == IR_OR || ir->op == IR_XOR) {
+                    insn(mnemonics[ir->op], operand(ir->d), operand(ir->a));
+                } else {
+                    insn("mov", tmpoperand(), operand(ir->a));
+                    insn(mnemonics[ir->op], tmpoperand(), operand(ir->b));
+                    insn("mov", operand(ir->d), tmpoperand());
+                }
+                break;
+            case IR_NEG:
+            case IR_NOT:
+                move(ir->d, ir->a);
+                insn(mnemonics[ir->op], operand(ir->d), NULL);
+                break;
+            case IR_LOAD:
+                if (regs[ir->d.value] < 0 && slots[ir->d.value] == UINT32_MAX)
+                    break;
+                insn(ir->width == 1 ? "movzx" : "mov", operand(ir->d), memory(ir->a, ir->offset));
+                break;
+            case IR_STORE:
+                if (ir->width == 1 && ir->b.kind == IRV_IMM)
+                    ir->b.value &= 0xff;
+                insn(ir->width == 1 ? "movb" : "mov", memory(ir->a, ir->offset), operand(ir->b));
+                break;
+            case IR_BR:
+                if (ir->carry) {
+                    // The flags are already set.
+                } else if (ir->test) {
+                    // Arithmetic already set ZF and SF if it wrote this operand.
+                    if (!(same(ir->a, ir->b) && ir->cc != CC_B && ir->cc != CC_BE
+                       && ir->cc != CC_A && ir->cc != CC_AE
+                       && strcmp(flagsloc, operand(ir->a)) == 0)) {
+                        insn("test", operand(ir->a), operand(ir->b));
+                    }
+                } else {
+                    insn("cmp", operand(ir->a), operand(ir->b));
+                }
+                insn(jumps[ir->cc], target, NULL);
+                break;
+            case IR_JMP:
+                // Don't jump to the next instruction.
+                if (falls_through(i + 1, ir->label))
+                    break;
+                insn("jmp", target, NULL);
+                break;
+            case IR_LABEL:
+                if (ir->label >= 0 && referenced[ir->label]) {
+                    fprintf(output, "__%s_%d:\n", name, ir->label);
+                    *flagsloc = '\0';
+                }
+                break;
+            case IR_ARG:
+                insn("push", operand(ir->a), NULL);
+                stackdepth += 4;
+                break;
+            case IR_CALL:
+                snprintf(target, sizeof target, "$_%s", ir->sym);
+                insn("call", target, NULL);
+                if (ir->nargs)
+                    insn("add", "r7", operand(imm(4 * ir->nargs)));
+                stackdepth -= 4 * ir->nargs;
+                if (ir->d.kind == IRV_REG && (regs[ir->d.value] >= 0 || slots[ir->d.value] != UINT32_MAX)) {
+                    if (strcmp(operand(ir->d), "r0") != 0)
+                        insn("mov", operand(ir->d), "r0");
+                }
+                break;
+            case IR_RET:
+                if (ir->a.kind != IRV_NONE && strcmp(operand(ir->a), "r0") != 0)
+                    insn("mov", "r0", operand(ir->a));
+                emit_epilogue();
+                break;
+        }
+    }
+}
+
+static void compile_function(void)
+{
+    type_t *ret  = parse_type();
+    func_t *func;
+    var_t   params[16];
+    int     nparams = 0;
+
+    if (tok != TOK_IDENT)
+        error(tokline, "expected function name");
+
+    if (!(func = find_func(tokstr))) {
+        func  = calloc(1, sizeof *func);
+        funcs = realloc(funcs, sizeof(func_t *) * ++nfuncs);
+        funcs[nfuncs - 1] = func;
+        func->name      = strdup(tokstr);
+        func->ret       = ret;
+        func->defined   = false;
+        func->nparams   = -1;
+    }
+
+    next();
+    expect('(', "'('");
+
+    nvregs  = 0;
+    nlabels = 0;
+    ncode   = 0;
+    depth   = 1;
+
+    // Parameters.
+    if (!(tok == TOK_VOID && lookahead() == ')') && tok != ')') {
+        do {
+            type_t *type = parse_type();
+
+            if (nparams == 16)
+                error(tokline, "too many parameters");
+
+            params[nparams].type = type;
+            params[nparams].name = NULL;
+
+            if (tok == TOK_IDENT) {
+                params[nparams].name = strdup(tokstr);
+                next();
+            }
+            nparams++;
+        } while (accept(','));
+    } else if (tok == TOK_VOID) {
+        next();
+    }
+
+    expect(')', "')'");
+
+    if (func->nparams >= 0 && func->nparams != nparams)
+        error(tokline, "conflicting types for '%s'", func->name);
+
+    func->nparams = nparams;
+
+    // This is just a prototype, e.g. for a stdlib routine.
+    if (accept(';'))
+        return;
+
+    if (func->defined)
+        error(tokline, "redefinition of '%s'", func->name);
+
+    func->defined   = true;
+    current         = func;
+
+    for (int i = 0; i < nparams; i++) {
+        var_t *var;
+
+        if (!params[i].name)
+            error(tokline, "parameter name omitted");
+
+        var = declare_var(params[i].name, params[i].type);
+        emit(IR_PARAM, vreg(var->vreg), none(), none())->offset = i;
+        free(params[i].name);
+    }
+
+    if (tok != '{')
+        error(tokline, "expected function body");
+
+    next();
+    gen_stmt(parse_block());
+
+    // Falling off the end of the function.
+    if (ncode == 0 || code[ncode - 1].op != IR_RET)
+        emit(IR_RET, none(), none(), none());
+
+    nvars = 0;
+    depth = 0;
+
+    optimize_ir();
+    merge_arms();
+    allocate_registers();
+    emit_function(func->name);
+}
+
+int main(int argc, char **argv)
+{
+    FILE   *input;
+    size_t  size = 0;
+    int     opt;
+
+    output = NULL;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+            case 'o':
+                if (!(output = fopen(optarg, "w"))) {
+                    errx(EXIT_FAILURE, "failed to open output file %s", optarg);
+                }
+                break;
+            default:
+                errx(EXIT_FAILURE, "usage: %s -o output.rs input.rc", argv[0]);
+        }
+    }
+
+    if (optind >= argc) {
+        errx(EXIT_FAILURE, "no input file specified");
+    }
+
+    if (!output) {
+        errx(EXIT_FAILURE, "no output file specified");
+    }
+
+    filename = argv[optind];
+
+    if (!(input = fopen(filename, "r"))) {
+        err(EXIT_FAILURE, "failed to open input file %s", filename);
+    }
+
+    source = NULL;
+
+    do {
+        source = realloc(source, size + BUFSIZ + 1);
+        size  += fread(source + size, 1, BUFSIZ, input);
+    } while (!feof(input) && !ferror(input));
+
+    source[size] = '\0';
+    fclose(input);
+
+    fprintf(output, "; Generated by rarcc from %s\n", filename);
+    fprintf(output, "; vim: syntax=fasm\n");
+
+    // Includes are passed through for cpp, so that the stdlib routines can be
+    // called from C.
+    for (char *p = source; *p; p = strchrnul(p, '\n'), p += !!*p) {
+        if (strncmp(p, "#include", 8) == 0) {
+            fprintf(output, "%.*s\n", (int)(strchrnul(p, '\n') - p), p);
+        }
+    }
+
+    cursor = source;
+    next();
+
+    while (tok != TOK_EOF) {
+        accept(TOK_EXTERN);
+        compile_function();
+    }
+
+    // If there's a main, then we need an entrypoint to call it, raras always
+    // begins with a jmp to _start. The stack pointer starts at the top of
+    // memory, so the ret terminates the program.
+    for (int i = 0; i < nfuncs; i++) {
+        if (strcmp(funcs[i]->name, "main") == 0 && funcs[i]->defined) {
+            if (funcs[i]->nparams != 0)
+                errx(EXIT_FAILURE, "main must not take parameters");
+
+            fprintf(output, "\n_start:\n");
+            fprintf(output, "        call    $_main\n");
+            fprintf(output, "        ret\n");
+        }
+    }
+
+    free(source);
+    fclose(output);
+    return 0;
+}
@@ -0,0 +1,514 @@
+// Execute RarVM object files without unrar.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <err.h>
+
+#include "rarvm.h"
+#include "checkpoint.h"
+#include "trace.h"
+#include "native.h"
+
+#define MAX_BREAKPOINTS     16
+
+// Instructions between keyframes in a trace.
+#define TRACE_INTERVAL      (1 << 20)
+
+// The name rar2c gives translated programs by default.
+#define NATIVE_NAME         "program"
+
+// A breakpoint replaces the instruction with a jump past the end of the
+// program, so it costs nothing until it's hit. The target says which one.
+#define TRAP_ADDRESS        0xFFFFFF00
+
+static uint32_t   breakpoints[MAX_BREAKPOINTS];
+static vm_insn_t  replaced[MAX_BREAKPOINTS];
+static unsigned   numbreakpoints;
+
+// Each segment runs from one checkpoint to the next.
+typedef struct {
+    vm_t           *vm;
+    vm_program_t   *program;
+    uint64_t        limit;          // Where the next segment starts.
+    bool            finished;       // Terminated, rather than reaching limit.
+    uint64_t        icount;         // The state at the start, to check the previous segment.
+    uint32_t        r[8];
+    uint32_t        flags;
+    uint32_t        ip;
+    uint8_t        *memory;
+    uint32_t       *immediates;
+} segment_t;
+
+static segment_t *segments;
+static unsigned   numsegments;
+static unsigned   nextsegment;
+
+static void set_breakpoints(vm_program_t *program, bool enabled)
+{
+    for (unsigned i = 0; i < numbreakpoints; i++) {
+        vm_insn_t *insn = &program->insns[breakpoints[i]];
+
+        if (enabled) {
+            replaced[i] = *insn;
+
+            memset(insn, 0, sizeof *insn);
+
+            insn->opcode    = VM_JMP;
+            insn->op1.type  = VM_OPINT;
+            insn->op1.value = TRAP_ADDRESS + i;
+        } else {
+            *insn = replaced[i];
+        }
+    }
+}
+
+static void save_checkpoint(checkpoint_t *checkpoint, vm_t *vm, vm_program_t *program)
+{
+    if (!checkpoint_save(checkpoint, vm, program)) {
+        errx(EXIT_FAILURE, "failed to write checkpoint at instruction %" PRIu64, vm->icount);
+    }
+}
+
+// Like vm_execute, but a checkpoint is saved at every breakpoint and every
+// interval instructions if output is specified.
+static bool run(vm_t *vm,
+                vm_program_t *program,
+                uint64_t maxinsns,
+                checkpoint_t *output,
+                uint64_t interval,
+                bool resumed)
+{
+    uint64_t next = interval ? (vm->icount / interval + 1) * interval : UINT64_MAX;
+
+    // If we resumed from a breakpoint, it was already saved.
+    for (unsigned i = 0; output && resumed && vm->icount < maxinsns && i < numbreakpoints; i++) {
+        if (breakpoints[i] == vm->ip) {
+            if (vm_execute(vm, program, vm->icount + 1))
+                return true;
+            break;
+        }
+    }
+
+    while (true) {
+        bool     result;
+        uint32_t trap;
+
+        if (output)
+            set_breakpoints(program, true);
+
+        result = vm_execute(vm, program, next < maxinsns ? next : maxinsns);
+
+        if (output)
+            set_breakpoints(program, false);
+
+        trap = vm->ip - TRAP_ADDRESS;
+
+        if (result && output && trap < numbreakpoints) {
+            // The jump doesn't count, the instruction it replaced hasn't run.
+            vm->ip = breakpoints[trap];
+            vm->icount--;
+
+            save_checkpoint(output, vm, program);
+
+            if (vm_execute(vm, program, vm->icount + 1))
+                return true;
+
+            continue;
+        }
+
+        if (result || vm->icount >= maxinsns)
+            return result;
+
+        save_checkpoint(output, vm, program);
+
+        next += interval;
+    }
+}
+
+static void * segment_worker(void *arg)
+{
+    unsigned i;
+
+    while ((i = __sync_fetch_and_add(&nextsegment, 1)) < numsegments) {
+        segments[i].finished = vm_execute(segments[i].vm, segments[i].program, segments[i].limit);
+    }
+
+    return NULL;
+}
+
+// Check a segment ended in exactly the state the next one started in.
+static bool segment_matches(const segment_t *segment, const segment_t *next)
+{
+    const vm_t *vm = segment->vm;
+
+    if (segment->finished
+     || vm->icount != next->icount
+     || vm->ip != next->ip
+     || vm->flags != next->flags
+     || memcmp(vm->r, next->r, sizeof vm->r) != 0
+     || memcmp(vm->mem, next->memory, VM_MEMSIZE + 4) != 0) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < segment->program->count; i++) {
+        if (segment->program->insns[i].op1.value != next->immediates[i * 2]
+         || segment->program->insns[i].op2.value != next->immediates[i * 2 + 1]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void start_segment(segment_t *segment)
+{
+    vm_t *vm = segment->vm;
+
+    memcpy(segment->r, vm->r, sizeof segment->r);
+
+    segment->icount     = vm->icount;
+    segment->flags      = vm->flags;
+    segment->ip         = vm->ip;
+    segment->memory     = malloc(VM_MEMSIZE + 4);
+    segment->immediates = malloc(segment->program->count * 2 * sizeof(uint32_t));
+
+    memcpy(segment->memory, vm->mem, VM_MEMSIZE + 4);
+
+    for (uint32_t i = 0; i < segment->program->count; i++) {
+        segment->immediates[i * 2]      = segment->program->insns[i].op1.value;
+        segment->immediates[i * 2 + 1]  = segment->program->insns[i].op2.value;
+    }
+}
+
+// Run the program from the start, and from every checkpoint at once. Each
+// segment assumes the checkpoint it starts from is right, so they're only
+// valid up to the first one that doesn't end where the next begins. From
+// there the program is run normally. Returns the segment with the result.
+static segment_t * speculate(const char *filename,
+                             const char *checkpoints,
+                             const uint8_t *block,
+                             uint32_t blocksize,
+                             uint64_t maxinsns,
+                             long numthreads,
+                             bool *result,
+                             unsigned *verified)
+{
+    checkpoint_t *input;
+    vm_program_t *program;
+    pthread_t    *threads;
+    unsigned      i;
+
+    if (!vm_program_load(&program, filename) || !checkpoint_open(&input, checkpoints, program))
+        errx(EXIT_FAILURE, "failed to open checkpoints %s", checkpoints);
+
+    if (!checkpoint_matches(input))
+        warnx("checkpoints are for a different program, only matching segments are used");
+
+    // The first segment starts from scratch.
+    for (numsegments = 0; true; numsegments++) {
+        segment_t *segment;
+
+        segments = realloc(segments, (numsegments + 1) * sizeof(segment_t));
+        segment  = memset(&segments[numsegments], 0, sizeof(segment_t));
+
+        if (!vm_create(&segment->vm) || !vm_program_load(&segment->program, filename))
+            errx(EXIT_FAILURE, "failed to allocate segment %u", numsegments);
+
+        if (numsegments == 0) {
+            vm_reset(segment->vm, segment->program, block, blocksize);
+        } else if (!checkpoint_load(input, segment->vm, segment->program)) {
+            vm_destroy(segment->vm);
+            vm_program_destroy(segment->program);
+            break;
+        }
+
+        start_segment(segment);
+    }
+
+    checkpoint_close(input);
+    vm_program_destroy(program);
+
+    for (i = 0; i < numsegments; i++) {
+        segments[i].limit = i + 1 < numsegments && segments[i + 1].icount < maxinsns
+                          ? segments[i + 1].icount
+                          : maxinsns;
+    }
+
+    threads = calloc(numthreads, sizeof(pthread_t));
+
+    for (long t = 0; t < numthreads; t++) {
+        if (pthread_create(&threads[t], NULL, segment_worker, NULL) != 0) {
+            errx(EXIT_FAILURE, "failed to create worker thread");
+        }
+    }
+
+    for (long t = 0; t < numthreads; t++)
+        pthread_join(threads[t], NULL);
+
+    free(threads);
+
+    for (i = 0; i + 1 < numsegments; i++) {
+        if (!segment_matches(&segments[i], &segments[i + 1]))
+            break;
+    }
+
+    *verified = i;
+
+    // Either every segment matched and the last has the answer, or this one
+    // went somewhere else and has to be finished.
+    if (i + 1 < numsegments) {
+        *result = segments[i].finished || vm_execute(segments[i].vm, segments[i].program, maxinsns);
+    } else {
+        *result = segments[i].finished;
+    }
+
+    return &segments[i];
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-s] [-n maxinsns] [-i block] [-c checkpoints [-a address]... [-e interval]]\n"
+                    "       [-t trace [-k interval]] [-x library.so] [-r checkpoints [-R index] | -V checkpoints [-j threads]] file.ro\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    vm_program_t  *program;
+    vm_t          *vm;
+    checkpoint_t  *output     = NULL;
+    checkpoint_t  *input      = NULL;
+    trace_t       *trace      = NULL;
+    const char    *record     = NULL;
+    uint64_t       keyframes  = TRACE_INTERVAL;
+    native_t      *native     = NULL;
+    const char    *library    = NULL;
+    segment_t     *segment    = NULL;
+    const char    *resume     = NULL;
+    const char    *verify     = NULL;
+    FILE          *blockfile  = NULL;
+    uint8_t       *block      = NULL;
+    uint32_t       blocksize  = 0;
+    uint64_t       maxinsns   = VM_MAXINSNS;
+    uint64_t       interval   = 0;
+    uint64_t       index      = UINT64_MAX;
+    long           numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned       verified   = 0;
+    const char    *save       = NULL;
+    bool           stats      = false;
+    bool           result;
+    const uint8_t *data;
+    uint32_t       size;
+    int            opt;
+
+    while ((opt = getopt(argc, argv, "si:n:c:a:e:r:R:V:j:t:k:x:")) != -1) {
+        switch (opt) {
+            case 's':
+                stats = true;
+                break;
+            case 'n':
+                maxinsns = strtoull(optarg, NULL, 0);
+                break;
+            case 'i':
+                if (!(blockfile = fopen(optarg, "r"))) {
+                    err(EXIT_FAILURE, "failed to open input block %s", optarg);
+                }
+                break;
+            case 'c':
+                save = optarg;
+                break;
+            case 'a':
+                if (numbreakpoints == MAX_BREAKPOINTS) {
+                    errx(EXIT_FAILURE, "too many checkpoint addresses, the limit is %u", MAX_BREAKPOINTS);
+                }
+                breakpoints[numbreakpoints++] = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                interval = strtoull(optarg, NULL, 0);
+                break;
+            case 'r':
+                resume = optarg;
+                break;
+            case 'R':
+                index = strtoull(optarg, NULL, 0);
+                break;
+            case 'V':
+                verify = optarg;
+                break;
+            case 'j':
+                numthreads = strtol(optarg, NULL, 0);
+                break;
+            case 't':
+                record = optarg;
+                break;
+            case 'k':
+                keyframes = strtoull(optarg, NULL, 0);
+                break;
+            case 'x':
+                library = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc) {
+        errx(EXIT_FAILURE, "no object file specified");
+    }
+
+    if ((numbreakpoints || interval) && !save) {
+        errx(EXIT_FAILURE, "checkpoints need a file to be written to, use -c");
+    }
+
+    if (verify && (resume || save)) {
+        errx(EXIT_FAILURE, "-V can't be combined with -r or -c");
+    }
+
+    if (record && (save || verify)) {
+        errx(EXIT_FAILURE, "-t can't be combined with -c or -V");
+    }
+
+    if (library && (save || verify || record)) {
+        errx(EXIT_FAILURE, "-x can't be combined with -c, -V or -t");
+    }
+
+    if (keyframes == 0) {
+        errx(EXIT_FAILURE, "the keyframe interval must be at least one instruction");
+    }
+
+    if (numthreads < 1)
+        numthreads = 1;
+
+    if (!vm_program_load(&program, argv[optind])) {
+        errx(EXIT_FAILURE, "failed to load rar object file %s", argv[optind]);
+    }
+
+    for (unsigned i = 0; i < numbreakpoints; i++) {
+        if (breakpoints[i] >= program->count)
+            errx(EXIT_FAILURE, "checkpoint address %u is outside the program", breakpoints[i]);
+
+        for (unsigned j = 0; j < i; j++) {
+            if (breakpoints[j] == breakpoints[i]) {
+                breakpoints[i--] = breakpoints[--numbreakpoints];
+                break;
+            }
+        }
+    }
+
+    // This must be before any checkpoint changes the immediates.
+    if (library && !native_load(&native, library, NATIVE_NAME, program)) {
+        errx(EXIT_FAILURE, "failed to load %s, or it wasn't translated from %s", library, argv[optind]);
+    }
+
+    // The block to filter is placed at the start of memory.
+    if (blockfile) {
+        block     = malloc(VM_GLOBALMEMADDR);
+        blocksize = fread(block, 1, VM_GLOBALMEMADDR, blockfile);
+        fclose(blockfile);
+    }
+
+    vm_create(&vm);
+    vm_reset(vm, program, block, blocksize);
+
+    // Open the input first, in case it's also the output.
+    if (resume) {
+        if (!checkpoint_open(&input, resume, program))
+            errx(EXIT_FAILURE, "failed to open checkpoints %s", resume);
+
+        if (!checkpoint_matches(input))
+            warnx("checkpoints in %s are for a different program", resume);
+
+        while (checkpoint_count(input) <= index && checkpoint_load(input, vm, program))
+            ;
+
+        if (checkpoint_count(input) == 0 || (index != UINT64_MAX && checkpoint_count(input) <= index))
+            errx(EXIT_FAILURE, "checkpoint %" PRIu64 " not found in %s", index, resume);
+
+        checkpoint_close(input);
+    }
+
+    if (save && !checkpoint_create(&output, save, program)) {
+        errx(EXIT_FAILURE, "failed to create checkpoint file %s", save);
+    }
+
+    if (record && !trace_create(&trace, record, keyframes)) {
+        errx(EXIT_FAILURE, "failed to create trace file %s", record);
+    }
+
+    if (record) {
+        result = trace_execute(trace, vm, program, maxinsns);
+
+        if (!trace_close(trace))
+            errx(EXIT_FAILURE, "failed to write trace file %s", record);
+    } else if (verify) {
+        segment = speculate(argv[optind], verify, block, blocksize, maxinsns, numthreads, &result, &verified);
+
+        vm_destroy(vm);
+        vm_program_destroy(program);
+
+        vm      = segment->vm;
+        program = segment->program;
+    } else if (native) {
+        result = native_execute(native, vm, program, maxinsns);
+    } else {
+        result = run(vm, program, maxinsns, output, interval, resume != NULL);
+    }
+
+    if (stats) {
+        fprintf(stderr, "instructions: %" PRIu64 "\n", vm->icount);
+        fprintf(stderr, "memory operands: %" PRIu64 "\n", vm->mcount);
+
+        if (output)
+            fprintf(stderr, "checkpoints: %" PRIu64 "\n", checkpoint_count(output));
+        if (verify)
+            fprintf(stderr, "segments: %u, verified %u\n", numsegments, verified);
+    }
+
+    if (output && !checkpoint_close(output)) {
+        errx(EXIT_FAILURE, "failed to write checkpoint file %s", save);
+    }
+
+    // Rar still writes the output block of a program that didn't terminate
+    // normally.
+    vm_getoutput(vm, &data, &size);
+    fwrite(data, 1, size, stdout);
+
+    if (verify) {
+        for (unsigned i = 0; i < numsegments; i++) {
+            vm_destroy(segments[i].vm);
+            vm_program_destroy(segments[i].program);
+            free(segments[i].memory);
+            free(segments[i].immediates);
+        }
+
+        free(segments);
+    } else {
+        vm_destroy(vm);
+        vm_program_destroy(program);
+    }
+
+    if (native)
+        native_unload(native);
+
+    free(block);
+
+    if (!result) {
+        errx(EXIT_FAILURE, "program exceeded %" PRIu64 " instructions", maxinsns);
+    }
+
+    return 0;
+}
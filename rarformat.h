@@ -0,0 +1,105 @@
+#ifndef __RARFORMAT_H
+#define __RARFORMAT_H
+
+// RAR 2.9/3.x archive structures, see RARTemplate.bt.
+
+#pragma pack(push, 1)
+
+static const uint8_t kRarSignature[] = { 0x52, 0x61, 0x72, 0x21, 0x1a, 0x07, 0x00 };
+
+enum {
+    TYPE_MARK       = 0x72,
+    TYPE_MAIN       = 0x73,
+    TYPE_FILE       = 0x74,
+    TYPE_COMM       = 0x75,
+    TYPE_AV         = 0x76,
+    TYPE_SUB        = 0x77,
+    TYPE_PROTECT    = 0x78,
+    TYPE_SIGN       = 0x79,
+    TYPE_NEWSUB     = 0x7A,
+    TYPE_ENDARC     = 0x7B,
+};
+
+enum {
+    HOST_MSDOS      = 0x00,
+    HOST_OS2        = 0x01,
+    HOST_WIN32      = 0x02,
+    HOST_UNIX       = 0x03,
+    HOST_MACOS      = 0x04,
+    HOST_BEOS       = 0x05,
+};
+
+enum {
+    MHD_VOLUME          = 0x0001,
+    MHD_COMMENT         = 0x0002,
+    MHD_LOCK            = 0x0004,
+    MHD_SOLID           = 0x0008,
+    MHD_PACK_COMMENT    = 0x0010,
+    MHD_AV              = 0x0020,
+    MHD_PROTECT         = 0x0040,
+    MHD_PASSWORD        = 0x0080,
+    MHD_FIRSTVOLUME     = 0x0100,
+    MHD_ENCRYPTVER      = 0x0200,
+};
+
+enum {
+    LHD_SPLIT_BEFORE    = 0x0001,
+    LHD_SPLIT_AFTER     = 0x0002,
+    LHD_PASSWORD        = 0x0004,
+    LHD_COMMENT         = 0x0008,
+    LHD_SOLID           = 0x0010,
+    LHD_DIRECTORY       = 0x00E0,   // All of the dictionary size bits set.
+    LHD_LARGE           = 0x0100,
+    LHD_UNICODE         = 0x0200,
+    LHD_SALT            = 0x0400,
+    LHD_VERSION         = 0x0800,
+    LHD_EXTTIME         = 0x1000,
+    LHD_EXTFLAGS        = 0x2000,
+};
+
+// Any block may have these flags.
+enum {
+    SKIP_IF_UNKNOWN     = 0x4000,
+    LONG_BLOCK          = 0x8000,   // A 32bit data size follows the header.
+};
+
+// Compression methods.
+enum {
+    METHOD_STORE        = 0x30,
+    METHOD_BEST         = 0x35,
+};
+
+typedef struct {
+    uint16_t    crc;
+    uint8_t     type;
+    uint16_t    flags;
+    uint16_t    size;
+} hdr_t;
+
+struct mainhdr {
+    hdr_t       hdr;
+    uint16_t    HighPosAv;
+    uint32_t    PosAv;
+    uint8_t     EncryptVer;
+};
+
+struct filehdr {
+    hdr_t       hdr;
+    uint32_t    PackSize;
+    uint32_t    UnpSize;
+    uint8_t     HostOS;
+    uint32_t    FileCRC;
+    uint32_t    FileTime;
+    uint8_t     UnpVer;
+    uint8_t     Method;
+    uint16_t    NameSize;
+    union {
+        uint32_t    FileAttr;
+        uint32_t    SubFlags;
+    };
+    uint8_t     FileName[6];        // HighPackSize and HighUnpSize come first if LHD_LARGE.
+};
+
+#pragma pack(pop)
+
+#endif
@@ -0,0 +1,433 @@
+// Coverage guided fuzzing harness for RarVM programs.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <err.h>
+#include <sys/shm.h>
+#include <sys/wait.h>
+
+#include "bitbuffer.h"
+#include "rarvm.h"
+#include "lexer.h"
+#include "rar.h"
+
+// There are two input formats. Without a program, the input is the bytecode
+// of a filter, in the same format as an object file. The check byte is
+// ignored, so that .ro files can be used as seeds. With a program, the input
+// is the initial state, r0-r6 followed by the block to filter.
+#define STATE_REGS_SIZE     (sizeof(uint32_t) * REG7)
+
+// Inputs larger than this are truncated.
+#define MAX_INPUT_SIZE      (VM_GLOBALMEMADDR + STATE_REGS_SIZE)
+
+// The default instruction limit is much lower than rar uses, infinite loops
+// are common and would dominate the execution time.
+#define DEFAULT_MAXINSNS    100000
+
+// These are how afl talks to the forkserver.
+#define FORKSRV_FD          198
+#define SHM_ENV_VAR         "__AFL_SHM_ID"
+#define PERSIST_CYCLES      10000
+
+// afl looks for these strings to decide how to run the target.
+static const char kAflSignatures[] __attribute__((used)) = "##SIG_AFL_PERSISTENT##" SHM_ENV_VAR;
+
+#ifdef LIBFUZZER
+// libFuzzer treats anything in this section as extra coverage counters.
+static uint8_t coverage[VM_COVERAGE_SIZE] __attribute__((section("__libfuzzer_extra_counters")));
+#else
+static uint8_t coverage[VM_COVERAGE_SIZE];
+#endif
+
+static struct {
+    vm_program_t   *program;        // For state inputs, the program to run.
+    vm_insn_t      *insns;          // The original instructions, immediates are writable.
+    vm_t           *vm;
+    uint8_t        *snapshot;
+    uint64_t        maxinsns;
+    bool            abort_on_limit; // Treat exceeding the limit as a crash, e.g. stdlib _error.
+    bool            roundtrip;      // Check the assembler can reproduce every instruction.
+} fuzz = {
+    .maxinsns = DEFAULT_MAXINSNS,
+};
+
+static bool operand_equal(const vm_operand_t *a, const vm_operand_t *b)
+{
+    if (a->type != b->type)
+        return false;
+
+    switch (a->type) {
+        case VM_OPREG:      return a->reg == b->reg;
+        case VM_OPINT:      return a->value == b->value;
+        case VM_OPREGMEM:   return a->reg == b->reg && a->value == b->value;
+        case VM_OPMEM:      return a->value == b->value;
+    }
+
+    return true;
+}
+
+// Disassemble the instruction, then assemble it again with the same routines
+// as raras and verify it decodes to the same thing. Returns false if the
+// instruction can't be expressed in assembly.
+static bool roundtrip_insn(const vm_insn_t *insn)
+{
+    uint8_t        flags    = vm_opcode_flags_table[insn->opcode];
+    bool           jump     = flags & (VMCF_JUMP | VMCF_PROC);
+    vm_insn_t      absolute = *insn;
+    char           line[192];
+    bitbuf_t      *output;
+    const uint8_t *bits;
+    uint32_t       size;
+    uint8_t        code[64] = {0};
+    vm_program_t  *program;
+
+    // Rar supports a byte form of every arithmetic instruction, but there are
+    // only mnemonics for a few of them.
+    if (!vm_mnemonic(insn->opcode, insn->bytemode))
+        return false;
+
+    // Jump targets are encoded as absolute addresses, but the decoder treats
+    // anything that's negative as a signed value as relative, so those can't
+    // be encoded at all.
+    if (jump && insn->op1.type == VM_OPINT) {
+        if (insn->op1.value + 256 < 256 || insn->op1.value + 256 > INT32_MAX)
+            return false;
+        absolute.op1.value += 256;
+    }
+
+    vm_format_insn(line, sizeof line, &absolute);
+
+    bitbuf_create(&output);
+    bitbuf_append(output, 0, 1);    // DataFlag
+    rar_assemble_line(line, output, NULL);
+
+    if (bitbuf_numbits(output) % 8)
+        bitbuf_append(output, 0, 8 - bitbuf_numbits(output) % 8);
+
+    bitbuf_getbits(output, &bits, &size);
+
+    if (size >= sizeof code)
+        errx(EXIT_FAILURE, "unexpectedly long encoding for %s", line);
+
+    memcpy(code + 1, bits, size);
+
+    for (uint32_t i = 0; i < size; i++)
+        code[0] ^= bits[i];
+
+    bitbuf_destroy(output);
+
+    if (!vm_program_decode(&program, code, size + 1))
+        errx(EXIT_FAILURE, "failed to decode reassembled %s", line);
+
+    if (program->insns[0].opcode != insn->opcode
+     || program->insns[0].bytemode != insn->bytemode
+     || ((flags & (VMCF_OP1 | VMCF_OP2)) && !operand_equal(&program->insns[0].op1, &insn->op1))
+     || ((flags & VMCF_OP2) && !operand_equal(&program->insns[0].op2, &insn->op2))) {
+        fprintf(stderr, "instruction at bit %u does not survive reassembly as '%s'\n", insn->bitpos, line);
+        abort();
+    }
+
+    vm_program_destroy(program);
+    return true;
+}
+
+// Execute one input, this is the persistent loop body.
+static int fuzz_one(const uint8_t *data, size_t size)
+{
+    static uint8_t code[MAX_INPUT_SIZE];
+    vm_program_t  *program = fuzz.program;
+    uint32_t       initr[REG7];
+    bool           result;
+
+    if (size > MAX_INPUT_SIZE)
+        size = MAX_INPUT_SIZE;
+
+    vm_restore(fuzz.vm, fuzz.snapshot);
+
+    if (program) {
+        if (size < STATE_REGS_SIZE)
+            return 0;
+
+        memcpy(initr, data, STATE_REGS_SIZE);
+        memcpy(program->insns, fuzz.insns, sizeof(vm_insn_t) * program->count);
+
+        vm_prepare(fuzz.vm, program, initr, data + STATE_REGS_SIZE, size - STATE_REGS_SIZE);
+    } else {
+        if (size < 2)
+            return 0;
+
+        // Fix the check byte, otherwise almost every input is rejected.
+        memcpy(code, data, size);
+
+        code[0] = 0;
+
+        for (size_t i = 1; i < size; i++)
+            code[0] ^= code[i];
+
+        if (!vm_program_decode(&program, code, size))
+            return 0;
+
+        if (fuzz.roundtrip) {
+            for (uint32_t i = 0; i < program->count - 1; i++)
+                roundtrip_insn(&program->insns[i]);
+        }
+
+        vm_prepare(fuzz.vm, program, NULL, NULL, 0);
+    }
+
+    result = vm_execute(fuzz.vm, program, fuzz.maxinsns);
+
+    if (program != fuzz.program)
+        vm_program_destroy(program);
+
+    if (!result && fuzz.abort_on_limit) {
+        fprintf(stderr, "program exceeded %llu instructions\n", (unsigned long long) fuzz.maxinsns);
+        abort();
+    }
+
+    return 0;
+}
+
+static void fuzz_init(const char *programfile)
+{
+    if (programfile) {
+        if (!vm_program_load(&fuzz.program, programfile)) {
+            errx(EXIT_FAILURE, "failed to load rar object file %s", programfile);
+        }
+
+        fuzz.insns = malloc(sizeof(vm_insn_t) * fuzz.program->count);
+
+        memcpy(fuzz.insns, fuzz.program->insns, sizeof(vm_insn_t) * fuzz.program->count);
+    }
+
+    vm_create(&fuzz.vm);
+
+    // Memory starts clear, every execution begins from this snapshot and only
+    // the pages it touched need to be restored.
+    vm_snapshot(fuzz.vm, &fuzz.snapshot);
+
+    fuzz.vm->coverage = coverage;
+}
+
+#ifdef LIBFUZZER
+
+// libFuzzer owns the command line, so options are in the environment.
+int LLVMFuzzerInitialize(int *argc, char ***argv)
+{
+    fuzz.abort_on_limit = getenv("RARFUZZ_ABORT") != NULL;
+    fuzz.roundtrip      = getenv("RARFUZZ_ROUNDTRIP") != NULL;
+
+    if (getenv("RARFUZZ_MAXINSNS"))
+        fuzz.maxinsns = strtoull(getenv("RARFUZZ_MAXINSNS"), NULL, 0);
+
+    fuzz_init(getenv("RARFUZZ_PROGRAM"));
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    return fuzz_one(data, size);
+}
+
+#else
+
+static size_t read_input(const char *filename, uint8_t *buf, size_t size)
+{
+    FILE   *input = filename ? fopen(filename, "r") : stdin;
+    size_t  count;
+
+    if (!input)
+        err(EXIT_FAILURE, "failed to open input file %s", filename);
+
+    if (!filename)
+        rewind(input);
+
+    count = fread(buf, 1, size, input);
+
+    if (filename)
+        fclose(input);
+
+    return count;
+}
+
+// The afl forkserver protocol. The parent stays here forever forking children,
+// or resuming a stopped child in persistent mode. Returns true in the child,
+// or false if afl isn't listening.
+static bool afl_forkserver(void)
+{
+    static uint8_t hello[4];
+    bool           stopped = false;
+    pid_t          child   = -1;
+    int            status;
+
+    if (write(FORKSRV_FD + 1, hello, sizeof hello) != sizeof hello)
+        return false;
+
+    while (true) {
+        uint32_t killed;
+
+        if (read(FORKSRV_FD, &killed, sizeof killed) != sizeof killed)
+            _exit(EXIT_FAILURE);
+
+        // A stopped child was killed by a timeout, so reap it.
+        if (stopped && killed) {
+            waitpid(child, &status, 0);
+            stopped = false;
+        }
+
+        if (!stopped) {
+            if ((child = fork()) < 0)
+                _exit(EXIT_FAILURE);
+
+            if (child == 0) {
+                close(FORKSRV_FD);
+                close(FORKSRV_FD + 1);
+                return true;
+            }
+        } else {
+            kill(child, SIGCONT);
+            stopped = false;
+        }
+
+        if (write(FORKSRV_FD + 1, &child, sizeof child) != sizeof child)
+            _exit(EXIT_FAILURE);
+
+        if (waitpid(child, &status, WUNTRACED) < 0)
+            _exit(EXIT_FAILURE);
+
+        stopped = WIFSTOPPED(status);
+
+        if (write(FORKSRV_FD + 1, &status, sizeof status) != sizeof status)
+            _exit(EXIT_FAILURE);
+    }
+}
+
+// Run under afl, the input is either the named file or stdin.
+static void afl_main(const char *filename)
+{
+    static uint8_t buf[MAX_INPUT_SIZE];
+    uint8_t       *shm;
+    int            cycles;
+
+    if ((shm = shmat(atoi(getenv(SHM_ENV_VAR)), NULL, 0)) == (void *) -1)
+        err(EXIT_FAILURE, "failed to attach afl shared memory");
+
+    // The coverage goes straight into the afl bitmap.
+    fuzz.vm->coverage = shm;
+
+    // Without a forkserver nobody would resume a stopped child, so there's
+    // only one input.
+    cycles = afl_forkserver() ? PERSIST_CYCLES : 1;
+
+    for (int i = 0; i < cycles; i++) {
+        size_t size = read_input(filename, buf, sizeof buf);
+
+        fuzz_one(buf, size);
+
+        // Tell the forkserver this input is finished, unless it's the last
+        // one. Then the exit status is reported for it instead, and the next
+        // input goes to a new child.
+        if (i < cycles - 1)
+            raise(SIGSTOP);
+    }
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-a] [-r] [-n maxinsns] [-p program.ro] [-b iterations] [input...]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    static uint8_t  buf[MAX_INPUT_SIZE];
+    const char     *programfile = NULL;
+    uint64_t        iterations  = 0;
+    struct timespec start;
+    struct timespec end;
+    int             opt;
+
+    while ((opt = getopt(argc, argv, "arn:p:b:h")) != -1) {
+        switch (opt) {
+            case 'a':
+                fuzz.abort_on_limit = true;
+                break;
+            case 'r':
+                fuzz.roundtrip = true;
+                break;
+            case 'n':
+                fuzz.maxinsns = strtoull(optarg, NULL, 0);
+                break;
+            case 'p':
+                programfile = optarg;
+                break;
+            case 'b':
+                iterations = strtoull(optarg, NULL, 0);
+                break;
+            case 'h':
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    fuzz_init(programfile);
+
+    if (getenv(SHM_ENV_VAR)) {
+        afl_main(optind < argc ? argv[optind] : NULL);
+        return 0;
+    }
+
+    if (optind == argc) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    // Otherwise just run each input, which is useful for reproducing crashes,
+    // or with -b to measure the execution rate.
+    for (int i = optind; i < argc; i++) {
+        size_t   size  = read_input(argv[i], buf, sizeof buf);
+        unsigned edges = 0;
+        double   elapsed;
+
+        memset(coverage, 0, sizeof coverage);
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        for (uint64_t n = 0; n < (iterations ? iterations : 1); n++)
+            fuzz_one(buf, size);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        for (int j = 0; j < VM_COVERAGE_SIZE; j++)
+            edges += coverage[j] != 0;
+
+        elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+        printf("%s: %llu instructions, %u edges", argv[i], (unsigned long long) fuzz.vm->icount, edges);
+
+        if (iterations) {
+            printf(", %.0f execs/s", iterations / elapsed);
+        }
+
+        printf("\n");
+    }
+
+    return 0;
+}
+
+#endif
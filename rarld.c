@@ -7,79 +7,386 @@
 // (at your option) any later version.
 //
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
+#include <getopt.h>
 #include <err.h>
 #include <zlib.h>
 
 #include "bitbuffer.h"
+#include "rarformat.h"
+#include "rarvm.h"
 
-#pragma pack(1)
-
-const uint8_t kRarSignature[] = { 0x52, 0x61, 0x72, 0x21, 0x1a, 0x07, 0x00 };
+// Number of symbols in each of the Huffman tables, see unpack.c.
+#define NC              299
+#define DC              60
+#define LDC             17
+#define RC              28
+#define BC              20
+#define HUFF_TABLE_SIZE (NC + DC + LDC + RC)
 
+// Special symbols in the main table.
 enum {
-    TYPE_MARK       = 0x72,
-    TYPE_MAIN       = 0x73,
-    TYPE_FILE       = 0x74,
-    TYPE_COMM       = 0x75,
-    TYPE_AV         = 0x76,
-    TYPE_SUB        = 0x77,
-    TYPE_PROTECT    = 0x78,
-    TYPE_SIGN       = 0x79,
-    TYPE_NEWSUB     = 0x7A,
-    TYPE_ENDARC     = 0x7B,
+    SYM_ENDBLOCK    = 256,
+    SYM_VMCODE      = 257,
 };
 
+// Flags in the first byte of a VM code block.
 enum {
-    HOST_MSDOS      = 0x00,
-    HOST_OS2        = 0x01,
-    HOST_WIN32      = 0x02,
-    HOST_UNIX       = 0x03,
-    HOST_MACOS      = 0x04,
-    HOST_BEOS       = 0x05,
+    VM_FILTNUM      = 0x80, // Filter number follows, otherwise the last one.
+    VM_BLOCKSTARTHI = 0x40, // Add 258 to BlockStart.
+    VM_BLOCKSIZE    = 0x20, // BlockLength follows, otherwise the last one.
+    VM_INITREGS     = 0x10, // Initial Register State Follows.
+    VM_GLOBALDATA   = 0x08, // Global data follows.
 };
 
+// A single execution of the program, over one block of data.
 typedef struct {
-    uint16_t    crc;
-    uint8_t     type;
-    uint16_t    flags;
-    uint16_t    size;
-} hdr_t;
-
-struct mainhdr {
-    hdr_t       hdr;
-    uint16_t    HighPosAv;
-    uint32_t    PosAv;
-    uint8_t     EncryptVer;
-};
+    const char *name;
+    uint8_t    *block;
+    uint32_t    blocksize;
+    uint8_t     initmask;
+    uint32_t    initr[7];
+    uint8_t    *data;
+    uint32_t    datasize;
+} invocation_t;
 
-struct filehdr {
-    hdr_t       hdr;
-    uint32_t    PackSize;
-    uint32_t    UnpSize;
-    uint8_t     HostOS;
-    uint32_t    FileCRC;
-    uint32_t    FileTime;
-    uint8_t     UnpVer;
-    uint8_t     Method;
-    uint16_t    NameSize;
-    union {
-        uint32_t    FileAttr;
-        uint32_t    SubFlags;
-    };
-    uint8_t     FileName[6];
-};
+static uint8_t * read_file(const char *filename, uint32_t *size, uint32_t maxsize)
+{
+    FILE    *file;
+    uint8_t *buf;
+
+    if (!(file = fopen(filename, "r"))) {
+        err(EXIT_FAILURE, "failed to open %s", filename);
+    }
+
+    buf   = malloc(maxsize + 1);
+    *size = fread(buf, 1, maxsize + 1, file);
+
+    fclose(file);
+
+    if (*size > maxsize) {
+        errx(EXIT_FAILURE, "%s is too large, the limit is %#x bytes", filename, maxsize);
+    }
+
+    return buf;
+}
+
+// Parse a register assignment like r0=1234.
+static void parse_register(invocation_t *invocation, const char *assignment)
+{
+    char    *value;
+    unsigned reg;
 
+    if (sscanf(assignment, "r%u=", &reg) != 1 || reg > REG6 || !(value = strchr(assignment, '='))) {
+        errx(EXIT_FAILURE, "invalid register assignment %s, expected r0-r6=value", assignment);
+    }
+
+    invocation->initmask   |= 1 << reg;
+    invocation->initr[reg]  = strtoul(value + 1, NULL, 0);
+}
+
+// Parse a block specification, file[,r0=value...][,data=file].
+static void parse_block(invocation_t *invocation, char *spec)
+{
+    char *saveptr;
+    char *option;
+
+    invocation->name  = strtok_r(spec, ",", &saveptr);
+    invocation->block = read_file(invocation->name, &invocation->blocksize, VM_GLOBALMEMADDR);
+
+    while ((option = strtok_r(NULL, ",", &saveptr))) {
+        if (strncmp(option, "data=", 5) == 0) {
+            free(invocation->data);
+            invocation->data = read_file(option + 5,
+                                         &invocation->datasize,
+                                         VM_GLOBALMEMSIZE - VM_FIXEDGLOBALSIZE);
+        } else {
+            parse_register(invocation, option);
+        }
+    }
+}
+
+// Encode an integer the way RarVM::ReadData expects, using the smallest form.
+static void append_data(bitbuf_t *output, uint32_t value)
+{
+    if (value < 16) {
+        bitbuf_append(output, 0b00, 2);
+        bitbuf_append(output, value, 4);
+    } else if (value < 256) {
+        bitbuf_append(output, 0b01, 2);
+        bitbuf_append(output, value, 8);
+    } else if (value >= 0xffffff00) {
+        bitbuf_append(output, 0b01, 2);
+        bitbuf_append(output, 0, 4);
+        bitbuf_append(output, value & 0xff, 8);
+    } else if (value < 65536) {
+        bitbuf_append(output, 0b10, 2);
+        bitbuf_append(output, value, 16);
+    } else {
+        bitbuf_append(output, 0b11, 2);
+        bitbuf_append(output, value, 32);
+    }
+}
+
+// Calculate Huffman code lengths no longer than maxlen. This is the simple
+// textbook algorithm, but the alphabets are tiny so it doesn't matter. If the
+// code is too long, the frequencies are flattened until it fits.
+static void build_lengths(const uint32_t *freqs, uint8_t *lengths, int count, int maxlen)
+{
+    uint32_t weight[count * 2];
+    int      parent[count * 2];
+    bool     used[count * 2];
+    uint32_t scaled[count];
+    int      nodes;
+    int      longest;
+
+    memcpy(scaled, freqs, sizeof scaled);
+
+    do {
+        nodes = count;
+
+        for (int i = 0; i < count; i++) {
+            weight[i] = scaled[i];
+            parent[i] = -1;
+            used[i]   = scaled[i] == 0;
+        }
+
+        // Repeatedly join the two lightest nodes.
+        while (true) {
+            int a = -1;
+            int b = -1;
+
+            for (int i = 0; i < nodes; i++) {
+                if (used[i])
+                    continue;
+                if (a < 0 || weight[i] < weight[a]) {
+                    b = a;
+                    a = i;
+                } else if (b < 0 || weight[i] < weight[b]) {
+                    b = i;
+                }
+            }
+
+            if (b < 0)
+                break;
+
+            weight[nodes] = weight[a] + weight[b];
+            parent[nodes] = -1;
+            used[nodes]   = false;
+            parent[a]     = nodes;
+            parent[b]     = nodes;
+            used[a]       = true;
+            used[b]       = true;
+            nodes++;
+        }
+
+        longest = 0;
+
+        for (int i = 0; i < count; i++) {
+            int depth = 0;
+
+            for (int n = i; parent[n] >= 0; n = parent[n])
+                depth++;
+
+            // A lone symbol still needs a code.
+            lengths[i] = scaled[i] ? (depth ? depth : 1) : 0;
+
+            if (lengths[i] > longest)
+                longest = lengths[i];
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (scaled[i])
+                scaled[i] = (scaled[i] + 1) / 2;
+        }
+    } while (longest > maxlen);
+}
+
+// Assign canonical codes, shorter codes first and then in symbol order. This
+// is how unrar builds its decode tables.
+static void build_codes(const uint8_t *lengths, uint32_t *codes, int count)
+{
+    uint32_t numlen[16] = {0};
+    uint32_t next[16];
+    uint32_t code = 0;
+
+    for (int i = 0; i < count; i++)
+        numlen[lengths[i]]++;
+
+    numlen[0] = 0;
+
+    for (int len = 1; len < 16; len++) {
+        code      = (code + numlen[len - 1]) << 1;
+        next[len] = code;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (lengths[i]) {
+            codes[i] = next[lengths[i]]++;
+        }
+    }
+}
+
+// Write the table header, the bit lengths for the main table are themselves
+// Huffman coded, with symbols 18 and 19 for runs of zeroes.
+static void append_tables(bitbuf_t *output, const uint8_t *table)
+{
+    uint32_t bcfreqs[BC] = {0};
+    uint8_t  bclengths[BC];
+    uint32_t bccodes[BC];
+    uint16_t symbols[HUFF_TABLE_SIZE];
+    uint8_t  extra[HUFF_TABLE_SIZE];
+    int      count = 0;
+
+    // Convert the table to a sequence of bit length symbols.
+    for (int i = 0; i < HUFF_TABLE_SIZE;) {
+        int run = 0;
+
+        while (i + run < HUFF_TABLE_SIZE && table[i + run] == 0 && run < 138)
+            run++;
+
+        if (run >= 11) {
+            symbols[count]  = 19;
+            extra[count++]  = run - 11;
+            i += run;
+        } else if (run >= 3) {
+            symbols[count]  = 18;
+            extra[count++]  = run - 3;
+            i += run;
+        } else {
+            symbols[count]  = table[i];
+            extra[count++]  = 0;
+            i++;
+        }
+    }
+
+    for (int i = 0; i < count; i++)
+        bcfreqs[symbols[i]]++;
+
+    // A length of 15 is an escape in the header, so stop short of it.
+    build_lengths(bcfreqs, bclengths, BC, 14);
+    build_codes(bclengths, bccodes, BC);
+
+    bitbuf_append(output, 0, 1);    // PpmBlock
+    bitbuf_append(output, 0, 1);    // KeepTables, these replace any previous tables.
+
+    for (int i = 0; i < BC; i++)
+        bitbuf_append(output, bclengths[i], 4);
+
+    for (int i = 0; i < count; i++) {
+        bitbuf_append(output, bccodes[symbols[i]], bclengths[symbols[i]]);
+
+        switch (symbols[i]) {
+            case 18: bitbuf_append(output, extra[i], 3);
+                     break;
+            case 19: bitbuf_append(output, extra[i], 7);
+                     break;
+        }
+    }
+}
+
+// Encode a VM code block, the filter is only defined by the first invocation
+// and later invocations refer to it, with any parameters that changed.
+static void append_vmcode(bitbuf_t *output,
+                          const uint8_t *code,
+                          uint32_t codesize,
+                          const invocation_t *invocation,
+                          bool newfilter,
+                          uint32_t lastlength)
+{
+    bitbuf_t      *vmcode;
+    const uint8_t *bytes;
+    uint32_t       length;
+    uint8_t        firstbyte = 0;
+
+    bitbuf_create(&vmcode);
+
+    if (invocation->blocksize != lastlength)
+        firstbyte |= VM_BLOCKSIZE;
+    if (invocation->initmask)
+        firstbyte |= VM_INITREGS;
+    if (invocation->datasize)
+        firstbyte |= VM_GLOBALDATA;
+
+    // The block follows the VM code, so it starts at the current position.
+    append_data(vmcode, 0);
+
+    if (firstbyte & VM_BLOCKSIZE)
+        append_data(vmcode, invocation->blocksize);
+
+    if (firstbyte & VM_INITREGS) {
+        bitbuf_append(vmcode, invocation->initmask, 7);
+
+        for (int i = 0; i < 7; i++) {
+            if (invocation->initmask & (1 << i)) {
+                append_data(vmcode, invocation->initr[i]);
+            }
+        }
+    }
+
+    if (newfilter) {
+        append_data(vmcode, codesize);
+
+        for (uint32_t i = 0; i < codesize; i++)
+            bitbuf_append(vmcode, code[i], 8);
+    }
+
+    if (firstbyte & VM_GLOBALDATA) {
+        append_data(vmcode, invocation->datasize);
+
+        for (uint32_t i = 0; i < invocation->datasize; i++)
+            bitbuf_append(vmcode, invocation->data[i], 8);
+    }
+
+    bitbuf_getbits(vmcode, &bytes, &length);
+
+    if (length > UINT16_MAX) {
+        errx(EXIT_FAILURE, "vm code for %s is too large", invocation->name);
+    }
+
+    // The length is stored in the first byte if it's small enough.
+    if (length <= 6) {
+        bitbuf_append(output, firstbyte | (length - 1), 8);
+    } else if (length <= 255 + 7) {
+        bitbuf_append(output, firstbyte | 6, 8);
+        bitbuf_append(output, length - 7, 8);
+    } else {
+        bitbuf_append(output, firstbyte | 7, 8);
+        bitbuf_append(output, length, 16);
+    }
+
+    // The final octet might be partial, so append it separately.
+    for (uint32_t i = 0; i < bitbuf_numbits(vmcode) / 8; i++)
+        bitbuf_append(output, bytes[i], 8);
+
+    if (bitbuf_numbits(vmcode) % 8) {
+        bitbuf_append(output, bytes[length - 1], bitbuf_numbits(vmcode) % 8);
+        bitbuf_append(output, 0, 8 - bitbuf_numbits(vmcode) % 8);
+    }
+
+    bitbuf_destroy(vmcode);
+}
 
 int main(int argc, char **argv)
 {
-    FILE     *input;
-    FILE     *output;
-    bitbuf_t *tables;
+    bitbuf_t     *stream;
+    invocation_t *invocations;
+    invocation_t  defaults  = {0};
+    int           count;
+    int           opt;
+    uint8_t      *code;
+    uint32_t      codesize;
+    uint32_t      freqs[NC] = {0};
+    uint8_t       table[HUFF_TABLE_SIZE] = {0};
+    uint32_t      codes[NC];
+    uint32_t      lastlength = 0;
+    uint64_t      unpsize = 0;
 
     struct mainhdr mainhdr = {
         .hdr = {
@@ -112,103 +419,103 @@ int main(int argc, char **argv)
         .FileName   = { 's', 't', 'd', 'o', 'u', 't' },
     };
 
+    // Options given before the object apply to every block.
+    while ((opt = getopt(argc, argv, "r:d:")) != -1) {
+        switch (opt) {
+            case 'r':
+                parse_register(&defaults, optarg);
+                break;
+            case 'd':
+                free(defaults.data);
+                defaults.data = read_file(optarg,
+                                          &defaults.datasize,
+                                          VM_GLOBALMEMSIZE - VM_FIXEDGLOBALSIZE);
+                break;
+            default:
+                errx(EXIT_FAILURE, "usage: %s [-r reg=value]... [-d data] object.ro [block[,reg=value...][,data=file]]...", *argv);
+        }
+    }
+
+    if (optind >= argc) {
+        errx(EXIT_FAILURE, "no object file specified");
+    }
+
     // Read the input object file
-    if (!(input = fopen(argv[1], "r"))) {
-        errx(EXIT_FAILURE, "failed to open specified rar object file, %s", argv[1]);
-    }
-
-    bitbuf_create(&tables);
-
-    // Packed Block Header
-    bitbuf_append(tables, 0, 1);    // PpmBlock
-    bitbuf_append(tables, 0, 1);    // KeepTables
-
-    // We need 20 length codes that are used when building the decode tables. I
-    // should simplify this. I don't think I can use just zeroes, but if I can,
-    // could just use two runs of 10 zeroes.
-    bitbuf_append(tables, 8, 4);
-    bitbuf_append(tables, 0, 4);
-    bitbuf_append(tables, 8, 4);
-    bitbuf_append(tables, 5, 4);
-    bitbuf_append(tables, 5, 4);
-    bitbuf_append(tables, 4, 4);
-    bitbuf_append(tables, 3, 4);
-    bitbuf_append(tables, 3, 4);
-    bitbuf_append(tables, 3, 4);
-    bitbuf_append(tables, 4, 4);
-    bitbuf_append(tables, 4, 4);
-    bitbuf_append(tables, 3, 4);
-    bitbuf_append(tables, 3, 4);
-    bitbuf_append(tables, 6, 4);
-    bitbuf_append(tables, 6, 4);
-    bitbuf_append(tables, 0, 4);
-    bitbuf_append(tables, 4, 4);
-    bitbuf_append(tables, 6, 4);
-    bitbuf_append(tables, 0, 4);
-    bitbuf_append(tables, 7, 4);
-    bitbuf_append(tables, 2, 4);
-
-    // Flush to an octet boundary.
-    bitbuf_append(tables, 0, 2);
-
-    for (int i = 0; i < 69; i++) {
-        // TODO: Simplify this, use RLE zeroes.
-        const uint8_t huffman_table[] = {
-            0x30, 0x1D, 0x6B, 0xE0, 0x17, 0x69, 0x2B, 0xF8, // 8
-            0x2A, 0xF4, 0x2B, 0xD4, 0xAF, 0xE8, 0x7A, 0x32, // 16
-            0xF4, 0xE6, 0x65, 0xE6, 0x5E, 0x6C, 0x30, 0xE6, // 24
-            0xD1, 0x24, 0xF2, 0x00, 0x3D, 0x93, 0xC9, 0xE6, // 32
-            0x89, 0xEC, 0x9E, 0xC9, 0xEB, 0x30, 0xB8, 0xE4, // 40
-            0x7A, 0x73, 0x1E, 0xBD, 0x6B, 0x61, 0xDD, 0xEB, // 48
-            0x34, 0x30, 0xBB, 0x76, 0xA8, 0x30, 0x30, 0xF0, // 56
-            0x30, 0x4B, 0x30, 0x00, 0x30, 0x00, 0x30, 0x3E, // 64
-            0x0F, 0xF7, 0x7F, 0x30, 0xF9,
-        };
-
-        bitbuf_append(tables, huffman_table[i], 8);
-    }
-
-    bitbuf_append(tables, 0xDC, 8);
-    bitbuf_append(tables, 0x9D, 8);
-    bitbuf_append(tables, 0xA1, 8);     // BlockStart?
-    bitbuf_append(tables, 0x1,  4);
-
-    enum {
-        VM_NEWFILTER    = 0x8, // Defining a new filter
-        VM_BLOCKSTARTHI = 0x4, // Add 258 to BlockSize
-        VM_BLOCKSIZE    = 0x2, // Change Blocksize
-        VM_INITREGS     = 0x1, // Initial Register State Follows
-    };
+    code = read_file(argv[optind++], &codesize, UINT16_MAX - 1);
 
-    enum {
-        VMTYPE_UINT4    = 0b00,
-        VMTYPE_UINT16   = 0b10,
-        VMTYPE_UINT32   = 0b11,
-    };
+    if (codesize == 0) {
+        errx(EXIT_FAILURE, "the object file %s is empty", argv[optind - 1]);
+    }
 
-    bitbuf_append(tables, 0, 4); // The first byte, contains VM flags.
-    bitbuf_append(tables, 7, 4);
+    // Without any blocks, the program just runs once and produces its own
+    // output.
+    count       = argc - optind ? argc - optind : 1;
+    invocations = calloc(count, sizeof(invocation_t));
 
-    // Now we need to know the size of the input file, so seek to the end.
-    fseek(input, 0, SEEK_END);
-    bitbuf_append(tables, ftell(input) + 9, 16);    // Literal Size, including vm parameters.
-    // XXX: NEED TO ACCOUNT FOR INIT DATA
+    for (int i = 0; i < count; i++) {
+        invocations[i] = defaults;
 
-    // VM DATA STARTS HERE
-    bitbuf_append(tables, VMTYPE_UINT32, 2);
-    bitbuf_append(tables, 0x00000000, 32);           // Block Start Address
-    bitbuf_append(tables, VMTYPE_UINT32, 2);
-    bitbuf_append(tables, ftell(input), 32);         // Literal Size of code
+        if (optind + i < argc) {
+            // The data is owned by each invocation.
+            if (defaults.data) {
+                invocations[i].data = malloc(defaults.datasize);
+                memcpy(invocations[i].data, defaults.data, defaults.datasize);
+            }
 
-    // Because we may not be on an octet boundary, we need to use the bitbuf
-    // interface to add this code, so rewind and add each byte.
-    fseek(input, 0, SEEK_SET);
+            parse_block(&invocations[i], argv[optind + i]);
+        } else {
+            invocations[i].name = argv[optind - 1];
+        }
+    }
 
-    for (int i = fgetc(input); i != EOF; i = fgetc(input)) {
-        bitbuf_append(tables, i, 8);
+    // Build a Huffman table for the literals we need, plus the vm code and
+    // end of file symbols. There are never any matches.
+    for (int i = 0; i < count; i++) {
+        for (uint32_t j = 0; j < invocations[i].blocksize; j++)
+            freqs[invocations[i].block[j]]++;
+
+        unpsize += invocations[i].blocksize;
     }
 
-    bitbuf_getbits(tables, NULL, &filehdr.PackSize);
+    freqs[SYM_VMCODE]   = count;
+    freqs[SYM_ENDBLOCK] = 1;
+
+    build_lengths(freqs, table, NC, 15);
+    build_codes(table, codes, NC);
+
+    bitbuf_create(&stream);
+
+    append_tables(stream, table);
+
+    // The tables are only sent once, each invocation is just the vm code
+    // block followed by the data to filter.
+    for (int i = 0; i < count; i++) {
+        bitbuf_append(stream, codes[SYM_VMCODE], table[SYM_VMCODE]);
+
+        append_vmcode(stream, code, codesize, &invocations[i], i == 0, lastlength);
+
+        lastlength = invocations[i].blocksize;
+
+        for (uint32_t j = 0; j < invocations[i].blocksize; j++) {
+            bitbuf_append(stream, codes[invocations[i].block[j]], table[invocations[i].block[j]]);
+        }
+    }
+
+    // End of file, keeping the tables for any solid file that follows.
+    bitbuf_append(stream, codes[SYM_ENDBLOCK], table[SYM_ENDBLOCK]);
+    bitbuf_append(stream, 0, 1);    // Not a new table.
+    bitbuf_append(stream, 0, 1);    // KeepTables.
+
+    // Rar reads the stream most significant bit first, so pad the final octet.
+    if (bitbuf_numbits(stream) % 8) {
+        bitbuf_append(stream, 0, 8 - bitbuf_numbits(stream) % 8);
+    }
+
+    bitbuf_getbits(stream, NULL, &filehdr.PackSize);
+
+    // This is only exact if the filter output is the same size as the input,
+    // programs that generate their own output don't need it.
+    filehdr.UnpSize = unpsize;
 
     // Fixup checksums
     mainhdr.hdr.crc = crc32(0, &(mainhdr.hdr.type), sizeof(mainhdr) - offsetof(struct mainhdr, hdr.type));
@@ -217,6 +524,16 @@ int main(int argc, char **argv)
     fwrite(kRarSignature, sizeof kRarSignature, 1, stdout);
     fwrite(&mainhdr, sizeof mainhdr, 1, stdout);
     fwrite(&filehdr, sizeof filehdr, 1, stdout);
-    fwrite(tables->bits, filehdr.PackSize, 1, stdout);
-    bitbuf_destroy(tables);
+    fwrite(stream->bits, filehdr.PackSize, 1, stdout);
+    bitbuf_destroy(stream);
+
+    for (int i = 0; i < count; i++) {
+        free(invocations[i].block);
+        free(invocations[i].data);
+    }
+
+    free(invocations);
+    free(defaults.data);
+    free(code);
+    return 0;
 }
@@ -0,0 +1,188 @@
+// Replay RarVM execution traces recorded by rarexec.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "rarvm.h"
+#include "trace.h"
+
+#define MAX_DUMPS   16
+
+static void print_state(const vm_t *vm, uint64_t index)
+{
+    printf("index %" PRIu64 ", ip %u, flags %08x\n", index, vm->ip, vm->flags);
+
+    for (int i = REG0; i <= REG7; i++)
+        printf("r%d %08x%s", i, vm->r[i], i % 4 == 3 ? "\n" : "  ");
+}
+
+// A line per instruction, with everything it changed.
+static void print_event(const vm_t *vm, const vm_program_t *program, const trace_event_t *event)
+{
+    char buf[128];
+
+    printf("%10" PRIu64 "  %5u", event->index, event->ip);
+
+    if (program && event->ip < program->count)
+        printf("  %-28s", vm_format_insn(buf, sizeof buf, &program->insns[event->ip]));
+
+    for (int i = REG0; i <= REG7; i++) {
+        if (event->regs & (1 << i)) {
+            printf("  r%d=%08x", i, vm->r[i]);
+        }
+    }
+
+    if (event->flags)
+        printf("  flags=%08x", vm->flags);
+
+    for (uint32_t i = 0; i < event->numwrites; i++) {
+        printf("  [%05x]=", event->writes[i].addr);
+
+        for (uint32_t j = 0; j < event->writes[i].size && j < 8; j++)
+            printf("%02x", vm->mem[event->writes[i].addr + j]);
+
+        if (event->writes[i].size > 8)
+            printf("...+%u", event->writes[i].size);
+    }
+
+    if (event->numimmediates)
+        printf("  immediate");
+    if (event->jump)
+        printf("  -> %u", vm->ip);
+    if (event->finished)
+        printf("  finished");
+
+    printf("\n");
+}
+
+static void dump_memory(const vm_t *vm, uint32_t addr, uint32_t size)
+{
+    for (uint32_t i = 0; i < size && addr + i < VM_MEMSIZE + 4; i++) {
+        if (i % 16 == 0)
+            printf("%s%05x:", i ? "\n" : "", addr + i);
+
+        printf(" %02x", vm->mem[addr + i]);
+    }
+
+    printf("\n");
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-p program.ro] [-i index] [-n count] [-m addr[,size]]... [-o] [-k] trace\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    vm_program_t  *program      = NULL;
+    vm_t          *vm;
+    trace_t       *trace;
+    uint64_t       index        = UINT64_MAX;
+    uint64_t       count        = 0;
+    uint32_t       dumps[MAX_DUMPS][2];
+    uint32_t       numdumps     = 0;
+    bool           output       = false;
+    bool           keyframes    = false;
+    trace_event_t  event;
+    int            c;
+
+    while ((c = getopt(argc, argv, "p:i:n:m:okh")) != -1) {
+        switch (c) {
+            case 'p':
+                if (!vm_program_load(&program, optarg))
+                    errx(EXIT_FAILURE, "failed to load rar object file %s", optarg);
+                break;
+            case 'i':
+                index = strtoull(optarg, NULL, 0);
+                break;
+            case 'n':
+                count = strtoull(optarg, NULL, 0);
+                break;
+            case 'm': {
+                char *size;
+
+                if (numdumps == MAX_DUMPS)
+                    errx(EXIT_FAILURE, "too many memory ranges, the limit is %u", MAX_DUMPS);
+
+                dumps[numdumps][0] = strtoul(optarg, &size, 0);
+                dumps[numdumps][1] = *size == ',' ? strtoul(size + 1, NULL, 0) : 64;
+                numdumps++;
+                break;
+            }
+            case 'o':
+                output = true;
+                break;
+            case 'k':
+                keyframes = true;
+                break;
+            case 'h':
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    if (!trace_open(&trace, argv[optind]))
+        errx(EXIT_FAILURE, "failed to open trace %s", argv[optind]);
+
+    if (keyframes) {
+        for (uint32_t i = 0; i < trace_keyframes(trace); i++)
+            printf("keyframe %u\tindex %" PRIu64 "\n", i, trace_keyframe(trace, i));
+
+        printf("%" PRIu64 " instructions\n", trace_length(trace));
+        trace_close(trace);
+        return EXIT_SUCCESS;
+    }
+
+    // Without an index, show the final state, or start from the beginning
+    // when listing instructions.
+    if (index == UINT64_MAX)
+        index = count ? 0 : trace_length(trace);
+
+    vm_create(&vm);
+
+    if (!trace_seek(trace, vm, program, index))
+        errx(EXIT_FAILURE, "failed to seek to instruction %" PRIu64 " of %" PRIu64, index, trace_length(trace));
+
+    for (uint64_t i = 0; i < count && trace_next(trace, vm, program, &event); i++)
+        print_event(vm, program, &event);
+
+    if (output) {
+        const uint8_t *data;
+        uint32_t       size;
+
+        vm_getoutput(vm, &data, &size);
+        fwrite(data, 1, size, stdout);
+    } else {
+        print_state(vm, index + count < trace_length(trace) ? index + count : trace_length(trace));
+    }
+
+    for (uint32_t i = 0; i < numdumps; i++)
+        dump_memory(vm, dumps[i][0], dumps[i][1]);
+
+    vm_destroy(vm);
+    trace_close(trace);
+
+    if (program)
+        vm_program_destroy(program);
+
+    return EXIT_SUCCESS;
+}
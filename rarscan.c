@@ -0,0 +1,335 @@
+// Scan RAR archives for filter programs.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <err.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "rarvm.h"
+#include "unpack.h"
+
+// Maximum number of paths waiting to be scanned.
+#define QUEUE_SIZE      256
+
+// Per archive statistics.
+typedef struct {
+    const char *path;
+    uint32_t    files;          // Files that were parsed.
+    uint32_t    skipped;        // Files that could not be parsed, e.g. encrypted.
+    uint32_t    filters;        // Filter invocations.
+    uint32_t    programs;       // Distinct filter definitions.
+    uint32_t    standard;       // Definitions that are standard filters.
+    uint32_t    written;        // Programs written to the output directory.
+    const char *error;
+} scan_t;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  notempty;
+    pthread_cond_t  notfull;
+    char           *paths[QUEUE_SIZE];
+    unsigned        head;
+    unsigned        count;
+    bool            done;
+} queue = {
+    .lock       = PTHREAD_MUTEX_INITIALIZER,
+    .notempty   = PTHREAD_COND_INITIALIZER,
+    .notfull    = PTHREAD_COND_INITIALIZER,
+};
+
+static pthread_mutex_t outputlock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *outdir;
+static bool verbose;
+
+static uint64_t totalarchives;
+static uint64_t totalbytes;
+static uint64_t totalprograms;
+
+static void queue_push(const char *path)
+{
+    pthread_mutex_lock(&queue.lock);
+
+    while (queue.count == QUEUE_SIZE)
+        pthread_cond_wait(&queue.notfull, &queue.lock);
+
+    queue.paths[(queue.head + queue.count++) % QUEUE_SIZE] = strdup(path);
+
+    pthread_cond_signal(&queue.notempty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+// Returns NULL when there are no more paths.
+static char * queue_pop(void)
+{
+    char *path = NULL;
+
+    pthread_mutex_lock(&queue.lock);
+
+    while (queue.count == 0 && !queue.done)
+        pthread_cond_wait(&queue.notempty, &queue.lock);
+
+    if (queue.count) {
+        path        = queue.paths[queue.head];
+        queue.head  = (queue.head + 1) % QUEUE_SIZE;
+        queue.count--;
+        pthread_cond_signal(&queue.notfull);
+    }
+
+    pthread_mutex_unlock(&queue.lock);
+    return path;
+}
+
+static void queue_finish(void)
+{
+    pthread_mutex_lock(&queue.lock);
+    queue.done = true;
+    pthread_cond_broadcast(&queue.notempty);
+    pthread_mutex_unlock(&queue.lock);
+}
+
+// Write the program to outdir, named by crc and length so that duplicates
+// across archives are only written once.
+static bool write_program(const unpack_filter_t *filter, uint32_t crc)
+{
+    char path[PATH_MAX];
+    int  fd;
+
+    snprintf(path, sizeof path, "%s/%08x-%u.ro", outdir, crc, filter->codesize);
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644)) < 0) {
+        if (errno != EEXIST)
+            warn("failed to create %s", path);
+        return false;
+    }
+
+    if (write(fd, filter->code, filter->codesize) != filter->codesize)
+        warn("failed to write %s", path);
+
+    close(fd);
+    return true;
+}
+
+static bool scan_filter(void *opaque, const unpack_filter_t *filter)
+{
+    scan_t         *scan = opaque;
+    vm_stdfilter_t  type = vm_standard_filter(filter->code, filter->codesize);
+    uint32_t        crc;
+
+    scan->filters++;
+
+    if (!filter->newfilter)
+        return true;
+
+    crc = crc32(0, filter->code, filter->codesize);
+
+    scan->programs++;
+
+    if (type != VMSF_NONE)
+        scan->standard++;
+
+    // The standard filters are in every archive, so aren't interesting.
+    if (outdir && type == VMSF_NONE && write_program(filter, crc))
+        scan->written++;
+
+    if (verbose) {
+        pthread_mutex_lock(&outputlock);
+        printf("%s\tfilter %u\t%08x\t%u\t%s\tpos %llu\tstart %u\tlength %u\n",
+               scan->path,
+               filter->filtnum,
+               crc,
+               filter->codesize,
+               vm_standard_filter_name(type),
+               (unsigned long long) filter->position,
+               filter->blockstart,
+               filter->blocklength);
+        pthread_mutex_unlock(&outputlock);
+    }
+
+    return true;
+}
+
+// The walk itself is shared with rarbatch, see unpack_archive().
+static unpack_archive_status_t scan_archive(scan_t *scan, const uint8_t *base, size_t size)
+{
+    unpack_archive_t archive;
+
+    unpack_archive(base, size, scan_filter, scan, &archive);
+
+    scan->files     = archive.files;
+    scan->skipped   = archive.skipped;
+    scan->error     = archive.error;
+    return archive.status;
+}
+
+static void scan_path(const char *path)
+{
+    scan_t                   scan = { .path = path };
+    struct stat              st;
+    uint8_t                 *base;
+    unpack_archive_status_t  status;
+    int                      fd;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        warn("failed to open %s", path);
+        return;
+    }
+
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return;
+    }
+
+    if ((base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        warn("failed to map %s", path);
+        close(fd);
+        return;
+    }
+
+    close(fd);
+    madvise(base, st.st_size, MADV_SEQUENTIAL);
+
+    status = scan_archive(&scan, base, st.st_size);
+
+    munmap(base, st.st_size);
+
+    __sync_fetch_and_add(&totalbytes, st.st_size);
+
+    if (status == ARCHIVE_NOT_RAR)
+        return;
+
+    __sync_fetch_and_add(&totalarchives, 1);
+    __sync_fetch_and_add(&totalprograms, scan.programs);
+
+    pthread_mutex_lock(&outputlock);
+    printf("%s\tfiles %u\tskipped %u\tfilters %u\tprograms %u\tstandard %u\twritten %u%s%s\n",
+           path,
+           scan.files,
+           scan.skipped,
+           scan.filters,
+           scan.programs,
+           scan.standard,
+           scan.written,
+           scan.error ? "\t" : "",
+           scan.error ? scan.error : "");
+    pthread_mutex_unlock(&outputlock);
+}
+
+static void * worker(void *arg)
+{
+    char *path;
+
+    while ((path = queue_pop())) {
+        scan_path(path);
+        free(path);
+    }
+
+    return NULL;
+}
+
+static int visit(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    if (type == FTW_F && S_ISREG(st->st_mode))
+        queue_push(path);
+
+    return 0;
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [-j threads] [-o outdir] path...\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    pthread_t      *threads;
+    long            numthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    struct timespec start;
+    struct timespec end;
+    double          elapsed;
+    int             c;
+
+    while ((c = getopt(argc, argv, "vj:o:h")) != -1) {
+        switch (c) {
+            case 'v':
+                verbose = true;
+                break;
+            case 'j':
+                numthreads = strtol(optarg, NULL, 0);
+                break;
+            case 'o':
+                outdir = optarg;
+                break;
+            case 'h':
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind == argc) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    if (numthreads < 1)
+        numthreads = 1;
+
+    if (outdir && mkdir(outdir, 0755) != 0 && errno != EEXIST)
+        err(EXIT_FAILURE, "failed to create output directory %s", outdir);
+
+    threads = calloc(numthreads, sizeof(pthread_t));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (long i = 0; i < numthreads; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            errx(EXIT_FAILURE, "failed to create worker thread");
+        }
+    }
+
+    for (int i = optind; i < argc; i++) {
+        if (nftw(argv[i], visit, 64, FTW_PHYS) != 0) {
+            warn("failed to walk %s", argv[i]);
+        }
+    }
+
+    queue_finish();
+
+    for (long i = 0; i < numthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    fprintf(stderr, "%llu archives, %llu programs, %.1f MB in %.2fs (%.1f MB/s)\n",
+            (unsigned long long) totalarchives,
+            (unsigned long long) totalprograms,
+            totalbytes / 1e6,
+            elapsed,
+            elapsed > 0 ? totalbytes / 1e6 / elapsed : 0);
+
+    free(threads);
+    return EXIT_SUCCESS;
+}
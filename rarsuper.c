@@ -0,0 +1,604 @@
+// Superoptimizer for RarVM instruction sequences.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "rarvm.h"
+#include "lexer.h"
+#include "superopt.h"
+
+// Maximum number of rules in a rules file.
+#define MAX_RULES       4096
+
+typedef struct {
+    vm_insn_t   match[SO_MAXINSNS];
+    uint32_t    matchlen;
+    vm_insn_t   replace[SO_MAXINSNS];
+    uint32_t    replacelen;
+    uint32_t    dead;       // Locations that must be dead after the match.
+    uint32_t    applied;
+} rule_t;
+
+// How a source line affects rewriting.
+typedef enum {
+    LINE_BLANK,             // Whitespace and comments, skipped when matching.
+    LINE_INSN,              // An instruction that rules can match.
+    LINE_OTHER,             // An instruction that can't be matched, e.g. it uses a symbol.
+    LINE_BARRIER,           // Labels, directives and anything unrecognised.
+} line_kind_t;
+
+typedef struct {
+    line_kind_t kind;
+    vm_insn_t   insn;
+    const char *text;
+    size_t      len;        // Including the newline.
+} source_line_t;
+
+static char * read_file(const char *path, size_t *size)
+{
+    FILE   *input = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    char   *buf   = NULL;
+    size_t  max   = 0;
+    size_t  n;
+
+    if (input == NULL)
+        err(EXIT_FAILURE, "failed to open %s", path);
+
+    *size = 0;
+
+    do {
+        if (*size == max) {
+            buf = realloc(buf, max = max ? max * 2 : 65536);
+        }
+
+        n = fread(buf + *size, 1, max - *size, input);
+
+        *size += n;
+    } while (n > 0);
+
+    if (input != stdin)
+        fclose(input);
+
+    return buf;
+}
+
+// Convert a line from the lexer into an instruction, using the generic opcode
+// and bytemode like rar_assemble() does. Symbols have no value until the
+// program is assembled, so they can't be matched.
+static bool convert_line(const asm_line_t *line, vm_insn_t *insn)
+{
+    static const uint8_t generic[] = {
+        VM_MOV, VM_CMP, VM_ADD, VM_SUB, VM_INC, VM_DEC, VM_NEG,
+    };
+    bool symbolic = false;
+
+    memset(insn, 0, sizeof *insn);
+
+    insn->opcode = line->opcode;
+
+    if (insn->opcode >= VM_MOVB && insn->opcode <= VM_NEGD) {
+        insn->bytemode  = (insn->opcode - VM_MOVB) % 2 == 0;
+        insn->opcode    = generic[(insn->opcode - VM_MOVB) / 2];
+    }
+
+    for (int i = 0; i < line->numops; i++) {
+        vm_operand_t *op = i == 0 ? &insn->op1 : &insn->op2;
+
+        op->type    = line->op[i].type;
+        op->reg     = line->op[i].reg;
+        op->value   = line->op[i].value;
+
+        if (op->type == ASM_OPSYMBOL) {
+            op->type    = VM_OPINT;
+            op->value   = 0;
+            symbolic    = true;
+        }
+
+        if (op->type == VM_OPREGMEM && !line->op[i].indexed)
+            op->value = 0;
+
+        // Byte immediates are truncated when encoded.
+        if (op->type == VM_OPINT && insn->bytemode)
+            op->value &= 0xff;
+    }
+
+    return !symbolic;
+}
+
+static bool insn_equal(const vm_insn_t *a, const vm_insn_t *b)
+{
+    return a->opcode == b->opcode
+        && a->bytemode == b->bytemode
+        && a->op1.type == b->op1.type
+        && a->op1.reg == b->op1.reg
+        && a->op1.value == b->op1.value
+        && a->op2.type == b->op2.type
+        && a->op2.reg == b->op2.reg
+        && a->op2.value == b->op2.value;
+}
+
+// Parse a list of locations like r2,r3,flags.
+static uint32_t parse_locations(const char *list)
+{
+    uint32_t locations = 0;
+    char    *copy      = strdup(list);
+    char    *saveptr;
+
+    for (char *name = strtok_r(copy, ", \t", &saveptr); name; name = strtok_r(NULL, ", \t", &saveptr)) {
+        int reg;
+
+        if (strcmp(name, "flags") == 0) {
+            locations |= SO_FLAGS;
+        } else if ((reg = lexer_register(name, strlen(name))) >= 0) {
+            locations |= 1 << reg;
+        } else {
+            errx(EXIT_FAILURE, "unrecognised location '%s', expected a register or flags", name);
+        }
+    }
+
+    free(copy);
+    return locations;
+}
+
+static void format_locations(char *buf, size_t size, uint32_t locations)
+{
+    size_t len = 0;
+
+    *buf = '\0';
+
+    for (int i = REG0; i <= REG7; i++) {
+        if (locations & (1 << i) && len < size)
+            len += snprintf(buf + len, size - len, "%sr%d", len ? ", " : "", i);
+    }
+
+    if (locations & SO_FLAGS && len < size)
+        snprintf(buf + len, size - len, "%sflags", len ? ", " : "");
+}
+
+// Read the sequence to optimise, it must be straight line code without any
+// symbols.
+static uint32_t parse_sequence(const char *filename, const char *source, size_t size, vm_insn_t *insns)
+{
+    lexer_t     lexer;
+    asm_line_t  line;
+    uint32_t    count = 0;
+
+    lexer_init(&lexer, filename, source, size);
+
+    while (lexer_next(&lexer, &line)) {
+        if (line.kind == ASM_LABEL) {
+            lexer_error(&lexer, line.line, line.column, "labels are not supported, the sequence must be straight line code");
+        }
+
+        if (count == SO_MAXINSNS) {
+            lexer_error(&lexer, line.line, line.column, "sequence is too long, at most %u instructions are supported", SO_MAXINSNS);
+        }
+
+        if (!convert_line(&line, &insns[count])) {
+            lexer_error(&lexer, line.line, line.column, "symbols are not supported");
+        }
+
+        if (!superopt_supported(&insns[count])) {
+            lexer_error(&lexer, line.line, line.column, "%.*s can't be superoptimised", (int) line.name.len, line.name.ptr);
+        }
+
+        count++;
+    }
+
+    return count;
+}
+
+static void print_sequence(FILE *output, const char *heading, const vm_insn_t *insns, uint32_t count)
+{
+    char buf[128];
+
+    fprintf(output, "%s\n", heading);
+
+    for (uint32_t i = 0; i < count; i++)
+        fprintf(output, "        %s\n", vm_format_insn(buf, sizeof buf, &insns[i]));
+}
+
+// Rules are written so they can be read back by -a, and so the replacement
+// can be pasted into the source.
+static void print_rule(FILE *output,
+                       const vm_insn_t *target,
+                       uint32_t length,
+                       const so_options_t *options,
+                       const so_result_t *result)
+{
+    uint32_t writes = 0;
+    char     locations[128];
+
+    for (uint32_t i = 0; i < length; i++)
+        writes |= superopt_writes(&target[i]);
+    for (uint32_t i = 0; i < result->length; i++)
+        writes |= superopt_writes(&result->insns[i]);
+
+    fprintf(output, "; %u instruction%s, %u bits -> %u instruction%s, %u bits\n",
+            length,
+            length == 1 ? "" : "s",
+            superopt_bits(target, length),
+            result->length,
+            result->length == 1 ? "" : "s",
+            superopt_bits(result->insns, result->length));
+
+    if (result->verdict == SO_PROVEN && result->inputbits == 0) {
+        fprintf(output, "; proven, the result does not depend on any input\n");
+    } else if (result->verdict == SO_PROVEN) {
+        format_locations(locations, sizeof locations, result->inputs);
+        fprintf(output, "; proven for all 2^%u inputs%s%s\n",
+                result->inputbits,
+                *locations ? " of " : "",
+                locations);
+    } else if (result->inputs & SO_MEMORY) {
+        fprintf(output, "; tested, not proven because memory is read\n");
+    } else {
+        fprintf(output, "; tested, not proven because there are 2^%u inputs, see -x\n", result->inputbits);
+    }
+
+    print_sequence(output, "match", target, length);
+    print_sequence(output, "replace", result->insns, result->length);
+
+    format_locations(locations, sizeof locations, ~options->live & writes & (SO_REGS | SO_FLAGS));
+
+    if (*locations)
+        fprintf(output, "dead    %s\n", locations);
+
+    fprintf(output, "end\n");
+}
+
+static size_t parse_rules(const char *filename, char *source, size_t size, rule_t *rules)
+{
+    size_t      count   = 0;
+    rule_t     *rule    = NULL;
+    vm_insn_t  *insns   = NULL;
+    uint32_t   *length  = NULL;
+    uint32_t    lineno  = 0;
+
+    for (char *p = source, *end; p < source + size; p = end + 1) {
+        char       *word;
+        size_t      len;
+        lexer_t     lexer;
+        asm_line_t  line;
+
+        if (!(end = memchr(p, '\n', source + size - p)))
+            end = source + size;
+
+        lineno++;
+
+        for (word = p; word < end && (*word == ' ' || *word == '\t'); word++)
+            ;
+        for (len = 0; word + len < end && word[len] != ' ' && word[len] != '\t' && word[len] != ';'; len++)
+            ;
+
+        if (len == 0)
+            continue;
+
+        if (len == 5 && strncmp(word, "match", len) == 0) {
+            if (rule)
+                errx(EXIT_FAILURE, "%s:%u: expected end before match", filename, lineno);
+            if (count == MAX_RULES)
+                errx(EXIT_FAILURE, "%s:%u: too many rules", filename, lineno);
+
+            rule    = memset(&rules[count], 0, sizeof *rule);
+            insns   = rule->match;
+            length  = &rule->matchlen;
+            continue;
+        }
+
+        if (rule == NULL)
+            errx(EXIT_FAILURE, "%s:%u: expected match", filename, lineno);
+
+        if (len == 7 && strncmp(word, "replace", len) == 0) {
+            insns   = rule->replace;
+            length  = &rule->replacelen;
+            continue;
+        }
+
+        if (len == 4 && strncmp(word, "dead", len) == 0) {
+            char *list = strndup(word + len, end - word - len);
+
+            list[strcspn(list, ";")] = '\0';
+            rule->dead = parse_locations(list);
+            free(list);
+            continue;
+        }
+
+        if (len == 3 && strncmp(word, "end", len) == 0) {
+            if (rule->matchlen == 0)
+                errx(EXIT_FAILURE, "%s:%u: empty match", filename, lineno);
+
+            count++;
+            rule = NULL;
+            continue;
+        }
+
+        lexer_init(&lexer, filename, p, end - p);
+
+        lexer.line = lineno - 1;
+
+        if (!lexer_next(&lexer, &line))
+            continue;
+
+        if (line.kind != ASM_INSN)
+            lexer_error(&lexer, line.line, line.column, "expected an instruction");
+        if (*length == SO_MAXINSNS)
+            lexer_error(&lexer, line.line, line.column, "too many instructions in rule");
+        if (!convert_line(&line, &insns[*length]))
+            lexer_error(&lexer, line.line, line.column, "symbols are not supported");
+
+        (*length)++;
+    }
+
+    if (rule)
+        errx(EXIT_FAILURE, "%s: missing end", filename);
+
+    return count;
+}
+
+// Split the source into lines and classify them, anything the lexer doesn't
+// accept, like macros that cpp hasn't expanded yet, is a barrier.
+static size_t classify_source(const char *filename, const char *source, size_t size, source_line_t **lines)
+{
+    size_t   count    = 0;
+    size_t   capacity = 0;
+
+    *lines = NULL;
+
+    for (const char *p = source, *end; p < source + size; p = end) {
+        source_line_t *line;
+        lexer_t        lexer;
+        asm_line_t     asmline;
+        jmp_buf        recover;
+
+        if ((end = memchr(p, '\n', source + size - p))) {
+            end++;
+        } else {
+            end = source + size;
+        }
+
+        if (count == capacity)
+            *lines = realloc(*lines, (capacity = capacity ? capacity * 2 : 1024) * sizeof **lines);
+
+        line        = &(*lines)[count++];
+        line->text  = p;
+        line->len   = end - p;
+        line->kind  = LINE_BARRIER;
+
+        // Directives, includes and so on.
+        if (*p == '#')
+            continue;
+
+        lexer_init(&lexer, filename, p, end - p);
+
+        lexer.recover = &recover;
+
+        if (setjmp(recover) != 0)
+            continue;
+
+        if (!lexer_next(&lexer, &asmline)) {
+            line->kind = LINE_BLANK;
+        } else if (asmline.kind == ASM_INSN) {
+            line->kind = convert_line(&asmline, &line->insn) ? LINE_INSN : LINE_OTHER;
+        }
+    }
+
+    return count;
+}
+
+// Check the locations are dead after line, by scanning forward until each one
+// is overwritten. The stdlib calling convention means that only r6 and r7
+// survive a call, and r0 holds the return value.
+static bool locations_dead(const source_line_t *lines, size_t count, size_t first, uint32_t locations)
+{
+    for (size_t i = first; i < count && locations; i++) {
+        const vm_insn_t *insn = &lines[i].insn;
+
+        if (lines[i].kind == LINE_BLANK)
+            continue;
+
+        if (lines[i].kind == LINE_BARRIER)
+            return false;
+
+        // Successors aren't followed.
+        if (vm_opcode_flags_table[insn->opcode] & VMCF_JUMP)
+            return false;
+
+        switch (insn->opcode) {
+            case VM_CALL:
+                return (locations & ~(SO_FLAGS | 0x3f)) == 0;
+            case VM_RET:
+                return (locations & ~(SO_FLAGS | 0x3e)) == 0;
+            case VM_PUSHA:
+            case VM_POPA:
+            case VM_PRINT:
+                return false;
+        }
+
+        if (superopt_reads(insn) & locations)
+            return false;
+
+        locations &= ~superopt_kills(insn);
+    }
+
+    return locations == 0;
+}
+
+// Try to match rule at line, returns the line after the match or zero.
+static size_t match_rule(const source_line_t *lines, size_t count, size_t first, const rule_t *rule)
+{
+    size_t i = first;
+
+    for (uint32_t n = 0; n < rule->matchlen; n++, i++) {
+        while (i < count && lines[i].kind == LINE_BLANK)
+            i++;
+
+        if (i == count || lines[i].kind != LINE_INSN || !insn_equal(&lines[i].insn, &rule->match[n]))
+            return 0;
+    }
+
+    return locations_dead(lines, count, i, rule->dead) ? i : 0;
+}
+
+static void apply_rules(FILE *output, const char *filename, const char *source, size_t size, rule_t *rules, size_t numrules)
+{
+    source_line_t *lines;
+    size_t         count    = classify_source(filename, source, size, &lines);
+    uint32_t       removed  = 0;
+    uint32_t       applied  = 0;
+
+    for (size_t i = 0; i < count; ) {
+        size_t next = 0;
+        size_t r;
+
+        if (lines[i].kind == LINE_INSN) {
+            for (r = 0; r < numrules && !next; r++)
+                next = match_rule(lines, count, i, &rules[r]);
+        }
+
+        if (!next) {
+            fwrite(lines[i].text, 1, lines[i].len, output);
+            i++;
+            continue;
+        }
+
+        // Keep the indentation of the first line.
+        for (uint32_t n = 0; n < rules[r - 1].replacelen; n++) {
+            char buf[128];
+
+            fprintf(output, "%.*s%s\n",
+                    (int) strspn(lines[i].text, " \t"),
+                    lines[i].text,
+                    vm_format_insn(buf, sizeof buf, &rules[r - 1].replace[n]));
+        }
+
+        rules[r - 1].applied++;
+        applied++;
+        removed += rules[r - 1].matchlen - rules[r - 1].replacelen;
+        i = next;
+    }
+
+    fprintf(stderr, "%s: %u rewrites, %d fewer instructions\n", filename, applied, removed);
+
+    free(lines);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "usage: %s [-v] [-b] [-s] [-j threads] [-n maxlength] [-x bits] [-d dead] [-k constant] sequence.rs\n", name);
+    fprintf(stderr, "       %s -a rules source.rs\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    so_options_t    options = {
+        .live           = SO_REGS | SO_FLAGS,
+        .maxlength      = 3,
+        .numthreads     = sysconf(_SC_NPROCESSORS_ONLN),
+        .exhaustbits    = 8,
+    };
+    so_result_t     result;
+    vm_insn_t       target[SO_MAXINSNS];
+    uint32_t        length;
+    const char     *rulesfile = NULL;
+    char           *source;
+    size_t          size;
+    int             c;
+
+    while ((c = getopt(argc, argv, "vbsj:n:x:d:k:a:h")) != -1) {
+        switch (c) {
+            case 'v':
+                options.verbose = true;
+                break;
+            case 'b':
+                options.bytemode = true;
+                break;
+            case 's':
+                options.smaller = true;
+                break;
+            case 'j':
+                options.numthreads = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                options.maxlength = strtoul(optarg, NULL, 0);
+                break;
+            case 'x':
+                options.exhaustbits = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                options.live &= ~parse_locations(optarg);
+                break;
+            case 'k':
+                options.constants = realloc(options.constants, (options.numconstants + 1) * sizeof(uint32_t));
+                options.constants[options.numconstants++] = strtoul(optarg, NULL, 0);
+                break;
+            case 'a':
+                rulesfile = optarg;
+                break;
+            case 'h':
+            default:
+                usage(*argv);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind != argc - 1) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    if (options.numthreads < 1)
+        options.numthreads = 1;
+
+    source = read_file(argv[optind], &size);
+
+    if (rulesfile) {
+        rule_t *rules = calloc(MAX_RULES, sizeof *rules);
+        size_t  rulesize;
+        char   *rulesource = read_file(rulesfile, &rulesize);
+        size_t  numrules   = parse_rules(rulesfile, rulesource, rulesize, rules);
+
+        apply_rules(stdout, argv[optind], source, size, rules, numrules);
+
+        if (options.verbose) {
+            for (size_t i = 0; i < numrules; i++) {
+                fprintf(stderr, "%s: rule %zu applied %u times\n", rulesfile, i + 1, rules[i].applied);
+            }
+        }
+
+        free(rulesource);
+        free(rules);
+        free(source);
+        return EXIT_SUCCESS;
+    }
+
+    if ((length = parse_sequence(argv[optind], source, size, target)) == 0)
+        errx(EXIT_FAILURE, "no instructions found in %s", argv[optind]);
+
+    if (!superopt_search(target, length, &options, &result)) {
+        fprintf(stderr, "no cheaper sequence found, %llu candidates tried, %llu passed testing\n",
+                (unsigned long long) result.candidates,
+                (unsigned long long) result.passed);
+        free(source);
+        return EXIT_FAILURE;
+    }
+
+    print_rule(stdout, target, length, &options, &result);
+
+    free(options.constants);
+    free(source);
+    return EXIT_SUCCESS;
+}
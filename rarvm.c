@@ -0,0 +1,843 @@
+// RarVM bytecode decoder and interpreter.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <err.h>
+#include <zlib.h>
+
+#include "rarvm.h"
+#include "stdfilter.h"
+
+const uint8_t vm_opcode_flags_table[UINT8_MAX] = {
+    [VM_ADC]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_ADD]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_AND]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_CALL]   = VMCF_OP1 | VMCF_PROC,
+    [VM_CMP]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_DEC]    = VMCF_OP1 | VMCF_BYTEMODE,
+    [VM_DIV]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_INC]    = VMCF_OP1 | VMCF_BYTEMODE,
+    [VM_JAE]    = VMCF_OP1 | VMCF_JUMP,
+    [VM_JA]     = VMCF_OP1 | VMCF_JUMP,
+    [VM_JBE]    = VMCF_OP1 | VMCF_JUMP,
+    [VM_JB]     = VMCF_OP1 | VMCF_JUMP,
+    [VM_JMP]    = VMCF_OP1 | VMCF_JUMP,
+    [VM_JNS]    = VMCF_OP1 | VMCF_JUMP,
+    [VM_JNZ]    = VMCF_OP1 | VMCF_JUMP,
+    [VM_JS]     = VMCF_OP1 | VMCF_JUMP,
+    [VM_JZ]     = VMCF_OP1 | VMCF_JUMP,
+    [VM_MOVSX]  = VMCF_OP2,
+    [VM_MOV]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_MOVZX]  = VMCF_OP2,
+    [VM_MUL]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_NEG]    = VMCF_OP1 | VMCF_BYTEMODE,
+    [VM_NOT]    = VMCF_OP1 | VMCF_BYTEMODE,
+    [VM_OR]     = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_POP]    = VMCF_OP1,
+    [VM_PUSH]   = VMCF_OP1,
+    [VM_RET]    = VMCF_PROC,
+    [VM_SAR]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_SBB]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_SHL]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_SHR]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_SUB]    = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_TEST]   = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_XCHG]   = VMCF_OP2 | VMCF_BYTEMODE,
+    [VM_XOR]    = VMCF_OP2 | VMCF_BYTEMODE,
+};
+
+// Return the next 16 bits of code at bitpos, most significant bit first. Rar
+// reads zeroes past the end of the code, so do the same.
+static uint32_t vm_peekbits(const uint8_t *code, uint32_t size, uint32_t bitpos)
+{
+    uint32_t offset = bitpos / 8;
+    uint32_t field  = 0;
+
+    for (int i = 0; i < 3; i++) {
+        field <<= 8;
+        field  |= offset + i < size ? code[offset + i] : 0;
+    }
+
+    return (field >> (8 - bitpos % 8)) & 0xffff;
+}
+
+// Decode a variable length integer, RarVM uses 2 bits to select one of 4
+// possible encodings.
+static uint32_t vm_decode_data(const uint8_t *code, uint32_t size, uint32_t *bitpos)
+{
+    uint32_t data = vm_peekbits(code, size, *bitpos);
+
+    switch (data & 0xc000) {
+        case 0x0000:    *bitpos += 6;
+                        return (data >> 10) & 0xf;
+        case 0x4000:    if ((data & 0x3c00) == 0) {
+                            *bitpos += 14;
+                            return 0xffffff00 | ((data >> 2) & 0xff);
+                        }
+                        *bitpos += 10;
+                        return (data >> 6) & 0xff;
+        case 0x8000:    *bitpos += 2;
+                        data     = vm_peekbits(code, size, *bitpos);
+                        *bitpos += 16;
+                        return data;
+        default:        *bitpos += 2;
+                        data     = vm_peekbits(code, size, *bitpos) << 16;
+                        *bitpos += 16;
+                        data    |= vm_peekbits(code, size, *bitpos);
+                        *bitpos += 16;
+                        return data;
+    }
+}
+
+static void vm_decode_operand(const uint8_t *code, uint32_t size, uint32_t *bitpos, vm_operand_t *op, bool bytemode)
+{
+    uint32_t data = vm_peekbits(code, size, *bitpos);
+
+    if (data & 0x8000) {
+        op->type    = VM_OPREG;
+        op->reg     = (data >> 12) & 7;
+        *bitpos    += 4;
+    } else if ((data & 0xc000) == 0) {
+        op->type    = VM_OPINT;
+        if (bytemode) {
+            op->value   = (data >> 6) & 0xff;
+            *bitpos    += 10;
+        } else {
+            *bitpos    += 2;
+            op->value   = vm_decode_data(code, size, bitpos);
+        }
+    } else if ((data & 0x2000) == 0) {
+        op->type    = VM_OPREGMEM;
+        op->reg     = (data >> 10) & 7;
+        op->value   = 0;
+        *bitpos    += 6;
+    } else if ((data & 0x1000) == 0) {
+        op->type    = VM_OPREGMEM;
+        op->reg     = (data >> 9) & 7;
+        *bitpos    += 7;
+        op->value   = vm_decode_data(code, size, bitpos);
+    } else {
+        op->type    = VM_OPMEM;
+        *bitpos    += 4;
+        op->value   = vm_decode_data(code, size, bitpos);
+    }
+}
+
+// Decode the RarVM bytecode in code, including the leading check byte, in the
+// same way unrar prepares a program for execution.
+bool vm_program_decode(vm_program_t **program, const uint8_t *code, uint32_t size)
+{
+    vm_program_t *prg;
+    uint32_t      bitpos;
+    uint8_t       checkbyte = 0;
+
+    if (size == 0)
+        return false;
+
+    for (uint32_t i = 1; i < size; i++)
+        checkbyte ^= code[i];
+
+    // Rar silently replaces invalid programs with a ret, I would rather know.
+    if (checkbyte != code[0])
+        return false;
+
+    prg = calloc(1, sizeof *prg);
+
+    // Skip over check byte.
+    bitpos = 8;
+
+    // Static data, as created by DB operators.
+    if (vm_peekbits(code, size, bitpos++) & 0x8000) {
+        uint32_t datasize = vm_decode_data(code, size, &bitpos) + 1;
+
+        prg->data = malloc(datasize);
+
+        while (bitpos / 8 < size && prg->datasize < datasize) {
+            prg->data[prg->datasize++] = vm_peekbits(code, size, bitpos) >> 8;
+            bitpos += 8;
+        }
+    }
+
+    while (bitpos / 8 < size) {
+        vm_insn_t *insn;
+        uint32_t   data;
+
+        prg->insns = realloc(prg->insns, sizeof(vm_insn_t) * (prg->count + 1));
+        insn       = memset(&prg->insns[prg->count], 0, sizeof(vm_insn_t));
+        data       = vm_peekbits(code, size, bitpos);
+
+        insn->bitpos = bitpos - 8;
+
+        // There are two possible opcode encodings, 3 and 5 bits.
+        if ((data & 0x8000) == 0) {
+            insn->opcode = data >> 12;
+            bitpos      += 4;
+        } else {
+            insn->opcode = (data >> 10) - 24;
+            bitpos      += 6;
+        }
+
+        if (vm_opcode_flags_table[insn->opcode] & VMCF_BYTEMODE) {
+            insn->bytemode = vm_peekbits(code, size, bitpos++) >> 15;
+        }
+
+        if (vm_opcode_flags_table[insn->opcode] & (VMCF_OP1 | VMCF_OP2)) {
+            vm_decode_operand(code, size, &bitpos, &insn->op1, insn->bytemode);
+
+            if (vm_opcode_flags_table[insn->opcode] & VMCF_OP2) {
+                vm_decode_operand(code, size, &bitpos, &insn->op2, insn->bytemode);
+            } else if (insn->op1.type == VM_OPINT
+                    && vm_opcode_flags_table[insn->opcode] & (VMCF_JUMP | VMCF_PROC)) {
+                // Branch targets are encoded relative to the current
+                // instruction, unless they're larger than 256.
+                int32_t distance = insn->op1.value;
+
+                if (distance >= 256) {
+                    distance -= 256;
+                } else {
+                    if (distance >= 136) {
+                        distance -= 264;
+                    } else if (distance >= 16) {
+                        distance -= 8;
+                    } else if (distance >= 8) {
+                        distance -= 16;
+                    }
+                    distance += prg->count;
+                }
+
+                insn->op1.value = distance;
+            }
+        }
+
+        insn->bitlen = bitpos - 8 - insn->bitpos;
+        prg->count++;
+    }
+
+    // Rar appends a ret to every program.
+    prg->insns = realloc(prg->insns, sizeof(vm_insn_t) * (prg->count + 1));
+
+    memset(&prg->insns[prg->count], 0, sizeof(vm_insn_t));
+
+    prg->insns[prg->count].opcode = VM_RET;
+    prg->insns[prg->count].bitpos = bitpos - 8;
+    prg->count++;
+
+    prg->filter = vm_standard_filter(code, size);
+
+    *program = prg;
+    return true;
+}
+
+// Read and decode a RarVM object file, as produced by raras.
+bool vm_program_load(vm_program_t **program, const char *filename)
+{
+    FILE    *input;
+    uint8_t *code   = NULL;
+    size_t   size   = 0;
+    size_t   count;
+    bool     result;
+
+    if (!(input = fopen(filename, "r"))) {
+        return false;
+    }
+
+    do {
+        code   = realloc(code, size + BUFSIZ);
+        count  = fread(code + size, 1, BUFSIZ, input);
+        size  += count;
+    } while (count == BUFSIZ);
+
+    fclose(input);
+
+    result = vm_program_decode(program, code, size);
+
+    free(code);
+    return result;
+}
+
+bool vm_program_destroy(vm_program_t *program)
+{
+    free(program->insns);
+    free(program->data);
+    free(program);
+    return true;
+}
+
+// Identifies a program as it was loaded, e.g. so that state saved for one
+// program isn't used with another.
+uint32_t vm_program_hash(const vm_program_t *program)
+{
+    uint32_t hash = crc32(0, program->data, program->datasize);
+
+    for (uint32_t i = 0; i < program->count; i++) {
+        const vm_insn_t *insn = &program->insns[i];
+        uint32_t         fields[] = {
+            insn->opcode,
+            insn->bytemode,
+            insn->op1.type,
+            insn->op1.reg,
+            insn->op1.value,
+            insn->op2.type,
+            insn->op2.reg,
+            insn->op2.value,
+        };
+
+        hash = crc32(hash, (const uint8_t *) fields, sizeof fields);
+    }
+
+    return hash;
+}
+
+vm_stdfilter_t vm_standard_filter(const uint8_t *code, uint32_t size)
+{
+    static const struct {
+        uint32_t        length;
+        uint32_t        crc;
+        vm_stdfilter_t  type;
+    } signatures[] = {
+        {  53, 0xad576887, VMSF_E8      },
+        {  57, 0x3cd7e57e, VMSF_E8E9    },
+        { 120, 0x3769893f, VMSF_ITANIUM },
+        {  29, 0x0e06077d, VMSF_DELTA   },
+        { 149, 0x1c2c5dc8, VMSF_RGB     },
+        { 216, 0xbc85e701, VMSF_AUDIO   },
+        {  40, 0x46b9c560, VMSF_UPCASE  },
+    };
+
+    for (int i = 0; i < sizeof signatures / sizeof *signatures; i++) {
+        if (signatures[i].length == size && signatures[i].crc == crc32(0, code, size)) {
+            return signatures[i].type;
+        }
+    }
+
+    return VMSF_NONE;
+}
+
+const char * vm_standard_filter_name(vm_stdfilter_t filter)
+{
+    static const char * names[] = {
+        [VMSF_NONE]     = "none",
+        [VMSF_E8]       = "e8",
+        [VMSF_E8E9]     = "e8e9",
+        [VMSF_ITANIUM]  = "itanium",
+        [VMSF_RGB]      = "rgb",
+        [VMSF_AUDIO]    = "audio",
+        [VMSF_DELTA]    = "delta",
+        [VMSF_UPCASE]   = "upcase",
+    };
+
+    return names[filter];
+}
+
+static const char *kMnemonics[VM_STANDARD] = {
+    [VM_MOV]   = "mov",   [VM_CMP]   = "cmp",   [VM_ADD]   = "add",   [VM_SUB]   = "sub",
+    [VM_JZ]    = "jz",    [VM_JNZ]   = "jnz",   [VM_INC]   = "inc",   [VM_DEC]   = "dec",
+    [VM_JMP]   = "jmp",   [VM_XOR]   = "xor",   [VM_AND]   = "and",   [VM_OR]    = "or",
+    [VM_TEST]  = "test",  [VM_JS]    = "js",    [VM_JNS]   = "jns",   [VM_JB]    = "jb",
+    [VM_JBE]   = "jbe",   [VM_JA]    = "ja",    [VM_JAE]   = "jae",   [VM_PUSH]  = "push",
+    [VM_POP]   = "pop",   [VM_CALL]  = "call",  [VM_RET]   = "ret",   [VM_NOT]   = "not",
+    [VM_SHL]   = "shl",   [VM_SHR]   = "shr",   [VM_SAR]   = "sar",   [VM_NEG]   = "neg",
+    [VM_PUSHA] = "pusha", [VM_POPA]  = "popa",  [VM_PUSHF] = "pushf", [VM_POPF]  = "popf",
+    [VM_MOVZX] = "movzx", [VM_MOVSX] = "movsx", [VM_XCHG]  = "xchg",  [VM_MUL]   = "mul",
+    [VM_DIV]   = "div",   [VM_ADC]   = "adc",   [VM_SBB]   = "sbb",   [VM_PRINT] = "print",
+    [VM_MOVB]  = "movb",  [VM_MOVD]  = "movd",  [VM_CMPB]  = "cmpb",  [VM_CMPD]  = "cmpd",
+    [VM_ADDB]  = "addb",  [VM_ADDD]  = "addd",  [VM_SUBB]  = "subb",  [VM_SUBD]  = "subd",
+    [VM_INCB]  = "incb",  [VM_INCD]  = "incd",  [VM_DECB]  = "decb",  [VM_DECD]  = "decd",
+    [VM_NEGB]  = "negb",  [VM_NEGD]  = "negd",
+};
+
+// The assembler mnemonic for an opcode. Rar supports a byte form of every
+// arithmetic instruction, but only a few of them can be written in assembly,
+// returns NULL for the others.
+const char * vm_mnemonic(uint8_t opcode, bool bytemode)
+{
+    static const uint8_t byteforms[] = {
+        [VM_MOV]    = VM_MOVB,
+        [VM_CMP]    = VM_CMPB,
+        [VM_ADD]    = VM_ADDB,
+        [VM_SUB]    = VM_SUBB,
+        [VM_INC]    = VM_INCB,
+        [VM_DEC]    = VM_DECB,
+        [VM_NEG]    = VM_NEGB,
+    };
+
+    if (bytemode)
+        return opcode < sizeof byteforms && byteforms[opcode] ? kMnemonics[byteforms[opcode]] : NULL;
+
+    return opcode < VM_STANDARD ? kMnemonics[opcode] : NULL;
+}
+
+static int vm_format_operand(char *buf, size_t size, const vm_operand_t *op)
+{
+    switch (op->type) {
+        case VM_OPREG:
+            return snprintf(buf, size, "r%u", op->reg);
+        case VM_OPINT:
+            return snprintf(buf, size, op->value < 10 ? "#%u" : "#%#x", op->value);
+        case VM_OPREGMEM:
+            if (op->value == 0)
+                return snprintf(buf, size, "[r%u]", op->reg);
+            if (op->value > 0xffff0000)
+                return snprintf(buf, size, "[r%u-#%u]", op->reg, -op->value);
+            return snprintf(buf, size, "[r%u+#%u]", op->reg, op->value);
+        case VM_OPMEM:
+            return snprintf(buf, size, "[#%#x]", op->value);
+    }
+    return snprintf(buf, size, "?");
+}
+
+// Format the instruction in the style of the stdlib, so that it can be pasted
+// back into the source. Byte forms without a mnemonic are shown with a b
+// suffix, but can't be assembled.
+const char * vm_format_insn(char *buf, size_t size, const vm_insn_t *insn)
+{
+    uint8_t     flags       = vm_opcode_flags_table[insn->opcode];
+    const char *mnemonic    = vm_mnemonic(insn->opcode, insn->bytemode);
+    char        name[16];
+    size_t      len;
+
+    if (!mnemonic) {
+        snprintf(name, sizeof name, "%sb", kMnemonics[insn->opcode]);
+        mnemonic = name;
+    }
+
+    len = snprintf(buf, size, "%-8s", mnemonic);
+
+    if (flags & (VMCF_OP1 | VMCF_OP2) && len < size)
+        len += vm_format_operand(buf + len, size - len, &insn->op1);
+
+    if (flags & VMCF_OP2 && len < size) {
+        len += snprintf(buf + len, size - len, ", ");
+        if (len < size)
+            vm_format_operand(buf + len, size - len, &insn->op2);
+    }
+
+    // No trailing space for pushf and popf.
+    if (!(flags & (VMCF_OP1 | VMCF_OP2)))
+        buf[strcspn(buf, " ")] = '\0';
+
+    return buf;
+}
+
+bool vm_create(vm_t **vm)
+{
+    if ((*vm = calloc(1, sizeof(vm_t)))) {
+        // Rar allocates a few extra bytes so that dword accesses at the very
+        // end of the address space don't need special handling.
+        if (((*vm)->mem = calloc(1, VM_MEMSIZE + 4))) {
+            return true;
+        }
+        free(*vm);
+    }
+    return false;
+}
+
+bool vm_destroy(vm_t *vm)
+{
+    free(vm->mem);
+    free(vm);
+    return true;
+}
+
+static inline uint32_t vm_getvalue(bool bytemode, const uint8_t *addr)
+{
+    uint32_t value;
+
+    if (bytemode)
+        return *addr;
+
+    memcpy(&value, addr, sizeof value);
+    return value;
+}
+
+static inline void vm_setvalue(bool bytemode, uint8_t *addr, uint32_t value)
+{
+    if (bytemode) {
+        *addr = value;
+    } else {
+        memcpy(addr, &value, sizeof value);
+    }
+}
+
+// Record that memory at addr is about to be accessed, a dword might span two
+// pages. The few bytes past the end belong to the last page.
+static inline uint8_t *vm_memory(vm_t *vm, uint32_t addr)
+{
+    addr       &= VM_MEMMASK;
+    vm->dirty  |= 1ULL << (addr / VM_PAGESIZE) | 1ULL << ((addr + 3) / VM_PAGESIZE % VM_NUMPAGES);
+    return &vm->mem[addr];
+}
+
+// Prepare vm to execute program with the default register set, the data to
+// be filtered is copied to the start of memory.
+bool vm_reset(vm_t *vm, const vm_program_t *program, const uint8_t *block, uint32_t blocklength)
+{
+    memset(vm->mem, 0, VM_MEMSIZE + 4);
+
+    vm->dirty = ~0ULL;
+
+    return vm_prepare(vm, program, NULL, block, blocklength);
+}
+
+// Like vm_reset, but memory is not cleared first, e.g. because it was just
+// restored from a snapshot. If initr is specified, it replaces r0-r6.
+bool vm_prepare(vm_t *vm,
+                const vm_program_t *program,
+                const uint32_t *initr,
+                const uint8_t *block,
+                uint32_t blocklength)
+{
+    uint32_t datasize = program->datasize;
+
+    memset(vm->r, 0, sizeof vm->r);
+
+    vm->r[REG3]     = VM_GLOBALMEMADDR;
+    vm->r[REG4]     = blocklength;
+    vm->r[REG5]     = 0;
+    vm->flags       = 0;
+    vm->ip          = 0;
+    vm->icount      = 0;
+    vm->mcount      = 0;
+
+    if (initr)
+        memcpy(vm->r, initr, sizeof(uint32_t) * REG7);
+
+    if (blocklength > VM_GLOBALMEMADDR)
+        return false;
+
+    for (uint32_t i = 0; i < blocklength; i += VM_PAGESIZE)
+        vm_memory(vm, i);
+
+    memcpy(vm->mem, block, blocklength);
+
+    // The fixed globals mirror the initial registers.
+    for (int i = REG0; i < REG7; i++)
+        vm_setvalue(false, vm_memory(vm, VM_GLOBALMEMADDR + i * 4), vm->r[i]);
+
+    vm_setvalue(false, vm_memory(vm, VMADDR_NEWBLOCKSIZE), blocklength);
+    vm_setvalue(false, vm_memory(vm, VMADDR_EXECCOUNT), vm->r[REG5]);
+
+    if (datasize > VM_GLOBALMEMSIZE - VM_FIXEDGLOBALSIZE)
+        datasize = VM_GLOBALMEMSIZE - VM_FIXEDGLOBALSIZE;
+
+    for (uint32_t i = 0; i < datasize; i += VM_PAGESIZE)
+        vm_memory(vm, VM_GLOBALMEMADDR + VM_FIXEDGLOBALSIZE + i);
+
+    memcpy(&vm->mem[VM_GLOBALMEMADDR + VM_FIXEDGLOBALSIZE], program->data, datasize);
+
+    vm->r[REG7] = VM_MEMSIZE;
+    return true;
+}
+
+// Save a copy of memory, after this only modified pages are tracked.
+bool vm_snapshot(vm_t *vm, uint8_t **snapshot)
+{
+    if (!(*snapshot = malloc(VM_MEMSIZE + 4)))
+        return false;
+
+    memcpy(*snapshot, vm->mem, VM_MEMSIZE + 4);
+
+    vm->dirty = 0;
+    return true;
+}
+
+// Copy back only the pages that were modified since the snapshot, this is
+// usually a tiny fraction of memory.
+bool vm_restore(vm_t *vm, const uint8_t *snapshot)
+{
+    for (uint64_t dirty = vm->dirty; dirty; dirty &= dirty - 1) {
+        uint32_t page = __builtin_ctzll(dirty);
+        uint32_t size = page == VM_NUMPAGES - 1 ? VM_PAGESIZE + 4 : VM_PAGESIZE;
+
+        memcpy(&vm->mem[page * VM_PAGESIZE], &snapshot[page * VM_PAGESIZE], size);
+    }
+
+    vm->dirty = 0;
+    return true;
+}
+
+static inline uint8_t *vm_operand(vm_t *vm, vm_operand_t *op)
+{
+    switch (op->type) {
+        case VM_OPREG:      return (uint8_t *) &vm->r[op->reg];
+        case VM_OPREGMEM:   vm->mcount++;
+                            return vm_memory(vm, vm->r[op->reg] + op->value);
+        case VM_OPMEM:      vm->mcount++;
+                            return vm_memory(vm, op->value);
+    }
+
+    // Immediates are writable in RarVM, the value is simply replaced.
+    return (uint8_t *) &op->value;
+}
+
+// Count an edge in the coverage bitmap, if there is one. The hash is just
+// something cheap that spreads out nearby edges.
+#define VM_EDGE(from, to) {                                     \
+        if (vm->coverage)                                       \
+            vm->coverage[((from) * 0x9E3779B1                   \
+                        ^ (to) * 0x85EBCA6B) >> 16]++;          \
+    }
+
+// Transfer control to the specified instruction, leaving the code segment
+// terminates the program normally.
+#define VM_SETIP(target) {                                      \
+        uint32_t __from = vm->ip;                               \
+        vm->ip = (target);                                      \
+        VM_EDGE(__from, vm->ip);                                \
+        if (vm->ip >= program->count)                           \
+            return true;                                        \
+        continue;                                               \
+    }
+
+// A conditional branch, both outcomes are separate edges.
+#define VM_BRANCH(condition) {                                  \
+        if (condition)                                          \
+            VM_SETIP(vm_getvalue(false, op1));                  \
+        VM_EDGE(vm->ip, vm->ip + 1);                            \
+        break;                                                  \
+    }
+
+// Execute program from the current instruction, returns true if the program
+// terminated normally, or false if maxinsns was reached. In that case exactly
+// maxinsns instructions have been executed, and calling it again with a larger
+// limit continues where it left off.
+bool vm_execute(vm_t *vm, vm_program_t *program, uint64_t maxinsns)
+{
+    // Rar doesn't interpret the standard filters, so neither do we. The
+    // filter could have written anywhere, so assume every page is dirty.
+    if (program->filter != VMSF_NONE) {
+        vm->dirty = ~0ULL;
+        return stdfilter_execute(stdfilter_best_isa(), program->filter, vm->mem, vm->r);
+    }
+
+    while (vm->icount < maxinsns) {
+        vm_insn_t *insn     = &program->insns[vm->ip];
+        bool       bytemode = insn->bytemode;
+        uint8_t   *op1      = vm_operand(vm, &insn->op1);
+        uint8_t   *op2      = vm_operand(vm, &insn->op2);
+        uint8_t   *sp       = &vm->mem[vm->r[REG7] & VM_MEMMASK];
+        uint32_t   value1;
+        uint32_t   value2;
+        uint32_t   result;
+
+        vm->icount++;
+
+        switch (insn->opcode) {
+            case VM_MOV:
+                vm_setvalue(bytemode, op1, vm_getvalue(bytemode, op2));
+                break;
+            case VM_CMP:
+                value1      = vm_getvalue(bytemode, op1);
+                result      = value1 - vm_getvalue(bytemode, op2);
+                vm->flags   = result == 0 ? VM_FZ : (result > value1) | (result & VM_FS);
+                break;
+            case VM_ADD:
+                value1      = vm_getvalue(bytemode, op1);
+                result      = value1 + vm_getvalue(bytemode, op2);
+                if (bytemode) {
+                    result     &= 0xff;
+                    vm->flags   = (result < value1) | (result == 0 ? VM_FZ : (result & 0x80) ? VM_FS : 0);
+                } else {
+                    vm->flags   = (result < value1) | (result == 0 ? VM_FZ : (result & VM_FS));
+                }
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_SUB:
+                value1      = vm_getvalue(bytemode, op1);
+                result      = value1 - vm_getvalue(bytemode, op2);
+                vm->flags   = result == 0 ? VM_FZ : (result > value1) | (result & VM_FS);
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_JZ:
+                VM_BRANCH(vm->flags & VM_FZ);
+            case VM_JNZ:
+                VM_BRANCH(!(vm->flags & VM_FZ));
+            case VM_INC:
+                result      = vm_getvalue(bytemode, op1) + 1;
+                if (bytemode)
+                    result &= 0xff;
+                vm_setvalue(bytemode, op1, result);
+                vm->flags   = result == 0 ? VM_FZ : result & VM_FS;
+                break;
+            case VM_DEC:
+                result      = vm_getvalue(bytemode, op1) - 1;
+                vm_setvalue(bytemode, op1, result);
+                vm->flags   = result == 0 ? VM_FZ : result & VM_FS;
+                break;
+            case VM_JMP:
+                VM_SETIP(vm_getvalue(false, op1));
+            case VM_XOR:
+                result      = vm_getvalue(bytemode, op1) ^ vm_getvalue(bytemode, op2);
+                vm->flags   = result == 0 ? VM_FZ : result & VM_FS;
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_AND:
+                result      = vm_getvalue(bytemode, op1) & vm_getvalue(bytemode, op2);
+                vm->flags   = result == 0 ? VM_FZ : result & VM_FS;
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_OR:
+                result      = vm_getvalue(bytemode, op1) | vm_getvalue(bytemode, op2);
+                vm->flags   = result == 0 ? VM_FZ : result & VM_FS;
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_TEST:
+                result      = vm_getvalue(bytemode, op1) & vm_getvalue(bytemode, op2);
+                vm->flags   = result == 0 ? VM_FZ : result & VM_FS;
+                break;
+            case VM_JS:
+                VM_BRANCH(vm->flags & VM_FS);
+            case VM_JNS:
+                VM_BRANCH(!(vm->flags & VM_FS));
+            case VM_JB:
+                VM_BRANCH(vm->flags & VM_FC);
+            case VM_JBE:
+                VM_BRANCH(vm->flags & (VM_FC | VM_FZ));
+            case VM_JA:
+                VM_BRANCH(!(vm->flags & (VM_FC | VM_FZ)));
+            case VM_JAE:
+                VM_BRANCH(!(vm->flags & VM_FC));
+            case VM_PUSH:
+                vm->r[REG7] -= 4;
+                vm_setvalue(false, vm_memory(vm, vm->r[REG7]), vm_getvalue(false, op1));
+                break;
+            case VM_POP:
+                vm_setvalue(false, op1, vm_getvalue(false, sp));
+                vm->r[REG7] += 4;
+                break;
+            case VM_CALL:
+                vm->r[REG7] -= 4;
+                vm_setvalue(false, vm_memory(vm, vm->r[REG7]), vm->ip + 1);
+                VM_SETIP(vm_getvalue(false, op1));
+            case VM_RET:
+                if (vm->r[REG7] >= VM_MEMSIZE)
+                    return true;
+                value1  = vm->ip;
+                vm->ip  = vm_getvalue(false, sp);
+                VM_EDGE(value1, vm->ip);
+                if (vm->ip >= program->count)
+                    return true;
+                vm->r[REG7] += 4;
+                continue;
+            case VM_NOT:
+                vm_setvalue(bytemode, op1, ~vm_getvalue(bytemode, op1));
+                break;
+            case VM_SHL:
+                value1      = vm_getvalue(bytemode, op1);
+                value2      = vm_getvalue(bytemode, op2);
+                result      = value1 << (value2 & 31);
+                vm->flags   = (result == 0 ? VM_FZ : (result & VM_FS))
+                            | ((value1 << ((value2 - 1) & 31)) & 0x80000000 ? VM_FC : 0);
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_SHR:
+                value1      = vm_getvalue(bytemode, op1);
+                value2      = vm_getvalue(bytemode, op2);
+                result      = value1 >> (value2 & 31);
+                vm->flags   = (result == 0 ? VM_FZ : (result & VM_FS))
+                            | ((value1 >> ((value2 - 1) & 31)) & VM_FC);
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_SAR:
+                value1      = vm_getvalue(bytemode, op1);
+                value2      = vm_getvalue(bytemode, op2);
+                result      = ((int32_t) value1) >> (value2 & 31);
+                vm->flags   = (result == 0 ? VM_FZ : (result & VM_FS))
+                            | ((value1 >> ((value2 - 1) & 31)) & VM_FC);
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_NEG:
+                result      = 0 - vm_getvalue(bytemode, op1);
+                vm->flags   = result == 0 ? VM_FZ : VM_FC | (result & VM_FS);
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_PUSHA:
+                for (uint32_t i = REG0, sp = vm->r[REG7] - 4; i <= REG7; i++, sp -= 4)
+                    vm_setvalue(false, vm_memory(vm, sp), vm->r[i]);
+                vm->r[REG7] -= 8 * 4;
+                break;
+            case VM_POPA:
+                for (uint32_t i = REG0, sp = vm->r[REG7]; i <= REG7; i++, sp += 4)
+                    vm->r[REG7 - i] = vm_getvalue(false, &vm->mem[sp & VM_MEMMASK]);
+                break;
+            case VM_PUSHF:
+                vm->r[REG7] -= 4;
+                vm_setvalue(false, vm_memory(vm, vm->r[REG7]), vm->flags);
+                break;
+            case VM_POPF:
+                vm->flags    = vm_getvalue(false, sp);
+                vm->r[REG7] += 4;
+                break;
+            case VM_MOVZX:
+                vm_setvalue(false, op1, vm_getvalue(true, op2));
+                break;
+            case VM_MOVSX:
+                vm_setvalue(false, op1, (int8_t) vm_getvalue(true, op2));
+                break;
+            case VM_XCHG:
+                value1      = vm_getvalue(bytemode, op1);
+                vm_setvalue(bytemode, op1, vm_getvalue(bytemode, op2));
+                vm_setvalue(bytemode, op2, value1);
+                break;
+            case VM_MUL:
+                result      = vm_getvalue(bytemode, op1) * vm_getvalue(bytemode, op2);
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_DIV:
+                // Division by zero is silently ignored.
+                if ((value2 = vm_getvalue(bytemode, op2)))
+                    vm_setvalue(bytemode, op1, vm_getvalue(bytemode, op1) / value2);
+                break;
+            case VM_ADC:
+                value1      = vm_getvalue(bytemode, op1);
+                value2      = vm->flags & VM_FC;
+                result      = value1 + vm_getvalue(bytemode, op2) + value2;
+                if (bytemode)
+                    result &= 0xff;
+                vm->flags   = (result < value1 || (result == value1 && value2))
+                            | (result == 0 ? VM_FZ : (result & VM_FS));
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_SBB:
+                value1      = vm_getvalue(bytemode, op1);
+                value2      = vm->flags & VM_FC;
+                result      = value1 - vm_getvalue(bytemode, op2) - value2;
+                vm->flags   = (result > value1 || (result == value1 && value2))
+                            | (result == 0 ? VM_FZ : (result & VM_FS));
+                vm_setvalue(bytemode, op1, result);
+                break;
+            case VM_PRINT:
+                break;
+        }
+
+        vm->ip++;
+    }
+
+    return false;
+}
+
+// Fetch the block the program requested be written to the output, the pointer
+// is into vm memory and is only valid until the next vm_reset.
+bool vm_getoutput(vm_t *vm, const uint8_t **data, uint32_t *size)
+{
+    uint32_t blockpos   = vm_getvalue(false, &vm->mem[VMADDR_NEWBLOCKPOS]) & VM_MEMMASK;
+    uint32_t blocksize  = vm_getvalue(false, &vm->mem[VMADDR_NEWBLOCKSIZE]) & VM_MEMMASK;
+
+    if (blockpos + blocksize >= VM_MEMSIZE) {
+        blockpos = blocksize = 0;
+    }
+
+    *data = &vm->mem[blockpos];
+    *size = blocksize;
+    return true;
+}
@@ -0,0 +1,139 @@
+#ifndef __RARVM_H
+#define __RARVM_H
+
+// Machine parameters, these match the values in stdlib/constants.rh.
+#define VM_MEMSIZE          0x00040000
+#define VM_MEMMASK          (VM_MEMSIZE - 1)
+#define VM_GLOBALMEMADDR    0x0003C000
+#define VM_GLOBALMEMSIZE    0x00002000
+#define VM_FIXEDGLOBALSIZE  64
+
+#define VMADDR_NEWBLOCKSIZE 0x0003C01C
+#define VMADDR_NEWBLOCKPOS  0x0003C020
+#define VMADDR_EXECCOUNT    0x0003C02C
+
+// Maximum number of instructions a program may execute, see README.md.
+#define VM_MAXINSNS         250000000
+
+// Memory is tracked in pages for snapshots, so there are exactly 64.
+#define VM_PAGESIZE         0x00001000
+#define VM_NUMPAGES         (VM_MEMSIZE / VM_PAGESIZE)
+
+// Size of the optional edge coverage bitmap, this matches afl.
+#define VM_COVERAGE_SIZE    0x00010000
+
+// Status flags.
+#define VM_FC               0x00000001
+#define VM_FZ               0x00000002
+#define VM_FS               0x80000000
+
+typedef enum {
+    VM_MOV,     VM_CMP,     VM_ADD,     VM_SUB,     VM_JZ,
+    VM_JNZ,     VM_INC,     VM_DEC,     VM_JMP,     VM_XOR,
+    VM_AND,     VM_OR,      VM_TEST,    VM_JS,      VM_JNS,
+    VM_JB,      VM_JBE,     VM_JA,      VM_JAE,     VM_PUSH,
+    VM_POP,     VM_CALL,    VM_RET,     VM_NOT,     VM_SHL,
+    VM_SHR,     VM_SAR,     VM_NEG,     VM_PUSHA,   VM_POPA,
+    VM_PUSHF,   VM_POPF,    VM_MOVZX,   VM_MOVSX,   VM_XCHG,
+    VM_MUL,     VM_DIV,     VM_ADC,     VM_SBB,     VM_PRINT,
+    VM_MOVB,    VM_MOVD,    VM_CMPB,    VM_CMPD,    VM_ADDB,
+    VM_ADDD,    VM_SUBB,    VM_SUBD,    VM_INCB,    VM_INCD,
+    VM_DECB,    VM_DECD,    VM_NEGB,    VM_NEGD,
+    VM_STANDARD,
+} vm_opcode_t;
+
+typedef enum {
+    VMCF_OP1        = 1 << 0,
+    VMCF_OP2        = 1 << 1,
+    VMCF_BYTEMODE   = 1 << 2,
+    VMCF_JUMP       = 1 << 3,
+    VMCF_PROC       = 1 << 4,
+} vm_opflags_t;
+
+typedef enum {
+    REG0,       REG1,       REG2,       REG3,       REG4,
+    REG5,       REG6,       REG7,
+} vm_reg_t;
+
+typedef enum {
+    VM_OPNONE,              // No operand.
+    VM_OPREG,               // r0
+    VM_OPINT,               // #0x1234
+    VM_OPREGMEM,            // [r0+#0x1234]
+    VM_OPMEM,               // [#0x1234]
+} vm_optype_t;
+
+// The filters built into rar, these are recognised by the crc and length of
+// their bytecode and executed natively.
+typedef enum {
+    VMSF_NONE,
+    VMSF_E8,
+    VMSF_E8E9,
+    VMSF_ITANIUM,
+    VMSF_RGB,
+    VMSF_AUDIO,
+    VMSF_DELTA,
+    VMSF_UPCASE,
+} vm_stdfilter_t;
+
+typedef struct {
+    uint8_t     type;
+    uint8_t     reg;
+    uint32_t    value;      // Immediate value, or base address for memory operands.
+} vm_operand_t;
+
+typedef struct {
+    uint8_t      opcode;
+    bool         bytemode;
+    vm_operand_t op1;
+    vm_operand_t op2;
+    uint32_t     bitpos;    // Offset of this instruction in the code, in bits.
+    uint32_t     bitlen;    // Number of bits used to encode this instruction.
+} vm_insn_t;
+
+typedef struct {
+    vm_insn_t  *insns;
+    uint32_t    count;      // Includes the implicit ret appended by rar.
+    uint8_t    *data;       // Static data, copied after the fixed globals.
+    uint32_t    datasize;
+    uint8_t     filter;     // A vm_stdfilter_t, these are executed natively.
+} vm_program_t;
+
+typedef struct {
+    uint32_t    r[8];
+    uint32_t    flags;
+    uint32_t    ip;
+    uint64_t    icount;     // Instructions executed.
+    uint64_t    mcount;     // Memory operands referenced.
+    uint64_t    dirty;      // Pages that might have changed since the last snapshot.
+    uint8_t    *coverage;   // If set, a hit count for each branch edge is recorded here.
+    uint8_t    *mem;
+} vm_t;
+
+extern const uint8_t vm_opcode_flags_table[UINT8_MAX];
+
+bool vm_program_decode(vm_program_t **program, const uint8_t *code, uint32_t size);
+bool vm_program_load(vm_program_t **program, const char *filename);
+bool vm_program_destroy(vm_program_t *program);
+uint32_t vm_program_hash(const vm_program_t *program);
+
+vm_stdfilter_t vm_standard_filter(const uint8_t *code, uint32_t size);
+const char * vm_standard_filter_name(vm_stdfilter_t filter);
+
+const char * vm_mnemonic(uint8_t opcode, bool bytemode);
+const char * vm_format_insn(char *buf, size_t size, const vm_insn_t *insn);
+
+bool vm_create(vm_t **vm);
+bool vm_destroy(vm_t *vm);
+bool vm_reset(vm_t *vm, const vm_program_t *program, const uint8_t *block, uint32_t blocklength);
+bool vm_prepare(vm_t *vm,
+                const vm_program_t *program,
+                const uint32_t *initr,
+                const uint8_t *block,
+                uint32_t blocklength);
+bool vm_snapshot(vm_t *vm, uint8_t **snapshot);
+bool vm_restore(vm_t *vm, const uint8_t *snapshot);
+bool vm_execute(vm_t *vm, vm_program_t *program, uint64_t maxinsns);
+bool vm_getoutput(vm_t *vm, const uint8_t **data, uint32_t *size);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef __SHA256_H
+#define __SHA256_H
+
+#define SHA256_DIGEST_SIZE  32
+
+typedef struct {
+    uint32_t    state[8];
+    uint64_t    length;
+    uint8_t     block[64];
+    size_t      used;
+} sha256_t;
+
+void sha256_init(sha256_t *ctx);
+void sha256_update(sha256_t *ctx, const void *data, size_t size);
+void sha256_final(sha256_t *ctx, uint8_t digest[SHA256_DIGEST_SIZE]);
+
+#endif
@@ -0,0 +1,79 @@
+// Check the SHA-256 implementation against the FIPS 180-2 examples.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "sha256.h"
+
+static const char *hex(const uint8_t digest[SHA256_DIGEST_SIZE])
+{
+    static char buf[SHA256_DIGEST_SIZE * 2 + 1];
+
+    for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+        sprintf(buf + i * 2, "%02x", digest[i]);
+
+    return buf;
+}
+
+// Hash the message in one call, then again in pieces of every size up to a
+// block and a bit, which must not change the result.
+static void check(const char *message, const char *expected)
+{
+    uint8_t  digest[SHA256_DIGEST_SIZE];
+    size_t   length = strlen(message);
+    sha256_t ctx;
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, message, length);
+    sha256_final(&ctx, digest);
+
+    assert(strcmp(hex(digest), expected) == 0);
+
+    for (size_t piece = 1; piece <= 65; piece++) {
+        sha256_init(&ctx);
+
+        for (size_t i = 0; i < length; i += piece)
+            sha256_update(&ctx, message + i, length - i < piece ? length - i : piece);
+
+        sha256_final(&ctx, digest);
+
+        assert(strcmp(hex(digest), expected) == 0);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t  digest[SHA256_DIGEST_SIZE];
+    char     block[1000];
+    sha256_t ctx;
+
+    check("",
+          "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855");
+    check("abc",
+          "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad");
+    check("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1");
+
+    // The long message, a million repetitions of 'a'.
+    memset(block, 'a', sizeof block);
+    sha256_init(&ctx);
+
+    for (int i = 0; i < 1000; i++)
+        sha256_update(&ctx, block, sizeof block);
+
+    sha256_final(&ctx, digest);
+
+    assert(strcmp(hex(digest), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0") == 0);
+    return 0;
+}
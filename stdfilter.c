@@ -0,0 +1,882 @@
+// Native versions of the standard rar filters.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "rarvm.h"
+#include "stdfilter.h"
+
+#if defined(__SSE2__)
+# include <emmintrin.h>
+# define HAVE_SSE2
+#endif
+
+// The AVX2 versions are compiled regardless of -march, and only used if the
+// cpu supports them.
+#if defined(HAVE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# include <immintrin.h>
+# define HAVE_AVX2
+# define AVX2 __attribute__((target("avx2")))
+#endif
+
+// The e8 filter assumes this is the maximum executable size.
+#define E8_FILESIZE 0x01000000
+
+static inline uint32_t getle32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline void putle32(uint8_t *p, uint32_t value)
+{
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+// Number of bytes belonging to channel c, when size bytes are interleaved
+// across channels.
+static inline uint32_t channel_size(uint32_t size, uint32_t channels, uint32_t c)
+{
+    return c < size ? (size - c - 1) / channels + 1 : 0;
+}
+
+// The compressor made the call at data[pos] absolute, so convert it back to
+// relative.
+static inline void e8_translate(uint8_t *data, uint32_t pos, uint32_t offset)
+{
+    uint32_t addr = getle32(data + pos + 1);
+    uint32_t next = pos + 1 + offset;
+
+    if (addr & 0x80000000) {
+        if (((addr + next) & 0x80000000) == 0)
+            putle32(data + pos + 1, addr + E8_FILESIZE);
+    } else if ((addr - E8_FILESIZE) & 0x80000000) {
+        putle32(data + pos + 1, addr - next);
+    }
+}
+
+static void e8_scalar(uint8_t *data, uint32_t pos, uint32_t size, uint32_t offset, uint8_t cmp)
+{
+    for (; pos + 4 < size; pos++) {
+        if (data[pos] == 0xe8 || data[pos] == cmp) {
+            e8_translate(data, pos, offset);
+            pos += 4;
+        }
+    }
+}
+
+static inline uint32_t itanium_getbits(const uint8_t *data, uint32_t bitpos, uint32_t count)
+{
+    return getle32(data + bitpos / 8) >> (bitpos & 7) & (0xffffffff >> (32 - count));
+}
+
+static inline void itanium_setbits(uint8_t *data, uint32_t value, uint32_t bitpos, uint32_t count)
+{
+    uint32_t mask = (0xffffffff >> (32 - count)) << (bitpos & 7);
+
+    putle32(data + bitpos / 8, (getle32(data + bitpos / 8) & ~mask) | value << (bitpos & 7));
+}
+
+static void itanium_scalar(uint8_t *data, uint32_t size, uint32_t offset)
+{
+    static const uint8_t masks[16] = {
+        4, 4, 6, 6, 0, 0, 7, 7, 4, 4, 0, 0, 4, 4, 0, 0,
+    };
+
+    offset >>= 4;
+
+    // Each bundle is 16 bytes, a template followed by three 41 bit slots.
+    for (uint32_t pos = 0; pos + 21 < size; pos += 16, data += 16, offset++) {
+        int32_t type = (data[0] & 0x1f) - 0x10;
+
+        if (type < 0)
+            continue;
+
+        for (int slot = 0; slot <= 2; slot++) {
+            uint32_t start = slot * 41 + 5;
+
+            if ((masks[type] & (1 << slot)) && itanium_getbits(data, start + 37, 4) == 5) {
+                uint32_t target = itanium_getbits(data, start + 13, 20);
+
+                itanium_setbits(data, (target - offset) & 0xfffff, start + 13, 20);
+            }
+        }
+    }
+}
+
+static void delta_scalar(const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels)
+{
+    for (uint32_t c = 0; c < channels && c < size; c++) {
+        uint8_t prev = 0;
+
+        for (uint64_t i = c; i < size; i += channels)
+            dst[i] = prev -= *src++;
+    }
+}
+
+// The paeth predictor, exactly as rar computes it.
+static inline uint8_t rgb_predict(const uint8_t *dst, uint32_t i, int32_t width, uint8_t prev)
+{
+    int64_t upperpos = (int64_t) i - width;
+    int     upper;
+    int     upperleft;
+    int     pa;
+    int     pb;
+    int     pc;
+
+    if (upperpos < 3)
+        return prev;
+
+    upper       = dst[upperpos];
+    upperleft   = dst[upperpos - 3];
+    pa          = abs(upper - upperleft);
+    pb          = abs(prev - upperleft);
+    pc          = abs(prev + upper - upperleft - upperleft);
+
+    if (pa <= pb && pa <= pc)
+        return prev;
+
+    return pb <= pc ? upper : upperleft;
+}
+
+// The red and blue channels are stored as differences from green.
+static void rgb_fixup(uint8_t *dst, uint32_t size, uint32_t posr)
+{
+    for (uint64_t i = posr; i + 2 < size; i += 3) {
+        dst[i]     += dst[i + 1];
+        dst[i + 2] += dst[i + 1];
+    }
+}
+
+static void rgb_scalar(const uint8_t *src, uint8_t *dst, uint32_t size, int32_t width, uint32_t posr)
+{
+    for (uint32_t c = 0; c < 3; c++) {
+        uint8_t prev = 0;
+
+        for (uint32_t i = c; i < size; i += 3)
+            dst[i] = prev = rgb_predict(dst, i, width, prev) - *src++;
+    }
+
+    rgb_fixup(dst, size, posr);
+}
+
+// The audio filter is an adaptive predictor, the weights are adjusted every
+// 32 samples depending on which would have done best.
+typedef struct {
+    int32_t     prevbyte;
+    int32_t     prevdelta;
+    int32_t     d1;
+    int32_t     d2;
+    int32_t     d3;
+    int32_t     k1;
+    int32_t     k2;
+    int32_t     k3;
+    uint32_t    dif[7];
+} audio_state_t;
+
+static inline void audio_adapt(int32_t *k1, int32_t *k2, int32_t *k3, uint32_t num)
+{
+    switch (num) {
+        case 1: if (*k1 >= -16) --*k1; break;
+        case 2: if (*k1 <   16) ++*k1; break;
+        case 3: if (*k2 >= -16) --*k2; break;
+        case 4: if (*k2 <   16) ++*k2; break;
+        case 5: if (*k3 >= -16) --*k3; break;
+        case 6: if (*k3 <   16) ++*k3; break;
+    }
+}
+
+static inline uint8_t audio_step(audio_state_t *s, uint8_t cur, uint32_t count)
+{
+    int32_t  d = (int8_t) cur * 8;
+    uint32_t predicted;
+
+    s->d3 = s->d2;
+    s->d2 = s->prevdelta - s->d1;
+    s->d1 = s->prevdelta;
+
+    predicted       = 8 * s->prevbyte + s->k1 * s->d1 + s->k2 * s->d2 + s->k3 * s->d3;
+    predicted       = ((predicted >> 3) & 0xff) - cur;
+    s->prevdelta    = (int8_t) (predicted - s->prevbyte);
+    s->prevbyte     = predicted & 0xff;
+
+    s->dif[0] += abs(d);
+    s->dif[1] += abs(d - s->d1);
+    s->dif[2] += abs(d + s->d1);
+    s->dif[3] += abs(d - s->d2);
+    s->dif[4] += abs(d + s->d2);
+    s->dif[5] += abs(d - s->d3);
+    s->dif[6] += abs(d + s->d3);
+
+    if ((count & 0x1f) == 0) {
+        uint32_t min = s->dif[0];
+        uint32_t num = 0;
+
+        s->dif[0] = 0;
+
+        for (int j = 1; j < 7; j++) {
+            if (s->dif[j] < min) {
+                min = s->dif[j];
+                num = j;
+            }
+            s->dif[j] = 0;
+        }
+
+        audio_adapt(&s->k1, &s->k2, &s->k3, num);
+    }
+
+    return predicted;
+}
+
+static void audio_scalar(const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels)
+{
+    for (uint32_t c = 0; c < channels && c < size; c++) {
+        audio_state_t state = {0};
+        uint32_t      count = 0;
+
+        for (uint64_t i = c; i < size; i += channels)
+            dst[i] = audio_step(&state, *src++, count++);
+    }
+}
+
+#ifdef HAVE_SSE2
+static inline __m128i abs_epi16(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+// Select a where mask is set, otherwise b.
+static inline __m128i select_si128(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline __m128i prefix_sum_epi8(__m128i x)
+{
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    return x;
+}
+
+// Copy the last byte into every byte.
+static inline __m128i broadcast_last_epi8(__m128i x)
+{
+    x = _mm_unpackhi_epi8(x, x);
+    x = _mm_shufflehi_epi16(x, 0xff);
+    return _mm_shuffle_epi32(x, 0xff);
+}
+
+// The opcode search is vectorised, translating an address restarts the
+// search after it, as the address might contain another opcode.
+static void e8_sse2(uint8_t *data, uint32_t size, uint32_t offset, uint8_t cmp)
+{
+    __m128i  e8  = _mm_set1_epi8(0xe8);
+    __m128i  e9  = _mm_set1_epi8(cmp);
+    uint32_t pos = 0;
+
+    while (pos + 16 + 4 <= size) {
+        __m128i  v      = _mm_loadu_si128((const __m128i *) (data + pos));
+        uint32_t mask   = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, e8),
+                                                         _mm_cmpeq_epi8(v, e9)));
+
+        if (mask == 0) {
+            pos += 16;
+            continue;
+        }
+
+        pos += __builtin_ctz(mask);
+
+        e8_translate(data, pos, offset);
+
+        pos += 5;
+    }
+
+    e8_scalar(data, pos, size, offset, cmp);
+}
+
+// A single channel is a running difference, which is a prefix sum 16 bytes at
+// a time.
+static void delta_single_sse2(const uint8_t *src, uint8_t *dst, uint32_t size)
+{
+    __m128i  prev = _mm_setzero_si128();
+    uint32_t i    = 0;
+    uint8_t  prevbyte;
+
+    for (; i + 16 <= size; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (src + i));
+
+        v    = _mm_sub_epi8(prev, prefix_sum_epi8(v));
+        prev = broadcast_last_epi8(v);
+
+        _mm_storeu_si128((__m128i *) (dst + i), v);
+    }
+
+    prevbyte = _mm_cvtsi128_si32(prev);
+
+    for (; i < size; i++)
+        dst[i] = prevbyte -= src[i];
+}
+
+// Two or four channels are interleaved in a register first, then it's a
+// prefix sum with a stride of the channel count. Scattering any other number
+// of channels a byte at a time is slower than just doing it all in scalar.
+static void delta_sse2(const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels)
+{
+    const uint8_t *plane[4];
+    uint32_t       count[4];
+    uint32_t       steps;
+    uint32_t       k        = 0;
+    __m128i        prev     = _mm_setzero_si128();
+    uint8_t        last[16];
+
+    if (channels == 1) {
+        delta_single_sse2(src, dst, size);
+        return;
+    }
+
+    if ((channels != 2 && channels != 4) || size < channels) {
+        delta_scalar(src, dst, size, channels);
+        return;
+    }
+
+    for (uint32_t c = 0; c < channels; c++) {
+        count[c] = channel_size(size, channels, c);
+        plane[c] = c ? plane[c - 1] + count[c - 1] : src;
+    }
+
+    steps = count[channels - 1];
+
+    for (; k + 16 / channels <= steps; k += 16 / channels) {
+        __m128i v;
+
+        if (channels == 2) {
+            v    = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (plane[0] + k)),
+                                     _mm_loadl_epi64((const __m128i *) (plane[1] + k)));
+            v    = _mm_add_epi8(v, _mm_slli_si128(v, 2));
+            v    = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+            v    = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+            v    = _mm_sub_epi8(prev, v);
+            prev = _mm_shuffle_epi32(_mm_shufflehi_epi16(v, 0xff), 0xff);
+        } else {
+            v    = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(getle32(plane[0] + k)),
+                                                        _mm_cvtsi32_si128(getle32(plane[1] + k))),
+                                      _mm_unpacklo_epi8(_mm_cvtsi32_si128(getle32(plane[2] + k)),
+                                                        _mm_cvtsi32_si128(getle32(plane[3] + k))));
+            v    = _mm_add_epi8(v, _mm_slli_si128(v, 4));
+            v    = _mm_add_epi8(v, _mm_slli_si128(v, 8));
+            v    = _mm_sub_epi8(prev, v);
+            prev = _mm_shuffle_epi32(v, 0xff);
+        }
+
+        _mm_storeu_si128((__m128i *) (dst + k * channels), v);
+    }
+
+    _mm_storeu_si128((__m128i *) last, prev);
+
+    for (uint32_t c = 0; c < channels; c++) {
+        for (uint32_t j = k; j < count[c]; j++) {
+            dst[c + j * channels] = last[c] -= plane[c][j];
+        }
+    }
+}
+
+// The three channels of a pixel are predicted together, which only works if
+// the row above is made of whole pixels, otherwise the prediction depends on
+// the order rar processes channels in.
+static void rgb_sse2(const uint8_t *src, uint8_t *dst, uint32_t size, int32_t width, uint32_t posr)
+{
+    const uint8_t *plane[3];
+    uint32_t       pixels   = size / 3;
+    uint32_t       first;
+    uint8_t        prev[3]  = {0};
+    uint32_t       p;
+    __m128i        left;
+    __m128i        mask     = _mm_set1_epi16(0xff);
+
+    if (width < 3 || width % 3) {
+        rgb_scalar(src, dst, size, width, posr);
+        return;
+    }
+
+    plane[0] = src;
+    plane[1] = plane[0] + channel_size(size, 3, 0);
+    plane[2] = plane[1] + channel_size(size, 3, 1);
+
+    // There is no row above the first, so it's just a difference.
+    first = (width + 3) / 3 < pixels ? (width + 3) / 3 : pixels;
+
+    for (p = 0; p < first; p++) {
+        for (int c = 0; c < 3; c++) {
+            dst[p * 3 + c] = prev[c] -= plane[c][p];
+        }
+    }
+
+    left = _mm_setr_epi16(prev[0], prev[1], prev[2], 0, 0, 0, 0, 0);
+
+    for (; p < pixels; p++) {
+        const uint8_t *above = dst + p * 3 - width;
+        uint32_t       pixel;
+        __m128i        upper;
+        __m128i        upperleft;
+        __m128i        cur;
+        __m128i        pa;
+        __m128i        pb;
+        __m128i        pc;
+        __m128i        predicted;
+
+        // The fourth lane is junk, but it's never stored.
+        upper       = _mm_unpacklo_epi8(_mm_cvtsi32_si128(getle32(above)), _mm_setzero_si128());
+        upperleft   = _mm_unpacklo_epi8(_mm_cvtsi32_si128(getle32(above - 3)), _mm_setzero_si128());
+        cur         = _mm_cvtsi32_si128(plane[0][p] | plane[1][p] << 16);
+        cur         = _mm_insert_epi16(cur, plane[2][p], 2);
+
+        pa          = abs_epi16(_mm_sub_epi16(upper, upperleft));
+        pb          = abs_epi16(_mm_sub_epi16(left, upperleft));
+        pc          = abs_epi16(_mm_sub_epi16(_mm_add_epi16(left, upper),
+                                              _mm_add_epi16(upperleft, upperleft)));
+
+        predicted   = select_si128(_mm_cmpgt_epi16(pb, pc), upperleft, upper);
+        predicted   = select_si128(_mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc)),
+                                   predicted,
+                                   left);
+
+        left        = _mm_and_si128(_mm_sub_epi16(predicted, cur), mask);
+        pixel       = _mm_cvtsi128_si32(_mm_packus_epi16(left, left));
+
+        dst[p * 3 + 0] = pixel;
+        dst[p * 3 + 1] = pixel >> 8;
+        dst[p * 3 + 2] = pixel >> 16;
+    }
+
+    // Finish any partial pixel.
+    prev[0] = _mm_extract_epi16(left, 0);
+    prev[1] = _mm_extract_epi16(left, 1);
+
+    for (uint32_t c = 0; p * 3 + c < size; c++)
+        dst[p * 3 + c] = rgb_predict(dst, p * 3 + c, width, prev[c]) - plane[c][p];
+
+    rgb_fixup(dst, size, posr);
+}
+
+// Audio has a long dependency chain within a channel, so instead up to 8
+// channels are predicted in parallel. The arithmetic all fits in 16 bits.
+static void audio_sse2(const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels)
+{
+    uint32_t        active  = channels < size ? channels : size;
+    const uint8_t  *next    = src;
+
+    // There's nothing to gain with a single channel, or with channels too
+    // short to pay for setting up the lanes.
+    if (active < 2 || size / channels < 16) {
+        audio_scalar(src, dst, size, channels);
+        return;
+    }
+
+    for (uint32_t g = 0; g < active; g += 8) {
+        uint32_t        lanes   = active - g < 8 ? active - g : 8;
+        const uint8_t  *in[8];
+        uint32_t        count[8];
+        uint32_t        steps;
+        audio_state_t   state[8];
+        int16_t         spill[8];
+        __m128i         prevbyte    = _mm_setzero_si128();
+        __m128i         prevdelta   = _mm_setzero_si128();
+        __m128i         d1          = _mm_setzero_si128();
+        __m128i         d2          = _mm_setzero_si128();
+        __m128i         d3          = _mm_setzero_si128();
+        __m128i         k1          = _mm_setzero_si128();
+        __m128i         k2          = _mm_setzero_si128();
+        __m128i         k3          = _mm_setzero_si128();
+        __m128i         dif[7];
+        __m128i         mask        = _mm_set1_epi16(0xff);
+        __m128i         bias        = _mm_set1_epi16(0x8000);
+
+        for (int j = 0; j < 7; j++)
+            dif[j] = _mm_setzero_si128();
+
+        // Find where each channel starts, unused lanes just repeat the first.
+        in[0] = next;
+
+        for (uint32_t j = 0; j < 8; j++) {
+            count[j] = channel_size(size, channels, g + j);
+
+            if (j >= lanes) {
+                in[j] = in[0];
+            } else if (j > 0) {
+                in[j] = in[j - 1] + count[j - 1];
+            }
+        }
+
+        next = in[lanes - 1] + count[lanes - 1];
+
+        // Later channels might be one byte shorter.
+        steps = count[lanes - 1];
+
+        for (uint32_t k = 0; k < steps; k++) {
+            __m128i  cur;
+            __m128i  d;
+            __m128i  predicted;
+            uint64_t out;
+            uint8_t *p = dst + g + (uint64_t) k * channels;
+
+            cur = _mm_cvtsi32_si128(in[0][k]);
+            cur = _mm_insert_epi16(cur, in[1][k], 1);
+            cur = _mm_insert_epi16(cur, in[2][k], 2);
+            cur = _mm_insert_epi16(cur, in[3][k], 3);
+            cur = _mm_insert_epi16(cur, in[4][k], 4);
+            cur = _mm_insert_epi16(cur, in[5][k], 5);
+            cur = _mm_insert_epi16(cur, in[6][k], 6);
+            cur = _mm_insert_epi16(cur, in[7][k], 7);
+
+            d3          = d2;
+            d2          = _mm_sub_epi16(prevdelta, d1);
+            d1          = prevdelta;
+
+            predicted   = _mm_add_epi16(_mm_slli_epi16(prevbyte, 3),
+                          _mm_add_epi16(_mm_mullo_epi16(k1, d1),
+                          _mm_add_epi16(_mm_mullo_epi16(k2, d2),
+                                        _mm_mullo_epi16(k3, d3))));
+            predicted   = _mm_and_si128(_mm_srli_epi16(predicted, 3), mask);
+            predicted   = _mm_and_si128(_mm_sub_epi16(predicted, cur), mask);
+            prevdelta   = _mm_srai_epi16(_mm_slli_epi16(_mm_sub_epi16(predicted, prevbyte), 8), 8);
+            prevbyte    = predicted;
+
+            d           = _mm_slli_epi16(_mm_srai_epi16(_mm_slli_epi16(cur, 8), 8), 3);
+            dif[0]      = _mm_add_epi16(dif[0], abs_epi16(d));
+            dif[1]      = _mm_add_epi16(dif[1], abs_epi16(_mm_sub_epi16(d, d1)));
+            dif[2]      = _mm_add_epi16(dif[2], abs_epi16(_mm_add_epi16(d, d1)));
+            dif[3]      = _mm_add_epi16(dif[3], abs_epi16(_mm_sub_epi16(d, d2)));
+            dif[4]      = _mm_add_epi16(dif[4], abs_epi16(_mm_add_epi16(d, d2)));
+            dif[5]      = _mm_add_epi16(dif[5], abs_epi16(_mm_sub_epi16(d, d3)));
+            dif[6]      = _mm_add_epi16(dif[6], abs_epi16(_mm_add_epi16(d, d3)));
+
+            // The differences are unsigned, but there are only signed compares.
+            if ((k & 0x1f) == 0) {
+                __m128i min = _mm_xor_si128(dif[0], bias);
+                __m128i num = _mm_setzero_si128();
+
+                for (int j = 1; j < 7; j++) {
+                    __m128i v  = _mm_xor_si128(dif[j], bias);
+                    __m128i lt = _mm_cmplt_epi16(v, min);
+
+                    min = select_si128(lt, v, min);
+                    num = select_si128(lt, _mm_set1_epi16(j), num);
+                }
+
+                for (int j = 0; j < 7; j++)
+                    dif[j] = _mm_setzero_si128();
+
+                // Adding a true mask decrements.
+                k1 = _mm_add_epi16(k1, _mm_and_si128(_mm_cmpeq_epi16(num, _mm_set1_epi16(1)),
+                                                     _mm_cmpgt_epi16(k1, _mm_set1_epi16(-17))));
+                k1 = _mm_sub_epi16(k1, _mm_and_si128(_mm_cmpeq_epi16(num, _mm_set1_epi16(2)),
+                                                     _mm_cmplt_epi16(k1, _mm_set1_epi16(16))));
+                k2 = _mm_add_epi16(k2, _mm_and_si128(_mm_cmpeq_epi16(num, _mm_set1_epi16(3)),
+                                                     _mm_cmpgt_epi16(k2, _mm_set1_epi16(-17))));
+                k2 = _mm_sub_epi16(k2, _mm_and_si128(_mm_cmpeq_epi16(num, _mm_set1_epi16(4)),
+                                                     _mm_cmplt_epi16(k2, _mm_set1_epi16(16))));
+                k3 = _mm_add_epi16(k3, _mm_and_si128(_mm_cmpeq_epi16(num, _mm_set1_epi16(5)),
+                                                     _mm_cmpgt_epi16(k3, _mm_set1_epi16(-17))));
+                k3 = _mm_sub_epi16(k3, _mm_and_si128(_mm_cmpeq_epi16(num, _mm_set1_epi16(6)),
+                                                     _mm_cmplt_epi16(k3, _mm_set1_epi16(16))));
+            }
+
+            _mm_storel_epi64((__m128i *) &out, _mm_packus_epi16(predicted, predicted));
+
+            for (uint32_t j = 0; j < lanes; j++)
+                p[j] = out >> (j * 8);
+        }
+
+        // Move the state into scalar form to finish the longer channels.
+        memset(state, 0, sizeof state);
+
+#define SPILL(v, field)                                                 \
+        _mm_storeu_si128((__m128i *) spill, v);                         \
+        for (uint32_t j = 0; j < lanes; j++) state[j].field = spill[j];
+
+        SPILL(prevbyte, prevbyte);
+        SPILL(prevdelta, prevdelta);
+        SPILL(d1, d1);
+        SPILL(d2, d2);
+        SPILL(d3, d3);
+        SPILL(k1, k1);
+        SPILL(k2, k2);
+        SPILL(k3, k3);
+
+        for (int i = 0; i < 7; i++) {
+            _mm_storeu_si128((__m128i *) spill, dif[i]);
+            for (uint32_t j = 0; j < lanes; j++)
+                state[j].dif[i] = (uint16_t) spill[j];
+        }
+#undef SPILL
+
+        for (uint32_t j = 0; j < lanes; j++) {
+            for (uint32_t k = steps; k < count[j]; k++) {
+                dst[g + j + (uint64_t) k * channels] = audio_step(&state[j], in[j][k], k);
+            }
+        }
+    }
+}
+#endif
+
+#ifdef HAVE_AVX2
+AVX2 static void e8_avx2(uint8_t *data, uint32_t size, uint32_t offset, uint8_t cmp)
+{
+    __m256i  e8  = _mm256_set1_epi8(0xe8);
+    __m256i  e9  = _mm256_set1_epi8(cmp);
+    uint32_t pos = 0;
+
+    while (pos + 32 + 4 <= size) {
+        __m256i  v      = _mm256_loadu_si256((const __m256i *) (data + pos));
+        uint32_t mask   = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, e8),
+                                                               _mm256_cmpeq_epi8(v, e9)));
+
+        if (mask == 0) {
+            pos += 32;
+            continue;
+        }
+
+        pos += __builtin_ctz(mask);
+
+        e8_translate(data, pos, offset);
+
+        pos += 5;
+    }
+
+    e8_scalar(data, pos, size, offset, cmp);
+}
+
+// The byte shifts only work within each 128 bit lane, so the total of the low
+// lane has to be carried into the high lane.
+AVX2 static inline __m256i prefix_sum_epi8_avx2(__m256i x)
+{
+    __m256i carry;
+
+    x       = _mm256_add_epi8(x, _mm256_slli_si256(x, 1));
+    x       = _mm256_add_epi8(x, _mm256_slli_si256(x, 2));
+    x       = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+    x       = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+    carry   = _mm256_shuffle_epi8(x, _mm256_set1_epi8(15));
+    carry   = _mm256_permute2x128_si256(carry, carry, 0x08);
+
+    return _mm256_add_epi8(x, carry);
+}
+
+// Only a single channel benefits from the extra width.
+AVX2 static void delta_avx2(const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels)
+{
+    __m256i  prev = _mm256_setzero_si256();
+    uint32_t i    = 0;
+    uint8_t  prevbyte;
+
+    if (channels != 1) {
+        delta_sse2(src, dst, size, channels);
+        return;
+    }
+
+    for (; i + 32 <= size; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (src + i));
+
+        v    = _mm256_sub_epi8(prev, prefix_sum_epi8_avx2(v));
+        prev = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(v, _mm256_set1_epi8(15)), 0xff);
+
+        _mm256_storeu_si256((__m256i *) (dst + i), v);
+    }
+
+    prevbyte = _mm_cvtsi128_si32(_mm256_castsi256_si128(prev));
+
+    for (; i < size; i++)
+        dst[i] = prevbyte -= src[i];
+}
+#endif
+
+sf_isa_t stdfilter_best_isa(void)
+{
+    if (stdfilter_isa_supported(SFI_AVX2))
+        return SFI_AVX2;
+    if (stdfilter_isa_supported(SFI_SSE2))
+        return SFI_SSE2;
+    return SFI_SCALAR;
+}
+
+bool stdfilter_isa_supported(sf_isa_t isa)
+{
+    switch (isa) {
+        case SFI_SCALAR:
+            return true;
+#ifdef HAVE_SSE2
+        case SFI_SSE2:
+            return true;
+#endif
+#ifdef HAVE_AVX2
+        case SFI_AVX2:
+            return __builtin_cpu_supports("avx2");
+#endif
+        default:
+            return false;
+    }
+}
+
+const char * stdfilter_isa_name(sf_isa_t isa)
+{
+    static const char * names[] = {
+        [SFI_SCALAR]    = "scalar",
+        [SFI_SSE2]      = "sse2",
+        [SFI_AVX2]      = "avx2",
+    };
+
+    return names[isa];
+}
+
+// The AVX2 versions fall back to SSE2 where there is no AVX2 version, as the
+// extra width doesn't help.
+void stdfilter_e8(sf_isa_t isa, uint8_t *data, uint32_t size, uint32_t offset, bool e9)
+{
+    uint8_t cmp = e9 ? 0xe9 : 0xe8;
+
+#ifdef HAVE_AVX2
+    if (isa >= SFI_AVX2) {
+        e8_avx2(data, size, offset, cmp);
+        return;
+    }
+#endif
+#ifdef HAVE_SSE2
+    if (isa >= SFI_SSE2) {
+        e8_sse2(data, size, offset, cmp);
+        return;
+    }
+#endif
+    e8_scalar(data, 0, size, offset, cmp);
+}
+
+// Itanium bundles have no independent work to vectorise.
+void stdfilter_itanium(sf_isa_t isa, uint8_t *data, uint32_t size, uint32_t offset)
+{
+    itanium_scalar(data, size, offset);
+}
+
+void stdfilter_delta(sf_isa_t isa, const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels)
+{
+#ifdef HAVE_AVX2
+    if (isa >= SFI_AVX2) {
+        delta_avx2(src, dst, size, channels);
+        return;
+    }
+#endif
+#ifdef HAVE_SSE2
+    if (isa >= SFI_SSE2) {
+        delta_sse2(src, dst, size, channels);
+        return;
+    }
+#endif
+    delta_scalar(src, dst, size, channels);
+}
+
+void stdfilter_rgb(sf_isa_t isa, const uint8_t *src, uint8_t *dst, uint32_t size, int32_t width, uint32_t posr)
+{
+#ifdef HAVE_SSE2
+    if (isa >= SFI_SSE2) {
+        rgb_sse2(src, dst, size, width, posr);
+        return;
+    }
+#endif
+    rgb_scalar(src, dst, size, width, posr);
+}
+
+void stdfilter_audio(sf_isa_t isa, const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels)
+{
+#ifdef HAVE_SSE2
+    if (isa >= SFI_SSE2) {
+        audio_sse2(src, dst, size, channels);
+        return;
+    }
+#endif
+    audio_scalar(src, dst, size, channels);
+}
+
+// Byte 2 is an escape, followed by either another 2 or a character to
+// convert to uppercase.
+uint32_t stdfilter_upcase(sf_isa_t isa, const uint8_t *src, uint8_t *dst, uint32_t size)
+{
+    uint32_t srcpos = 0;
+    uint32_t dstpos = 0;
+
+    while (srcpos < size) {
+        uint8_t c = src[srcpos++];
+
+        if (c == 2 && (c = src[srcpos++]) != 2)
+            c -= 32;
+
+        dst[dstpos++] = c;
+    }
+
+    return dstpos;
+}
+
+// The filters that produce a new block write it immediately after the input,
+// so the input can be at most half the available memory.
+bool stdfilter_execute(sf_isa_t isa, vm_stdfilter_t filter, uint8_t *mem, const uint32_t *r)
+{
+    uint32_t size = r[REG4];
+
+    switch (filter) {
+        case VMSF_E8:
+        case VMSF_E8E9:
+            if (size >= VM_GLOBALMEMADDR || size < 4)
+                break;
+            stdfilter_e8(isa, mem, size, r[REG6], filter == VMSF_E8E9);
+            putle32(&mem[VMADDR_NEWBLOCKSIZE], size);
+            putle32(&mem[VMADDR_NEWBLOCKPOS], 0);
+            break;
+        case VMSF_ITANIUM:
+            if (size >= VM_GLOBALMEMADDR || size < 21)
+                break;
+            stdfilter_itanium(isa, mem, size, r[REG6]);
+            putle32(&mem[VMADDR_NEWBLOCKSIZE], size);
+            putle32(&mem[VMADDR_NEWBLOCKPOS], 0);
+            break;
+        case VMSF_DELTA:
+            putle32(&mem[VMADDR_NEWBLOCKPOS], size);
+            if (size >= VM_GLOBALMEMADDR / 2)
+                break;
+            stdfilter_delta(isa, mem, mem + size, size, r[REG0]);
+            break;
+        case VMSF_RGB:
+            putle32(&mem[VMADDR_NEWBLOCKPOS], size);
+            // Rar reads outside the block with a width less than -3.
+            if (size >= VM_GLOBALMEMADDR / 2 || (int32_t) r[REG1] < 0 || (int32_t) (r[REG0] - 3) < -3)
+                break;
+            stdfilter_rgb(isa, mem, mem + size, size, r[REG0] - 3, r[REG1]);
+            break;
+        case VMSF_AUDIO:
+            putle32(&mem[VMADDR_NEWBLOCKPOS], size);
+            if (size >= VM_GLOBALMEMADDR / 2)
+                break;
+            stdfilter_audio(isa, mem, mem + size, size, r[REG0]);
+            break;
+        case VMSF_UPCASE:
+            if (size >= VM_GLOBALMEMADDR / 2)
+                break;
+            putle32(&mem[VMADDR_NEWBLOCKSIZE], stdfilter_upcase(isa, mem, mem + size, size));
+            putle32(&mem[VMADDR_NEWBLOCKPOS], size);
+            break;
+        default:
+            return false;
+    }
+
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef __STDFILTER_H
+#define __STDFILTER_H
+
+// Native implementations of the standard rar filters. Rar never runs the
+// bytecode of these filters, it recognises them and runs its own versions
+// instead, so we do the same.
+//
+// Each filter has a scalar reference implementation, and where it helps, SSE2
+// and AVX2 versions. They must all produce identical output, stdfilter_test
+// checks they do.
+
+typedef enum {
+    SFI_SCALAR,
+    SFI_SSE2,
+    SFI_AVX2,
+} sf_isa_t;
+
+sf_isa_t stdfilter_best_isa(void);
+bool stdfilter_isa_supported(sf_isa_t isa);
+const char * stdfilter_isa_name(sf_isa_t isa);
+
+// The kernels work on any buffer, with the parameters rar passes in
+// registers. The data size is not limited like it is in the VM, but dst must
+// not overlap src. Like rar, rgb reads up to 3 bytes past the end of dst if
+// width is negative (it must be at least -3), and upcase might read one byte
+// past the end of src.
+void stdfilter_e8(sf_isa_t isa, uint8_t *data, uint32_t size, uint32_t offset, bool e9);
+void stdfilter_itanium(sf_isa_t isa, uint8_t *data, uint32_t size, uint32_t offset);
+void stdfilter_delta(sf_isa_t isa, const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels);
+void stdfilter_rgb(sf_isa_t isa, const uint8_t *src, uint8_t *dst, uint32_t size, int32_t width, uint32_t posr);
+void stdfilter_audio(sf_isa_t isa, const uint8_t *src, uint8_t *dst, uint32_t size, uint32_t channels);
+uint32_t stdfilter_upcase(sf_isa_t isa, const uint8_t *src, uint8_t *dst, uint32_t size);
+
+// Run a filter on VM memory, exactly as rar would. The registers are the
+// initial values, the output block is described in the globals as usual.
+bool stdfilter_execute(sf_isa_t isa, vm_stdfilter_t filter, uint8_t *mem, const uint32_t *r);
+
+#endif
@@ -0,0 +1,326 @@
+// Check the native standard filters agree with each other, and measure them.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "rarvm.h"
+#include "stdfilter.h"
+
+#define NUM_CASES   4000
+#define BENCH_SIZE  (16 << 20)
+
+typedef struct {
+    vm_stdfilter_t  filter;
+    uint32_t        size;
+    uint32_t        r0;         // Channels, or width + 3 for rgb.
+    uint32_t        r1;         // Position of the red channel for rgb.
+    uint32_t        offset;     // File offset for e8 and itanium.
+} params_t;
+
+static uint32_t random32(void)
+{
+    static uint32_t state = 0x2545f491;
+
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Random data, with plenty of call opcodes for the e8 filter to find.
+static void fill(uint8_t *buf, size_t size)
+{
+    for (size_t i = 0; i < size; i++) {
+        uint32_t r = random32();
+
+        buf[i] = (r & 7) == 0 ? 0xe8 + (r >> 3 & 1) : r >> 8;
+    }
+}
+
+// The output is written after the input, like in the VM.
+static void run(sf_isa_t isa, const params_t *p, uint8_t *buf)
+{
+    switch (p->filter) {
+        case VMSF_E8:
+        case VMSF_E8E9:
+            stdfilter_e8(isa, buf, p->size, p->offset, p->filter == VMSF_E8E9);
+            break;
+        case VMSF_ITANIUM:
+            stdfilter_itanium(isa, buf, p->size, p->offset);
+            break;
+        case VMSF_DELTA:
+            stdfilter_delta(isa, buf, buf + p->size, p->size, p->r0);
+            break;
+        case VMSF_RGB:
+            stdfilter_rgb(isa, buf, buf + p->size, p->size, p->r0 - 3, p->r1);
+            break;
+        case VMSF_AUDIO:
+            stdfilter_audio(isa, buf, buf + p->size, p->size, p->r0);
+            break;
+        case VMSF_UPCASE:
+            stdfilter_upcase(isa, buf, buf + p->size, p->size);
+            break;
+        default:
+            abort();
+    }
+}
+
+static void random_params(params_t *p)
+{
+    static const vm_stdfilter_t filters[] = {
+        VMSF_E8, VMSF_E8E9, VMSF_ITANIUM, VMSF_DELTA, VMSF_RGB, VMSF_AUDIO, VMSF_UPCASE,
+    };
+
+    p->filter   = filters[random32() % (sizeof filters / sizeof *filters)];
+    p->size     = random32() % 4 ? random32() % 20000 : random32() % 64;
+    p->offset   = random32();
+    p->r1       = random32() % 6;
+
+    switch (random32() % 4) {
+        case 0:  p->r0 = random32() % 6; break;
+        case 1:  p->r0 = random32() % 20; break;
+        case 2:  p->r0 = (random32() % 1000) * 3; break;
+        default: p->r0 = random32() % 3000; break;
+    }
+}
+
+// Every implementation must match the scalar version exactly, including the
+// bytes they shouldn't touch.
+static void cross_check(void)
+{
+    size_t   bufsize = 2 * 20000 + 64;
+    uint8_t *orig    = malloc(bufsize);
+    uint8_t *expect  = malloc(bufsize);
+    uint8_t *result  = malloc(bufsize);
+    params_t p;
+
+    for (int i = 0; i < NUM_CASES; i++) {
+        random_params(&p);
+        fill(orig, bufsize);
+
+        memcpy(expect, orig, bufsize);
+        run(SFI_SCALAR, &p, expect);
+
+        for (sf_isa_t isa = SFI_SSE2; isa <= SFI_AVX2; isa++) {
+            if (!stdfilter_isa_supported(isa))
+                continue;
+
+            memcpy(result, orig, bufsize);
+            run(isa, &p, result);
+
+            if (memcmp(result, expect, bufsize) != 0) {
+                fprintf(stderr, "%s %s mismatch, size %u r0 %u r1 %u offset %#x\n",
+                        vm_standard_filter_name(p.filter),
+                        stdfilter_isa_name(isa),
+                        p.size,
+                        p.r0,
+                        p.r1,
+                        p.offset);
+                abort();
+            }
+        }
+    }
+
+    free(orig);
+    free(expect);
+    free(result);
+}
+
+// The largest blocks with the most channels rar allows, where every channel
+// is only a byte or two long.
+static void many_channels(void)
+{
+    static const uint32_t channels[] = { 0x1ffff, 0xffff, 5003 };
+    size_t   bufsize = 2 * 0x1ffff + 64;
+    uint8_t *orig    = malloc(bufsize);
+    uint8_t *expect  = malloc(bufsize);
+    uint8_t *result  = malloc(bufsize);
+
+    fill(orig, bufsize);
+
+    for (int i = 0; i < sizeof channels / sizeof *channels; i++) {
+        params_t p = {
+            .filter = VMSF_AUDIO,
+            .size   = 0x1ffff,
+            .r0     = channels[i],
+        };
+
+        memcpy(expect, orig, bufsize);
+        run(SFI_SCALAR, &p, expect);
+
+        for (sf_isa_t isa = SFI_SSE2; isa <= SFI_AVX2; isa++) {
+            if (!stdfilter_isa_supported(isa))
+                continue;
+
+            memcpy(result, orig, bufsize);
+            run(isa, &p, result);
+
+            assert(memcmp(result, expect, bufsize) == 0);
+        }
+    }
+
+    free(orig);
+    free(expect);
+    free(result);
+}
+
+// A few cases that are easy to work out by hand.
+static void known_answers(void)
+{
+    uint8_t buf[64];
+
+    // A call to 0 at offset 0x10 is relative to the next byte.
+    memset(buf, 0x90, sizeof buf);
+    memcpy(buf, "\xe8\x00\x00\x00\x00\xe9\x10\x00\x00\x00", 10);
+    stdfilter_e8(SFI_SCALAR, buf, sizeof buf, 0x10, true);
+    assert(memcmp(buf, "\xe8\xef\xff\xff\xff\xe9\xfa\xff\xff\xff", 10) == 0);
+
+    // Negative addresses that point inside the file are relative to the end.
+    memcpy(buf, "\xe8\xff\xff\xff\xff", 5);
+    stdfilter_e8(SFI_SCALAR, buf, sizeof buf, 0, false);
+    assert(memcmp(buf, "\xe8\xff\xff\xff\x00", 5) == 0);
+
+    memcpy(buf, "\x01\x01\x01", 3);
+    stdfilter_delta(SFI_SCALAR, buf, buf + 3, 3, 1);
+    assert(memcmp(buf + 3, "\xff\xfe\xfd", 3) == 0);
+
+    memcpy(buf, "\x01\x02\x03\x04", 4);
+    stdfilter_delta(SFI_SCALAR, buf, buf + 4, 4, 2);
+    assert(memcmp(buf + 4, "\xff\xfd\xfd\xf9", 4) == 0);
+
+    memcpy(buf, "a\x02" "b\x02\x02" "c", 6);
+    assert(stdfilter_upcase(SFI_SCALAR, buf, buf + 6, 6) == 4);
+    assert(memcmp(buf + 6, "aB\x02" "c", 4) == 0);
+}
+
+// Standard filters are recognised when a program is decoded, and executed
+// natively instead of being interpreted.
+static void vm_execute_standard(void)
+{
+    static const uint8_t code[] = { 0x00, 0x00 };
+    const uint32_t       initr[7] = { 2, 0, 0, VM_GLOBALMEMADDR, 4 };
+    vm_program_t        *program;
+    vm_t                *vm;
+    const uint8_t       *data;
+    uint32_t             size;
+
+    assert(vm_program_decode(&program, code, sizeof code));
+    assert(program->filter == VMSF_NONE);
+
+    program->filter = VMSF_DELTA;
+
+    assert(vm_create(&vm));
+    assert(vm_prepare(vm, program, initr, (const uint8_t *) "\x01\x02\x03\x04", 4));
+    assert(vm_execute(vm, program, VM_MAXINSNS));
+    assert(vm_getoutput(vm, &data, &size));
+    assert(size == 4);
+    assert(memcmp(data, "\xff\xfd\xfd\xf9", 4) == 0);
+
+    vm_destroy(vm);
+    vm_program_destroy(program);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void benchmark(void)
+{
+    static const struct {
+        const char     *name;
+        vm_stdfilter_t  filter;
+        uint32_t        r0;
+    } tests[] = {
+        { "e8",         VMSF_E8,        0           },
+        { "e8e9",       VMSF_E8E9,      0           },
+        { "itanium",    VMSF_ITANIUM,   0           },
+        { "delta/1",    VMSF_DELTA,     1           },
+        { "delta/4",    VMSF_DELTA,     4           },
+        { "rgb",        VMSF_RGB,       1920 * 3 + 3},
+        { "audio/1",    VMSF_AUDIO,     1           },
+        { "audio/4",    VMSF_AUDIO,     4           },
+        { "upcase",     VMSF_UPCASE,    0           },
+    };
+
+    uint8_t *orig = malloc(BENCH_SIZE * 2 + 64);
+    uint8_t *buf  = malloc(BENCH_SIZE * 2 + 64);
+
+    fill(orig, BENCH_SIZE * 2 + 64);
+
+    for (int i = 0; i < sizeof tests / sizeof *tests; i++) {
+        params_t p = {
+            .filter = tests[i].filter,
+            .size   = BENCH_SIZE,
+            .r0     = tests[i].r0,
+        };
+
+        printf("%-10s", tests[i].name);
+
+        for (sf_isa_t isa = SFI_SCALAR; isa <= SFI_AVX2; isa++) {
+            double best = 0;
+
+            if (!stdfilter_isa_supported(isa))
+                continue;
+
+            // Report the fastest of a few runs.
+            for (int n = 0; n < 3; n++) {
+                double start;
+
+                memcpy(buf, orig, BENCH_SIZE * 2 + 64);
+
+                start = now();
+                run(isa, &p, buf);
+
+                if (best == 0 || now() - start < best)
+                    best = now() - start;
+            }
+
+            printf("  %s %6.2f GB/s", stdfilter_isa_name(isa), BENCH_SIZE / best / 1e9);
+        }
+
+        printf("\n");
+    }
+
+    free(orig);
+    free(buf);
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b")) != -1) {
+        switch (opt) {
+            case 'b':
+                benchmark();
+                return 0;
+            default:
+                fprintf(stderr, "usage: %s [-b]\n", *argv);
+                return 1;
+        }
+    }
+
+    known_answers();
+    cross_check();
+    many_channels();
+    vm_execute_standard();
+    return 0;
+}
@@ -0,0 +1,1372 @@
+// Superoptimizer for short straight line RarVM sequences.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <err.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rarvm.h"
+#include "superopt.h"
+
+// Candidates are screened against this many inputs as they are built, almost
+// all of them are rejected by the first.
+#define SO_QUICKTESTS   4
+
+// Inputs a candidate must then survive on the built-in executor, and then on
+// the real VM, before it is reported.
+#define SO_TESTS        (1 << 14)
+#define SO_VMTESTS      (1 << 12)
+
+// Memory contents are varied between inputs, the real VM needs a snapshot of
+// each variation.
+#define SO_MEMSEEDS     16
+
+// Enough immediates for the usual constants and anything derived from the
+// target, the alphabet grows quickly with each one.
+#define SO_MAXIMMS      48
+
+// An exhaustive proof is split into chunks of this many inputs.
+#define SO_CHUNKBITS    16
+
+// Values that tend to expose differences in flags and overflow.
+static const uint32_t kEdgeValues[] = {
+    0, 1, 2, 0x7f, 0x80, 0xff, 0x100, 0x7fffffff, 0x80000000, 0xfffffffe, 0xffffffff,
+};
+
+// Constants that are always worth trying.
+static const uint32_t kImmediates[] = {
+    0, 1, 2, 3, 4, 8, 16, 24, 31, 0xff, 0xffff, 0x7fffffff, 0x80000000, 0xffffffff,
+};
+
+// A resolved operand, memory addresses are computed before the instruction
+// executes, just like vm_operand().
+typedef struct {
+    uint8_t     type;
+    uint8_t     reg;
+    uint32_t    value;
+} so_loc_t;
+
+// An instruction in the search alphabet, with its liveness precomputed.
+typedef struct {
+    vm_insn_t   insn;
+    uint32_t    reads;
+    uint32_t    writes;
+    uint32_t    kills;
+    uint32_t    bits;
+} so_entry_t;
+
+// A sequence that survived testing on the built-in executor.
+typedef struct {
+    uint32_t    seq[SO_MAXINSNS];
+    uint32_t    bits;
+} so_candidate_t;
+
+typedef struct {
+    const so_options_t *options;
+    uint32_t            live;
+    uint32_t            targetbits;
+    uint32_t            maxbits;    // Candidates must use fewer bits than this.
+    so_entry_t         *alphabet;
+    uint32_t            count;
+    so_state_t         *inputs;
+    so_state_t         *outputs;    // The target applied to each input.
+    uint32_t            length;     // Current candidate length.
+    uint32_t            next;       // Next first instruction to try.
+    pthread_mutex_t     lock;
+    so_candidate_t     *found;
+    size_t              numfound;
+    size_t              capacity;
+    uint64_t            candidates;
+    uint64_t            passed;
+} so_context_t;
+
+typedef struct {
+    so_context_t       *ctx;
+    so_state_t          states[SO_MAXINSNS + 1][SO_QUICKTESTS];
+    uint32_t            seq[SO_MAXINSNS];
+    uint64_t            candidates;
+    uint64_t            passed;
+} so_worker_t;
+
+// Inputs for an exhaustive proof.
+typedef struct {
+    const vm_insn_t    *target;
+    uint32_t            targetlen;
+    const vm_insn_t    *candidate;
+    uint32_t            candidatelen;
+    uint32_t            live;
+    uint32_t            inputs;
+    uint32_t            inputbits;
+    so_state_t          base;
+    uint64_t            next;       // Next chunk.
+    uint64_t            numchunks;
+    bool                failed;
+} so_proof_t;
+
+static uint64_t so_random(uint64_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// The initial contents of memory, this is just a hash of the address so that
+// nothing needs to be stored.
+uint8_t superopt_memory(uint32_t seed, uint32_t addr)
+{
+    uint32_t h = (addr ^ seed * 0x9E3779B1) * 0x85EBCA6B;
+
+    h ^= h >> 15;
+    h *= 0xC2B2AE35;
+    h ^= h >> 13;
+    return h;
+}
+
+static inline uint8_t so_load_byte(const so_state_t *state, uint32_t addr)
+{
+    // The most recent write to this byte wins.
+    for (uint32_t i = state->nwrites; i-- > 0; ) {
+        uint32_t offset = addr - state->writes[i].addr;
+
+        if (offset < state->writes[i].size)
+            return state->writes[i].value >> (offset * 8);
+    }
+
+    return superopt_memory(state->memseed, addr);
+}
+
+uint8_t superopt_load(const so_state_t *state, uint32_t addr)
+{
+    return so_load_byte(state, addr);
+}
+
+// Accesses don't wrap, a dword at the end of memory uses the extra bytes the
+// VM allocates.
+static inline uint32_t so_load(const so_state_t *state, uint32_t addr, bool bytemode)
+{
+    if (bytemode)
+        return so_load_byte(state, addr);
+
+    return so_load_byte(state, addr + 0)
+         | so_load_byte(state, addr + 1) << 8
+         | so_load_byte(state, addr + 2) << 16
+         | so_load_byte(state, addr + 3) << 24;
+}
+
+static inline void so_store(so_state_t *state, uint32_t addr, bool bytemode, uint32_t value)
+{
+    if (state->nwrites == SO_MAXWRITES) {
+        state->overflow = true;
+        return;
+    }
+
+    state->writes[state->nwrites].addr  = addr;
+    state->writes[state->nwrites].value = bytemode ? value & 0xff : value;
+    state->writes[state->nwrites].size  = bytemode ? 1 : 4;
+    state->nwrites++;
+}
+
+static inline void so_resolve(const so_state_t *state, const vm_operand_t *op, so_loc_t *loc)
+{
+    loc->type   = op->type;
+    loc->reg    = op->reg;
+    loc->value  = op->value;
+
+    if (op->type == VM_OPREGMEM) {
+        loc->value = (state->r[op->reg] + op->value) & VM_MEMMASK;
+    } else if (op->type == VM_OPMEM) {
+        loc->value = op->value & VM_MEMMASK;
+    }
+}
+
+static inline uint32_t so_get(const so_state_t *state, const so_loc_t *loc, bool bytemode)
+{
+    switch (loc->type) {
+        case VM_OPREG:      return bytemode ? state->r[loc->reg] & 0xff : state->r[loc->reg];
+        case VM_OPREGMEM:
+        case VM_OPMEM:      return so_load(state, loc->value, bytemode);
+    }
+
+    return bytemode ? loc->value & 0xff : loc->value;
+}
+
+// Writes to immediates are not modelled, superopt_supported() rejects them.
+static inline void so_set(so_state_t *state, const so_loc_t *loc, bool bytemode, uint32_t value)
+{
+    switch (loc->type) {
+        case VM_OPREG:      if (bytemode) {
+                                state->r[loc->reg] = (state->r[loc->reg] & ~0xff) | (value & 0xff);
+                            } else {
+                                state->r[loc->reg] = value;
+                            }
+                            break;
+        case VM_OPREGMEM:
+        case VM_OPMEM:      so_store(state, loc->value, bytemode, value);
+                            break;
+    }
+}
+
+// This must match vm_execute() exactly, superopt_test checks that it does.
+static void so_step(so_state_t *state, const vm_insn_t *insn)
+{
+    bool     bytemode = insn->bytemode;
+    uint32_t sp       = state->r[REG7] & VM_MEMMASK;
+    uint32_t value1;
+    uint32_t value2;
+    uint32_t result;
+    so_loc_t op1;
+    so_loc_t op2;
+
+    so_resolve(state, &insn->op1, &op1);
+    so_resolve(state, &insn->op2, &op2);
+
+    switch (insn->opcode) {
+        case VM_MOV:
+            so_set(state, &op1, bytemode, so_get(state, &op2, bytemode));
+            break;
+        case VM_CMP:
+            value1          = so_get(state, &op1, bytemode);
+            result          = value1 - so_get(state, &op2, bytemode);
+            state->flags    = result == 0 ? VM_FZ : (result > value1) | (result & VM_FS);
+            break;
+        case VM_ADD:
+            value1          = so_get(state, &op1, bytemode);
+            result          = value1 + so_get(state, &op2, bytemode);
+            if (bytemode) {
+                result         &= 0xff;
+                state->flags    = (result < value1) | (result == 0 ? VM_FZ : (result & 0x80) ? VM_FS : 0);
+            } else {
+                state->flags    = (result < value1) | (result == 0 ? VM_FZ : (result & VM_FS));
+            }
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_SUB:
+            value1          = so_get(state, &op1, bytemode);
+            result          = value1 - so_get(state, &op2, bytemode);
+            state->flags    = result == 0 ? VM_FZ : (result > value1) | (result & VM_FS);
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_INC:
+            result          = so_get(state, &op1, bytemode) + 1;
+            if (bytemode)
+                result &= 0xff;
+            so_set(state, &op1, bytemode, result);
+            state->flags    = result == 0 ? VM_FZ : result & VM_FS;
+            break;
+        case VM_DEC:
+            result          = so_get(state, &op1, bytemode) - 1;
+            so_set(state, &op1, bytemode, result);
+            state->flags    = result == 0 ? VM_FZ : result & VM_FS;
+            break;
+        case VM_XOR:
+            result          = so_get(state, &op1, bytemode) ^ so_get(state, &op2, bytemode);
+            state->flags    = result == 0 ? VM_FZ : result & VM_FS;
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_AND:
+            result          = so_get(state, &op1, bytemode) & so_get(state, &op2, bytemode);
+            state->flags    = result == 0 ? VM_FZ : result & VM_FS;
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_OR:
+            result          = so_get(state, &op1, bytemode) | so_get(state, &op2, bytemode);
+            state->flags    = result == 0 ? VM_FZ : result & VM_FS;
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_TEST:
+            result          = so_get(state, &op1, bytemode) & so_get(state, &op2, bytemode);
+            state->flags    = result == 0 ? VM_FZ : result & VM_FS;
+            break;
+        case VM_PUSH:
+            state->r[REG7] -= 4;
+            so_store(state, state->r[REG7] & VM_MEMMASK, false, so_get(state, &op1, false));
+            break;
+        case VM_POP:
+            so_set(state, &op1, false, so_load(state, sp, false));
+            state->r[REG7] += 4;
+            break;
+        case VM_NOT:
+            so_set(state, &op1, bytemode, ~so_get(state, &op1, bytemode));
+            break;
+        case VM_SHL:
+            value1          = so_get(state, &op1, bytemode);
+            value2          = so_get(state, &op2, bytemode);
+            result          = value1 << (value2 & 31);
+            state->flags    = (result == 0 ? VM_FZ : (result & VM_FS))
+                            | ((value1 << ((value2 - 1) & 31)) & 0x80000000 ? VM_FC : 0);
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_SHR:
+            value1          = so_get(state, &op1, bytemode);
+            value2          = so_get(state, &op2, bytemode);
+            result          = value1 >> (value2 & 31);
+            state->flags    = (result == 0 ? VM_FZ : (result & VM_FS))
+                            | ((value1 >> ((value2 - 1) & 31)) & VM_FC);
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_SAR:
+            value1          = so_get(state, &op1, bytemode);
+            value2          = so_get(state, &op2, bytemode);
+            result          = ((int32_t) value1) >> (value2 & 31);
+            state->flags    = (result == 0 ? VM_FZ : (result & VM_FS))
+                            | ((value1 >> ((value2 - 1) & 31)) & VM_FC);
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_NEG:
+            result          = 0 - so_get(state, &op1, bytemode);
+            state->flags    = result == 0 ? VM_FZ : VM_FC | (result & VM_FS);
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_PUSHF:
+            state->r[REG7] -= 4;
+            so_store(state, state->r[REG7] & VM_MEMMASK, false, state->flags);
+            break;
+        case VM_POPF:
+            state->flags    = so_load(state, sp, false);
+            state->r[REG7] += 4;
+            break;
+        case VM_MOVZX:
+            so_set(state, &op1, false, so_get(state, &op2, true));
+            break;
+        case VM_MOVSX:
+            so_set(state, &op1, false, (int8_t) so_get(state, &op2, true));
+            break;
+        case VM_XCHG:
+            value1          = so_get(state, &op1, bytemode);
+            so_set(state, &op1, bytemode, so_get(state, &op2, bytemode));
+            so_set(state, &op2, bytemode, value1);
+            break;
+        case VM_MUL:
+            result          = so_get(state, &op1, bytemode) * so_get(state, &op2, bytemode);
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_DIV:
+            if ((value2 = so_get(state, &op2, bytemode)))
+                so_set(state, &op1, bytemode, so_get(state, &op1, bytemode) / value2);
+            break;
+        case VM_ADC:
+            value1          = so_get(state, &op1, bytemode);
+            value2          = state->flags & VM_FC;
+            result          = value1 + so_get(state, &op2, bytemode) + value2;
+            if (bytemode)
+                result &= 0xff;
+            state->flags    = (result < value1 || (result == value1 && value2))
+                            | (result == 0 ? VM_FZ : (result & VM_FS));
+            so_set(state, &op1, bytemode, result);
+            break;
+        case VM_SBB:
+            value1          = so_get(state, &op1, bytemode);
+            value2          = state->flags & VM_FC;
+            result          = value1 - so_get(state, &op2, bytemode) - value2;
+            state->flags    = (result > value1 || (result == value1 && value2))
+                            | (result == 0 ? VM_FZ : (result & VM_FS));
+            so_set(state, &op1, bytemode, result);
+            break;
+    }
+}
+
+void superopt_execute(const vm_insn_t *insns, uint32_t count, so_state_t *state)
+{
+    for (uint32_t i = 0; i < count; i++)
+        so_step(state, &insns[i]);
+}
+
+// Copying the whole write log is wasteful, it's usually empty.
+static inline void so_copy(so_state_t *dst, const so_state_t *src)
+{
+    memcpy(dst, src, offsetof(so_state_t, writes) + src->nwrites * sizeof *src->writes);
+}
+
+bool superopt_equal(const so_state_t *a, const so_state_t *b, uint32_t live)
+{
+    for (uint32_t regs = live & SO_REGS; regs; regs &= regs - 1) {
+        if (a->r[__builtin_ctz(regs)] != b->r[__builtin_ctz(regs)])
+            return false;
+    }
+
+    if (live & SO_FLAGS && a->flags != b->flags)
+        return false;
+
+    if (a->overflow || b->overflow)
+        return false;
+
+    // Memory always matters, any byte either sequence wrote must agree.
+    for (const so_state_t *s = a; s; s = s == a ? b : NULL) {
+        for (uint32_t i = 0; i < s->nwrites; i++) {
+            for (uint32_t j = 0; j < s->writes[i].size; j++) {
+                uint32_t addr = s->writes[i].addr + j;
+
+                if (so_load_byte(a, addr) != so_load_byte(b, addr))
+                    return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool superopt_supported(const vm_insn_t *insn)
+{
+    switch (insn->opcode) {
+        case VM_CMP:
+        case VM_TEST:
+        case VM_PUSH:
+        case VM_PUSHF:
+        case VM_POPF:
+            return true;
+        case VM_XCHG:
+            if (insn->op2.type == VM_OPINT)
+                return false;
+        case VM_MOV:    case VM_ADD:    case VM_SUB:    case VM_INC:
+        case VM_DEC:    case VM_XOR:    case VM_AND:    case VM_OR:
+        case VM_POP:    case VM_NOT:    case VM_SHL:    case VM_SHR:
+        case VM_SAR:    case VM_NEG:    case VM_MOVZX:  case VM_MOVSX:
+        case VM_MUL:    case VM_DIV:    case VM_ADC:    case VM_SBB:
+            // Immediates are writable, but that would modify the program.
+            return insn->op1.type != VM_OPINT;
+    }
+
+    // Control flow, pusha and popa, and print.
+    return false;
+}
+
+// The locations an operand reads, memory operands also read their base.
+static uint32_t so_operand_reads(const vm_operand_t *op, bool value)
+{
+    switch (op->type) {
+        case VM_OPREG:      return value ? 1 << op->reg : 0;
+        case VM_OPREGMEM:   return 1 << op->reg | (value ? SO_MEMORY : 0);
+        case VM_OPMEM:      return value ? SO_MEMORY : 0;
+    }
+    return 0;
+}
+
+static uint32_t so_operand_writes(const vm_operand_t *op)
+{
+    switch (op->type) {
+        case VM_OPREG:      return 1 << op->reg;
+        case VM_OPREGMEM:
+        case VM_OPMEM:      return SO_MEMORY;
+    }
+    return 0;
+}
+
+static bool so_writes_flags(uint8_t opcode)
+{
+    switch (opcode) {
+        case VM_CMP:    case VM_ADD:    case VM_SUB:    case VM_INC:
+        case VM_DEC:    case VM_XOR:    case VM_AND:    case VM_OR:
+        case VM_TEST:   case VM_SHL:    case VM_SHR:    case VM_SAR:
+        case VM_NEG:    case VM_ADC:    case VM_SBB:    case VM_POPF:
+            return true;
+    }
+    return false;
+}
+
+uint32_t superopt_reads(const vm_insn_t *insn)
+{
+    switch (insn->opcode) {
+        case VM_MOV:
+            // A byte move keeps the upper bits of the destination.
+            return so_operand_reads(&insn->op1, insn->bytemode)
+                 | so_operand_reads(&insn->op2, true);
+        case VM_MOVZX:
+        case VM_MOVSX:
+            return so_operand_reads(&insn->op1, false)
+                 | so_operand_reads(&insn->op2, true);
+        case VM_ADC:
+        case VM_SBB:
+            return so_operand_reads(&insn->op1, true)
+                 | so_operand_reads(&insn->op2, true)
+                 | SO_FLAGS;
+        case VM_PUSH:
+            return so_operand_reads(&insn->op1, true) | 1 << REG7;
+        case VM_POP:
+            return so_operand_reads(&insn->op1, false) | 1 << REG7 | SO_MEMORY;
+        case VM_PUSHF:
+            return 1 << REG7 | SO_FLAGS;
+        case VM_POPF:
+            return 1 << REG7 | SO_MEMORY;
+    }
+
+    return so_operand_reads(&insn->op1, true) | so_operand_reads(&insn->op2, true);
+}
+
+uint32_t superopt_writes(const vm_insn_t *insn)
+{
+    uint32_t writes = so_writes_flags(insn->opcode) ? SO_FLAGS : 0;
+
+    switch (insn->opcode) {
+        case VM_CMP:
+        case VM_TEST:
+            return writes;
+        case VM_PUSH:
+        case VM_PUSHF:
+            return 1 << REG7 | SO_MEMORY;
+        case VM_POP:
+            return so_operand_writes(&insn->op1) | 1 << REG7;
+        case VM_POPF:
+            return writes | 1 << REG7;
+        case VM_XCHG:
+            return so_operand_writes(&insn->op1) | so_operand_writes(&insn->op2);
+    }
+
+    return writes | so_operand_writes(&insn->op1);
+}
+
+// The locations completely replaced, regardless of their previous value.
+uint32_t superopt_kills(const vm_insn_t *insn)
+{
+    uint32_t kills = so_writes_flags(insn->opcode) ? SO_FLAGS : 0;
+    uint32_t regs  = superopt_writes(insn) & SO_REGS;
+
+    switch (insn->opcode) {
+        case VM_DIV:
+            // Division by zero leaves the destination alone.
+            return kills;
+        case VM_PUSH:
+        case VM_PUSHF:
+        case VM_POPF:
+            // The stack pointer is adjusted, not replaced.
+            return kills;
+        case VM_POP:
+            return kills | (insn->op1.type == VM_OPREG ? 1 << insn->op1.reg : 0);
+    }
+
+    return insn->bytemode ? kills : kills | regs;
+}
+
+// The locations a sequence depends on, either because they're read before
+// being replaced, or because they're live and only partially replaced.
+uint32_t superopt_livein(const vm_insn_t *insns, uint32_t count, uint32_t live)
+{
+    uint32_t livein = 0;
+    uint32_t killed = 0;
+    uint32_t writes = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        livein |= superopt_reads(&insns[i]) & ~killed;
+        killed |= superopt_kills(&insns[i]);
+        writes |= superopt_writes(&insns[i]);
+    }
+
+    return livein | (live & writes & ~killed & (SO_REGS | SO_FLAGS));
+}
+
+static uint32_t so_operand_bits(const vm_operand_t *op, bool bytemode)
+{
+    switch (op->type) {
+        case VM_OPREG:      return 4;
+        case VM_OPINT:      return bytemode ? 10 : 36;
+        case VM_OPREGMEM:   return op->value ? 41 : 6;
+        case VM_OPMEM:      return 38;
+    }
+    return 0;
+}
+
+// The number of bits raras uses to encode the sequence.
+uint32_t superopt_bits(const vm_insn_t *insns, uint32_t count)
+{
+    uint32_t bits = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t flags = vm_opcode_flags_table[insns[i].opcode];
+
+        bits += insns[i].opcode < 8 ? 4 : 6;
+
+        if (flags & VMCF_BYTEMODE)
+            bits += 1;
+        if (flags & (VMCF_OP1 | VMCF_OP2))
+            bits += so_operand_bits(&insns[i].op1, insns[i].bytemode);
+        if (flags & VMCF_OP2)
+            bits += so_operand_bits(&insns[i].op2, insns[i].bytemode);
+    }
+
+    return bits;
+}
+
+// Generate a random input, registers are often given interesting values, or
+// the same value as another register so that memory operands alias.
+static void so_input(so_state_t *state, uint64_t *seed, const uint32_t *interesting, uint32_t count)
+{
+    static const uint32_t flags[] = { 0, VM_FC, VM_FZ, VM_FS, VM_FC | VM_FS };
+
+    memset(state, 0, offsetof(so_state_t, writes));
+
+    for (int i = REG0; i <= REG7; i++) {
+        uint64_t r = so_random(seed);
+
+        switch (r % 8) {
+            case 0:     state->r[i] = kEdgeValues[(r >> 8) % (sizeof kEdgeValues / sizeof *kEdgeValues)];
+                        break;
+            case 1:     state->r[i] = count ? interesting[(r >> 8) % count] + (int) ((r >> 40) % 3) - 1 : r >> 32;
+                        break;
+            case 2:     state->r[i] = i ? state->r[(r >> 8) % i] : r >> 32;
+                        break;
+            case 3:     state->r[i] = (r >> 32) & 0xff;
+                        break;
+            default:    state->r[i] = r >> 32;
+                        break;
+        }
+    }
+
+    state->flags    = flags[so_random(seed) % (sizeof flags / sizeof *flags)];
+    state->memseed  = so_random(seed) % SO_MEMSEEDS;
+}
+
+static bool so_operand_equal(const vm_operand_t *a, const vm_operand_t *b)
+{
+    return a->type == b->type && a->reg == b->reg && a->value == b->value;
+}
+
+// Add an instruction to the alphabet, unless it's obviously a no-op or just
+// a more expensive form of another entry.
+static void so_alphabet_add(so_context_t *ctx, uint8_t opcode, bool bytemode, const vm_operand_t *op1, const vm_operand_t *op2)
+{
+    so_entry_t *entry;
+    vm_insn_t   insn = {
+        .opcode     = opcode,
+        .bytemode   = bytemode,
+    };
+
+    if (op1)
+        insn.op1 = *op1;
+    if (op2)
+        insn.op2 = *op2;
+
+    if (bytemode && insn.op2.type == VM_OPINT)
+        insn.op2.value &= 0xff;
+
+    if (op1 && op2 && so_operand_equal(op1, op2)) {
+        switch (opcode) {
+            case VM_MOV:
+            case VM_XCHG:
+            case VM_AND:
+            case VM_OR:
+            case VM_SUB:
+                return;
+        }
+    }
+
+    if (op2 && op2->type == VM_OPINT) {
+        uint32_t value = insn.op2.value;
+
+        switch (opcode) {
+            case VM_SHL:
+            case VM_SHR:
+            case VM_SAR:
+                // Only the low bits of the count are used.
+                if (value == 0 || value > 31)
+                    return;
+                break;
+            case VM_MUL:
+            case VM_DIV:
+                if (value < 2)
+                    return;
+                break;
+            case VM_ADD:
+            case VM_SUB:
+            case VM_OR:
+            case VM_XOR:
+            case VM_AND:
+                // These are all just a test, or a mov #0.
+                if (value == 0)
+                    return;
+                break;
+            case VM_XCHG:
+                return;
+        }
+    }
+
+    // Both orders of xchg are the same.
+    if (opcode == VM_XCHG && op1->type == VM_OPREG && op2->type == VM_OPREG && op1->reg > op2->reg)
+        return;
+
+    // Check for duplicates, e.g. the same byte immediate.
+    for (uint32_t i = 0; i < ctx->count; i++) {
+        if (ctx->alphabet[i].insn.opcode == insn.opcode
+         && ctx->alphabet[i].insn.bytemode == insn.bytemode
+         && so_operand_equal(&ctx->alphabet[i].insn.op1, &insn.op1)
+         && so_operand_equal(&ctx->alphabet[i].insn.op2, &insn.op2))
+            return;
+    }
+
+    ctx->alphabet           = realloc(ctx->alphabet, (ctx->count + 1) * sizeof *ctx->alphabet);
+    entry                   = &ctx->alphabet[ctx->count++];
+    entry->insn             = insn;
+    entry->reads            = superopt_reads(&insn);
+    entry->writes           = superopt_writes(&insn);
+    entry->kills            = superopt_kills(&insn);
+    entry->bits             = superopt_bits(&insn, 1);
+}
+
+static void so_add_immediate(uint32_t *imms, uint32_t *count, uint32_t value)
+{
+    for (uint32_t i = 0; i < *count; i++) {
+        if (imms[i] == value)
+            return;
+    }
+
+    if (*count < SO_MAXIMMS)
+        imms[(*count)++] = value;
+}
+
+// The alphabet is every operation over the registers and memory operands the
+// target uses, the dead registers as temporaries, and a set of immediates.
+static void so_alphabet(so_context_t *ctx, const vm_insn_t *target, uint32_t length, uint32_t *imms, uint32_t *numimms)
+{
+    static const uint8_t binary[] = {
+        VM_MOV, VM_CMP, VM_ADD, VM_SUB, VM_XOR, VM_AND, VM_OR, VM_TEST, VM_SHL,
+        VM_SHR, VM_SAR, VM_MOVZX, VM_MOVSX, VM_XCHG, VM_MUL, VM_DIV, VM_ADC, VM_SBB,
+    };
+    static const uint8_t unary[] = {
+        VM_INC, VM_DEC, VM_NOT, VM_NEG,
+    };
+    static const uint8_t bytebinary[] = { VM_MOV, VM_CMP, VM_ADD, VM_SUB };
+    static const uint8_t byteunary[]  = { VM_INC, VM_DEC, VM_NEG };
+    const so_options_t *options = ctx->options;
+    vm_operand_t        mem[SO_MAXINSNS * 2];
+    vm_operand_t        dst[8 + SO_MAXINSNS * 2];
+    vm_operand_t        src[8 + SO_MAXINSNS * 2 + SO_MAXIMMS];
+    uint32_t            nummem  = 0;
+    uint32_t            numdst  = 0;
+    uint32_t            numsrc  = 0;
+    uint32_t            regs    = ~options->live & (SO_REGS & ~(1 << REG7));
+    bool                stack   = false;
+
+    *numimms = 0;
+
+    for (uint32_t i = 0; i < sizeof kImmediates / sizeof *kImmediates; i++)
+        so_add_immediate(imms, numimms, kImmediates[i]);
+
+    for (uint32_t i = 0; i < options->numconstants; i++)
+        so_add_immediate(imms, numimms, options->constants[i]);
+
+    // Constants in the target, and the obvious transformations of them.
+    for (uint32_t i = 0; i < length; i++) {
+        const vm_operand_t *ops[] = { &target[i].op1, &target[i].op2 };
+
+        for (int j = 0; j < 2; j++) {
+            uint32_t value = ops[j]->value;
+
+            switch (ops[j]->type) {
+                case VM_OPREG:
+                    regs |= 1 << ops[j]->reg;
+                    break;
+                case VM_OPREGMEM:
+                    regs |= 1 << ops[j]->reg;
+                case VM_OPMEM:
+                    mem[nummem++] = *ops[j];
+                    break;
+                case VM_OPINT:
+                    so_add_immediate(imms, numimms, value);
+                    so_add_immediate(imms, numimms, value + 1);
+                    so_add_immediate(imms, numimms, value - 1);
+                    so_add_immediate(imms, numimms, -value);
+                    so_add_immediate(imms, numimms, ~value);
+                    if (value && value < 32)
+                        so_add_immediate(imms, numimms, 32 - value);
+                    break;
+            }
+        }
+
+        switch (target[i].opcode) {
+            case VM_PUSH:
+            case VM_POP:
+            case VM_PUSHF:
+            case VM_POPF:
+                stack = true;
+                break;
+        }
+    }
+
+    // Registers first, so they're preferred when candidates are sorted.
+    for (uint32_t r = REG0; r <= REG7; r++) {
+        if (regs & (1 << r)) {
+            dst[numdst++] = src[numsrc++] = (vm_operand_t) { .type = VM_OPREG, .reg = r };
+        }
+    }
+
+    for (uint32_t i = 0; i < nummem; i++) {
+        bool duplicate = false;
+
+        for (uint32_t j = 0; j < i; j++)
+            duplicate |= so_operand_equal(&mem[i], &mem[j]);
+
+        if (!duplicate)
+            dst[numdst++] = src[numsrc++] = mem[i];
+    }
+
+    for (uint32_t i = 0; i < *numimms; i++)
+        src[numsrc++] = (vm_operand_t) { .type = VM_OPINT, .value = imms[i] };
+
+    for (uint32_t d = 0; d < numdst; d++) {
+        for (uint32_t i = 0; i < sizeof unary; i++)
+            so_alphabet_add(ctx, unary[i], false, &dst[d], NULL);
+
+        if (options->bytemode) {
+            for (uint32_t i = 0; i < sizeof byteunary; i++)
+                so_alphabet_add(ctx, byteunary[i], true, &dst[d], NULL);
+        }
+
+        for (uint32_t s = 0; s < numsrc; s++) {
+            for (uint32_t i = 0; i < sizeof binary; i++)
+                so_alphabet_add(ctx, binary[i], false, &dst[d], &src[s]);
+
+            if (options->bytemode) {
+                for (uint32_t i = 0; i < sizeof bytebinary; i++)
+                    so_alphabet_add(ctx, bytebinary[i], true, &dst[d], &src[s]);
+            }
+        }
+
+        if (stack)
+            so_alphabet_add(ctx, VM_POP, false, &dst[d], NULL);
+    }
+
+    if (stack) {
+        for (uint32_t s = 0; s < numsrc; s++)
+            so_alphabet_add(ctx, VM_PUSH, false, &src[s], NULL);
+
+        so_alphabet_add(ctx, VM_PUSHF, false, NULL, NULL);
+        so_alphabet_add(ctx, VM_POPF, false, NULL, NULL);
+    }
+}
+
+// An instruction whose results are all dead could be removed, so a shorter
+// candidate already covered this one.
+static bool so_redundant(const so_context_t *ctx, const uint32_t *seq, uint32_t length)
+{
+    uint32_t live = ctx->live | SO_MEMORY;
+
+    for (uint32_t i = length; i-- > 0; ) {
+        const so_entry_t *entry = &ctx->alphabet[seq[i]];
+
+        if (!(entry->writes & live))
+            return true;
+
+        live = (live & ~entry->kills) | entry->reads;
+    }
+
+    return false;
+}
+
+static void so_found(so_worker_t *worker, uint32_t bits)
+{
+    so_context_t   *ctx = worker->ctx;
+    so_candidate_t *candidate;
+
+    pthread_mutex_lock(&ctx->lock);
+
+    if (ctx->numfound == ctx->capacity) {
+        ctx->capacity   = ctx->capacity ? ctx->capacity * 2 : 64;
+        ctx->found      = realloc(ctx->found, ctx->capacity * sizeof *ctx->found);
+    }
+
+    candidate       = &ctx->found[ctx->numfound++];
+    candidate->bits = bits;
+
+    memset(candidate->seq, 0, sizeof candidate->seq);
+    memcpy(candidate->seq, worker->seq, ctx->length * sizeof *worker->seq);
+
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+// Run the complete sequence against the remaining inputs.
+static bool so_test(const so_context_t *ctx, const uint32_t *seq, uint32_t length, uint32_t first)
+{
+    so_state_t state;
+
+    for (uint32_t t = first; t < SO_TESTS; t++) {
+        so_copy(&state, &ctx->inputs[t]);
+
+        for (uint32_t i = 0; i < length; i++)
+            so_step(&state, &ctx->alphabet[seq[i]].insn);
+
+        if (!superopt_equal(&state, &ctx->outputs[t], ctx->live))
+            return false;
+    }
+
+    return true;
+}
+
+static void so_leaf(so_worker_t *worker)
+{
+    so_context_t *ctx  = worker->ctx;
+    uint32_t      bits = 0;
+
+    for (uint32_t i = 0; i < ctx->length; i++)
+        bits += ctx->alphabet[worker->seq[i]].bits;
+
+    if (bits >= ctx->maxbits)
+        return;
+
+    if (so_redundant(ctx, worker->seq, ctx->length))
+        return;
+
+    worker->candidates++;
+
+    for (uint32_t t = 0; t < SO_QUICKTESTS; t++) {
+        so_state_t *state = &worker->states[ctx->length][t];
+
+        so_copy(state, &worker->states[ctx->length - 1][t]);
+        so_step(state, &ctx->alphabet[worker->seq[ctx->length - 1]].insn);
+
+        if (!superopt_equal(state, &ctx->outputs[t], ctx->live))
+            return;
+    }
+
+    if (so_test(ctx, worker->seq, ctx->length, SO_QUICKTESTS)) {
+        worker->passed++;
+        so_found(worker, bits);
+    }
+}
+
+// Extend the sequence one instruction at a time, so that each prefix is only
+// executed once.
+static void so_extend(so_worker_t *worker, uint32_t depth)
+{
+    so_context_t *ctx = worker->ctx;
+
+    for (uint32_t a = 0; a < ctx->count; a++) {
+        worker->seq[depth] = a;
+
+        if (depth + 1 == ctx->length) {
+            so_leaf(worker);
+            continue;
+        }
+
+        for (uint32_t t = 0; t < SO_QUICKTESTS; t++) {
+            so_copy(&worker->states[depth + 1][t], &worker->states[depth][t]);
+            so_step(&worker->states[depth + 1][t], &ctx->alphabet[a].insn);
+        }
+
+        so_extend(worker, depth + 1);
+    }
+}
+
+static void * so_search_worker(void *arg)
+{
+    so_worker_t  *worker = arg;
+    so_context_t *ctx    = worker->ctx;
+    uint32_t      first;
+
+    for (uint32_t t = 0; t < SO_QUICKTESTS; t++)
+        so_copy(&worker->states[0][t], &ctx->inputs[t]);
+
+    // The first instruction is the unit of work.
+    while ((first = __atomic_fetch_add(&ctx->next, 1, __ATOMIC_RELAXED)) < ctx->count) {
+        worker->seq[0] = first;
+
+        if (ctx->length == 1) {
+            so_leaf(worker);
+            continue;
+        }
+
+        for (uint32_t t = 0; t < SO_QUICKTESTS; t++) {
+            so_copy(&worker->states[1][t], &worker->states[0][t]);
+            so_step(&worker->states[1][t], &ctx->alphabet[first].insn);
+        }
+
+        so_extend(worker, 1);
+    }
+
+    return NULL;
+}
+
+static void so_run_threads(void * (*start)(void *), void **args, uint32_t numthreads)
+{
+    pthread_t *threads = calloc(numthreads, sizeof *threads);
+
+    for (uint32_t i = 0; i < numthreads; i++) {
+        if (pthread_create(&threads[i], NULL, start, args[i]) != 0) {
+            errx(EXIT_FAILURE, "failed to create worker thread");
+        }
+    }
+
+    for (uint32_t i = 0; i < numthreads; i++)
+        pthread_join(threads[i], NULL);
+
+    free(threads);
+}
+
+static int so_compare_candidates(const void *a, const void *b)
+{
+    const so_candidate_t *x = a;
+    const so_candidate_t *y = b;
+
+    if (x->bits != y->bits)
+        return x->bits < y->bits ? -1 : 1;
+
+    return memcmp(x->seq, y->seq, sizeof x->seq);
+}
+
+// Build a state from the next input in an exhaustive proof. Flags only ever
+// hold combinations of the three status bits.
+static void so_proof_input(const so_proof_t *proof, uint64_t x, so_state_t *state)
+{
+    so_copy(state, &proof->base);
+
+    for (uint32_t regs = proof->inputs & SO_REGS; regs; regs &= regs - 1) {
+        state->r[__builtin_ctz(regs)] = x;
+        x >>= 32;
+    }
+
+    if (proof->inputs & SO_FLAGS) {
+        state->flags = (x & 1 ? VM_FC : 0) | (x & 2 ? VM_FZ : 0) | (x & 4 ? VM_FS : 0);
+    }
+}
+
+static void * so_proof_worker(void *arg)
+{
+    so_proof_t *proof = arg;
+    uint64_t    chunk;
+    so_state_t  a;
+    so_state_t  b;
+
+    while (!__atomic_load_n(&proof->failed, __ATOMIC_RELAXED)
+        && (chunk = __atomic_fetch_add(&proof->next, 1, __ATOMIC_RELAXED)) < proof->numchunks) {
+        uint64_t first = chunk << SO_CHUNKBITS;
+        uint64_t last  = first + (1ULL << SO_CHUNKBITS);
+
+        if (last > 1ULL << proof->inputbits)
+            last = 1ULL << proof->inputbits;
+
+        for (uint64_t x = first; x < last; x++) {
+            so_proof_input(proof, x, &a);
+            so_proof_input(proof, x, &b);
+            superopt_execute(proof->target, proof->targetlen, &a);
+            superopt_execute(proof->candidate, proof->candidatelen, &b);
+
+            if (!superopt_equal(&a, &b, proof->live)) {
+                __atomic_store_n(&proof->failed, true, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+    }
+
+    return NULL;
+}
+
+// Try every possible input. Registers that neither sequence depends on are
+// left alone, if memory is read there are too many inputs to enumerate.
+static so_verdict_t so_prove(const vm_insn_t *target,
+                             uint32_t targetlen,
+                             const vm_insn_t *candidate,
+                             uint32_t candidatelen,
+                             const so_options_t *options,
+                             const so_state_t *base,
+                             uint32_t *inputs,
+                             uint32_t *inputbits)
+{
+    so_proof_t proof = {
+        .target         = target,
+        .targetlen      = targetlen,
+        .candidate      = candidate,
+        .candidatelen   = candidatelen,
+        .live           = options->live,
+    };
+    void      **args;
+
+    proof.inputs    = superopt_livein(target, targetlen, options->live)
+                    | superopt_livein(candidate, candidatelen, options->live);
+    proof.inputbits = __builtin_popcount(proof.inputs & SO_REGS) * 32
+                    + (proof.inputs & SO_FLAGS ? 3 : 0);
+
+    *inputs     = proof.inputs;
+    *inputbits  = proof.inputbits;
+
+    if (proof.inputs & SO_MEMORY || proof.inputbits > options->exhaustbits || proof.inputbits > 63)
+        return SO_TESTED;
+
+    so_copy(&proof.base, base);
+
+    proof.numchunks = ((1ULL << proof.inputbits) + (1ULL << SO_CHUNKBITS) - 1) >> SO_CHUNKBITS;
+
+    // Every thread works on the same proof, taking chunks as they go.
+    args = calloc(options->numthreads, sizeof *args);
+
+    for (uint32_t i = 0; i < options->numthreads; i++)
+        args[i] = &proof;
+
+    so_run_threads(so_proof_worker, args, options->numthreads);
+
+    free(args);
+
+    return proof.failed ? SO_NOTFOUND : SO_PROVEN;
+}
+
+// Run one of the programs built by superopt_check_vm() from the input state.
+static void so_vm_run(vm_t *vm, vm_program_t *program, const so_state_t *input)
+{
+    memcpy(vm->r, input->r, sizeof vm->r);
+
+    vm->flags   = input->flags;
+    vm->ip      = 0;
+    vm->icount  = 0;
+
+    vm_execute(vm, program, program->count);
+}
+
+// Check the candidate against the target on the real VM, in case the
+// built-in executor has drifted from vm_execute().
+bool superopt_check_vm(const vm_insn_t *target,
+                       uint32_t targetlen,
+                       const vm_insn_t *candidate,
+                       uint32_t candidatelen,
+                       uint32_t live,
+                       uint32_t tests)
+{
+    vm_insn_t       insns[2][SO_MAXINSNS + 1] = {0};
+    vm_program_t    programs[2] = {0};
+    uint64_t        seed        = 0x2545F4914F6CDD1DULL;
+    uint8_t        *pages;
+    uint8_t        *snapshot;
+    bool            equal       = true;
+    vm_t           *vm;
+
+    if (targetlen > SO_MAXINSNS || candidatelen > SO_MAXINSNS)
+        return false;
+
+    memcpy(insns[0], target, targetlen * sizeof *target);
+    memcpy(insns[1], candidate, candidatelen * sizeof *candidate);
+
+    programs[0].insns   = insns[0];
+    programs[0].count   = targetlen + 1;
+    programs[1].insns   = insns[1];
+    programs[1].count   = candidatelen + 1;
+
+    // vm_execute() expects every program to end with a ret, jumping past
+    // the end is simpler because it doesn't depend on the stack.
+    for (int i = 0; i < 2; i++) {
+        insns[i][programs[i].count - 1].opcode      = VM_JMP;
+        insns[i][programs[i].count - 1].op1.type    = VM_OPINT;
+        insns[i][programs[i].count - 1].op1.value   = programs[i].count;
+    }
+
+    if (!vm_create(&vm))
+        return false;
+
+    pages = malloc(VM_MEMSIZE + 4);
+
+    for (uint32_t memseed = 0; memseed < SO_MEMSEEDS && equal; memseed++) {
+        for (uint32_t addr = 0; addr < VM_MEMSIZE + 4; addr++)
+            vm->mem[addr] = superopt_memory(memseed, addr);
+
+        vm_snapshot(vm, &snapshot);
+
+        for (uint32_t t = 0; t < tests / SO_MEMSEEDS && equal; t++) {
+            uint32_t   r[8];
+            uint32_t   flags;
+            uint64_t   dirty;
+            so_state_t input;
+
+            so_input(&input, &seed, NULL, 0);
+            so_vm_run(vm, &programs[0], &input);
+
+            memcpy(r, vm->r, sizeof r);
+
+            flags = vm->flags;
+            dirty = vm->dirty;
+
+            for (uint64_t d = dirty; d; d &= d - 1) {
+                uint32_t page = __builtin_ctzll(d);
+                uint32_t size = page == VM_NUMPAGES - 1 ? VM_PAGESIZE + 4 : VM_PAGESIZE;
+
+                memcpy(&pages[page * VM_PAGESIZE], &vm->mem[page * VM_PAGESIZE], size);
+            }
+
+            vm_restore(vm, snapshot);
+            so_vm_run(vm, &programs[1], &input);
+
+            for (uint32_t regs = live & SO_REGS; regs; regs &= regs - 1)
+                equal &= vm->r[__builtin_ctz(regs)] == r[__builtin_ctz(regs)];
+
+            if (live & SO_FLAGS)
+                equal &= vm->flags == flags;
+
+            for (uint64_t d = dirty | vm->dirty; d; d &= d - 1) {
+                uint32_t       page     = __builtin_ctzll(d);
+                uint32_t       size     = page == VM_NUMPAGES - 1 ? VM_PAGESIZE + 4 : VM_PAGESIZE;
+                const uint8_t *expected = dirty & (1ULL << page) ? pages : snapshot;
+
+                equal &= memcmp(&vm->mem[page * VM_PAGESIZE], &expected[page * VM_PAGESIZE], size) == 0;
+            }
+
+            vm_restore(vm, snapshot);
+        }
+
+        free(snapshot);
+    }
+
+    free(pages);
+    vm_destroy(vm);
+    return equal;
+}
+
+// Search for a cheaper sequence equivalent to target. By default that means
+// fewer instructions, or if options->smaller is set fewer bits.
+bool superopt_search(const vm_insn_t *target,
+                     uint32_t length,
+                     const so_options_t *options,
+                     so_result_t *result)
+{
+    so_context_t    ctx = {
+        .options    = options,
+        .live       = options->live,
+        .maxbits    = UINT32_MAX,
+        .lock       = PTHREAD_MUTEX_INITIALIZER,
+    };
+    uint32_t        imms[SO_MAXIMMS];
+    uint32_t        numimms;
+    uint32_t        maxlength;
+    uint64_t        seed        = 0x9E3779B97F4A7C15ULL;
+    uint32_t        numthreads  = options->numthreads ? options->numthreads : 1;
+    so_worker_t    *workers;
+    void          **args;
+
+    memset(result, 0, sizeof *result);
+
+    if (length > SO_MAXINSNS)
+        return false;
+
+    for (uint32_t i = 0; i < length; i++) {
+        if (!superopt_supported(&target[i]))
+            return false;
+    }
+
+    ctx.targetbits = superopt_bits(target, length);
+
+    so_alphabet(&ctx, target, length, imms, &numimms);
+
+    ctx.inputs  = calloc(SO_TESTS, sizeof *ctx.inputs);
+    ctx.outputs = calloc(SO_TESTS, sizeof *ctx.outputs);
+
+    for (uint32_t t = 0; t < SO_TESTS; t++) {
+        so_input(&ctx.inputs[t], &seed, imms, numimms);
+        so_copy(&ctx.outputs[t], &ctx.inputs[t]);
+        superopt_execute(target, length, &ctx.outputs[t]);
+    }
+
+    // When looking for fewer bits, a sequence the same length is acceptable.
+    maxlength = options->smaller ? length : length - 1;
+
+    if (options->smaller)
+        ctx.maxbits = ctx.targetbits;
+
+    if (maxlength > options->maxlength)
+        maxlength = options->maxlength;
+
+    workers = calloc(numthreads, sizeof *workers);
+    args    = calloc(numthreads, sizeof *args);
+
+    for (uint32_t i = 0; i < numthreads; i++) {
+        workers[i].ctx  = &ctx;
+        args[i]         = &workers[i];
+    }
+
+    for (ctx.length = 0; ctx.length <= maxlength && length > 0; ctx.length++) {
+        struct timespec start;
+        struct timespec end;
+        uint64_t        candidates  = 0;
+        uint64_t        passed      = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        ctx.numfound    = 0;
+        ctx.next        = 0;
+
+        if (ctx.length == 0) {
+            // The target might be entirely dead.
+            candidates++;
+
+            if (so_test(&ctx, NULL, 0, 0)) {
+                workers[0].passed++;
+                so_found(&workers[0], 0);
+            }
+        } else {
+            so_run_threads(so_search_worker, args, numthreads);
+        }
+
+        for (uint32_t i = 0; i < numthreads; i++) {
+            candidates  += workers[i].candidates;
+            passed      += workers[i].passed;
+            workers[i].candidates = workers[i].passed = 0;
+        }
+
+        result->candidates  += candidates;
+        result->passed      += passed;
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (options->verbose) {
+            fprintf(stderr, "length %u: %u instructions, %llu candidates, %llu passed testing, %.2fs\n",
+                    ctx.length,
+                    ctx.count,
+                    (unsigned long long) candidates,
+                    (unsigned long long) passed,
+                    (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        }
+
+        qsort(ctx.found, ctx.numfound, sizeof *ctx.found, so_compare_candidates);
+
+        // Take the cheapest that survives the real VM and, if possible, a proof.
+        for (size_t i = 0; i < ctx.numfound; i++) {
+            vm_insn_t    insns[SO_MAXINSNS];
+            uint32_t     inputs;
+            uint32_t     inputbits;
+            so_verdict_t verdict;
+
+            for (uint32_t j = 0; j < ctx.length; j++)
+                insns[j] = ctx.alphabet[ctx.found[i].seq[j]].insn;
+
+            if (!superopt_check_vm(target, length, insns, ctx.length, ctx.live, SO_VMTESTS)) {
+                if (options->verbose)
+                    fprintf(stderr, "candidate rejected by the real vm\n");
+                continue;
+            }
+
+            verdict = so_prove(target, length, insns, ctx.length, options, &ctx.inputs[0], &inputs, &inputbits);
+
+            if (verdict == SO_NOTFOUND) {
+                if (options->verbose)
+                    fprintf(stderr, "candidate disproved by exhaustive search over %u bits\n", inputbits);
+                continue;
+            }
+
+            result->verdict     = verdict;
+            result->length      = ctx.length;
+            result->inputs      = inputs;
+            result->inputbits   = inputbits;
+
+            memcpy(result->insns, insns, sizeof insns);
+
+            ctx.maxbits = ctx.found[i].bits;
+            break;
+        }
+
+        if (result->verdict != SO_NOTFOUND && !options->smaller)
+            break;
+    }
+
+    free(ctx.inputs);
+    free(ctx.outputs);
+    free(ctx.found);
+    free(ctx.alphabet);
+    free(workers);
+    free(args);
+
+    return result->verdict != SO_NOTFOUND;
+}
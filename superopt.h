@@ -0,0 +1,80 @@
+#ifndef __SUPEROPT_H
+#define __SUPEROPT_H
+
+// A superoptimizer for short straight line RarVM sequences. Candidates are
+// run on a small executor that only models the state a few instructions can
+// touch, checked against the real VM, then proven equivalent by trying every
+// input when there are few enough input bits.
+
+#define SO_MAXINSNS     6
+#define SO_MAXWRITES    16
+
+// Locations for liveness, bits 0-7 are the registers.
+#define SO_FLAGS        (1 << 8)
+#define SO_MEMORY       (1 << 9)
+#define SO_REGS         0xff
+
+// Memory starts out as superopt_memory(), only writes are recorded.
+typedef struct {
+    uint32_t    r[8];
+    uint32_t    flags;
+    uint32_t    memseed;    // Selects the initial contents of memory.
+    uint32_t    nwrites;
+    bool        overflow;   // Too many writes were made to record.
+    struct {
+        uint32_t    addr;
+        uint32_t    value;
+        uint32_t    size;
+    } writes[SO_MAXWRITES];
+} so_state_t;
+
+typedef struct {
+    uint32_t    live;           // Locations that must match afterwards, memory always does.
+    uint32_t    maxlength;      // Longest candidate to try.
+    uint32_t    numthreads;
+    uint32_t    exhaustbits;    // Prove by trying every input if there are at most this many bits.
+    bool        bytemode;       // Try the byte forms, movb, addb, etc.
+    bool        smaller;        // Accept candidates of the same length with fewer bits.
+    bool        verbose;
+    uint32_t   *constants;      // Extra immediates to try.
+    uint32_t    numconstants;
+} so_options_t;
+
+typedef enum {
+    SO_NOTFOUND,
+    SO_TESTED,                  // Passed random testing on both executors.
+    SO_PROVEN,                  // Equivalent for every input.
+} so_verdict_t;
+
+typedef struct {
+    so_verdict_t    verdict;
+    vm_insn_t       insns[SO_MAXINSNS];
+    uint32_t        length;
+    uint32_t        inputs;     // Locations enumerated by the proof.
+    uint32_t        inputbits;
+    uint64_t        candidates; // Sequences executed.
+    uint64_t        passed;     // Sequences that passed the quick tests.
+} so_result_t;
+
+uint8_t superopt_memory(uint32_t seed, uint32_t addr);
+uint8_t superopt_load(const so_state_t *state, uint32_t addr);
+bool superopt_supported(const vm_insn_t *insn);
+uint32_t superopt_reads(const vm_insn_t *insn);
+uint32_t superopt_writes(const vm_insn_t *insn);
+uint32_t superopt_kills(const vm_insn_t *insn);
+uint32_t superopt_livein(const vm_insn_t *insns, uint32_t count, uint32_t live);
+uint32_t superopt_bits(const vm_insn_t *insns, uint32_t count);
+void superopt_execute(const vm_insn_t *insns, uint32_t count, so_state_t *state);
+bool superopt_equal(const so_state_t *a, const so_state_t *b, uint32_t live);
+bool superopt_check_vm(const vm_insn_t *target,
+                       uint32_t targetlen,
+                       const vm_insn_t *candidate,
+                       uint32_t candidatelen,
+                       uint32_t live,
+                       uint32_t tests);
+bool superopt_search(const vm_insn_t *target,
+                     uint32_t length,
+                     const so_options_t *options,
+                     so_result_t *result);
+
+#endif
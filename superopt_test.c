@@ -0,0 +1,287 @@
+// Check the superoptimizer executor agrees with the VM, and that the search
+// finds some known answers.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include "bitbuffer.h"
+#include "rarvm.h"
+#include "lexer.h"
+#include "rar.h"
+#include "superopt.h"
+#include "vmtest.h"
+
+#define NUM_CASES   20000
+#define NUM_SEEDS   4
+
+// Any instruction the executor supports, including byte forms that have no
+// mnemonic.
+static void random_insn(vm_insn_t *insn, bool assemble)
+{
+    static const uint8_t bytemodes[] = { VM_MOV, VM_CMP, VM_ADD, VM_SUB, VM_INC, VM_DEC, VM_NEG };
+
+    do {
+        uint8_t flags;
+
+        memset(insn, 0, sizeof *insn);
+
+        insn->opcode    = vmtest_random32() % VM_PRINT;
+        flags           = vm_opcode_flags_table[insn->opcode];
+
+        if (flags & VMCF_BYTEMODE && vmtest_random32() % 3 == 0) {
+            insn->bytemode = true;
+
+            if (assemble && !memchr(bytemodes, insn->opcode, sizeof bytemodes))
+                insn->bytemode = false;
+        }
+
+        if (flags & (VMCF_OP1 | VMCF_OP2))
+            vmtest_random_operand(&insn->op1, 0, vmtest_random32() % 8);
+        if (flags & VMCF_OP2)
+            vmtest_random_operand(&insn->op2, 0, vmtest_random32() % 8);
+
+        if (insn->bytemode && insn->op2.type == VM_OPINT)
+            insn->op2.value &= 0xff;
+        if (insn->bytemode && insn->op1.type == VM_OPINT)
+            insn->op1.value &= 0xff;
+    } while (!superopt_supported(insn));
+}
+
+// Random sequences are run on both the VM and the executor, which must agree
+// on every register, the flags and every byte of memory.
+static void executor(void)
+{
+    vm_t    *vm;
+    uint8_t *snapshot;
+
+    assert(vm_create(&vm));
+
+    for (uint32_t seed = 0; seed < NUM_SEEDS; seed++) {
+        for (uint32_t addr = 0; addr < VM_MEMSIZE + 4; addr++)
+            vm->mem[addr] = superopt_memory(seed, addr);
+
+        assert(vm_snapshot(vm, &snapshot));
+
+        for (int i = 0; i < NUM_CASES / NUM_SEEDS; i++) {
+            vm_insn_t     insns[SO_MAXINSNS + 1] = {0};
+            vm_program_t  program   = { .insns = insns };
+            uint32_t      count     = 1 + vmtest_random32() % SO_MAXINSNS;
+            so_state_t    state     = { .memseed = seed };
+
+            for (uint32_t j = 0; j < count; j++)
+                random_insn(&insns[j], false);
+
+            // Leave by jumping past the end, rather than ret.
+            insns[count].opcode     = VM_JMP;
+            insns[count].op1.type   = VM_OPINT;
+            insns[count].op1.value  = count + 1;
+            program.count           = count + 1;
+
+            for (int r = REG0; r <= REG7; r++)
+                state.r[r] = vmtest_random_value();
+
+            state.flags = (vmtest_random32() & (VM_FC | VM_FZ)) | (vmtest_random32() & VM_FS);
+
+            memcpy(vm->r, state.r, sizeof vm->r);
+
+            vm->flags   = state.flags;
+            vm->ip      = 0;
+            vm->icount  = 0;
+
+            assert(vm_execute(vm, &program, program.count));
+
+            superopt_execute(insns, count, &state);
+
+            assert(!state.overflow);
+            assert(memcmp(vm->r, state.r, sizeof vm->r) == 0);
+            assert(vm->flags == state.flags);
+
+            // Every byte the VM changed must have been recorded.
+            for (uint64_t dirty = vm->dirty; dirty; dirty &= dirty - 1) {
+                uint32_t page = __builtin_ctzll(dirty);
+                uint32_t size = page == VM_NUMPAGES - 1 ? VM_PAGESIZE + 4 : VM_PAGESIZE;
+
+                for (uint32_t addr = page * VM_PAGESIZE; addr < page * VM_PAGESIZE + size; addr++) {
+                    if (vm->mem[addr] != snapshot[addr])
+                        assert(superopt_load(&state, addr) == vm->mem[addr]);
+                }
+            }
+
+            // And every recorded write must have happened.
+            for (uint32_t j = 0; j < state.nwrites; j++) {
+                for (uint32_t k = 0; k < state.writes[j].size; k++) {
+                    uint32_t addr = state.writes[j].addr + k;
+
+                    assert(superopt_load(&state, addr) == vm->mem[addr]);
+                }
+            }
+
+            vm_restore(vm, snapshot);
+        }
+
+        free(snapshot);
+    }
+
+    vm_destroy(vm);
+}
+
+// Rules are printed with vm_format_insn(), which must assemble to the same
+// instruction in the number of bits superopt_bits() claims.
+static void encoding(void)
+{
+    for (int i = 0; i < NUM_CASES; i++) {
+        uint8_t        code[64] = {0};
+        char           text[128];
+        vm_insn_t      insn;
+        bitbuf_t      *output;
+        const uint8_t *bits;
+        uint32_t       size;
+        vm_program_t  *program;
+
+        random_insn(&insn, true);
+
+        vm_format_insn(text, sizeof text, &insn);
+
+        bitbuf_create(&output);
+        bitbuf_append(output, 0, 1);    // DataFlag
+
+        assert(rar_assemble_line(text, output, NULL));
+        assert(bitbuf_numbits(output) - 1 == superopt_bits(&insn, 1));
+
+        bitbuf_append(output, 0, 8 - bitbuf_numbits(output) % 8);
+        bitbuf_getbits(output, &bits, &size);
+
+        memcpy(code + 1, bits, size);
+
+        for (uint32_t j = 0; j < size; j++)
+            code[0] ^= bits[j];
+
+        assert(vm_program_decode(&program, code, size + 1));
+
+        assert(program->insns[0].opcode == insn.opcode);
+        assert(program->insns[0].bytemode == insn.bytemode);
+        assert(program->insns[0].op1.type == insn.op1.type);
+        assert(program->insns[0].op1.value == insn.op1.value);
+        assert(program->insns[0].op2.type == insn.op2.type);
+        assert(program->insns[0].op2.value == insn.op2.value);
+
+        vm_program_destroy(program);
+        bitbuf_destroy(output);
+    }
+}
+
+static void liveness(void)
+{
+    vm_insn_t insns[] = {
+        { VM_MOV,  false, { VM_OPREG, 1 },  { VM_OPREG, 0 } },
+        { VM_ADD,  false, { VM_OPREG, 1 },  { VM_OPREG, 2 } },
+        { VM_MOV,  true,  { VM_OPREG, 3 },  { VM_OPINT, 0, 1 } },
+        { VM_DIV,  false, { VM_OPREG, 4 },  { VM_OPREGMEM, 5 } },
+    };
+
+    assert(superopt_reads(&insns[0]) == 1 << 0);
+    assert(superopt_kills(&insns[0]) == 1 << 1);
+    assert(superopt_writes(&insns[1]) == (1 << 1 | SO_FLAGS));
+
+    // A byte move keeps the rest of the register, and division by zero does
+    // nothing, so neither replaces the destination.
+    assert(superopt_reads(&insns[2]) == 1 << 3);
+    assert(superopt_kills(&insns[2]) == 0);
+    assert(superopt_kills(&insns[3]) == 0);
+    assert(superopt_reads(&insns[3]) == (1 << 4 | 1 << 5 | SO_MEMORY));
+
+    // r1 is replaced before it's read, r3 is live and partially written.
+    assert(superopt_livein(insns, 3, SO_REGS) == (1 << 0 | 1 << 2 | 1 << 3));
+    assert(superopt_livein(insns, 3, 1 << 1) == (1 << 0 | 1 << 2 | 1 << 3));
+}
+
+static void search(const char *text, uint32_t live, bool smaller, so_verdict_t verdict, const char *expected)
+{
+    so_options_t    options = {
+        .live           = live,
+        .maxlength      = 2,
+        .numthreads     = 2,
+        .smaller        = smaller,
+    };
+    vm_insn_t       target[SO_MAXINSNS];
+    uint32_t        length = 0;
+    so_result_t     result;
+    lexer_t         lexer;
+    asm_line_t      line;
+    char            buf[128];
+
+    lexer_init(&lexer, "<test>", text, strlen(text));
+
+    while (lexer_next(&lexer, &line)) {
+        vm_insn_t *insn = memset(&target[length++], 0, sizeof *target);
+
+        insn->opcode    = line.opcode;
+        insn->op1.type  = line.op[0].type;
+        insn->op1.reg   = line.op[0].reg;
+        insn->op1.value = line.op[0].value;
+        insn->op2.type  = line.op[1].type;
+        insn->op2.reg   = line.op[1].reg;
+        insn->op2.value = line.op[1].value;
+    }
+
+    assert(superopt_search(target, length, &options, &result) == (verdict != SO_NOTFOUND));
+    assert(result.verdict == verdict);
+
+    if (expected) {
+        assert(result.length == 1);
+        assert(strcmp(vm_format_insn(buf, sizeof buf, &result.insns[0]), expected) == 0);
+    }
+}
+
+static void searches(void)
+{
+    uint32_t regs = SO_REGS;
+
+    // Flags are set differently, inc never sets the carry.
+    search("inc r0\ninc r0\n", 1 << 0, false, SO_TESTED, "add     r0, #2");
+    search("inc r0\ninc r0\n", 1 << 0 | SO_FLAGS, false, SO_NOTFOUND, NULL);
+
+    // Nothing is read, so there's only one input to try.
+    search("mov r1, #5\nadd r1, #3\n", regs, false, SO_PROVEN, "mov     r1, #8");
+
+    // Memory is read, so this can only be tested.
+    search("mov r0, [r1]\nand r0, #0xff\n", regs, false, SO_TESTED, "movzx   r0, [r1]");
+
+    // Same length, fewer bits.
+    search("mov r0, #0\n", regs, true, SO_TESTED, "xor     r0, r0");
+
+    // Adding zero only sets the flags, and test sets them the same way.
+    search("add r0, #0\n", regs | SO_FLAGS, true, SO_TESTED, "test    r0, r0");
+}
+
+static void check_vm(void)
+{
+    vm_insn_t inc = { VM_INC, false, { VM_OPREG, 0 } };
+    vm_insn_t add = { VM_ADD, false, { VM_OPREG, 0 }, { VM_OPINT, 0, 1 } };
+    vm_insn_t sub = { VM_SUB, false, { VM_OPREG, 0 }, { VM_OPINT, 0, -1 } };
+
+    assert(superopt_check_vm(&inc, 1, &add, 1, SO_REGS, 1024));
+    assert(superopt_check_vm(&add, 1, &sub, 1, SO_REGS, 1024));
+    assert(!superopt_check_vm(&inc, 1, &add, 1, SO_REGS | SO_FLAGS, 1024));
+    assert(!superopt_check_vm(&inc, 1, &inc, 0, SO_REGS, 1024));
+}
+
+int main(int argc, char **argv)
+{
+    executor();
+    encoding();
+    liveness();
+    searches();
+    check_vm();
+    return 0;
+}
@@ -0,0 +1,35 @@
+#include <constants.rh>
+#include <util.rh>
+; vim: syntax=fasm
+
+; Filter each block in place, using the registers and global data from its own
+; invocation. Every byte is xored with the first byte of the global data, then
+; r0 is added to it.
+;
+; Usage:
+;
+;   $ rarld blocks.ro blocks.1,r0=1,data=blocks.k1 blocks.2,r0=2,data=blocks.k2 > blocks.rar
+;   $ unrar p -inul blocks.rar
+;   Hello, World!
+;
+
+_start:
+    mov     r2, [#0x3C040]              ; Global data follows the fixed globals.
+    and     r2, #0xff
+    mov     r1, #0
+    jmp     $next
+
+filter:
+    movzx   r3, [r1]
+    xor     r3, r2
+    add     r3, r0
+    movb    [r1], r3
+    inc     r1
+
+next:
+    cmp     r1, r4                      ; The block length.
+    jb      $filter
+
+    mov     [VMADDR_NEWBLOCKPOS],  #0   ; Pointer
+    mov     [VMADDR_NEWBLOCKSIZE], r4   ; Size
+    call    $_success
@@ -0,0 +1,751 @@
+// Record and replay execution traces.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "rarvm.h"
+#include "trace.h"
+
+#define TRACE_MAGIC         0x52545652      // "RVTR"
+#define TRACE_VERSION       1
+
+// Records are collected here and written in one go.
+#define TRACE_BUFSIZE       0x10000
+
+// The most memory a single instruction can write, pusha writes 8 dwords.
+#define MAX_REGIONS         10
+
+// Each record starts with a tag saying what follows.
+enum {
+    TR_JUMP         = 1 << 0,       // The new ip.
+    TR_FLAGS        = 1 << 1,       // The new flags.
+    TR_REGS         = 1 << 2,       // A mask of registers, then the difference for each.
+    TR_MEMORY       = 1 << 3,       // A number of runs, each an address, length and the bytes.
+    TR_IMMEDIATE    = 1 << 4,       // A number of operands, each an index and value.
+    TR_FINISHED     = 1 << 5,       // The program terminated, nothing else follows.
+    TR_ENDCHUNK     = 0xff,
+};
+
+#pragma pack(push, 1)
+
+// The header is rewritten when the trace is closed.
+typedef struct {
+    uint32_t    magic;
+    uint32_t    version;
+    uint32_t    numkeyframes;
+    uint64_t    length;         // Instructions recorded.
+    uint64_t    indexoffset;    // Where the keyframe index starts.
+} header_t;
+
+typedef struct {
+    uint64_t    index;          // Instructions executed before the keyframe.
+    uint64_t    offset;         // Of the gzip member that starts with it.
+} keyframe_t;
+
+#pragma pack(pop)
+
+struct trace {
+    char       *filename;
+    bool        writing;
+    gzFile      file;           // The current chunk.
+    uint64_t    interval;       // Instructions between keyframes.
+    header_t    header;
+    keyframe_t *keyframes;
+    uint32_t    chunk;
+    uint64_t    index;          // Instructions recorded or replayed so far.
+    uint8_t    *shadow;         // Memory before a standard filter ran.
+    uint8_t    *buf;
+    uint32_t    used;
+    bool        failed;         // A write failed.
+};
+
+static void flush(trace_t *trace)
+{
+    if (trace->used && gzwrite(trace->file, trace->buf, trace->used) != trace->used)
+        trace->failed = true;
+
+    trace->used = 0;
+}
+
+static void put_bytes(trace_t *trace, const uint8_t *data, uint32_t size)
+{
+    if (trace->used + size > TRACE_BUFSIZE)
+        flush(trace);
+
+    if (size > TRACE_BUFSIZE) {
+        if (gzwrite(trace->file, data, size) != size)
+            trace->failed = true;
+        return;
+    }
+
+    memcpy(trace->buf + trace->used, data, size);
+    trace->used += size;
+}
+
+static void put_varint(trace_t *trace, uint64_t value)
+{
+    uint8_t  bytes[10];
+    uint32_t count = 0;
+
+    do {
+        bytes[count] = value & 0x7f;
+        value      >>= 7;
+        bytes[count++] |= value ? 0x80 : 0;
+    } while (value);
+
+    put_bytes(trace, bytes, count);
+}
+
+static void put_byte(trace_t *trace, uint8_t value)
+{
+    put_bytes(trace, &value, 1);
+}
+
+// Signed differences are zigzag encoded, so small ones are short.
+static inline uint32_t zigzag(uint32_t old, uint32_t new)
+{
+    int32_t delta = new - old;
+
+    return (delta << 1) ^ (delta >> 31);
+}
+
+static inline uint32_t unzigzag(uint32_t old, uint32_t value)
+{
+    return old + ((value >> 1) ^ -(value & 1));
+}
+
+// The sign flag is the top bit, rotate it to the bottom so the usual flags
+// fit in a byte.
+static inline uint32_t pack_flags(uint32_t flags)
+{
+    return flags << 1 | flags >> 31;
+}
+
+static inline uint32_t unpack_flags(uint32_t flags)
+{
+    return flags >> 1 | flags << 31;
+}
+
+static bool get_varint(trace_t *trace, uint64_t *value)
+{
+    int c;
+
+    *value = 0;
+
+    for (uint32_t shift = 0; shift < 64; shift += 7) {
+        if ((c = gzgetc(trace->file)) < 0)
+            return false;
+
+        *value |= (uint64_t)(c & 0x7f) << shift;
+
+        if (!(c & 0x80))
+            return true;
+    }
+
+    return false;
+}
+
+static bool get_varint32(trace_t *trace, uint32_t *value)
+{
+    uint64_t result;
+
+    if (!get_varint(trace, &result) || result > UINT32_MAX)
+        return false;
+
+    *value = result;
+    return true;
+}
+
+static void mark_dirty(vm_t *vm, uint32_t addr, uint32_t size)
+{
+    for (uint32_t page = addr / VM_PAGESIZE; page <= (addr + size - 1) / VM_PAGESIZE; page++)
+        vm->dirty |= 1ULL << (page % VM_NUMPAGES);
+}
+
+// The complete state, so that a chunk can be replayed on its own. That
+// includes the value of every immediate, because programs can change them.
+static void write_keyframe(trace_t *trace, const vm_t *vm, const vm_program_t *program)
+{
+    put_varint(trace, trace->index);
+    put_varint(trace, vm->icount);
+    put_varint(trace, vm->mcount);
+    put_varint(trace, vm->ip);
+    put_varint(trace, vm->flags);
+
+    for (int i = REG0; i <= REG7; i++)
+        put_varint(trace, vm->r[i]);
+
+    put_varint(trace, program->count * 2);
+
+    for (uint32_t i = 0; i < program->count; i++) {
+        put_varint(trace, program->insns[i].op1.value);
+        put_varint(trace, program->insns[i].op2.value);
+    }
+
+    put_bytes(trace, vm->mem, VM_MEMSIZE + 4);
+}
+
+static bool read_keyframe(trace_t *trace, vm_t *vm, vm_program_t *program)
+{
+    uint32_t numoperands;
+
+    if (!get_varint(trace, &trace->index)
+     || !get_varint(trace, &vm->icount)
+     || !get_varint(trace, &vm->mcount)
+     || !get_varint32(trace, &vm->ip)
+     || !get_varint32(trace, &vm->flags)) {
+        return false;
+    }
+
+    for (int i = REG0; i <= REG7; i++) {
+        if (!get_varint32(trace, &vm->r[i])) {
+            return false;
+        }
+    }
+
+    if (!get_varint32(trace, &numoperands))
+        return false;
+
+    // The program is optional, but if it's a different size, the
+    // immediates can't be for it.
+    for (uint32_t i = 0; i < numoperands; i++) {
+        uint32_t value;
+
+        if (!get_varint32(trace, &value))
+            return false;
+
+        if (program && program->count * 2 == numoperands) {
+            vm_insn_t *insn = &program->insns[i / 2];
+
+            if (i % 2) {
+                insn->op2.value = value;
+            } else {
+                insn->op1.value = value;
+            }
+        }
+    }
+
+    vm->dirty = ~0ULL;
+
+    return gzread(trace->file, vm->mem, VM_MEMSIZE + 4) == VM_MEMSIZE + 4;
+}
+
+// Each chunk is a separate gzip member appended to the file, so it can be
+// decompressed without the ones before it.
+static bool start_chunk(trace_t *trace, const vm_t *vm, const vm_program_t *program)
+{
+    struct stat st;
+
+    if (stat(trace->filename, &st) != 0 || !(trace->file = gzopen(trace->filename, "ab1"))) {
+        trace->failed = true;
+        return false;
+    }
+
+    trace->keyframes = realloc(trace->keyframes, (trace->header.numkeyframes + 1) * sizeof(keyframe_t));
+    trace->keyframes[trace->header.numkeyframes].index  = trace->index;
+    trace->keyframes[trace->header.numkeyframes].offset = st.st_size;
+    trace->header.numkeyframes++;
+
+    write_keyframe(trace, vm, program);
+    return true;
+}
+
+static bool end_chunk(trace_t *trace)
+{
+    put_byte(trace, TR_ENDCHUNK);
+    flush(trace);
+
+    if (gzclose(trace->file) != Z_OK)
+        trace->failed = true;
+
+    trace->file = NULL;
+    return !trace->failed;
+}
+
+static bool open_chunk(trace_t *trace, uint32_t chunk)
+{
+    int fd;
+
+    if (trace->file)
+        gzclose(trace->file);
+
+    trace->file = NULL;
+
+    if ((fd = open(trace->filename, O_RDONLY)) < 0)
+        return false;
+
+    // gzdopen starts reading from the current offset.
+    if (lseek(fd, trace->keyframes[chunk].offset, SEEK_SET) < 0 || !(trace->file = gzdopen(fd, "rb"))) {
+        close(fd);
+        return false;
+    }
+
+    trace->chunk = chunk;
+    return true;
+}
+
+bool trace_create(trace_t **trace, const char *filename, uint64_t interval)
+{
+    FILE *file;
+
+    if (!(*trace = calloc(1, sizeof(trace_t))))
+        return false;
+
+    (*trace)->filename          = strdup(filename);
+    (*trace)->writing           = true;
+    (*trace)->interval          = interval;
+    (*trace)->buf               = malloc(TRACE_BUFSIZE);
+    (*trace)->header.magic      = TRACE_MAGIC;
+    (*trace)->header.version    = TRACE_VERSION;
+
+    if (!(file = fopen(filename, "wb"))) {
+        trace_close(*trace);
+        return false;
+    }
+
+    fwrite(&(*trace)->header, sizeof(header_t), 1, file);
+    fclose(file);
+    return true;
+}
+
+// Memory an instruction might write, it's compared afterwards to see what
+// actually changed.
+static uint32_t write_regions(const vm_t *vm, const vm_insn_t *insn, uint32_t *regions)
+{
+    uint32_t count = 0;
+    uint32_t sp    = vm->r[REG7];
+
+    if (insn->op1.type == VM_OPREGMEM)
+        regions[count++] = (vm->r[insn->op1.reg] + insn->op1.value) & VM_MEMMASK;
+    if (insn->op1.type == VM_OPMEM)
+        regions[count++] = insn->op1.value & VM_MEMMASK;
+    if (insn->op2.type == VM_OPREGMEM)
+        regions[count++] = (vm->r[insn->op2.reg] + insn->op2.value) & VM_MEMMASK;
+    if (insn->op2.type == VM_OPMEM)
+        regions[count++] = insn->op2.value & VM_MEMMASK;
+
+    switch (insn->opcode) {
+        case VM_PUSH:
+        case VM_CALL:
+        case VM_PUSHF:
+            regions[count++] = (sp - 4) & VM_MEMMASK;
+            break;
+        case VM_PUSHA:
+            for (int i = REG0; i <= REG7; i++)
+                regions[count++] = (sp - 4 * (i + 1)) & VM_MEMMASK;
+            break;
+    }
+
+    return count;
+}
+
+// Standard filters run natively and could change anything.
+static void write_changes(trace_t *trace, const vm_t *vm)
+{
+    uint32_t numruns = 0;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t addr = 0; addr < VM_MEMSIZE + 4;) {
+            uint32_t start;
+
+            if (vm->mem[addr] == trace->shadow[addr]) {
+                addr++;
+                continue;
+            }
+
+            for (start = addr; addr < VM_MEMSIZE + 4 && vm->mem[addr] != trace->shadow[addr]; addr++)
+                ;
+
+            if (pass == 0) {
+                numruns++;
+            } else {
+                put_varint(trace, start);
+                put_varint(trace, addr - start);
+                put_bytes(trace, &vm->mem[start], addr - start);
+            }
+        }
+
+        if (pass == 0)
+            put_varint(trace, numruns);
+    }
+}
+
+// Like vm_execute, but every instruction is recorded. The program is single
+// stepped, and each instruction compared with the state before it.
+bool trace_execute(trace_t *trace, vm_t *vm, vm_program_t *program, uint64_t maxinsns)
+{
+    bool filter = program->filter != VMSF_NONE;
+
+    if (!trace->file && !start_chunk(trace, vm, program))
+        return false;
+
+    if (filter && !trace->shadow)
+        trace->shadow = malloc(VM_MEMSIZE + 4);
+
+    while (filter || vm->icount < maxinsns) {
+        vm_insn_t *insn = &program->insns[vm->ip];
+        uint32_t   ip   = vm->ip;
+        uint32_t   flags = vm->flags;
+        uint32_t   r[8];
+        uint32_t   immediates[2] = { insn->op1.value, insn->op2.value };
+        uint32_t   regions[MAX_REGIONS];
+        uint32_t   before[MAX_REGIONS];
+        uint32_t   numregions = 0;
+        uint32_t   changed    = 0;
+        uint8_t    regs       = 0;
+        uint8_t    tag        = 0;
+        bool       finished;
+
+        if (trace->index && trace->index % trace->interval == 0 && trace->keyframes[trace->header.numkeyframes - 1].index != trace->index) {
+            if (!end_chunk(trace) || !start_chunk(trace, vm, program)) {
+                return false;
+            }
+        }
+
+        memcpy(r, vm->r, sizeof r);
+
+        if (filter) {
+            memcpy(trace->shadow, vm->mem, VM_MEMSIZE + 4);
+        } else {
+            numregions = write_regions(vm, insn, regions);
+
+            for (uint32_t i = 0; i < numregions; i++)
+                memcpy(&before[i], &vm->mem[regions[i]], sizeof(uint32_t));
+        }
+
+        finished = vm_execute(vm, program, vm->icount + 1);
+
+        for (int i = REG0; i <= REG7; i++)
+            regs |= (vm->r[i] != r[i]) << i;
+
+        for (uint32_t i = 0; i < numregions; i++)
+            changed |= (memcmp(&before[i], &vm->mem[regions[i]], sizeof(uint32_t)) != 0) << i;
+
+        if (vm->ip != ip + 1)
+            tag |= TR_JUMP;
+        if (vm->flags != flags)
+            tag |= TR_FLAGS;
+        if (regs)
+            tag |= TR_REGS;
+        if (changed || filter)
+            tag |= TR_MEMORY;
+        if (!filter && (insn->op1.value != immediates[0] || insn->op2.value != immediates[1]))
+            tag |= TR_IMMEDIATE;
+        if (finished || filter)
+            tag |= TR_FINISHED;
+
+        put_byte(trace, tag);
+
+        if (tag & TR_JUMP)
+            put_varint(trace, vm->ip);
+        if (tag & TR_FLAGS)
+            put_varint(trace, pack_flags(vm->flags));
+
+        if (tag & TR_REGS) {
+            put_byte(trace, regs);
+
+            for (int i = REG0; i <= REG7; i++) {
+                if (regs & (1 << i)) {
+                    put_varint(trace, zigzag(r[i], vm->r[i]));
+                }
+            }
+        }
+
+        if (tag & TR_MEMORY && filter) {
+            write_changes(trace, vm);
+        } else if (tag & TR_MEMORY) {
+            put_varint(trace, __builtin_popcount(changed));
+
+            for (uint32_t i = 0; i < numregions; i++) {
+                if (changed & (1 << i)) {
+                    put_varint(trace, regions[i]);
+                    put_varint(trace, sizeof(uint32_t));
+                    put_bytes(trace, &vm->mem[regions[i]], sizeof(uint32_t));
+                }
+            }
+        }
+
+        if (tag & TR_IMMEDIATE) {
+            put_varint(trace, (insn->op1.value != immediates[0]) + (insn->op2.value != immediates[1]));
+
+            if (insn->op1.value != immediates[0]) {
+                put_varint(trace, ip * 2);
+                put_varint(trace, insn->op1.value);
+            }
+
+            if (insn->op2.value != immediates[1]) {
+                put_varint(trace, ip * 2 + 1);
+                put_varint(trace, insn->op2.value);
+            }
+        }
+
+        trace->index++;
+
+        if (trace->failed)
+            return false;
+
+        if (tag & TR_FINISHED)
+            return finished;
+    }
+
+    return false;
+}
+
+bool trace_open(trace_t **trace, const char *filename)
+{
+    FILE *file;
+
+    if (!(*trace = calloc(1, sizeof(trace_t))))
+        return false;
+
+    (*trace)->filename = strdup(filename);
+
+    if (!(file = fopen(filename, "rb"))) {
+        trace_close(*trace);
+        return false;
+    }
+
+    if (fread(&(*trace)->header, sizeof(header_t), 1, file) != 1
+     || (*trace)->header.magic != TRACE_MAGIC
+     || (*trace)->header.version != TRACE_VERSION
+     || (*trace)->header.numkeyframes == 0
+     || fseek(file, (*trace)->header.indexoffset, SEEK_SET) != 0) {
+        fclose(file);
+        trace_close(*trace);
+        return false;
+    }
+
+    (*trace)->keyframes = calloc((*trace)->header.numkeyframes, sizeof(keyframe_t));
+
+    if (fread((*trace)->keyframes, sizeof(keyframe_t), (*trace)->header.numkeyframes, file) != (*trace)->header.numkeyframes) {
+        fclose(file);
+        trace_close(*trace);
+        return false;
+    }
+
+    fclose(file);
+    return true;
+}
+
+// The index goes at the end, and the header is updated to point at it.
+bool trace_close(trace_t *trace)
+{
+    bool  result = true;
+    FILE *file;
+
+    if (trace->writing && trace->file) {
+        trace->header.length = trace->index;
+
+        if (!end_chunk(trace) || !(file = fopen(trace->filename, "r+b"))) {
+            result = false;
+        } else {
+            fseek(file, 0, SEEK_END);
+
+            trace->header.indexoffset = ftell(file);
+
+            fwrite(trace->keyframes, sizeof(keyframe_t), trace->header.numkeyframes, file);
+            fseek(file, 0, SEEK_SET);
+            fwrite(&trace->header, sizeof(header_t), 1, file);
+
+            result = fclose(file) == 0;
+        }
+    } else if (trace->file) {
+        gzclose(trace->file);
+    }
+
+    if (trace->failed)
+        result = false;
+
+    free(trace->filename);
+    free(trace->keyframes);
+    free(trace->shadow);
+    free(trace->buf);
+    free(trace);
+    return result;
+}
+
+// Rebuild the state before instruction index was executed, starting from the
+// closest keyframe.
+bool trace_seek(trace_t *trace, vm_t *vm, vm_program_t *program, uint64_t index)
+{
+    uint32_t chunk = 0;
+
+    if (index > trace->header.length)
+        return false;
+
+    for (uint32_t lo = 0, hi = trace->header.numkeyframes; lo < hi;) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (trace->keyframes[mid].index <= index) {
+            chunk = mid;
+            lo    = mid + 1;
+        } else {
+            hi    = mid;
+        }
+    }
+
+    // Carry on from here if that's quicker.
+    if (!(trace->file && trace->chunk == chunk && trace->index <= index)) {
+        if (!open_chunk(trace, chunk) || !read_keyframe(trace, vm, program)) {
+            return false;
+        }
+    }
+
+    while (trace->index < index) {
+        if (!trace_next(trace, vm, program, NULL)) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Replay the next instruction, returns false at the end of the trace.
+bool trace_next(trace_t *trace, vm_t *vm, vm_program_t *program, trace_event_t *event)
+{
+    trace_event_t  unused;
+    int            tag;
+
+    if (!trace->file && !trace_seek(trace, vm, program, 0))
+        return false;
+
+    if (!event)
+        event = &unused;
+
+    // The next chunk starts with a keyframe of the state we already have.
+    while ((tag = gzgetc(trace->file)) == TR_ENDCHUNK) {
+        if (trace->chunk + 1 >= trace->header.numkeyframes)
+            return false;
+
+        if (!open_chunk(trace, trace->chunk + 1) || !read_keyframe(trace, vm, program))
+            return false;
+    }
+
+    if (tag < 0)
+        return false;
+
+    memset(event, 0, sizeof *event);
+
+    event->index    = trace->index;
+    event->ip       = vm->ip;
+    event->jump     = tag & TR_JUMP;
+    event->flags    = tag & TR_FLAGS;
+    event->finished = tag & TR_FINISHED;
+
+    vm->ip++;
+
+    if (tag & TR_JUMP && !get_varint32(trace, &vm->ip))
+        return false;
+    if (tag & TR_FLAGS) {
+        if (!get_varint32(trace, &vm->flags))
+            return false;
+        vm->flags = unpack_flags(vm->flags);
+    }
+
+    if (tag & TR_REGS) {
+        int regs = gzgetc(trace->file);
+
+        if (regs < 0)
+            return false;
+
+        event->regs = regs;
+
+        for (int i = REG0; i <= REG7; i++) {
+            uint32_t delta;
+
+            if (!(regs & (1 << i)))
+                continue;
+
+            if (!get_varint32(trace, &delta))
+                return false;
+
+            vm->r[i] = unzigzag(vm->r[i], delta);
+        }
+    }
+
+    if (tag & TR_MEMORY) {
+        uint32_t numruns;
+
+        if (!get_varint32(trace, &numruns))
+            return false;
+
+        for (uint32_t i = 0; i < numruns; i++) {
+            uint32_t addr;
+            uint32_t size;
+
+            if (!get_varint32(trace, &addr)
+             || !get_varint32(trace, &size)
+             || size == 0
+             || addr >= VM_MEMSIZE + 4
+             || size > VM_MEMSIZE + 4 - addr
+             || gzread(trace->file, &vm->mem[addr], size) != size) {
+                return false;
+            }
+
+            mark_dirty(vm, addr, size);
+
+            if (event->numwrites < TRACE_MAXWRITES) {
+                event->writes[event->numwrites].addr = addr;
+                event->writes[event->numwrites].size = size;
+                event->numwrites++;
+            }
+        }
+    }
+
+    if (tag & TR_IMMEDIATE) {
+        if (!get_varint32(trace, &event->numimmediates))
+            return false;
+
+        for (uint32_t i = 0; i < event->numimmediates; i++) {
+            uint32_t operand;
+            uint32_t value;
+
+            if (!get_varint32(trace, &operand) || !get_varint32(trace, &value))
+                return false;
+
+            if (program && operand < program->count * 2) {
+                vm_insn_t *insn = &program->insns[operand / 2];
+
+                if (operand % 2) {
+                    insn->op2.value = value;
+                } else {
+                    insn->op1.value = value;
+                }
+            }
+        }
+    }
+
+    vm->icount++;
+    trace->index++;
+    return true;
+}
+
+// The number of instructions recorded.
+uint64_t trace_length(const trace_t *trace)
+{
+    return trace->header.length;
+}
+
+uint32_t trace_keyframes(const trace_t *trace)
+{
+    return trace->header.numkeyframes;
+}
+
+uint64_t trace_keyframe(const trace_t *trace, uint32_t keyframe)
+{
+    return trace->keyframes[keyframe].index;
+}
@@ -0,0 +1,42 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+// Execution traces. Only what each instruction changed is recorded, the
+// registers, flags, memory, any immediate it overwrote, and the new ip if it
+// didn't just continue to the next instruction. These are varint encoded in
+// chunks, each a separate gzip member that starts with a keyframe of the
+// complete state, and an index of the chunks at the end of the file allows
+// seeking to any instruction by replaying at most one chunk.
+
+// Changes beyond this are applied, but not described in trace_event_t.
+#define TRACE_MAXWRITES     16
+
+// What a single instruction did, as replayed.
+typedef struct {
+    uint64_t    index;          // Instructions executed before this one.
+    uint32_t    ip;             // The instruction executed.
+    uint8_t     regs;           // Registers it changed.
+    bool        flags;          // It changed the flags.
+    bool        jump;           // It didn't continue to the next instruction.
+    bool        finished;       // The program terminated.
+    uint32_t    numimmediates;  // Immediates it overwrote.
+    uint32_t    numwrites;
+    struct {
+        uint32_t    addr;
+        uint32_t    size;
+    } writes[TRACE_MAXWRITES];
+} trace_event_t;
+
+typedef struct trace trace_t;
+
+bool trace_create(trace_t **trace, const char *filename, uint64_t interval);
+bool trace_execute(trace_t *trace, vm_t *vm, vm_program_t *program, uint64_t maxinsns);
+bool trace_open(trace_t **trace, const char *filename);
+bool trace_close(trace_t *trace);
+bool trace_seek(trace_t *trace, vm_t *vm, vm_program_t *program, uint64_t index);
+bool trace_next(trace_t *trace, vm_t *vm, vm_program_t *program, trace_event_t *event);
+uint64_t trace_length(const trace_t *trace);
+uint32_t trace_keyframes(const trace_t *trace);
+uint64_t trace_keyframe(const trace_t *trace, uint32_t keyframe);
+
+#endif
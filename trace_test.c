@@ -0,0 +1,166 @@
+// Check that replaying a trace rebuilds exactly the state the VM was in.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include "rarvm.h"
+#include "trace.h"
+#include "vmtest.h"
+
+#define NUM_CASES   200
+#define MAX_INSNS   24
+#define MAX_STEPS   2000
+#define NUM_SEEKS   16
+
+static void random_state(vm_t *vm)
+{
+    for (int i = REG0; i <= REG7; i++)
+        vm->r[i] = vmtest_random32() % 2 ? vmtest_random32() % 0x200 : vmtest_random32();
+
+    vm->r[REG7] = vmtest_random32() % 2 ? 0x200 : 0x40000;
+    vm->flags   = vmtest_random32() & (VM_FC | VM_FZ | VM_FS);
+    vm->ip      = 0;
+    vm->icount  = 0;
+    vm->mcount  = 0;
+
+    for (uint32_t addr = 0; addr < VM_MEMSIZE + 4; addr++)
+        vm->mem[addr] = addr < 0x300 || addr >= VM_MEMSIZE - 0x100 ? vmtest_random32() : 0;
+}
+
+static void check_state(const vm_t *vm, const vm_program_t *program, const vm_t *replay, const vm_program_t *replayed, bool memory)
+{
+    assert(memcmp(vm->r, replay->r, sizeof vm->r) == 0);
+    assert(vm->flags == replay->flags);
+    assert(vm->ip == replay->ip);
+    assert(vm->icount == replay->icount);
+
+    for (uint32_t i = 0; i < program->count; i++) {
+        assert(program->insns[i].op1.value == replayed->insns[i].op1.value);
+        assert(program->insns[i].op2.value == replayed->insns[i].op2.value);
+    }
+
+    if (memory)
+        assert(memcmp(vm->mem, replay->mem, VM_MEMSIZE + 4) == 0);
+}
+
+// Every instruction is replayed in order and compared with the VM stepping
+// the same program, then random instructions are seeked to directly.
+static void replay(void)
+{
+    char          filename[] = "/tmp/trace_test.XXXXXX";
+    vm_insn_t     insns[MAX_INSNS + 1];
+    vm_insn_t     original[MAX_INSNS + 1];
+    vm_insn_t     copy[MAX_INSNS + 1];
+    vm_program_t  program   = { .insns = insns };
+    vm_program_t  replayed  = { .insns = copy };
+    vm_t         *vm;
+    vm_t         *replay;
+    vm_t          start;
+    uint8_t      *initial;
+    int           fd;
+
+    vmtest_seed(0x6b43a9b5);
+
+    assert((fd = mkstemp(filename)) >= 0);
+    assert(vm_create(&vm));
+    assert(vm_create(&replay));
+
+    close(fd);
+
+    for (int i = 0; i < NUM_CASES; i++) {
+        trace_t       *trace;
+        trace_event_t  event;
+        uint64_t       maxinsns = 1 + vmtest_random32() % MAX_STEPS;
+        uint64_t       length;
+        bool           finished;
+
+        vmtest_random_program(&program, MAX_INSNS);
+        random_state(vm);
+
+        replayed.count = program.count;
+
+        memcpy(original, insns, sizeof insns);
+        assert(vm_snapshot(vm, &initial));
+
+        start = *vm;
+
+        assert(trace_create(&trace, filename, 1 + vmtest_random32() % 64));
+
+        finished = trace_execute(trace, vm, &program, maxinsns);
+
+        assert(trace_close(trace));
+        assert(trace_open(&trace, filename));
+
+        length = trace_length(trace);
+
+        assert(finished ? length <= maxinsns : length == maxinsns);
+
+        // Replay from the start, alongside the VM running it again.
+        vm_restore(vm, initial);
+        random_state(replay);
+        memcpy(insns, original, sizeof insns);
+        memcpy(copy, original, sizeof copy);
+        memcpy(vm->r, start.r, sizeof vm->r);
+
+        vm->flags   = start.flags;
+        vm->ip      = vm->icount = vm->mcount = 0;
+
+        for (uint64_t n = 0; n < length; n++) {
+            assert(trace_next(trace, replay, &replayed, &event));
+            assert(event.index == n);
+            assert(event.finished == (n == length - 1 && finished));
+            assert(vm_execute(vm, &program, n + 1) == event.finished);
+
+            check_state(vm, &program, replay, &replayed, n % 64 == 0);
+        }
+
+        assert(!trace_next(trace, replay, &replayed, &event));
+
+        check_state(vm, &program, replay, &replayed, true);
+
+        // Seeking backwards and forwards, across keyframes.
+        for (int s = 0; s < NUM_SEEKS; s++) {
+            uint64_t index = vmtest_random32() % (length + 1);
+
+            vm_restore(vm, initial);
+            memcpy(insns, original, sizeof insns);
+            memcpy(vm->r, start.r, sizeof vm->r);
+
+            vm->flags   = start.flags;
+            vm->ip      = vm->icount = vm->mcount = 0;
+
+            if (index)
+                vm_execute(vm, &program, index);
+
+            assert(trace_seek(trace, replay, &replayed, index));
+
+            check_state(vm, &program, replay, &replayed, true);
+        }
+
+        assert(!trace_seek(trace, replay, &replayed, length + 1));
+
+        trace_close(trace);
+        free(initial);
+    }
+
+    unlink(filename);
+    vm_destroy(vm);
+    vm_destroy(replay);
+}
+
+int main(int argc, char **argv)
+{
+    replay();
+    return 0;
+}
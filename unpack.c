@@ -0,0 +1,981 @@
+// Parser for the RAR 2.9 compressed stream.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <err.h>
+
+#include "rarvm.h"
+#include "rarformat.h"
+#include "unpack.h"
+
+// The signature might not be at the start, e.g. self extracting archives.
+#define MAX_SFX_SIZE    (1 << 20)
+
+// Number of symbols in each of the Huffman tables.
+#define NC              299     // Literals, lengths and special codes.
+#define DC              60      // Distances.
+#define LDC             17      // Low distance bits.
+#define RC              28      // Repeated distance lengths.
+#define BC              20      // Bit lengths, used to encode the others.
+#define HUFF_TABLE_SIZE (NC + DC + RC + LDC)
+
+#define LOW_DIST_REP_COUNT  16
+#define MAX_FILTERS         1024
+#define MAX_PENDING         8192    // Filters waiting for their block.
+#define WINDOW_SIZE         0x400000
+#define WINDOW_MASK         (WINDOW_SIZE - 1)
+
+// Codes up to this many bits are decoded with a single table lookup.
+#define QUICK_BITS      10
+
+typedef struct {
+    uint32_t    declen[16];
+    uint32_t    decpos[16];
+    uint32_t    maxnum;
+    uint16_t    decnum[NC];
+    uint16_t    quicknum[1 << QUICK_BITS];
+    uint8_t     quicklen[1 << QUICK_BITS];
+} decode_t;
+
+// The input is read directly from the archive, it is never copied.
+typedef struct {
+    const uint8_t  *buf;
+    size_t          size;
+    size_t          addr;
+    unsigned        bit;
+} bitin_t;
+
+typedef struct {
+    uint8_t    *code;
+    uint32_t    codesize;
+    uint32_t    execcount;
+    uint32_t    length;         // The last block length, used if none is specified.
+} filter_t;
+
+// An invocation that can't run until its block has been decoded. The code and
+// data are copies, the filter table may change before then.
+typedef struct {
+    unpack_filter_t filter;
+    uint8_t        *code;
+    uint8_t        *data;
+} pending_t;
+
+struct unpack {
+    decode_t    ld;
+    decode_t    dd;
+    decode_t    ldd;
+    decode_t    rd;
+    decode_t    bd;
+    uint8_t     oldtable[HUFF_TABLE_SIZE];
+    bool        tablesread;
+    uint32_t    prevlowdist;
+    uint32_t    lowdistrepcount;
+    uint32_t    lastlength;
+    uint32_t    lastdist;
+    uint32_t    olddist[4];
+    uint64_t    produced;       // Bytes of output the stream describes.
+    uint8_t    *window;
+    filter_t    filters[MAX_FILTERS];
+    uint32_t    numfilters;
+    uint32_t    lastfilter;
+    pending_t  *pending;        // A queue, in the order they appear.
+    uint32_t    firstpending;
+    uint32_t    numpending;
+    uint64_t    flushat;        // Where the first pending block ends.
+    uint8_t    *block;          // The block passed to the callback.
+    bitin_t     in;
+};
+
+static const uint8_t kLengthBase[]  = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 14, 16, 20,
+                                        24, 28, 32, 40, 48, 56, 64, 80, 96, 112, 128,
+                                        160, 192, 224 };
+static const uint8_t kLengthBits[]  = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5 };
+static const uint8_t kShortBase[]   = { 0, 4, 8, 16, 32, 64, 128, 192 };
+static const uint8_t kShortBits[]   = { 2, 2, 3, 4, 5, 6, 6, 6 };
+
+// The distance slots have 4 with no extra bits, then two for each bit length
+// up to 15, then 14 with 16 bits, and 12 with 18 bits.
+static uint32_t kDistBase[DC];
+static uint8_t  kDistBits[DC];
+
+static void __attribute__((constructor)) init_distance_slots(void)
+{
+    static const uint8_t counts[] = { 4, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 14, 0, 12 };
+    uint32_t distance = 0;
+
+    for (int i = 0, slot = 0; i < sizeof counts; i++) {
+        for (int j = 0; j < counts[i]; j++, slot++, distance += 1 << i) {
+            kDistBase[slot] = distance;
+            kDistBits[slot] = i;
+        }
+    }
+}
+
+// Return the next 16 bits of input, reading zeroes past the end like rar does.
+static inline uint32_t getbits(const bitin_t *in)
+{
+    uint32_t field;
+
+    if (in->addr + 3 <= in->size) {
+        field = in->buf[in->addr] << 16 | in->buf[in->addr + 1] << 8 | in->buf[in->addr + 2];
+    } else {
+        field = 0;
+        for (size_t i = in->addr; i < in->addr + 3; i++)
+            field = field << 8 | (i < in->size ? in->buf[i] : 0);
+    }
+
+    return (field >> (8 - in->bit)) & 0xffff;
+}
+
+static inline void addbits(bitin_t *in, unsigned bits)
+{
+    bits     += in->bit;
+    in->addr += bits >> 3;
+    in->bit   = bits & 7;
+}
+
+static inline bool overrun(const bitin_t *in)
+{
+    return in->addr > in->size;
+}
+
+// Equivalent to RarVM::ReadData in unrar.
+static uint32_t read_data(bitin_t *in)
+{
+    uint32_t data = getbits(in);
+
+    switch (data & 0xc000) {
+        case 0x0000:
+            addbits(in, 6);
+            return (data >> 10) & 0xf;
+        case 0x4000:
+            if ((data & 0x3c00) == 0) {
+                addbits(in, 14);
+                return 0xffffff00 | ((data >> 2) & 0xff);
+            }
+            addbits(in, 10);
+            return (data >> 6) & 0xff;
+        case 0x8000:
+            addbits(in, 2);
+            data = getbits(in);
+            addbits(in, 16);
+            return data;
+        default:
+            addbits(in, 2);
+            data = getbits(in) << 16;
+            addbits(in, 16);
+            data |= getbits(in);
+            addbits(in, 16);
+            return data;
+    }
+}
+
+// Rar uses a canonical Huffman code, but doesn't validate the lengths. This
+// reproduces exactly how unrar builds its tables, so that invalid codes decode
+// the same way.
+static void make_decode_tables(const uint8_t *lengths, decode_t *dec, uint32_t size)
+{
+    uint32_t count[16] = {0};
+    uint32_t tmppos[16];
+    uint32_t n = 0;
+
+    memset(dec->decnum, 0, size * sizeof(*dec->decnum));
+
+    for (uint32_t i = 0; i < size; i++)
+        count[lengths[i] & 0xf]++;
+
+    count[0]        = 0;
+    dec->declen[0]  = 0;
+    dec->decpos[0]  = 0;
+    tmppos[0]       = 0;
+
+    for (int i = 1; i < 16; i++) {
+        n               = 2 * (n + count[i]);
+        dec->declen[i]  = n << (15 - i) > 0xffff ? 0xffff : n << (15 - i);
+        dec->decpos[i]  = dec->decpos[i - 1] + count[i - 1];
+        tmppos[i]       = dec->decpos[i];
+    }
+
+    for (uint32_t i = 0; i < size; i++) {
+        if (lengths[i] & 0xf) {
+            dec->decnum[tmppos[lengths[i] & 0xf]++] = i;
+        }
+    }
+
+    dec->maxnum = size;
+
+    // A code of QUICK_BITS or less only depends on that many leading bits, so
+    // the result of the slow path can be cached.
+    for (uint32_t prefix = 0; prefix < 1 << QUICK_BITS; prefix++) {
+        uint32_t field = prefix << (16 - QUICK_BITS);
+        uint32_t bits;
+        uint32_t num;
+
+        for (bits = 1; bits < 15 && field >= dec->declen[bits]; bits++)
+            ;
+
+        dec->quicklen[prefix] = 0;
+
+        if (bits <= QUICK_BITS) {
+            num = dec->decpos[bits] + ((field - dec->declen[bits - 1]) >> (16 - bits));
+            dec->quicknum[prefix] = dec->decnum[num >= dec->maxnum ? 0 : num];
+            dec->quicklen[prefix] = bits;
+        }
+    }
+}
+
+static inline uint32_t decode_number(bitin_t *in, const decode_t *dec)
+{
+    uint32_t field = getbits(in) & 0xfffe;
+    uint32_t bits;
+    uint32_t num;
+
+    if (dec->quicklen[field >> (16 - QUICK_BITS)]) {
+        addbits(in, dec->quicklen[field >> (16 - QUICK_BITS)]);
+        return dec->quicknum[field >> (16 - QUICK_BITS)];
+    }
+
+    for (bits = QUICK_BITS + 1; bits < 15 && field >= dec->declen[bits]; bits++)
+        ;
+
+    addbits(in, bits);
+
+    num = dec->decpos[bits] + ((field - dec->declen[bits - 1]) >> (16 - bits));
+
+    return dec->decnum[num >= dec->maxnum ? 0 : num];
+}
+
+static unpack_status_t read_tables(unpack_t *unpack)
+{
+    bitin_t *in = &unpack->in;
+    uint8_t  bitlength[BC];
+    uint8_t  table[HUFF_TABLE_SIZE];
+    uint32_t field;
+
+    // Tables always begin on a byte boundary.
+    addbits(in, (8 - in->bit) & 7);
+
+    field = getbits(in);
+
+    if (field & 0x8000)
+        return UNPACK_PPM;
+
+    unpack->prevlowdist     = 0;
+    unpack->lowdistrepcount = 0;
+
+    // KeepTables, the new lengths are deltas from the old ones.
+    if (!(field & 0x4000))
+        memset(unpack->oldtable, 0, sizeof unpack->oldtable);
+
+    addbits(in, 2);
+
+    for (int i = 0; i < BC; i++) {
+        uint32_t length = getbits(in) >> 12;
+
+        addbits(in, 4);
+
+        if (length == 15) {
+            uint32_t zerocount = getbits(in) >> 12;
+
+            addbits(in, 4);
+
+            if (zerocount == 0) {
+                bitlength[i] = 15;
+            } else {
+                for (zerocount += 2; zerocount-- > 0 && i < BC; i++)
+                    bitlength[i] = 0;
+                i--;
+            }
+        } else {
+            bitlength[i] = length;
+        }
+    }
+
+    make_decode_tables(bitlength, &unpack->bd, BC);
+
+    for (int i = 0; i < HUFF_TABLE_SIZE;) {
+        uint32_t number = decode_number(in, &unpack->bd);
+        uint32_t n;
+
+        if (overrun(in))
+            return UNPACK_CORRUPT;
+
+        if (number < 16) {
+            table[i] = (number + unpack->oldtable[i]) & 0xf;
+            i++;
+            continue;
+        }
+
+        if (number == 16 || number == 18) {
+            n = (getbits(in) >> 13) + 3;
+            addbits(in, 3);
+        } else {
+            n = (getbits(in) >> 9) + 11;
+            addbits(in, 7);
+        }
+
+        // Repeat the previous length, or a run of zeroes.
+        if (number < 18) {
+            if (i == 0)
+                return UNPACK_CORRUPT;
+
+            for (; n > 0 && i < HUFF_TABLE_SIZE; n--, i++)
+                table[i] = table[i - 1];
+        } else {
+            for (; n > 0 && i < HUFF_TABLE_SIZE; n--, i++)
+                table[i] = 0;
+        }
+    }
+
+    if (overrun(in))
+        return UNPACK_CORRUPT;
+
+    unpack->tablesread = true;
+
+    make_decode_tables(&table[0], &unpack->ld, NC);
+    make_decode_tables(&table[NC], &unpack->dd, DC);
+    make_decode_tables(&table[NC + DC], &unpack->ldd, LDC);
+    make_decode_tables(&table[NC + DC + LDC], &unpack->rd, RC);
+
+    memcpy(unpack->oldtable, table, sizeof unpack->oldtable);
+    return UNPACK_OK;
+}
+
+static void init_filters(unpack_t *unpack)
+{
+    for (uint32_t i = 0; i < unpack->numfilters; i++)
+        free(unpack->filters[i].code);
+
+    unpack->numfilters = 0;
+    unpack->lastfilter = 0;
+}
+
+static void discard_pending(unpack_t *unpack)
+{
+    for (; unpack->numpending; unpack->numpending--) {
+        pending_t *pending = &unpack->pending[unpack->firstpending];
+
+        free(pending->code);
+        free(pending->data);
+
+        unpack->firstpending = (unpack->firstpending + 1) % MAX_PENDING;
+    }
+
+    unpack->firstpending    = 0;
+    unpack->flushat         = UINT64_MAX;
+}
+
+// Pass pending filters to the callback in order, as soon as their blocks have
+// been decoded. At the end of the file the rest are passed too, anything not
+// decoded yet reads as zeros.
+static unpack_status_t flush_pending(unpack_t *unpack, bool all, unpack_callback_t callback, void *opaque)
+{
+    while (unpack->numpending) {
+        pending_t       *pending    = &unpack->pending[unpack->firstpending];
+        unpack_filter_t *filter     = &pending->filter;
+        uint64_t         start      = filter->position + filter->blockstart;
+        uint64_t         available;
+        bool             proceed;
+
+        if (!all && start + filter->blocklength > unpack->produced)
+            break;
+
+        // Too large for the VM, so there's no point copying it.
+        if (filter->blocklength <= VM_GLOBALMEMADDR) {
+            uint32_t offset = start & WINDOW_MASK;
+            uint32_t first;
+
+            available   = unpack->produced > start ? unpack->produced - start : 0;
+            available   = available < filter->blocklength ? available : filter->blocklength;
+            first       = available < WINDOW_SIZE - offset ? available : WINDOW_SIZE - offset;
+
+            memcpy(unpack->block, unpack->window + offset, first);
+            memcpy(unpack->block + first, unpack->window, available - first);
+            memset(unpack->block + available, 0, filter->blocklength - available);
+
+            filter->block = unpack->block;
+        }
+
+        proceed = !callback || callback(opaque, filter);
+
+        free(pending->code);
+        free(pending->data);
+
+        unpack->firstpending = (unpack->firstpending + 1) % MAX_PENDING;
+        unpack->numpending--;
+
+        if (!proceed)
+            return UNPACK_STOPPED;
+    }
+
+    if (unpack->numpending) {
+        const unpack_filter_t *next = &unpack->pending[unpack->firstpending].filter;
+        unpack->flushat = next->position + next->blockstart + next->blocklength;
+    } else {
+        unpack->flushat = UINT64_MAX;
+    }
+
+    return UNPACK_OK;
+}
+
+// Parse a VM code block, see Unpack::AddVMCode in unrar.
+static unpack_status_t add_vm_code(unpack_t *unpack,
+                                   uint32_t firstbyte,
+                                   const uint8_t *vmcode,
+                                   uint32_t length)
+{
+    bitin_t          in     = { vmcode, length, 0, 0 };
+    unpack_filter_t  filter = {0};
+    filter_t        *saved;
+    pending_t       *pending;
+    uint32_t         filtpos;
+    uint32_t         blockstart;
+    uint8_t          globaldata[VM_GLOBALMEMSIZE - VM_FIXEDGLOBALSIZE];
+
+    if (firstbyte & 0x80) {
+        filtpos = read_data(&in);
+
+        // Like InitFilters in unrar, this also drops invocations that are
+        // still waiting for their block.
+        if (filtpos == 0) {
+            init_filters(unpack);
+            discard_pending(unpack);
+        } else {
+            filtpos--;
+        }
+    } else {
+        filtpos = unpack->lastfilter;
+    }
+
+    if (filtpos > unpack->numfilters || filtpos >= MAX_FILTERS)
+        return UNPACK_CORRUPT;
+
+    if (unpack->numpending == MAX_PENDING)
+        return UNPACK_CORRUPT;
+
+    unpack->lastfilter  = filtpos;
+    filter.filtnum      = filtpos;
+    filter.newfilter    = filtpos == unpack->numfilters;
+    saved               = &unpack->filters[filtpos];
+
+    if (filter.newfilter) {
+        memset(saved, 0, sizeof *saved);
+    } else {
+        saved->execcount++;
+    }
+
+    blockstart = read_data(&in);
+
+    if (firstbyte & 0x40)
+        blockstart += 258;
+
+    filter.position     = unpack->produced;
+    filter.blockstart   = blockstart;
+    filter.blocklength  = firstbyte & 0x20 ? read_data(&in) : saved->length;
+    filter.execcount    = saved->execcount;
+    saved->length       = filter.blocklength;
+
+    filter.initr[3]     = VM_GLOBALMEMADDR;
+    filter.initr[4]     = filter.blocklength;
+    filter.initr[5]     = filter.execcount;
+
+    if (firstbyte & 0x10) {
+        filter.initmask = getbits(&in) >> 9;
+        addbits(&in, 7);
+
+        for (int i = 0; i < 7; i++) {
+            if (filter.initmask & (1 << i)) {
+                filter.initr[i] = read_data(&in);
+            }
+        }
+    }
+
+    if (filter.newfilter) {
+        uint32_t codesize = read_data(&in);
+
+        if (codesize >= 0x10000 || codesize == 0)
+            return UNPACK_CORRUPT;
+
+        saved->code     = malloc(codesize);
+        saved->codesize = codesize;
+
+        // The filter isn't in the table until it's complete, so nothing
+        // else would free it.
+        for (uint32_t i = 0; i < codesize; i++) {
+            if (overrun(&in)) {
+                free(saved->code);
+                saved->code = NULL;
+                return UNPACK_CORRUPT;
+            }
+
+            saved->code[i] = getbits(&in) >> 8;
+            addbits(&in, 8);
+        }
+
+        unpack->numfilters++;
+    }
+
+    if (firstbyte & 0x08) {
+        filter.datasize = read_data(&in);
+
+        if (filter.datasize > sizeof globaldata)
+            return UNPACK_CORRUPT;
+
+        for (uint32_t i = 0; i < filter.datasize; i++) {
+            if (overrun(&in))
+                return UNPACK_CORRUPT;
+
+            globaldata[i] = getbits(&in) >> 8;
+            addbits(&in, 8);
+        }
+    }
+
+    // The invocation is complete, so it can be queued.
+    pending         = &unpack->pending[(unpack->firstpending + unpack->numpending) % MAX_PENDING];
+    pending->code   = malloc(saved->codesize);
+    pending->data   = NULL;
+    filter.code     = memcpy(pending->code, saved->code, saved->codesize);
+    filter.codesize = saved->codesize;
+
+    if (filter.datasize) {
+        pending->data   = malloc(filter.datasize);
+        filter.data     = memcpy(pending->data, globaldata, filter.datasize);
+    }
+
+    pending->filter = filter;
+
+    if (unpack->numpending++ == 0)
+        unpack->flushat = filter.position + filter.blockstart + filter.blocklength;
+
+    return UNPACK_OK;
+}
+
+static unpack_status_t read_vm_code(unpack_t *unpack)
+{
+    bitin_t  *in        = &unpack->in;
+    uint32_t  firstbyte = getbits(in) >> 8;
+    uint32_t  length;
+    uint8_t   vmcode[0x10000 + 7];
+
+    addbits(in, 8);
+
+    length = (firstbyte & 7) + 1;
+
+    if (length == 7) {
+        length = (getbits(in) >> 8) + 7;
+        addbits(in, 8);
+    } else if (length == 8) {
+        length = getbits(in);
+        addbits(in, 16);
+    }
+
+    // This is the only copy, the VM code isn't byte aligned in the stream.
+    for (uint32_t i = 0; i < length; i++) {
+        vmcode[i] = getbits(in) >> 8;
+        addbits(in, 8);
+    }
+
+    if (overrun(in))
+        return UNPACK_CORRUPT;
+
+    return add_vm_code(unpack, firstbyte, vmcode, length);
+}
+
+bool unpack_create(unpack_t **unpack)
+{
+    if (!(*unpack = calloc(1, sizeof(unpack_t))))
+        return false;
+
+    (*unpack)->window   = calloc(WINDOW_SIZE, 1);
+    (*unpack)->pending  = calloc(MAX_PENDING, sizeof(pending_t));
+    (*unpack)->block    = malloc(VM_GLOBALMEMADDR);
+    (*unpack)->flushat  = UINT64_MAX;
+
+    if (!(*unpack)->window || !(*unpack)->pending || !(*unpack)->block) {
+        unpack_destroy(*unpack);
+        return false;
+    }
+
+    return true;
+}
+
+bool unpack_destroy(unpack_t *unpack)
+{
+    if (unpack) {
+        init_filters(unpack);
+
+        if (unpack->pending)
+            discard_pending(unpack);
+
+        free(unpack->window);
+        free(unpack->pending);
+        free(unpack->block);
+    }
+
+    free(unpack);
+    return true;
+}
+
+// Discard all state, the next file is not part of a solid stream.
+void unpack_reset(unpack_t *unpack)
+{
+    init_filters(unpack);
+    discard_pending(unpack);
+    memset(unpack->oldtable, 0, sizeof unpack->oldtable);
+    memset(unpack->olddist, 0, sizeof unpack->olddist);
+    memset(unpack->window, 0, unpack->produced < WINDOW_SIZE ? unpack->produced : WINDOW_SIZE);
+    unpack->tablesread      = false;
+    unpack->prevlowdist     = 0;
+    unpack->lowdistrepcount = 0;
+    unpack->lastlength      = 0;
+    unpack->lastdist        = 0;
+    unpack->produced        = 0;
+}
+
+uint64_t unpack_produced(const unpack_t *unpack)
+{
+    return unpack->produced;
+}
+
+static inline void copy_string(unpack_t *unpack, uint32_t length, uint32_t distance)
+{
+    uint64_t source = unpack->produced - distance;
+
+    unpack->lastlength  = length;
+    unpack->lastdist    = distance;
+
+    while (length--)
+        unpack->window[unpack->produced++ & WINDOW_MASK] = unpack->window[source++ & WINDOW_MASK];
+}
+
+static inline void insert_old_dist(unpack_t *unpack, uint32_t distance)
+{
+    memmove(&unpack->olddist[1], &unpack->olddist[0], sizeof unpack->olddist - sizeof *unpack->olddist);
+    unpack->olddist[0] = distance;
+}
+
+// Decode the compressed data for a single file into the window, filters are
+// queued until their block is complete, see Unpack::Unpack29 in unrar.
+static unpack_status_t decode_file(unpack_t *unpack, unpack_callback_t callback, void *opaque)
+{
+    bitin_t         *in = &unpack->in;
+    unpack_status_t  status;
+    uint32_t         bits;
+
+    if (!unpack->tablesread && (status = read_tables(unpack)) != UNPACK_OK)
+        return status;
+
+    while (!overrun(in)) {
+        uint32_t number;
+
+        if (unpack->produced >= unpack->flushat && (status = flush_pending(unpack, false, callback, opaque)) != UNPACK_OK)
+            return status;
+
+        number = decode_number(in, &unpack->ld);
+
+        // Literal.
+        if (number < 256) {
+            unpack->window[unpack->produced++ & WINDOW_MASK] = number;
+            continue;
+        }
+
+        // Match with a new distance.
+        if (number >= 271) {
+            uint32_t length = kLengthBase[number -= 271] + 3;
+            uint32_t distnum;
+            uint32_t distance;
+
+            if ((bits = kLengthBits[number]) > 0) {
+                length += getbits(in) >> (16 - bits);
+                addbits(in, bits);
+            }
+
+            distnum = decode_number(in, &unpack->dd);
+
+            if (distnum >= DC)
+                return UNPACK_CORRUPT;
+
+            distance = kDistBase[distnum] + 1;
+
+            if ((bits = kDistBits[distnum]) > 0) {
+                if (distnum > 9) {
+                    if (bits > 4) {
+                        distance += (getbits(in) >> (20 - bits)) << 4;
+                        addbits(in, bits - 4);
+                    }
+
+                    if (unpack->lowdistrepcount > 0) {
+                        unpack->lowdistrepcount--;
+                        distance += unpack->prevlowdist;
+                    } else {
+                        uint32_t lowdist = decode_number(in, &unpack->ldd);
+
+                        if (lowdist == 16) {
+                            unpack->lowdistrepcount = LOW_DIST_REP_COUNT - 1;
+                            distance += unpack->prevlowdist;
+                        } else {
+                            distance += lowdist;
+                            unpack->prevlowdist = lowdist;
+                        }
+                    }
+                } else {
+                    distance += getbits(in) >> (16 - bits);
+                    addbits(in, bits);
+                }
+            }
+
+            if (distance >= 0x2000) {
+                length++;
+                if (distance >= 0x40000) {
+                    length++;
+                }
+            }
+
+            insert_old_dist(unpack, distance);
+            copy_string(unpack, length, distance);
+            continue;
+        }
+
+        // End of block, either a new table or the end of this file.
+        if (number == 256) {
+            uint32_t field = getbits(in);
+
+            if (field & 0x8000) {
+                addbits(in, 1);
+                unpack->tablesread = false;
+                if ((status = read_tables(unpack)) != UNPACK_OK)
+                    return status;
+                continue;
+            }
+
+            addbits(in, 2);
+            unpack->tablesread = !(field & 0x4000);
+            return UNPACK_OK;
+        }
+
+        // Filter.
+        if (number == 257) {
+            if ((status = read_vm_code(unpack)) != UNPACK_OK)
+                return status;
+            continue;
+        }
+
+        // Repeat the last match.
+        if (number == 258) {
+            copy_string(unpack, unpack->lastlength, unpack->lastdist);
+            continue;
+        }
+
+        // Match using one of the previous distances, which moves to the front.
+        if (number < 263) {
+            uint32_t distance = unpack->olddist[number - 259];
+            uint32_t lengthnum;
+            uint32_t length;
+
+            memmove(&unpack->olddist[1], &unpack->olddist[0], (number - 259) * sizeof *unpack->olddist);
+            unpack->olddist[0] = distance;
+
+            lengthnum = decode_number(in, &unpack->rd);
+
+            if (lengthnum >= RC)
+                return UNPACK_CORRUPT;
+
+            length = kLengthBase[lengthnum] + 2;
+
+            if ((bits = kLengthBits[lengthnum]) > 0) {
+                length += getbits(in) >> (16 - bits);
+                addbits(in, bits);
+            }
+
+            copy_string(unpack, length, distance);
+            continue;
+        }
+
+        // Short match.
+        {
+            uint32_t distance = kShortBase[number -= 263] + 1;
+
+            if ((bits = kShortBits[number]) > 0) {
+                distance += getbits(in) >> (16 - bits);
+                addbits(in, bits);
+            }
+
+            insert_old_dist(unpack, distance);
+            copy_string(unpack, 2, distance);
+        }
+    }
+
+    // Rar just stops when the input is exhausted.
+    return UNPACK_OK;
+}
+
+unpack_status_t unpack_file(unpack_t *unpack,
+                            const uint8_t *data,
+                            size_t size,
+                            bool solid,
+                            unpack_callback_t callback,
+                            void *opaque)
+{
+    unpack_status_t status;
+
+    if (!solid)
+        unpack_reset(unpack);
+
+    unpack->in.buf  = data;
+    unpack->in.size = size;
+    unpack->in.addr = 0;
+    unpack->in.bit  = 0;
+
+    status = decode_file(unpack, callback, opaque);
+
+    // Nothing more will be decoded for filters still waiting, so they're
+    // passed with whatever is available, even if the stream was corrupt.
+    if (status != UNPACK_STOPPED && flush_pending(unpack, true, callback, opaque) == UNPACK_STOPPED && status == UNPACK_OK)
+        status = UNPACK_STOPPED;
+
+    discard_pending(unpack);
+    return status;
+}
+
+// Archive headers aren't aligned.
+static inline uint32_t getle32(const uint8_t *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+// Walk the headers of an archive in memory, parsing every file that can be.
+// All offsets are checked against size, the data is never copied.
+unpack_archive_status_t unpack_archive(const uint8_t *base,
+                                       size_t size,
+                                       unpack_callback_t callback,
+                                       void *opaque,
+                                       unpack_archive_t *archive)
+{
+    const uint8_t   *start;
+    const hdr_t     *hdr;
+    unpack_t        *unpack;
+    bool             broken = false;
+    size_t           offset;
+
+    memset(archive, 0, sizeof *archive);
+
+    if (!(start = memmem(base, size < MAX_SFX_SIZE ? size : MAX_SFX_SIZE, kRarSignature, sizeof kRarSignature))) {
+        archive->error = "not an archive";
+        return archive->status = ARCHIVE_NOT_RAR;
+    }
+
+    unpack_create(&unpack);
+
+    for (offset = start - base + sizeof kRarSignature; offset + sizeof(hdr_t) <= size;) {
+        const struct filehdr *file;
+        uint64_t              packsize;
+        uint64_t              datasize = 0;
+        size_t                headersize;
+
+        hdr = (const hdr_t *)(base + offset);
+
+        if (hdr->size < sizeof(hdr_t) || hdr->size > size - offset) {
+            archive->status = ARCHIVE_TRUNCATED;
+            archive->error  = "truncated header";
+            break;
+        }
+
+        headersize = hdr->size;
+
+        if (hdr->type == TYPE_ENDARC)
+            break;
+
+        if (hdr->type == TYPE_MAIN && hdr->flags & MHD_PASSWORD) {
+            archive->status = ARCHIVE_ENCRYPTED;
+            archive->error  = "encrypted headers";
+            break;
+        }
+
+        // Subblocks such as recovery records use the file header, including
+        // the high half of the size for large blocks.
+        if (hdr->type == TYPE_FILE || hdr->type == TYPE_NEWSUB) {
+            if (headersize < offsetof(struct filehdr, FileName)) {
+                archive->status = ARCHIVE_INVALID;
+                archive->error  = "invalid file header";
+                break;
+            }
+
+            datasize = getle32(base + offset + offsetof(struct filehdr, PackSize));
+
+            if (hdr->flags & LHD_LARGE) {
+                if (headersize < offsetof(struct filehdr, FileName) + 8) {
+                    archive->status = ARCHIVE_INVALID;
+                    archive->error  = "invalid file header";
+                    break;
+                }
+                datasize |= (uint64_t) getle32(base + offset + offsetof(struct filehdr, FileName)) << 32;
+            }
+        } else if (hdr->flags & LONG_BLOCK) {
+            if (headersize < sizeof(hdr_t) + sizeof(uint32_t)) {
+                archive->status = ARCHIVE_INVALID;
+                archive->error  = "invalid header size";
+                break;
+            }
+            datasize = getle32(base + offset + sizeof(hdr_t));
+        }
+
+        if (datasize > size - offset - headersize) {
+            archive->status = ARCHIVE_TRUNCATED;
+            archive->error  = hdr->type == TYPE_FILE ? "truncated file" : "truncated block";
+            break;
+        }
+
+        if (hdr->type != TYPE_FILE) {
+            offset += headersize + datasize;
+            continue;
+        }
+
+        file        = (const struct filehdr *) hdr;
+        packsize    = datasize;
+        offset     += headersize;
+
+        // Solid files depend on all of the previous files, so once one has
+        // failed the rest can't be parsed.
+        if ((file->hdr.flags & LHD_DIRECTORY) == LHD_DIRECTORY) {
+            // Directories have no data.
+        } else if (file->hdr.flags & (LHD_PASSWORD | LHD_SPLIT_BEFORE)
+                || (file->UnpVer != 29 && file->UnpVer != 36)
+                || (broken && file->hdr.flags & LHD_SOLID)) {
+            archive->skipped++;
+            broken = true;
+        } else if (file->Method == METHOD_STORE) {
+            archive->files++;
+        } else {
+            switch (unpack_file(unpack, base + offset, packsize, file->hdr.flags & LHD_SOLID, callback, opaque)) {
+                case UNPACK_OK:
+                    archive->files++;
+                    broken = false;
+                    break;
+                case UNPACK_PPM:
+                case UNPACK_CORRUPT:
+                case UNPACK_STOPPED:
+                    archive->skipped++;
+                    broken = true;
+                    break;
+            }
+        }
+
+        offset += packsize;
+    }
+
+    unpack_destroy(unpack);
+    return archive->status;
+}
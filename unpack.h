@@ -0,0 +1,71 @@
+#ifndef __UNPACK_H
+#define __UNPACK_H
+
+// Decoder for the RAR 2.9 compressed stream, LZ only. The output goes into a
+// window and isn't written anywhere, but the filter programs embedded in the
+// stream are passed to a callback along with the block they filter.
+
+typedef enum {
+    UNPACK_OK,              // Reached the end of the file, or the input.
+    UNPACK_PPM,             // Found a PPMd block, which is not supported.
+    UNPACK_CORRUPT,         // The stream is invalid.
+    UNPACK_STOPPED,         // The callback asked to stop.
+} unpack_status_t;
+
+// A filter invocation, as described by a VM code block in the stream. These
+// are passed in order once the block has been decoded, or at the end of the
+// file if it never is.
+typedef struct {
+    uint32_t        filtnum;        // Index in the filter table.
+    bool            newfilter;      // This invocation defined the filter.
+    uint64_t        position;       // Output position of the VM code block.
+    uint32_t        blockstart;     // Relative to position.
+    uint32_t        blocklength;
+    uint32_t        execcount;
+    uint8_t         initmask;       // Registers explicitly initialized.
+    uint32_t        initr[7];
+    const uint8_t  *code;           // Bytecode, including the check byte.
+    uint32_t        codesize;
+    const uint8_t  *data;           // Global data passed as a parameter.
+    uint32_t        datasize;
+    const uint8_t  *block;          // The unfiltered block, NULL if it's too large for the VM.
+} unpack_filter_t;
+
+// Why walking an archive stopped before the end.
+typedef enum {
+    ARCHIVE_OK,
+    ARCHIVE_NOT_RAR,        // There's no signature, so it's not an archive.
+    ARCHIVE_TRUNCATED,      // A header or its data runs past the end.
+    ARCHIVE_INVALID,        // A header is too short for its type.
+    ARCHIVE_ENCRYPTED,      // The headers are encrypted.
+} unpack_archive_status_t;
+
+// The result of walking every file in an archive.
+typedef struct {
+    uint32_t                    files;      // Files that were parsed.
+    uint32_t                    skipped;    // Files that could not be parsed, e.g. encrypted.
+    unpack_archive_status_t     status;
+    const char                 *error;      // A description of status.
+} unpack_archive_t;
+
+typedef bool (*unpack_callback_t)(void *opaque, const unpack_filter_t *filter);
+
+typedef struct unpack unpack_t;
+
+bool unpack_create(unpack_t **unpack);
+bool unpack_destroy(unpack_t *unpack);
+void unpack_reset(unpack_t *unpack);
+unpack_status_t unpack_file(unpack_t *unpack,
+                            const uint8_t *data,
+                            size_t size,
+                            bool solid,
+                            unpack_callback_t callback,
+                            void *opaque);
+uint64_t unpack_produced(const unpack_t *unpack);
+unpack_archive_status_t unpack_archive(const uint8_t *base,
+                                       size_t size,
+                                       unpack_callback_t callback,
+                                       void *opaque,
+                                       unpack_archive_t *archive);
+
+#endif
@@ -0,0 +1,111 @@
+// Random programs for testing, shared by the *_test programs.
+// Copyright (C) 2012 Tavis Ormandy <taviso@cmpxchg8b.com>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "rarvm.h"
+#include "vmtest.h"
+
+static uint32_t state = 0x2545f491;
+
+void vmtest_seed(uint32_t seed)
+{
+    // Xorshift can't leave zero.
+    state = seed ? seed : 0x2545f491;
+}
+
+uint32_t vmtest_random32(void)
+{
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+}
+
+// Often a value that exposes differences in flags and overflow.
+uint32_t vmtest_random_value(void)
+{
+    static const uint32_t edges[] = {
+        0, 1, 7, 8, 31, 32, 33, 0x7f, 0x80, 0xff, 0x100, 0x7fffffff, 0x80000000, 0xffffffff,
+    };
+
+    return vmtest_random32() % 2
+        ? edges[vmtest_random32() % (sizeof edges / sizeof *edges)]
+        : vmtest_random32();
+}
+
+// Memory operands are mostly kept in a small window so that instructions read
+// back what others wrote, addresses near the end of memory use the extra
+// bytes. Immediates are often a valid jump target if count is the length of
+// the program, writable operands are never immediates.
+void vmtest_random_operand(vm_operand_t *op, uint32_t count, bool writable)
+{
+    static const uint32_t addrs[] = {
+        0, 0x10, 0x100, 0x102, 0x104, 0x108, 0x3c000, 0x3fffc, 0x3fffe, 0x3ffff, 0x40001,
+    };
+
+    switch (vmtest_random32() % (writable ? 4 : 5)) {
+        case 0:
+        case 1: op->type    = VM_OPREG;
+                op->reg     = vmtest_random32() % 8;
+                break;
+        case 2: op->type    = VM_OPREGMEM;
+                op->reg     = vmtest_random32() % 8;
+                op->value   = vmtest_random32() % 2 ? vmtest_random32() % 16 : (int8_t) vmtest_random32();
+                break;
+        case 3: op->type    = VM_OPMEM;
+                op->value   = addrs[vmtest_random32() % (sizeof addrs / sizeof *addrs)];
+                break;
+        case 4: op->type    = VM_OPINT;
+                op->value   = count && vmtest_random32() % 2
+                            ? vmtest_random32() % (count + 1)
+                            : vmtest_random_value();
+                break;
+    }
+}
+
+// Programs of up to maxinsns instructions that loop, call, use the stack and
+// overwrite their own immediates, which always end by jumping past the end.
+// The program needs space for maxinsns + 1 instructions.
+void vmtest_random_program(vm_program_t *program, uint32_t maxinsns)
+{
+    program->count = 1 + vmtest_random32() % maxinsns;
+
+    for (uint32_t i = 0; i < program->count; i++) {
+        vm_insn_t *insn = &program->insns[i];
+        uint8_t    flags;
+
+        memset(insn, 0, sizeof *insn);
+
+        insn->opcode    = vmtest_random32() % (VM_PRINT + 1);
+        flags           = vm_opcode_flags_table[insn->opcode];
+        insn->bytemode  = flags & VMCF_BYTEMODE && vmtest_random32() % 4 == 0;
+
+        if (flags & (VMCF_OP1 | VMCF_OP2))
+            vmtest_random_operand(&insn->op1, program->count, false);
+        if (flags & VMCF_OP2)
+            vmtest_random_operand(&insn->op2, program->count, false);
+
+        // Branches mostly stay inside the program.
+        if (flags & (VMCF_JUMP | VMCF_PROC) && insn->op1.type && vmtest_random32() % 4) {
+            insn->op1.type  = VM_OPINT;
+            insn->op1.value = vmtest_random32() % (program->count + 1);
+        }
+    }
+
+    memset(&program->insns[program->count], 0, sizeof(vm_insn_t));
+
+    program->insns[program->count].opcode       = VM_JMP;
+    program->insns[program->count].op1.type     = VM_OPINT;
+    program->insns[program->count].op1.value    = program->count + 1;
+    program->count++;
+}
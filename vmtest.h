@@ -0,0 +1,14 @@
+#ifndef __VMTEST_H
+#define __VMTEST_H
+
+// Random values, operands and programs for the tests that compare something
+// against vm_execute(). The sequence is the same on every run, tests choose
+// their own seed so that they explore different programs.
+
+void vmtest_seed(uint32_t seed);
+uint32_t vmtest_random32(void);
+uint32_t vmtest_random_value(void);
+void vmtest_random_operand(vm_operand_t *op, uint32_t count, bool writable);
+void vmtest_random_program(vm_program_t *program, uint32_t maxinsns);
+
+#endif